@@ -0,0 +1,478 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : cmpsc311_hashtable.c
+//  Description   : This is an open addressing implementation of the generic
+//                  hashtable interface, a drop-in replacement for the
+//                  chained table in libcrud (link this object ahead of the
+//                  library). Entries live in one flat array of slots with a
+//                  control byte per slot holding 7 bits of the hash, and a
+//                  lookup compares a whole group of 16 control bytes at
+//                  once (SSE2) before touching any slot. A table that gets
+//                  full is resized incrementally: the new array takes the
+//                  inserts while each insert and delete moves a few slots
+//                  of the old one, so no single call rehashes everything.
+//
+//                  The table may not be changed while it is iterated.
+//
+
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Project Includes
+#include <cmpsc311_hashtable.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define HT_GROUP 16         // control bytes probed together
+#define HT_EMPTY 0x80       // control byte of a slot never used since the last rehash
+#define HT_DELETED 0xfe     // control byte of a deleted slot, probes continue past it
+#define HT_MAX_BITS 32      // widest initial table
+#define HT_MIGRATE_STEP 64  // old slots moved per insert or delete while resizing
+#define HT_NONE UINT64_MAX  // no slot
+
+// A stored entry
+typedef struct {
+	HtIndexValue index; // the key
+	void        *block; // the value
+} HtSlot;
+
+// An array of slots, the control bytes and slots are one allocation
+typedef struct {
+	uint8_t  *ctrl;  // a control byte per slot, HT_EMPTY, HT_DELETED or the low 7 hash bits
+	HtSlot   *slots; // the entries
+	uint64_t  mask;  // slots - 1, the slot count is a power of 2 and a multiple of HT_GROUP
+	uint64_t  used;  // slots full or deleted
+} HtArray;
+
+// The table behind HTable
+typedef struct {
+	HtArray  cur;     // the array inserts go to
+	HtArray  old;     // the array being migrated out of, ctrl is NULL when not resizing
+	uint64_t migrate; // next slot of old to move
+} HtFlat;
+
+//
+// Helper functions
+
+// Mix the key so the group and the control bits are independent of its pattern
+uint64_t htHash(HtIndexValue idx) {
+	uint64_t x = (uint64_t)idx;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return( x );
+}
+
+// Bit i set if control byte i of the group equals b
+uint32_t htMatch(uint8_t *group, uint8_t b) {
+#ifdef __SSE2__
+	return( (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((__m128i *)group), _mm_set1_epi8((char)b))) );
+#else
+	uint32_t i, bits = 0;
+	for (i = 0; i < HT_GROUP; i++) {
+		bits |= (uint32_t)(group[i] == b) << i;
+	}
+	return( bits );
+#endif
+}
+
+// Bit i set if slot i of the group is empty or deleted (the control high bit)
+uint32_t htMatchFree(uint8_t *group) {
+#ifdef __SSE2__
+	return( (uint32_t)_mm_movemask_epi8(_mm_load_si128((__m128i *)group)) );
+#else
+	uint32_t i, bits = 0;
+	for (i = 0; i < HT_GROUP; i++) {
+		bits |= (uint32_t)(group[i] >> 7) << i;
+	}
+	return( bits );
+#endif
+}
+
+// Allocate an empty array of "slots" slots
+int htArrayInit(HtArray *a, uint64_t slots) {
+	if ( (a->ctrl = aligned_alloc(HT_GROUP, slots + slots * sizeof(HtSlot))) == NULL ) {
+		return( -1 );
+	}
+	memset(a->ctrl, HT_EMPTY, slots);
+	a->slots = (HtSlot *)(a->ctrl + slots);
+	a->mask = slots - 1;
+	a->used = 0;
+	return( 0 );
+}
+
+// Find the slot of a key, HT_NONE if it is not in the array. Groups are probed
+// in triangular order, which visits every group of a power of 2 array
+uint64_t htArrayFind(HtArray *a, HtIndexValue idx, uint64_t hash) {
+	uint64_t groups = (a->mask + 1) / HT_GROUP, g = (hash >> 7) & (groups - 1), step, k;
+	uint32_t bits;
+
+	for (step = 0; step < groups; step++) {
+		bits = htMatch(&a->ctrl[g * HT_GROUP], (uint8_t)(hash & 0x7f));
+		while (bits) {
+			k = g * HT_GROUP + __builtin_ctz(bits);
+			if (a->slots[k].index == idx) {
+				return( k );
+			}
+			bits &= bits - 1;
+		}
+		if (htMatch(&a->ctrl[g * HT_GROUP], HT_EMPTY)) {
+			return( HT_NONE ); // the key would have been placed here
+		}
+		g = (g + step + 1) & (groups - 1);
+	}
+	return( HT_NONE );
+}
+
+// Store a key known not to be in the array, which has a free slot
+void htArrayPut(HtArray *a, HtIndexValue idx, void *blk, uint64_t hash) {
+	uint64_t groups = (a->mask + 1) / HT_GROUP, g = (hash >> 7) & (groups - 1), step, k;
+	uint32_t bits;
+
+	for (step = 0; step < groups; step++) {
+		if ( (bits = htMatchFree(&a->ctrl[g * HT_GROUP])) != 0 ) {
+			k = g * HT_GROUP + __builtin_ctz(bits);
+			a->used += (a->ctrl[k] == HT_EMPTY);
+			a->ctrl[k] = (uint8_t)(hash & 0x7f);
+			a->slots[k].index = idx;
+			a->slots[k].block = blk;
+			return;
+		}
+		g = (g + step + 1) & (groups - 1);
+	}
+}
+
+// Free slot k, it can go back to empty if its group never overflowed
+void htArrayRemove(HtArray *a, uint64_t k) {
+	if (htMatch(&a->ctrl[k & ~(uint64_t)(HT_GROUP - 1)], HT_EMPTY)) {
+		a->ctrl[k] = HT_EMPTY;
+		a->used--;
+	} else {
+		a->ctrl[k] = HT_DELETED;
+	}
+}
+
+// Move up to n slots of the old array into the current one, free the old
+// array once it is drained
+void htMigrate(HtFlat *f, uint64_t n) {
+	uint64_t k;
+
+	if (f->old.ctrl == NULL) {
+		return;
+	}
+	for (; (n > 0) && (f->migrate <= f->old.mask); f->migrate++, n--) {
+		k = f->migrate;
+		if ( (f->old.ctrl[k] & 0x80) == 0 ) {
+			htArrayPut(&f->cur, f->old.slots[k].index, f->old.slots[k].block, htHash(f->old.slots[k].index));
+			f->old.ctrl[k] = HT_DELETED; // later probes of the old array continue past it
+		}
+	}
+	if (f->migrate > f->old.mask) {
+		free(f->old.ctrl);
+		f->old.ctrl = NULL;
+	}
+}
+
+// Start moving to a new array when the current one is 7/8 used: twice the
+// size, or the same size if it is mostly deleted slots
+int htGrow(HTable *ht, HtFlat *f) {
+	uint64_t slots = f->cur.mask + 1, live;
+	HtArray grown;
+
+	htMigrate(f, UINT64_MAX); // a resize still running finishes first
+	live = ht->elements;
+	if (live * 16 >= slots * 7) {
+		slots = slots * 2;
+	}
+	if (htArrayInit(&grown, slots) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "Failed growing hash table to %lu slots", (unsigned long)slots);
+		return( -1 );
+	}
+	f->old = f->cur;
+	f->cur = grown;
+	f->migrate = 0;
+	ht->htTableSize = (uint16_t)__builtin_ctzll(slots);
+	return( 0 );
+}
+
+// Locate a key in either array, returns the slot and sets *a to its array
+uint64_t htLocate(HtFlat *f, HtIndexValue idx, HtArray **a) {
+	uint64_t hash = htHash(idx), k;
+
+	if ( (k = htArrayFind(&f->cur, idx, hash)) != HT_NONE ) {
+		*a = &f->cur;
+		return( k );
+	}
+	if ( (f->old.ctrl != NULL) && ((k = htArrayFind(&f->old, idx, hash)) != HT_NONE) ) {
+		*a = &f->old;
+		return( k );
+	}
+	return( HT_NONE );
+}
+
+//
+// Hashtable Interface
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : initHashTable
+// Description  : Initialize the hash table with room for about 2^bits
+//                elements before it first grows
+//
+// Inputs       : ht - the table
+//                bits - log2 of the initial slot count
+// Outputs      : 0 if successful, -1 if failure
+
+int initHashTable( HTable *ht, uint16_t bits ) {
+	HtFlat *f;
+
+	if (bits > HT_MAX_BITS) {
+		logMessage(LOG_ERROR_LEVEL, "Hash table width %u too large", bits);
+		return( -1 );
+	}
+	while ((1ULL << bits) < HT_GROUP) {
+		bits++;
+	}
+	if ( (f = calloc(1, sizeof(HtFlat))) == NULL ) {
+		return( -1 );
+	}
+	if (htArrayInit(&f->cur, 1ULL << bits) == -1) {
+		free(f);
+		return( -1 );
+	}
+	ht->htTableSize = bits;
+	ht->elements = 0;
+	ht->table = f;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cleanupHashTable
+// Description  : Free the table and the values still stored in it
+//
+// Inputs       : ht - the table
+// Outputs      : 0 if successful, -1 if failure
+
+int cleanupHashTable( HTable *ht ) {
+	HtFlat *f = ht->table;
+	HtArray *arrays[2];
+	uint64_t k;
+	int i;
+
+	if (f == NULL) {
+		return( -1 );
+	}
+	arrays[0] = &f->cur;
+	arrays[1] = &f->old;
+	for (i = 0; i < 2; i++) {
+		if (arrays[i]->ctrl == NULL) {
+			continue;
+		}
+		for (k = 0; k <= arrays[i]->mask; k++) {
+			if ( (arrays[i]->ctrl[k] & 0x80) == 0 ) {
+				free(arrays[i]->slots[k].block);
+			}
+		}
+		free(arrays[i]->ctrl);
+	}
+	free(f);
+	ht->table = NULL;
+	ht->elements = 0;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insertValueInHashTable
+// Description  : Insert a value under a key, the key must not be present
+//
+// Inputs       : ht - the table
+//                idx - the key
+//                blk - the value
+// Outputs      : 0 if successful, -1 if failure
+
+int insertValueInHashTable( HTable *ht, HtIndexValue idx, void *blk ) {
+	HtFlat *f = ht->table;
+	HtArray *a;
+
+	if (htLocate(f, idx, &a) != HT_NONE) {
+		logMessage(LOG_ERROR_LEVEL, "Duplicate index value %lu inserted into hash table", idx);
+		return( -1 );
+	}
+	if ( ((f->cur.used + 1) * 8 > (f->cur.mask + 1) * 7) && (htGrow(ht, f) == -1) ) {
+		return( -1 );
+	}
+	htArrayPut(&f->cur, idx, blk, htHash(idx));
+	ht->elements++;
+	htMigrate(f, HT_MIGRATE_STEP);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findValueInHashTable
+// Description  : Find the value stored under a key
+//
+// Inputs       : ht - the table
+//                idx - the key
+// Outputs      : the value, NULL if the key is not present
+
+void * findValueInHashTable( HTable *ht, HtIndexValue idx ) {
+	HtArray *a;
+	uint64_t k = htLocate(ht->table, idx, &a);
+
+	return( (k == HT_NONE) ? NULL : a->slots[k].block );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : deleteValueFromHashTable
+// Description  : Remove a key, the value is returned and not freed
+//
+// Inputs       : ht - the table
+//                idx - the key
+// Outputs      : the value, NULL if the key is not present
+
+void * deleteValueFromHashTable( HTable *ht, HtIndexValue idx ) {
+	HtFlat *f = ht->table;
+	HtArray *a;
+	uint64_t k;
+	void *blk;
+
+	if ( (k = htLocate(f, idx, &a)) == HT_NONE ) {
+		return( NULL );
+	}
+	blk = a->slots[k].block;
+	htArrayRemove(a, k);
+	ht->elements--;
+	htMigrate(f, HT_MIGRATE_STEP);
+	return( blk );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : initHashTableIterator
+// Description  : Start an iteration over the values of the table
+//
+// Inputs       : ht - the table
+//                it - the iterator
+// Outputs      : 0 if successful, -1 if failure
+
+int initHashTableIterator( HTable *ht, HtIterator *it ) {
+	it->table = ht;
+	it->idx = 0;
+	it->slot = 0;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : iterateHashTable
+// Description  : Get the next value of the iteration, the slots of the old
+//                array not yet migrated come first
+//
+// Inputs       : it - the iterator
+// Outputs      : the value, NULL at the end of the table
+
+void * iterateHashTable( HtIterator *it ) {
+	HtFlat *f = it->table->table;
+	HtArray *a;
+
+	for (; it->idx < 2; it->idx++, it->slot = 0) {
+		a = (it->idx == 0) ? &f->old : &f->cur;
+		if (a->ctrl == NULL) {
+			continue;
+		}
+		for (; it->slot <= a->mask; it->slot++) {
+			if ( (a->ctrl[it->slot] & 0x80) == 0 ) {
+				return( a->slots[it->slot++].block );
+			}
+		}
+	}
+	return( NULL );
+}
+
+//
+// Unit Testing
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hashTableUnitTest
+// Description  : Fill a small table far past its initial size (through many
+//                incremental resizes), then check lookups, iteration,
+//                deletes and reinserts
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hashTableUnitTest( void ) {
+	HtIndexValue n = 100000, i, *v, sum = 0;
+	HtIterator it;
+	HTable ht;
+	int ok = 1;
+
+	if (initHashTable(&ht, 4)) {
+		return( -1 );
+	}
+	for (i = 0; (i < n) && ok; i++) {
+		if ( (v = malloc(sizeof(HtIndexValue))) == NULL ) {
+			return( -1 );
+		}
+		*v = i * 0x9e3779b97f4a7c15ULL;
+		ok = (insertValueInHashTable(&ht, *v, v) == 0);
+	}
+	for (i = 0; (i < n) && ok; i++) {
+		v = findValueInHashTable(&ht, i * 0x9e3779b97f4a7c15ULL);
+		ok = (v != NULL) && (*v == i * 0x9e3779b97f4a7c15ULL) && (findValueInHashTable(&ht, i * 0x9e3779b97f4a7c15ULL + 1) == NULL);
+	}
+
+	// Every value once
+	initHashTableIterator(&ht, &it);
+	for (i = 0; (v = iterateHashTable(&it)) != NULL; i++) {
+		sum += *v;
+	}
+	ok = ok && (i == n) && (ht.elements == n);
+	for (i = 0; i < n; i++) {
+		sum -= i * 0x9e3779b97f4a7c15ULL;
+	}
+	ok = ok && (sum == 0);
+
+	// Delete the odd keys, check, and put them back
+	for (i = 1; (i < n) && ok; i += 2) {
+		v = deleteValueFromHashTable(&ht, i * 0x9e3779b97f4a7c15ULL);
+		ok = (v != NULL) && (deleteValueFromHashTable(&ht, i * 0x9e3779b97f4a7c15ULL) == NULL);
+		free(v);
+	}
+	for (i = 0; (i < n) && ok; i++) {
+		ok = ((findValueInHashTable(&ht, i * 0x9e3779b97f4a7c15ULL) != NULL) == ((i & 1) == 0));
+	}
+	for (i = 1; (i < n) && ok; i += 2) {
+		if ( (v = malloc(sizeof(HtIndexValue))) == NULL ) {
+			return( -1 );
+		}
+		*v = i * 0x9e3779b97f4a7c15ULL;
+		ok = (insertValueInHashTable(&ht, *v, v) == 0);
+	}
+	for (i = 0; (i < n) && ok; i++) {
+		v = findValueInHashTable(&ht, i * 0x9e3779b97f4a7c15ULL);
+		ok = (v != NULL) && (*v == i * 0x9e3779b97f4a7c15ULL);
+	}
+	ok = ok && (ht.elements == n);
+	cleanupHashTable(&ht);
+
+	if (!ok) {
+		logMessage(LOG_ERROR_LEVEL, "HT Unit Test: failed.");
+		return( -1 );
+	}
+	logMessage(LOG_OUTPUT_LEVEL, "HT Unit Test: %lu elements inserted, found, iterated, deleted and reinserted.", (unsigned long)n);
+	return( 0 );
+}
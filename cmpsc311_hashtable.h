@@ -5,7 +5,10 @@
 //
 //  File          : cmpsc311_hashtable.h
 //  Description   : This is a generic hashtable implementation used for
-//                  data structure storage and access.
+//                  data structure storage and access. The structures keep
+//                  the size and layout of the libcrud chained table, so
+//                  the open addressing table (cmpsc311_hashtable.c) can
+//                  replace it at link time.
 ////
 
 //
@@ -17,7 +20,7 @@
 #define HT_COOKIE_VALUE 0xa3a3
 typedef unsigned long HtIndexValue;
 
-// Hash table entry structure
+// Hash table entry structure (of the libcrud chained table)
 typedef struct HtEntry {
 	uint16_t 	    cookie;  // This is a cookie value to detect memory corruption
 	HtIndexValue	index;   // This is the "key value" index of the object
@@ -30,21 +33,22 @@ typedef struct HtEntry {
 typedef struct  {
 	uint16_t         htTableSize;  // The the bits in the hash values
 	uint32_t	     elements;     // This is the number of elements
-	HtEntryData    **hasHTable;    // This is the hash table itself
+	void            *table;        // This is the hash table itself
 } HTable;
 
 // Hash table iterator
 typedef struct {
 	HTable      *table; // The table we are iterating through
-	uint16_t 	 idx;   // The current index into the hash table
-	HtEntryData *ptr;   // The pointer into the linked list at the index
+	uint16_t 	 idx;   // The array being walked (old then current while resizing)
+	uint64_t     slot;  // The next slot of that array
 } HtIterator;
 
 //
 // Hashtable Interface
 
 int initHashTable( HTable *ht, uint16_t bits );
-	// This function initializes the hash table to a width of 2^(bits) width
+	// This function initializes the hash table to a width of 2^(bits) width,
+	// it grows as needed
 
 int cleanupHashTable( HTable *ht );
 	// Cleanup the hash table
@@ -0,0 +1,896 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_async.c
+//  Description    : This is the implementation of the asynchronous interface
+//                   to the HDD storage system. A worker thread takes requests
+//                   off the submission ring and runs each READ/WRITE as a
+//                   small state machine of block commands. The commands of
+//                   independent requests are pipelined on the client
+//                   connection (sent back to back, responses received in
+//                   order), so the round trips of a batch overlap.
+//
+//                   Ordering: requests on the same file handle that involve
+//                   a write run one after the other, reads of the same handle
+//                   may overlap, and so may overwrites of disjoint ranges
+//                   inside the file (they share the entry lock the first
+//                   of them took and leave the entry as it is). OPEN and FLUSH run alone once everything
+//                   submitted before them has completed. A request flagged
+//                   HDD_ASYNC_LINK holds back the next one until it succeeds.
+//                   The block requests ready to go are sent in the order of
+//                   the I/O scheduler (hdd_sched.h), which also merges reads
+//                   of the same block; requests that may run together never
+//                   conflict, so any order is correct.
+//
+
+// Includes
+#include <malloc.h>
+#include <string.h>
+#include <sched.h>
+
+// Project Includes
+#include <hdd_async.h>
+#include <hdd_file_io.h>
+#include <hdd_driver.h>
+#include <hdd_network.h>
+#include <hdd_sched.h>
+#include <hdd_cache.h>
+#include <hdd_stripe.h>
+#include <cmpsc311_log.h>
+
+// These are the steps of a request
+typedef enum {
+	HDD_ASYNC_WAITING   = 0, // Not started
+	HDD_ASYNC_READING   = 1, // Block read outstanding (READ, and WRITE merging into old data)
+	HDD_ASYNC_OVERWRITE = 2, // Block overwrite outstanding
+	HDD_ASYNC_DELETE    = 3, // Old block delete outstanding before growing a file
+	HDD_ASYNC_CREATE    = 4, // Block create outstanding
+	HDD_ASYNC_RANGE     = 5, // v2 ranged read or overwrite outstanding, straight to/from the caller's buffer
+	HDD_ASYNC_COMMIT    = 6, // Entry changed, completes once the journal holds the change
+	HDD_ASYNC_DONE      = 7, // Completion posted
+} HDD_ASYNC_STEP_TYPES;
+
+// A request inside the worker
+typedef struct {
+	HddAsyncSqe sqe;       // the submitted request
+	int         step;      // HDD_ASYNC_STEP_TYPES
+	int         ready;     // 1 if sreq is built, 2 once it is queued with the scheduler
+	HddSchedReq sreq;      // the next (or outstanding) block request
+	int         locked;    // 1 while the request holds its entry lock
+	HddBlockID  blockID;   // the file's block when the request started
+	int32_t     blockSize; // the file's size when the request started
+	int32_t     newSize;   // the file's size after a WRITE
+	char       *scratch;   // block buffer, kept for the next request in this slot
+	int32_t     scratchSize;
+	int32_t     result;    // the completion result once done
+} HddAsyncOp;
+
+// The worker's pipeline state
+typedef struct {
+	HddAsyncOp *ops;         // requests taken off the submission ring, in order
+	uint32_t    opHead;      // oldest request not yet retired
+	uint32_t    opTail;      // end of the requests taken
+	HddSched    sched;       // block requests ready to be sent
+	HddSchedReq **sent;      // block requests outstanding, in send order
+	uint32_t    sentHead;    // oldest outstanding request
+	uint32_t    sentTail;    // end of the outstanding requests
+	int32_t     sentBytes;   // response payload bytes outstanding
+	int         connection;  // 1 while the worker holds the client connection
+	int         commits;     // requests in HDD_ASYNC_COMMIT
+	uint32_t   *fdSeen;      // per handle, scan generation an earlier request used it in
+	uint8_t    *fdWrite;     // per handle, 1 if that earlier request writes
+	uint8_t    *fdInPlace;   // per handle, 1 if every earlier request is an in-place overwrite
+	uint32_t   *fdHeld;      // per handle, writes holding its entry lock (shared by in-place overwrites)
+	uint32_t    generation;  // current scan generation
+} HddAsyncEngine;
+
+//
+// Functional Prototypes
+
+void *hdd_async_worker(void *arg);
+
+//
+// Helper functions
+
+// Grow a request's scratch buffer to hold at least size bytes
+int ensureScratch(HddAsyncOp *op, int32_t size) {
+	if (op->scratchSize < size) {
+		char *grown = realloc(op->scratch, size);
+		if (grown == NULL) {
+			return -1;
+		}
+		op->scratch = grown;
+		op->scratchSize = size;
+	}
+	return 0;
+}
+
+// Release the entry lock of a request, the last write holding it unlocks
+void releaseEntry(HddAsyncEngine *eng, HddAsyncOp *op) {
+	if (op->locked == 1) {
+		if ( (op->sqe.op != HDD_ASYNC_WRITE) || (--eng->fdHeld[op->sqe.fd] == 0) ) {
+			unlockFile(op->sqe.fd);
+		}
+		op->locked = 0;
+	}
+}
+
+// Is the request an overwrite in flight inside its file?
+int inPlaceOp(HddAsyncOp *op) {
+	return( (op->sqe.op == HDD_ASYNC_WRITE) && (op->step == HDD_ASYNC_RANGE) );
+}
+
+// Post the completion of a request and release what it holds
+void completeOp(HddAsyncRing *ring, HddAsyncOp *op, int32_t result) {
+	releaseEntry(ring->engine, op);
+	op->step = HDD_ASYNC_DONE;
+	op->ready = 0;
+	op->result = result;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->cq[ring->cqTail & (ring->entries - 1)].userData = op->sqe.userData;
+	ring->cq[ring->cqTail & (ring->entries - 1)].result = result;
+	ring->cqTail++;
+	pthread_cond_broadcast(&ring->completed);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+// Release the entry of a request that changed it, it completes with result
+// once the worker committed the journal
+void commitOp(HddAsyncRing *ring, HddAsyncOp *op, int32_t result) {
+	releaseEntry(ring->engine, op);
+	op->step = HDD_ASYNC_COMMIT;
+	op->ready = 0;
+	op->result = result;
+	((HddAsyncEngine *)ring->engine)->commits++;
+}
+
+// Build the next block command of a request
+void setCommand(HddAsyncOp *op, int step, HddBitCmd cmd, void *buf) {
+	memset(&op->sreq, 0, sizeof(HddSchedReq));
+	op->sreq.req.op = getOpCode(cmd);
+	op->sreq.req.flags = getFlag(cmd);
+	op->sreq.req.blockID = (uint32_t)getID(cmd);
+	op->sreq.req.length = getBlockSize(cmd);
+	op->sreq.buf = buf;
+	op->sreq.owner = op;
+	op->step = step;
+	op->ready = 1;
+}
+
+// Build a v2 ranged READ or OVERWRITE of the caller's buffer
+void setRange(HddAsyncOp *op, uint8_t blockOp, int32_t count) {
+	memset(&op->sreq, 0, sizeof(HddSchedReq));
+	op->sreq.req.op = blockOp;
+	op->sreq.req.flags = HDD_NULL_FLAG;
+	op->sreq.req.blockID = op->blockID;
+	op->sreq.req.offset = op->sqe.offset;
+	op->sreq.req.length = count;
+	op->sreq.buf = op->sqe.buf;
+	op->sreq.owner = op;
+	op->step = HDD_ASYNC_RANGE;
+	op->ready = 1;
+}
+
+// Take the client connection for pipelining
+void takeConnection(HddAsyncEngine *eng) {
+	if (eng->connection == 0) {
+		hdd_client_lock();
+		eng->connection = 1;
+	}
+}
+
+// Give the client connection back, nothing may be outstanding
+void releaseConnection(HddAsyncEngine *eng) {
+	if (eng->connection == 1) {
+		hdd_client_unlock();
+		eng->connection = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : startOp
+// Description  : Take the entry lock of a READ/WRITE and queue its first
+//                block command (or complete it if it needs none)
+//
+// Inputs       : ring - the rings
+//                eng - the worker state
+//                op - the request
+// Outputs      : 0 if started, -1 if the entry is busy and we must retry later
+
+int startOp(HddAsyncRing *ring, HddAsyncEngine *eng, HddAsyncOp *op) {
+	HddAsyncSqe *sqe = &op->sqe;
+	int exclusive = (sqe->op == HDD_ASYNC_WRITE) ? 1 : 0;
+	int32_t count;
+	int type;
+
+	if ( (sqe->fd < 0) || (sqe->fd >= MAX_HDD_FILEDESCR) ) {
+		completeOp(ring, op, -1);
+		return( 0 );
+	}
+
+	// Never block on an entry lock while holding the connection with commands
+	// outstanding, the holder may be waiting for the connection itself
+	if (lockFile(sqe->fd, exclusive, 0) == -1) {
+		if (eng->sentHead != eng->sentTail) {
+			return( -1 );
+		}
+		releaseConnection(eng);
+		lockFile(sqe->fd, exclusive, 1);
+	}
+	op->locked = 1;
+	eng->fdHeld[sqe->fd] += exclusive;
+
+	if ( (type = hdd_entry_get(sqe->fd, &op->blockID, &op->blockSize)) == -1 ) {
+		completeOp(ring, op, -1); // file is closed
+		return( 0 );
+	}
+
+	// Striped files (and writes that stripe one) take the stripe servers'
+	// connections, packed files (and writes that pack one) share their
+	// container and inline files live in their entry, they are done in place
+	// once nothing is outstanding here
+	if ( (type != HDD_INODE_FILE) || ((sqe->op == HDD_ASYNC_WRITE) && (hdd_stripe_fits((uint64_t)sqe->offset + sqe->count) ||
+		 ((op->blockID == 0) && (hdd_pack_fits((uint64_t)sqe->offset + sqe->count) ||
+		 hdd_inline_fits((uint64_t)sqe->offset + sqe->count))))) ) {
+		releaseEntry(eng, op);
+		if (eng->sentHead != eng->sentTail) {
+			return( -1 );
+		}
+		releaseConnection(eng);
+		count = (sqe->op == HDD_ASYNC_READ) ? hdd_pread(sqe->fd, sqe->buf, sqe->count, sqe->offset) :
+				hdd_pwrite(sqe->fd, sqe->buf, sqe->count, sqe->offset);
+		completeOp(ring, op, count);
+		return( 0 );
+	}
+
+	if (sqe->op == HDD_ASYNC_READ) {
+		if ( (op->blockID == 0) || (sqe->offset > op->blockSize) ) {
+			completeOp(ring, op, -1);
+			return( 0 );
+		}
+		if (hdd_client_protocol() == HDD_PROTOCOL_V2) {
+			count = (op->blockSize < sqe->offset + sqe->count) ? op->blockSize - sqe->offset : sqe->count;
+			if (count == 0) {
+				completeOp(ring, op, 0);
+			} else {
+				setRange(op, HDD_BLOCK_READ, count);
+			}
+			return( 0 );
+		}
+		if (ensureScratch(op, op->blockSize) == -1) {
+			completeOp(ring, op, -1);
+			return( 0 );
+		}
+		setCommand(op, HDD_ASYNC_READING, set_block_read(op->blockID, op->blockSize), op->scratch);
+		return( 0 );
+	}
+
+	// WRITE, same rules as hdd_pwrite
+	if ( (sqe->offset + sqe->count > hdd_client_max_block_size()) || (sqe->offset > op->blockSize) ) {
+		completeOp(ring, op, -1);
+		return( 0 );
+	}
+	hdd_cache_invalidate(op->blockID); // the entry stays locked until the write is done
+	hdd_entry_touch(sqe->fd);
+	if (op->blockID == 0) {
+		op->newSize = sqe->count;
+		setCommand(op, HDD_ASYNC_CREATE, set_block_create(0, sqe->count), sqe->buf);
+		return( 0 );
+	}
+
+	if ( (hdd_client_protocol() == HDD_PROTOCOL_V2) && (sqe->offset + sqe->count <= op->blockSize) ) {
+		if (sqe->count == 0) {
+			completeOp(ring, op, 0);
+		} else {
+			setRange(op, HDD_BLOCK_OVERWRITE, sqe->count);
+		}
+		return( 0 );
+	}
+	op->newSize = (sqe->offset + sqe->count > op->blockSize) ? sqe->offset + sqe->count : op->blockSize;
+	if (ensureScratch(op, op->newSize) == -1) {
+		completeOp(ring, op, -1);
+		return( 0 );
+	}
+	if ( (sqe->offset > 0) || (sqe->offset + sqe->count < op->blockSize) ) {
+		// Merge into the old contents
+		setCommand(op, HDD_ASYNC_READING, set_block_read(op->blockID, op->blockSize), op->scratch);
+	} else if (op->newSize == op->blockSize) {
+		memcpy(op->scratch, sqe->buf, sqe->count);
+		setCommand(op, HDD_ASYNC_OVERWRITE, set_block_overwrite(op->blockID, op->blockSize), op->scratch);
+	} else {
+		memcpy(op->scratch, sqe->buf, sqe->count);
+		setCommand(op, HDD_ASYNC_DELETE, set_delete_block_command(op->blockID), NULL);
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : joinOp
+// Description  : Start a WRITE behind in-place overwrites of the same handle,
+//                sharing the entry lock they hold, if it overwrites a range
+//                inside the file too
+//
+// Inputs       : eng - the worker state
+//                op - the request
+// Outputs      : 0 if started, -1 if it must wait for the requests before it
+
+int joinOp(HddAsyncEngine *eng, HddAsyncOp *op) {
+	HddAsyncSqe *sqe = &op->sqe;
+
+	if ( (hdd_client_protocol() != HDD_PROTOCOL_V2) || (sqe->count == 0) ||
+		 (hdd_entry_get(sqe->fd, &op->blockID, &op->blockSize) != HDD_INODE_FILE) || (op->blockID == 0) ||
+		 (sqe->offset + sqe->count > op->blockSize) || hdd_stripe_fits((uint64_t)sqe->offset + sqe->count) ) {
+		return( -1 );
+	}
+	op->locked = 1;
+	eng->fdHeld[sqe->fd]++;
+	hdd_cache_invalidate(op->blockID);
+	hdd_entry_touch(sqe->fd);
+	setRange(op, HDD_BLOCK_OVERWRITE, sqe->count);
+	return( 0 );
+}
+
+// Does a request overlap an earlier unfinished one on its handle?
+int overlapsEarlier(HddAsyncRing *ring, HddAsyncEngine *eng, uint32_t i) {
+	HddAsyncOp *op = &eng->ops[i & (ring->entries - 1)], *prev;
+	uint32_t j;
+
+	for (j = eng->opHead; j != i; j++) {
+		prev = &eng->ops[j & (ring->entries - 1)];
+		if ( (prev->step != HDD_ASYNC_DONE) && (prev->sqe.fd == op->sqe.fd) &&
+			 ((uint64_t)prev->sqe.offset < (uint64_t)op->sqe.offset + op->sqe.count) &&
+			 ((uint64_t)op->sqe.offset < (uint64_t)prev->sqe.offset + prev->sqe.count) ) {
+			return( 1 );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : advanceOp
+// Description  : Move a request to its next step once the response to its
+//                outstanding block command arrived
+//
+// Inputs       : ring - the rings
+//                op - the request
+//                response - the response to the outstanding command
+// Outputs      : none
+
+void advanceOp(HddAsyncRing *ring, HddAsyncOp *op, HddBitResp response) {
+	HddAsyncSqe *sqe = &op->sqe;
+	int32_t count;
+
+	if (getResult(response) == 1) {
+		if ( (op->step == HDD_ASYNC_CREATE) && (op->blockID != 0) ) {
+			hdd_entry_set(sqe->fd, 0, 0); // the old block was deleted
+			commitOp(ring, op, -1);
+			return;
+		}
+		completeOp(ring, op, -1);
+		return;
+	}
+
+	switch (op->step) {
+	case HDD_ASYNC_READING:
+		if (sqe->op == HDD_ASYNC_READ) {
+			count = sqe->count;
+			if (op->blockSize < sqe->offset + count) {
+				count = op->blockSize - sqe->offset;
+			}
+			memcpy(sqe->buf, op->scratch + sqe->offset, count);
+			completeOp(ring, op, count);
+			return;
+		}
+		memcpy(op->scratch + sqe->offset, sqe->buf, sqe->count);
+		if (op->newSize == op->blockSize) {
+			setCommand(op, HDD_ASYNC_OVERWRITE, set_block_overwrite(op->blockID, op->blockSize), op->scratch);
+		} else {
+			setCommand(op, HDD_ASYNC_DELETE, set_delete_block_command(op->blockID), NULL);
+		}
+		return;
+
+	case HDD_ASYNC_DELETE:
+		setCommand(op, HDD_ASYNC_CREATE, set_block_create(0, op->newSize), op->scratch);
+		return;
+
+	case HDD_ASYNC_CREATE:
+		hdd_entry_set(sqe->fd, getBlockID(response), op->newSize);
+		commitOp(ring, op, sqe->count);
+		return;
+
+	case HDD_ASYNC_OVERWRITE:
+		completeOp(ring, op, sqe->count);
+		return;
+
+	default: // This should never happen
+		logMessage(LOG_ERROR_LEVEL, "HDD_ASYNC : response for a request in step %d", op->step);
+		completeOp(ring, op, -1);
+		return;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : finishRequest
+// Description  : Hand the response to a block request to the request(s) it
+//                was sent for, a merged read completes each of its members
+//
+// Inputs       : ring - the rings
+//                sr - the block request, its response fields are filled in
+// Outputs      : none
+
+void finishRequest(HddAsyncRing *ring, HddSchedReq *sr) {
+	HddSchedReq *m = (sr->members != NULL) ? sr->members : sr, *next;
+	HddAsyncOp *op;
+
+	hdd_sched_complete(sr); // frees a merged request, its members live in the ops
+	for (; m != NULL; m = next) {
+		next = m->nextMember;
+		op = m->owner;
+		op->ready = 0;
+		if (op->step == HDD_ASYNC_RANGE) {
+			completeOp(ring, op, (m->req.result != 0) ? -1 :
+					   (op->sqe.op == HDD_ASYNC_READ) ? (int32_t)m->req.length : op->sqe.count);
+		} else {
+			advanceOp(ring, op, formatResponse(m->req.op, m->req.length, m->req.flags, m->req.result, (uint32_t)m->req.blockID));
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : runBarrierOp
+// Description  : Execute an OPEN, FLUSH or NOP, everything before it has
+//                completed and no command is outstanding
+//
+// Inputs       : ring - the rings
+//                eng - the worker state
+//                op - the request
+// Outputs      : none
+
+void runBarrierOp(HddAsyncRing *ring, HddAsyncEngine *eng, HddAsyncOp *op) {
+	int32_t result = 0;
+
+	// These go through hdd_client_operation, which takes the connection itself
+	releaseConnection(eng);
+	switch (op->sqe.op) {
+	case HDD_ASYNC_OPEN:
+		result = hdd_open(op->sqe.path);
+		break;
+
+	case HDD_ASYNC_FLUSH:
+		result = ( (op->sqe.fd < 0) || (op->sqe.fd >= MAX_HDD_FILEDESCR) ) ? -1 : hdd_fsync(op->sqe.fd);
+		break;
+
+	case HDD_ASYNC_NOP:
+		break;
+
+	default:
+		logMessage(LOG_ERROR_LEVEL, "HDD_ASYNC : unknown request type %d", op->sqe.op);
+		result = -1;
+		break;
+	}
+	completeOp(ring, op, result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : scheduleOps
+// Description  : Walk the requests in order and start every one whose
+//                ordering constraints are met
+//
+// Inputs       : ring - the rings
+//                eng - the worker state
+// Outputs      : none
+
+void scheduleOps(HddAsyncRing *ring, HddAsyncEngine *eng) {
+	uint32_t i, mask = ring->entries - 1;
+	int barrier = 0, earlierPending = 0, linked = 0, prevDone = 0, prevFailed = 0;
+	HddAsyncOp *op;
+
+	eng->generation++;
+	for (i = eng->opHead; i != eng->opTail; i++) {
+		op = &eng->ops[i & mask];
+
+		if (op->step == HDD_ASYNC_WAITING) {
+			if ( linked && prevDone && prevFailed ) {
+				completeOp(ring, op, HDD_ASYNC_CANCELED); // the link chain is broken
+			} else if ( (linked && !prevDone) || barrier ) {
+				// wait for the predecessor in the chain, or for an earlier OPEN/FLUSH
+			} else if ( (op->sqe.op != HDD_ASYNC_READ) && (op->sqe.op != HDD_ASYNC_WRITE) ) {
+				if ( !earlierPending && (eng->sentHead == eng->sentTail) ) {
+					runBarrierOp(ring, eng, op);
+				}
+			} else if ( (op->sqe.fd >= 0) && (op->sqe.fd < MAX_HDD_FILEDESCR) &&
+						(eng->fdSeen[op->sqe.fd] == eng->generation) &&
+						((op->sqe.op == HDD_ASYNC_WRITE) || eng->fdWrite[op->sqe.fd]) ) {
+				// conflicts with an earlier request on the same handle, unless they
+				// are all overwrites inside the file and the ranges are disjoint
+				if ( (op->sqe.op == HDD_ASYNC_WRITE) && eng->fdInPlace[op->sqe.fd] && !overlapsEarlier(ring, eng, i) ) {
+					joinOp(eng, op);
+				}
+			} else {
+				startOp(ring, eng, op); // if the entry is busy outside the ring, retry on the next pass
+			}
+		}
+
+		// Record what later requests have to wait for
+		if (op->step != HDD_ASYNC_DONE) {
+			earlierPending = 1;
+			if ( (op->sqe.op != HDD_ASYNC_READ) && (op->sqe.op != HDD_ASYNC_WRITE) ) {
+				barrier = 1;
+			} else if ( (op->sqe.fd >= 0) && (op->sqe.fd < MAX_HDD_FILEDESCR) ) {
+				if (eng->fdSeen[op->sqe.fd] != eng->generation) {
+					eng->fdSeen[op->sqe.fd] = eng->generation;
+					eng->fdWrite[op->sqe.fd] = 0;
+					eng->fdInPlace[op->sqe.fd] = 1;
+				}
+				eng->fdWrite[op->sqe.fd] |= (op->sqe.op == HDD_ASYNC_WRITE);
+				eng->fdInPlace[op->sqe.fd] &= inPlaceOp(op);
+			}
+		}
+		linked = (op->sqe.flags & HDD_ASYNC_LINK) ? 1 : 0;
+		prevDone = (op->step == HDD_ASYNC_DONE);
+		prevFailed = prevDone && (op->result < 0);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_async_init
+// Description  : Create the rings and start the worker thread
+//
+// Inputs       : ring - the rings to set up
+//                entries - the number of requests the ring holds
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_async_init(HddAsyncRing *ring, uint32_t entries) {
+	HddAsyncEngine *eng;
+	uint32_t size = 1;
+
+	if ( (entries == 0) || (entries > HDD_ASYNC_MAX_ENTRIES) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_ASYNC : bad ring size %u", entries);
+		return( -1 );
+	}
+	while (size < entries) {
+		size = size << 1;
+	}
+
+	memset(ring, 0x0, sizeof(HddAsyncRing));
+	ring->entries = size;
+	ring->sq = calloc(size, sizeof(HddAsyncSqe));
+	ring->cq = calloc(size, sizeof(HddAsyncCqe));
+	eng = calloc(1, sizeof(HddAsyncEngine));
+	if ( (ring->sq == NULL) || (ring->cq == NULL) || (eng == NULL) ) {
+		free(ring->sq);
+		free(ring->cq);
+		free(eng);
+		return( -1 );
+	}
+	eng->ops = calloc(size, sizeof(HddAsyncOp));
+	eng->sent = calloc(size, sizeof(HddSchedReq *));
+	eng->fdSeen = calloc(MAX_HDD_FILEDESCR, sizeof(uint32_t));
+	eng->fdWrite = calloc(MAX_HDD_FILEDESCR, sizeof(uint8_t));
+	eng->fdInPlace = calloc(MAX_HDD_FILEDESCR, sizeof(uint8_t));
+	eng->fdHeld = calloc(MAX_HDD_FILEDESCR, sizeof(uint32_t));
+	ring->engine = eng;
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->submitted, NULL);
+	pthread_cond_init(&ring->completed, NULL);
+
+	if ( (eng->ops == NULL) || (eng->sent == NULL) || (eng->fdSeen == NULL) || (eng->fdWrite == NULL) ||
+		 (eng->fdInPlace == NULL) || (eng->fdHeld == NULL) ||
+		 pthread_create(&ring->worker, NULL, hdd_async_worker, ring) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_ASYNC : failed starting the ring worker");
+		free(eng->ops);
+		free(eng->sent);
+		free(eng->fdSeen);
+		free(eng->fdWrite);
+		free(eng->fdInPlace);
+		free(eng->fdHeld);
+		free(eng);
+		free(ring->sq);
+		free(ring->cq);
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_async_exit
+// Description  : Let the worker finish the submitted requests, stop it and
+//                free the rings
+//
+// Inputs       : ring - the rings
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_async_exit(HddAsyncRing *ring) {
+	HddAsyncEngine *eng = ring->engine;
+	uint32_t i;
+
+	pthread_mutex_lock(&ring->lock);
+	ring->shutdown = 1;
+	pthread_cond_broadcast(&ring->submitted);
+	pthread_mutex_unlock(&ring->lock);
+	if (pthread_join(ring->worker, NULL)) {
+		return( -1 );
+	}
+
+	for (i = 0; i < ring->entries; i++) {
+		free(eng->ops[i].scratch);
+	}
+	hdd_sched_report(&eng->sched, "async ring");
+	hdd_sched_free(&eng->sched);
+	free(eng->ops);
+	free(eng->sent);
+	free(eng->fdSeen);
+	free(eng->fdWrite);
+	free(eng->fdInPlace);
+	free(eng->fdHeld);
+	free(eng);
+	free(ring->sq);
+	free(ring->cq);
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->submitted);
+	pthread_cond_destroy(&ring->completed);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_async_get_sqe
+// Description  : Get the next free submission entry (single submitter)
+//
+// Inputs       : ring - the rings
+// Outputs      : the entry, NULL if the ring is full
+
+HddAsyncSqe *hdd_async_get_sqe(HddAsyncRing *ring) {
+	HddAsyncSqe *sqe = NULL;
+
+	pthread_mutex_lock(&ring->lock);
+	// every request needs a completion slot, and its submission slot must have been taken by the worker
+	if ( (ring->sqLocal - ring->cqHead < ring->entries) && (ring->sqLocal - ring->sqHead < ring->entries) ) {
+		sqe = &ring->sq[ring->sqLocal & (ring->entries - 1)];
+		memset(sqe, 0x0, sizeof(HddAsyncSqe));
+		ring->sqLocal++;
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return( sqe );
+}
+
+// Prepare an open of "path"
+void hdd_async_prep_open(HddAsyncSqe *sqe, char *path, uint64_t userData) {
+	sqe->op = HDD_ASYNC_OPEN;
+	sqe->path = path;
+	sqe->userData = userData;
+}
+
+// Prepare a positional read
+void hdd_async_prep_read(HddAsyncSqe *sqe, int16_t fd, void *buf, int32_t count, uint32_t offset, uint64_t userData) {
+	sqe->op = HDD_ASYNC_READ;
+	sqe->fd = fd;
+	sqe->buf = buf;
+	sqe->count = count;
+	sqe->offset = offset;
+	sqe->userData = userData;
+}
+
+// Prepare a positional write
+void hdd_async_prep_write(HddAsyncSqe *sqe, int16_t fd, void *buf, int32_t count, uint32_t offset, uint64_t userData) {
+	sqe->op = HDD_ASYNC_WRITE;
+	sqe->fd = fd;
+	sqe->buf = buf;
+	sqe->count = count;
+	sqe->offset = offset;
+	sqe->userData = userData;
+}
+
+// Prepare a flush of the file's directory entry
+void hdd_async_prep_flush(HddAsyncSqe *sqe, int16_t fd, uint64_t userData) {
+	sqe->op = HDD_ASYNC_FLUSH;
+	sqe->fd = fd;
+	sqe->userData = userData;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_async_submit
+// Description  : Hand the prepared entries to the worker, does not wait
+//
+// Inputs       : ring - the rings
+// Outputs      : the number of entries submitted
+
+int hdd_async_submit(HddAsyncRing *ring) {
+	int count;
+
+	pthread_mutex_lock(&ring->lock);
+	count = ring->sqLocal - ring->sqTail;
+	if (count > 0) {
+		ring->sqTail = ring->sqLocal;
+		pthread_cond_signal(&ring->submitted);
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return( count );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_async_peek_cqe
+// Description  : Get the next completion if there is one
+//
+// Inputs       : ring - the rings
+//                cqe - set to the completion
+// Outputs      : 0 if there is a completion, -1 if not
+
+int hdd_async_peek_cqe(HddAsyncRing *ring, HddAsyncCqe **cqe) {
+	int found = -1;
+
+	pthread_mutex_lock(&ring->lock);
+	if (ring->cqHead != ring->cqTail) {
+		*cqe = &ring->cq[ring->cqHead & (ring->entries - 1)];
+		found = 0;
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return( found );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_async_wait_cqe
+// Description  : Wait for the next completion
+//
+// Inputs       : ring - the rings
+//                cqe - set to the completion
+// Outputs      : 0 if there is a completion, -1 if nothing is in flight
+
+int hdd_async_wait_cqe(HddAsyncRing *ring, HddAsyncCqe **cqe) {
+	int found = -1;
+
+	pthread_mutex_lock(&ring->lock);
+	while ( (ring->cqHead == ring->cqTail) && (ring->cqHead != ring->sqTail) ) {
+		pthread_cond_wait(&ring->completed, &ring->lock);
+	}
+	if (ring->cqHead != ring->cqTail) {
+		*cqe = &ring->cq[ring->cqHead & (ring->entries - 1)];
+		found = 0;
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return( found );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_async_cqe_seen
+// Description  : Release the completion returned by peek/wait
+//
+// Inputs       : ring - the rings
+//                cqe - the completion
+// Outputs      : none
+
+void hdd_async_cqe_seen(HddAsyncRing *ring, HddAsyncCqe *cqe) {
+	pthread_mutex_lock(&ring->lock);
+	ring->cqHead++;
+	pthread_mutex_unlock(&ring->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_async_worker
+// Description  : The worker thread, pipelines the block commands of the
+//                submitted requests on the client connection
+//
+// Inputs       : arg - the rings
+// Outputs      : NULL
+
+void *hdd_async_worker(void *arg) {
+	HddAsyncRing *ring = arg;
+	HddAsyncEngine *eng = ring->engine;
+	uint32_t i, mask = ring->entries - 1;
+	HddAsyncOp *op;
+	HddSchedReq *sr;
+	int progress;
+
+	while (1) {
+
+		// Take the newly submitted requests while there is room behind the oldest
+		// unfinished one (completions can be reaped out of order), sleep if there
+		// is nothing to do
+		pthread_mutex_lock(&ring->lock);
+		while ( (ring->sqHead == ring->sqTail) && (eng->opHead == eng->opTail) && !ring->shutdown ) {
+			pthread_cond_wait(&ring->submitted, &ring->lock);
+		}
+		if ( (ring->sqHead == ring->sqTail) && (eng->opHead == eng->opTail) && ring->shutdown ) {
+			pthread_mutex_unlock(&ring->lock);
+			break;
+		}
+		while ( (ring->sqHead != ring->sqTail) && (eng->opTail - eng->opHead < ring->entries) ) {
+			op = &eng->ops[eng->opTail & mask];
+			op->sqe = ring->sq[ring->sqHead & mask];
+			op->step = HDD_ASYNC_WAITING;
+			op->ready = 0;
+			op->locked = 0;
+			ring->sqHead++;
+			eng->opTail++;
+		}
+		pthread_mutex_unlock(&ring->lock);
+
+		// Start what can start, queue the block requests built since the last
+		// pass, then keep the connection busy in the scheduler's order
+		scheduleOps(ring, eng);
+		progress = 0;
+		eng->sched.merge = (hdd_client_protocol() == HDD_PROTOCOL_V2) ? HDD_SCHED_MERGE_RANGES : HDD_SCHED_MERGE_SAME;
+		for (i = eng->opHead; i != eng->opTail; i++) {
+			op = &eng->ops[i & mask];
+			if (op->ready != 1) {
+				continue;
+			}
+			if (hdd_sched_add(&eng->sched, &op->sreq) == -1) {
+				completeOp(ring, op, -1);
+				continue;
+			}
+			op->ready = 2;
+		}
+		while ( (eng->commits == 0) && ((sr = hdd_sched_peek(&eng->sched)) != NULL) ) { // commits drain the pipeline first
+			if ( (eng->sentHead != eng->sentTail) && (eng->sentBytes + hdd_sched_resp_bytes(sr) > HDD_ASYNC_WINDOW) ) {
+				break; // let the responses drain before the socket buffers fill up
+			}
+			hdd_sched_take(&eng->sched, sr);
+			takeConnection(eng);
+			if (hdd_client_send_request(&sr->req, sr->buf) == -1) {
+				logMessage(LOG_ERROR_LEVEL, "HDD_ASYNC : failed sending a block command");
+				sr->req.result = 1;
+				finishRequest(ring, sr);
+				continue;
+			}
+			eng->sent[eng->sentTail & mask] = sr;
+			eng->sentTail++;
+			eng->sentBytes += hdd_sched_resp_bytes(sr);
+			progress = 1;
+		}
+
+		// Collect the oldest response
+		if (eng->sentHead != eng->sentTail) {
+			sr = eng->sent[eng->sentHead & mask];
+			eng->sentHead++;
+			eng->sentBytes -= hdd_sched_resp_bytes(sr);
+			hdd_client_recv_request(&sr->req, sr->buf);
+			finishRequest(ring, sr);
+			progress = 1;
+		}
+		if (eng->sentHead == eng->sentTail) {
+			releaseConnection(eng);
+		}
+
+		// Writes that changed their entry complete once the journal holds
+		// the changes, one group commit for all of them like hdd_pwrite's
+		if ( (eng->commits > 0) && (eng->sentHead == eng->sentTail) ) {
+			hdd_journal_commit(); // a failure leaves the entries to be saved at unmount
+			for (i = eng->opHead; i != eng->opTail; i++) {
+				op = &eng->ops[i & mask];
+				if (op->step == HDD_ASYNC_COMMIT) {
+					completeOp(ring, op, op->result);
+				}
+			}
+			eng->commits = 0;
+			progress = 1;
+		}
+
+		// Retire completed requests in order
+		while ( (eng->opHead != eng->opTail) && (eng->ops[eng->opHead & mask].step == HDD_ASYNC_DONE) ) {
+			eng->opHead++;
+			progress = 1;
+		}
+
+		// Nothing could move (entry held outside the ring), don't spin hot
+		if (!progress && (eng->opHead != eng->opTail)) {
+			sched_yield();
+		}
+	}
+
+	releaseConnection(eng);
+	return( NULL );
+}
@@ -0,0 +1,129 @@
+#ifndef HDD_ASYNC_INCLUDED
+#define HDD_ASYNC_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_async.h
+//  Description    : This is the header file for the asynchronous interface to
+//                   the HDD storage system. Requests are queued on a
+//                   submission ring, executed by a worker thread that
+//                   pipelines their block operations over the client
+//                   connection, and their results are reaped from a
+//                   completion ring.
+//
+
+//
+
+// Include files
+#include <stdint.h>
+#include <pthread.h>
+
+// Project include files
+#include <hdd_file_io.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Defines
+#define HDD_ASYNC_MAX_ENTRIES 4096 // largest submission ring
+#define HDD_ASYNC_WINDOW 65536     // response bytes allowed in flight before draining
+#define HDD_ASYNC_CANCELED -2      // result of a linked request whose predecessor failed
+
+// These are the asynchronous request types
+typedef enum {
+	HDD_ASYNC_NOP   = 0, // Complete without doing anything
+	HDD_ASYNC_OPEN  = 1, // hdd_open(path), result is the file handle
+	HDD_ASYNC_READ  = 2, // hdd_pread(fd, buf, count, offset), result is the bytes read
+	HDD_ASYNC_WRITE = 3, // hdd_pwrite(fd, buf, count, offset), result is the bytes written
+	HDD_ASYNC_FLUSH = 4, // hdd_fsync(fd), result is 0
+} HDD_ASYNC_OP_TYPES;
+
+// These are the submission flags
+typedef enum {
+	HDD_ASYNC_LINK = 1, // The next request starts only after this one succeeds, else it is canceled
+} HDD_ASYNC_FLAG_TYPES;
+
+// Submission queue entry
+typedef struct {
+	uint8_t   op;       // HDD_ASYNC_OP_TYPES
+	uint8_t   flags;    // HDD_ASYNC_FLAG_TYPES
+	int16_t   fd;       // file handle (READ, WRITE, FLUSH)
+	int32_t   count;    // bytes to transfer (READ, WRITE)
+	uint32_t  offset;   // position in the file (READ, WRITE)
+	void     *buf;      // data buffer (READ, WRITE)
+	char     *path;     // file name (OPEN)
+	uint64_t  userData; // copied to the completion
+} HddAsyncSqe;
+
+// Completion queue entry
+typedef struct {
+	uint64_t userData; // from the submission
+	int32_t  result;   // the request result, -1 on failure, HDD_ASYNC_CANCELED if canceled
+} HddAsyncCqe;
+
+// The rings, fields are private to hdd_async.c
+typedef struct {
+	uint32_t        entries;   // ring size (power of 2), bounds the requests submitted but not yet reaped
+	HddAsyncSqe    *sq;        // submission ring
+	uint32_t        sqHead;    // next entry the worker takes
+	uint32_t        sqTail;    // end of the submitted entries
+	uint32_t        sqLocal;   // end of the entries handed out by hdd_async_get_sqe
+	HddAsyncCqe    *cq;        // completion ring
+	uint32_t        cqHead;    // next completion to reap
+	uint32_t        cqTail;    // end of the posted completions
+	int             shutdown;  // set to stop the worker
+	pthread_t       worker;    // the thread executing requests
+	pthread_mutex_t lock;      // protects the ring indices
+	pthread_cond_t  submitted; // signalled when requests are submitted
+	pthread_cond_t  completed; // signalled when completions are posted
+	void           *engine;    // the worker's pipeline state
+} HddAsyncRing;
+
+//
+// Ring management
+
+int hdd_async_init(HddAsyncRing *ring, uint32_t entries);
+	// Create the rings with room for "entries" requests (rounded up to a power of 2) and start the worker
+
+int hdd_async_exit(HddAsyncRing *ring);
+	// Wait for the submitted requests, stop the worker and free the rings
+
+//
+// Submission
+
+HddAsyncSqe *hdd_async_get_sqe(HddAsyncRing *ring);
+	// Get the next free submission entry, NULL if the ring is full
+
+void hdd_async_prep_open(HddAsyncSqe *sqe, char *path, uint64_t userData);
+	// Prepare an open of "path"
+
+void hdd_async_prep_read(HddAsyncSqe *sqe, int16_t fd, void *buf, int32_t count, uint32_t offset, uint64_t userData);
+	// Prepare a positional read
+
+void hdd_async_prep_write(HddAsyncSqe *sqe, int16_t fd, void *buf, int32_t count, uint32_t offset, uint64_t userData);
+	// Prepare a positional write
+
+void hdd_async_prep_flush(HddAsyncSqe *sqe, int16_t fd, uint64_t userData);
+	// Prepare a flush of the file's directory entry
+
+int hdd_async_submit(HddAsyncRing *ring);
+	// Hand the prepared entries to the worker without waiting, returns how many
+
+//
+// Completion
+
+int hdd_async_peek_cqe(HddAsyncRing *ring, HddAsyncCqe **cqe);
+	// Get the next completion without blocking, returns 0 if there is one, -1 if not
+
+int hdd_async_wait_cqe(HddAsyncRing *ring, HddAsyncCqe **cqe);
+	// Wait for the next completion, returns 0 if there is one, -1 if nothing is in flight
+
+void hdd_async_cqe_seen(HddAsyncRing *ring, HddAsyncCqe *cqe);
+	// Release a completion returned by peek/wait
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
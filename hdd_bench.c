@@ -0,0 +1,2144 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_bench.c
+//  Description   : This is the benchmark driver for the HDD filesystem. Each
+//                  benchmark runs against a live HDD server and reports its
+//                  timings through the log.
+//
+
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+// Project Includes
+#include <hdd_driver.h>
+#include <hdd_network.h>
+#include <hdd_file_io.h>
+#include <hdd_async.h>
+#include <hdd_trace.h>
+#include <hdd_sched.h>
+#include <hdd_cache.h>
+#include <hdd_stripe.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define HDD_BENCH_ARGUMENTS "hvr:s:c:R:H:S:E:J:k:a:p:"
+#define HDD_BENCH_DEFAULT_REPEAT 5
+#define HDD_BENCH_FILE_SIZE 32
+#define HDD_BENCH_LINE_SIZE 2048
+#define HDD_BENCH_COHERENCE_BLOCK 4096  // bytes in each block of the coherence benchmark
+#define HDD_BENCH_COHERENCE_HISTORY 64  // writes of each block remembered for the staleness check
+#define HDD_BENCH_HEDGE_BLOCK 4096      // bytes in each block of the hedge benchmark
+#define HDD_BENCH_STRIPE_UNITS 64       // units of each stripe unit size coded by the kernel measurement
+#define HDD_BENCH_JOURNAL_KB 64         // journal of the journal benchmark without -J
+#define HDD_BENCH_JOURNAL_WRITE 512     // bytes written to each file of the journal benchmark
+#define HDD_BENCH_PACK_GROWTH 64        // bytes the pack benchmark's rewrites add to a file
+#define HDD_BENCH_WIRE_CLASSES 6        // request classes the wire replay reports
+#define HDD_BENCH_WIRE_PENDING 0xffffffff // block map entry of a create still in flight
+#define USAGE \
+	"USAGE: hdd_bench [-h] [-v] [-r <repeat>] [-s <scheduler>] [-c <cache>] [-R <replicas>]\n" \
+	"                 [-H <percentile>] [-S <servers>] [-E <layout>] [-J <KiB>]\n" \
+	"                 [-k <bytes>] [-a <ip addr>] [-p <port>] <benchmark> [args]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -r - number of timed repetitions per measurement (default 5)\n" \
+	"    -s - client I/O scheduler: fifo, clook or deadline[:<ms>]\n" \
+	"         (default deadline:50)\n" \
+	"    -c - client block cache, see hdd_client -h (default off)\n" \
+	"    -R - more servers holding copies of the store, see hdd_client -h\n" \
+	"    -H - percentile of read latency reads are hedged after (default 95)\n" \
+	"    -S - servers large files are striped across, see hdd_client -h\n" \
+	"    -E - stripe layout, see hdd_client -h\n" \
+	"    -J - directory journal, see hdd_client -h (default none)\n" \
+	"    -k - packed file size, see hdd_client -h (default none)\n" \
+	"    -a - IP address of the server\n" \
+	"    -p - port number of the server\n" \
+	"\n" \
+	"benchmarks:\n" \
+	"    mount [n ...] - eager vs lazy mount + first open latency for\n" \
+	"                    directories of n files (default 16 64 256 1024)\n" \
+	"    files [n ...] - create, reopen and mount directories of n empty\n" \
+	"                    files and report the heap used per file\n" \
+	"                    (default 10000 100000 1000000)\n" \
+	"    namespace [n ...] - cold and warm lookups, readdir and prefix\n" \
+	"                    listing in a directory of n files\n" \
+	"                    (default 10000 100000 1000000)\n" \
+	"    async [setup ...] <workload> - replay the workload through the\n" \
+	"                    synchronous API and the async ring at queue depth\n" \
+	"                    1, 8 and 64 (setup workloads are replayed first);\n" \
+	"                    workloads are text (without payload files) or\n" \
+	"                    hdd_wlgen -b binary traces\n" \
+	"    coherence [clients [seconds [blocks]]] - clients (default 8) in\n" \
+	"                    separate processes read and overwrite blocks (default\n" \
+	"                    256 of 4 KiB) for the given time (default 2), first\n" \
+	"                    uncached, then each with its own block cache (-c, no\n" \
+	"                    file tier). Every read is checked for torn data and\n" \
+	"                    for missing a write completed longer ago than the\n" \
+	"                    server's lease term (any write when uncached)\n" \
+	"    hedge [threads [seconds [blocks]]] - threads (default 8) read random\n" \
+	"                    blocks (default 1024 of 4 KiB) for the given time\n" \
+	"                    (default 5), without and then with hedging, and report\n" \
+	"                    the latency percentiles; run the servers with -d and\n" \
+	"                    give their copies with -R\n" \
+	"    stripe [mb [chunk]] - write a file of mb MiB (default 64) in chunks\n" \
+	"                    of chunk KiB (default 1024), remount and read it\n" \
+	"                    back, striped over the first w of the -S servers for\n" \
+	"                    every width w the -E parity allows; with parity the\n" \
+	"                    file is read again with the first server down. Then\n" \
+	"                    the parity coding rate of each GF(2^8) kernel; run\n" \
+	"                    the servers with -d so the transfers take disk time\n" \
+	"    journal [threads [files]] - threads (default 8) each create files\n" \
+	"                    (default 256), write and fsync each, with fsync\n" \
+	"                    saving the directory and then with the journal (-J,\n" \
+	"                    default 64 KiB); the journaled files are checked\n" \
+	"                    after remounting without an unmount\n" \
+	"    pack [files [size]] - write files (default 1024) of size bytes\n" \
+	"                    (default 1024) in one directory, remount and read\n" \
+	"                    them back in name order, then rewrite every other\n" \
+	"                    one a little larger and compact; unpacked and then\n" \
+	"                    packed (-k, default the file size plus the growth),\n" \
+	"                    reporting the block reads of the read pass\n" \
+	"    wire <trace> [paced [depth]] - replay a wire trace (hdd_client -T)\n" \
+	"                    against the server, as fast as possible or with\n" \
+	"                    paced 1 at the recorded times, keeping up to depth\n" \
+	"                    requests in flight (default 1, paced 64), and\n" \
+	"                    report the latency of each kind of request next to\n" \
+	"                    the recorded one. Blocks are written with a pattern\n" \
+	"                    (traces hold no data) and block IDs are mapped to\n" \
+	"                    the ones the server hands out\n" \
+	"\n" \
+
+// A workload operation turned into a positional read or write
+typedef struct {
+	int16_t   file;   // index into the trace file names
+	uint8_t   write;  // 1 for a write, 0 for a read
+	int32_t   len;    // bytes to transfer
+	uint32_t  off;    // position in the file
+	char     *data;   // write payload or read buffer
+} HddBenchOp;
+
+// A replayable workload
+typedef struct {
+	HddBenchOp *ops;       // the operations in order
+	int         nops;      // number of operations
+	int         capacity;  // allocated operations
+	char       *names[MAX_HDD_FILEDESCR]; // the files touched
+	uint32_t    pos[MAX_HDD_FILEDESCR];   // per file position while loading
+	uint32_t    size[MAX_HDD_FILEDESCR];  // per file size after the ops
+	int         nfiles;    // number of files
+} HddBenchTrace;
+
+// The start of a block in the coherence benchmark, the rest of the block is
+// filled with a pattern of the block and its sequence number
+typedef struct {
+	uint32_t block;  // index of the block
+	uint32_t writer; // client that wrote it
+	uint64_t seq;    // writes of the block so far
+} HddBenchStamp;
+
+// The writes of a block, in memory shared by the clients (only the client
+// owning the block writes it)
+typedef struct {
+	uint64_t writes;                            // writes completed
+	uint64_t seq[HDD_BENCH_COHERENCE_HISTORY];  // write k stored at k % HISTORY is k + 1 once done[] is set
+	double   done[HDD_BENCH_COHERENCE_HISTORY]; // when write k completed (us)
+} HddBenchHistory;
+
+// What a client of the coherence benchmark did and found
+typedef struct {
+	uint64_t reads;    // blocks read
+	uint64_t writes;   // blocks written
+	uint64_t checked;  // reads whose staleness could be measured
+	uint64_t stale;    // reads missing a write completed more than the lease ago
+	uint64_t torn;     // reads with mixed or foreign contents
+	uint64_t errors;   // failed requests
+	double   maxStale; // longest a read missed a completed write by (us)
+} HddBenchClient;
+
+// A reader thread of the hedge benchmark
+typedef struct {
+	HddBlockID *ids;      // the blocks
+	int         blocks;   // number of blocks
+	double      deadline; // when to stop (us)
+	unsigned    seed;     // for picking blocks
+	double     *latency;  // read latencies (us)
+	int         reads;    // reads done
+	int         capacity; // entries allocated for latency
+	int         errors;   // failed reads
+} HddBenchReader;
+
+// A request of the wire replay in flight
+typedef struct {
+	uint32_t   record; // index of its trace record
+	double     sent;   // when it was sent (us)
+	HddRequest req;    // the request, its response once received
+} HddBenchWireSent;
+
+// A wire replay in progress
+typedef struct {
+	HddWireRecord    *recs;     // the trace
+	uint32_t          nrecs;    // records in it
+	HddBlockID       *map;      // recorded block ID to the one the server handed out, 0 if unmapped
+	uint32_t          mapSize;  // entries in map
+	HddBenchWireSent *ring;     // requests in flight, oldest at head
+	uint32_t          depth;    // entries in ring
+	uint32_t          head;     // oldest in flight
+	uint32_t          inflight; // requests in flight
+	char             *payload;  // what blocks are written with
+	char             *scratch;  // where blocks are read to
+	double           *latency;  // replayed latency of each record (us), -1 if it failed
+	uint32_t          mismatch; // responses whose result differs from the recorded one
+} HddBenchWire;
+
+// A thread of the journal benchmark
+typedef struct {
+	int      thread; // index, names its directory
+	int      files;  // files to create
+	char    *data;   // what each file gets
+	int      errors; // failed calls
+} HddBenchCreator;
+
+//
+// Global Data
+int repeat = HDD_BENCH_DEFAULT_REPEAT;
+char *cacheSpec = NULL; // the -c option, set up before the benchmark runs
+double hedgeOption = HDD_HEDGE_PERCENTILE; // the -H option
+char *stripeSpec = NULL; // the -S option
+char *layoutSpec = "default"; // the -E option
+uint32_t journalOption = 0; // the -J option
+uint32_t packOption = 0; // the -k option
+
+//
+// Functional Prototypes
+
+int bench_mount( int argc, char *argv[] );
+int bench_async( int argc, char *argv[] );
+int bench_files( int argc, char *argv[] );
+int bench_namespace( int argc, char *argv[] );
+int bench_coherence( int argc, char *argv[] );
+int bench_hedge( int argc, char *argv[] );
+int bench_stripe( int argc, char *argv[] );
+int bench_journal( int argc, char *argv[] );
+int bench_pack( int argc, char *argv[] );
+int bench_wire( int argc, char *argv[] );
+int bench_load_binary( FILE *fhandle, HddBenchTrace *trace );
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_now_us
+// Description  : Get a monotonic timestamp in microseconds
+//
+// Inputs       : none
+// Outputs      : the timestamp
+
+double bench_now_us( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return( (double)ts.tv_sec * 1000000.0 + (double)ts.tv_nsec / 1000.0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the HDD benchmarks
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+	// Local variables
+	int ch;
+
+	// Process the command line parameters
+	initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	while ((ch = getopt(argc, argv, HDD_BENCH_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			enableLogLevels( LOG_INFO_LEVEL );
+			break;
+
+		case 'r': // Set the repetitions
+			if ( (sscanf( optarg, "%d", &repeat ) != 1) || (repeat < 1) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad repeat count [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 's': // Set the I/O scheduler
+			if (hdd_sched_configure(optarg)) {
+				return(-1);
+			}
+			break;
+
+		case 'c': // Set up the block cache
+			cacheSpec = optarg;
+			break;
+
+		case 'R': // Add replicas
+			if (hdd_client_set_replicas(optarg)) {
+				return(-1);
+			}
+			break;
+
+		case 'H': // Set the hedging percentile
+			if ( (sscanf( optarg, "%lf", &hedgeOption ) != 1) || (hedgeOption < 0) || (hedgeOption >= 100) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad hedging percentile [%s]", optarg );
+				return(-1);
+			}
+			hdd_client_set_hedge(hedgeOption);
+			break;
+
+		case 'S': // Set the stripe servers
+			if (hdd_stripe_set_servers(optarg)) {
+				return(-1);
+			}
+			stripeSpec = optarg;
+			break;
+
+		case 'E': // Set the stripe layout
+			if (hdd_stripe_configure(optarg)) {
+				return(-1);
+			}
+			layoutSpec = optarg;
+			break;
+
+		case 'J': // Set the journal size
+			if ( sscanf(optarg, "%u", &journalOption) != 1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad journal size [%s]", optarg );
+				return(-1);
+			}
+			hdd_set_journal(journalOption);
+			break;
+
+		case 'k': // Set the packed file size
+			if ( sscanf(optarg, "%u", &packOption) != 1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad packed file size [%s]", optarg );
+				return(-1);
+			}
+			hdd_set_pack(packOption);
+			break;
+
+		case 'a': // Set the server address
+			if ( inet_addr(optarg) == INADDR_NONE ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad IP address [%s]", optarg );
+				return(-1);
+			}
+			hdd_network_address = (unsigned char *)strdup(optarg);
+			break;
+
+		case 'p': // Set the server port
+			if ( sscanf(optarg, "%hu", &hdd_network_port) != 1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad port number [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// The benchmark name should be the next option
+	if ( optind >= argc ) {
+		fprintf( stderr, "Missing benchmark name, use -h to see usage, aborting.\n" );
+		return( -1 );
+	}
+
+	// The coherence clients each set up their own cache
+	if ( strcmp(argv[optind], "coherence") == 0 ) {
+		return( bench_coherence(argc-optind-1, &argv[optind+1]) );
+	}
+	if ( (cacheSpec != NULL) && hdd_cache_configure(cacheSpec) ) {
+		return( -1 );
+	}
+
+	if ( strcmp(argv[optind], "mount") == 0 ) {
+		return( bench_mount(argc-optind-1, &argv[optind+1]) );
+	}
+	if ( strcmp(argv[optind], "async") == 0 ) {
+		return( bench_async(argc-optind-1, &argv[optind+1]) );
+	}
+	if ( strcmp(argv[optind], "files") == 0 ) {
+		return( bench_files(argc-optind-1, &argv[optind+1]) );
+	}
+	if ( strcmp(argv[optind], "namespace") == 0 ) {
+		return( bench_namespace(argc-optind-1, &argv[optind+1]) );
+	}
+	if ( strcmp(argv[optind], "hedge") == 0 ) {
+		return( bench_hedge(argc-optind-1, &argv[optind+1]) );
+	}
+	if ( strcmp(argv[optind], "stripe") == 0 ) {
+		return( bench_stripe(argc-optind-1, &argv[optind+1]) );
+	}
+	if ( strcmp(argv[optind], "journal") == 0 ) {
+		return( bench_journal(argc-optind-1, &argv[optind+1]) );
+	}
+	if ( strcmp(argv[optind], "pack") == 0 ) {
+		return( bench_pack(argc-optind-1, &argv[optind+1]) );
+	}
+	if ( strcmp(argv[optind], "wire") == 0 ) {
+		return( bench_wire(argc-optind-1, &argv[optind+1]) );
+	}
+
+	fprintf( stderr, "Unknown benchmark [%s], use -h to see usage, aborting.\n", argv[optind] );
+	return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_mount_once
+// Description  : Time one mount followed by the first open of a file
+//
+// Inputs       : mode - the mount mode to use
+//                first - the name of the file opened after mounting
+// Outputs      : the elapsed time in microseconds, -1 if failure
+
+double bench_mount_once( HDD_MOUNT_MODE mode, char *first ) {
+	double start, elapsed;
+	int16_t fh;
+
+	hdd_set_mount_mode(mode);
+	start = bench_now_us();
+	if ( (hdd_mount() != 0) || ((fh = hdd_open(first)) == -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : mount or open of [%s] failed.", first );
+		return( -1 );
+	}
+	elapsed = bench_now_us() - start;
+
+	if ( (hdd_close(fh) != 0) || (hdd_unmount() != 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : close or unmount failed." );
+		return( -1 );
+	}
+	return( elapsed );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_mount
+// Description  : Build directories of increasing size and compare the time
+//                to first I/O of an eager mount against a lazy mount
+//
+// Inputs       : argc - the number of directory sizes
+//                argv - the directory sizes
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_mount( int argc, char *argv[] ) {
+	int defaults[] = { 16, 64, 256, 1024 };
+	int nsizes = (argc > 0) ? argc : (int)(sizeof(defaults)/sizeof(int));
+	int s, i, r, files;
+	char fname[MAX_FILENAME_LENGTH], data[HDD_BENCH_FILE_SIZE];
+	double eager, lazy, t;
+	int16_t fh;
+
+	memset(data, 'b', HDD_BENCH_FILE_SIZE);
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH mount: %8s %14s %14s", "files", "eager us", "lazy us" );
+	for (s=0; s<nsizes; s++) {
+		files = (argc > 0) ? atoi(argv[s]) : defaults[s];
+		if (files < 1) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : bad directory size [%d]", files );
+			return( -1 );
+		}
+
+		// Build a fresh directory of the requested size
+		if ( hdd_format() || hdd_mount() ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : format or mount failed." );
+			return( -1 );
+		}
+		for (i=0; i<files; i++) {
+			snprintf( fname, MAX_FILENAME_LENGTH, "bench-%d.txt", i );
+			if ( ((fh = hdd_open(fname)) == -1) ||
+				 (hdd_write(fh, data, HDD_BENCH_FILE_SIZE) != HDD_BENCH_FILE_SIZE) ||
+				 hdd_close(fh) ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : creating [%s] failed.", fname );
+				return( -1 );
+			}
+		}
+		if ( hdd_unmount() ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : unmount failed." );
+			return( -1 );
+		}
+
+		// Average mount + first open over the repetitions
+		eager = lazy = 0;
+		for (r=0; r<repeat; r++) {
+			snprintf( fname, MAX_FILENAME_LENGTH, "bench-%d.txt", r % files );
+			if ( ((t = bench_mount_once(HDD_MOUNT_EAGER, fname)) < 0) ) {
+				return( -1 );
+			}
+			eager += t;
+			if ( ((t = bench_mount_once(HDD_MOUNT_LAZY, fname)) < 0) ) {
+				return( -1 );
+			}
+			lazy += t;
+		}
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH mount: %8d %14.1f %14.1f", files, eager/repeat, lazy/repeat );
+	}
+
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_trace_file
+// Description  : Find a file of the trace by name, adding it if it is new
+//
+// Inputs       : trace - the trace
+//                fname - the file name
+// Outputs      : the file index if successful, -1 if failure
+
+int bench_trace_file( HddBenchTrace *trace, char *fname ) {
+	int f;
+
+	for (f=0; (f<trace->nfiles) && strcmp(trace->names[f], fname); f++);
+	if (f == trace->nfiles) {
+		if (f == MAX_HDD_FILEDESCR) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : too many files in workload" );
+			return( -1 );
+		}
+		trace->names[f] = strdup(fname);
+		trace->pos[f] = trace->size[f] = 0;
+		trace->nfiles++;
+	}
+	return( f );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_load_binary
+// Description  : Append a binary trace (hdd_trace.h) to a trace
+//
+// Inputs       : fhandle - the open trace file
+//                trace - the trace to append to
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_load_binary( FILE *fhandle, HddBenchTrace *trace ) {
+	char fname[MAX_FILENAME_LENGTH];
+	HddTraceHeader hdr;
+	HddTraceOp rec;
+	HddBenchOp *op;
+	uint16_t nlen;
+	int *map;
+	uint32_t i;
+
+	if ( (fread(&hdr, sizeof(hdr), 1, fhandle) != 1) || (hdr.version != HDD_TRACE_VERSION) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : bad trace header" );
+		return( -1 );
+	}
+
+	// Map the trace's file numbers to the benchmark's
+	if ( (map = malloc((hdr.files + 1) * sizeof(int))) == NULL ) {
+		return( -1 );
+	}
+	for (i=0; i<hdr.files; i++) {
+		if ( (fread(&nlen, sizeof(nlen), 1, fhandle) != 1) || (nlen >= MAX_FILENAME_LENGTH) ||
+			 (fread(fname, 1, nlen, fhandle) != nlen) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : bad trace file name %u", i );
+			free( map );
+			return( -1 );
+		}
+		fname[nlen] = '\0';
+		if ( (map[i] = bench_trace_file(trace, fname)) == -1 ) {
+			free( map );
+			return( -1 );
+		}
+	}
+
+	for (i=0; i<hdr.ops; i++) {
+		if ( (fread(&rec, sizeof(rec), 1, fhandle) != 1) || (rec.file >= hdr.files) || (rec.len > INT32_MAX) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : bad trace operation %u", i );
+			free( map );
+			return( -1 );
+		}
+		if (trace->nops == trace->capacity) {
+			trace->capacity = (trace->capacity == 0) ? 1024 : trace->capacity * 2;
+			trace->ops = realloc(trace->ops, trace->capacity * sizeof(HddBenchOp));
+		}
+		op = &trace->ops[trace->nops++];
+		op->file = map[rec.file];
+		op->write = (rec.op == HDD_TRACE_WRITE);
+		op->len = rec.len;
+		op->off = rec.off;
+		op->data = malloc(rec.len > 0 ? rec.len : 1);
+		if ( op->write && (fread(op->data, 1, rec.len, fhandle) != rec.len) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : truncated trace write %u", i );
+			free( map );
+			return( -1 );
+		}
+		if ( op->write && (op->off + rec.len > trace->size[op->file]) ) {
+			trace->size[op->file] = op->off + rec.len;
+		}
+	}
+	free( map );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_load_workload
+// Description  : Append a workload file to a trace, turning its WRITE,
+//                WRITEAT, SEEK and READ commands into positional operations
+//
+// Inputs       : wload - the workload file name
+//                trace - the trace to append to
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_load_workload( char *wload, HddBenchTrace *trace ) {
+	char line[HDD_BENCH_LINE_SIZE], fname[MAX_FILENAME_LENGTH], command[128], *sep;
+	int32_t len, off, i;
+	HddBenchOp *op;
+	FILE *fhandle;
+	uint32_t magic;
+	int f, ret;
+
+	if ( (fhandle=fopen(wload, "r")) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : failure opening the workload file [%s]", wload );
+		return( -1 );
+	}
+	if ( (fread(&magic, sizeof(magic), 1, fhandle) == 1) && (magic == HDD_TRACE_MAGIC) ) {
+		rewind( fhandle );
+		ret = bench_load_binary( fhandle, trace );
+		fclose( fhandle );
+		return( ret );
+	}
+	rewind( fhandle );
+	while (fgets(line, HDD_BENCH_LINE_SIZE, fhandle) != NULL) {
+		sep = strpbrk(line, ":=<"); // text, a fill pattern or a payload file
+		if ( (sscanf(line, "%127s %127s %d %d", fname, command, &len, &off) != 4) || (sep == NULL) || (*sep == '<') ||
+			 ((*sep == '=') && strncmp(sep, "=pos", 4) && strncmp(sep, "=zero", 5)) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : un-parsable workload string [%s]", line );
+			fclose( fhandle );
+			return( -1 );
+		}
+		if ( (strcmp(command, "FORMAT") == 0) || (strcmp(command, "MOUNT") == 0) || (strcmp(command, "UNMOUNT") == 0) ) {
+			continue; // the benchmark formats and mounts itself
+		}
+
+		if ( (f = bench_trace_file(trace, fname)) == -1 ) {
+			fclose( fhandle );
+			return( -1 );
+		}
+
+		if (strcmp(command, "SEEK") == 0) {
+			trace->pos[f] = off;
+			continue;
+		}
+		if (strcmp(command, "WRITEAT") == 0) {
+			trace->pos[f] = off;
+		}
+
+		if (trace->nops == trace->capacity) {
+			trace->capacity = (trace->capacity == 0) ? 1024 : trace->capacity * 2;
+			trace->ops = realloc(trace->ops, trace->capacity * sizeof(HddBenchOp));
+		}
+		op = &trace->ops[trace->nops++];
+		op->file = f;
+		op->len = len;
+		op->off = trace->pos[f];
+		op->data = malloc(len > 0 ? len : 1);
+		if (strcmp(command, "READ") == 0) {
+			op->write = 0;
+			if (op->off + len > trace->size[f]) {
+				len = trace->size[f] - op->off;
+			}
+		} else {
+			op->write = 1;
+			if (strncmp(sep, "=pos", 4) == 0) {
+				hdd_fill_pos((uint8_t *)op->data, op->off, len);
+			} else if (*sep == '=') {
+				memset(op->data, 0x0, len); // =zero
+			} else {
+				memcpy(op->data, sep+1, len);
+				for (i=0; i<len; i++) {
+					if (op->data[i] == '*') {
+						op->data[i] = '\n';
+					}
+				}
+			}
+			if (op->off + len > trace->size[f]) {
+				trace->size[f] = op->off + len;
+			}
+		}
+		trace->pos[f] += len;
+	}
+	fclose( fhandle );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_replay_sync
+// Description  : Replay trace operations with hdd_pread/hdd_pwrite
+//
+// Inputs       : trace - the trace
+//                fh - the handles of the trace files
+//                first, last - the range of operations to replay
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_replay_sync( HddBenchTrace *trace, int16_t *fh, int first, int last ) {
+	HddBenchOp *op;
+	int i, expected;
+
+	for (i=first; i<last; i++) {
+		op = &trace->ops[i];
+		if (op->write) {
+			if (hdd_pwrite(fh[op->file], op->data, op->len, op->off) != op->len) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : write %d of [%s] failed", i, trace->names[op->file] );
+				return( -1 );
+			}
+		} else {
+			expected = hdd_pread(fh[op->file], op->data, op->len, op->off);
+			if (expected == -1) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : read %d of [%s] failed", i, trace->names[op->file] );
+				return( -1 );
+			}
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_replay_async
+// Description  : Replay trace operations through an async ring, keeping up
+//                to "depth" requests in flight
+//
+// Inputs       : trace - the trace
+//                fh - the handles of the trace files
+//                first, last - the range of operations to replay
+//                depth - the queue depth
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_replay_async( HddBenchTrace *trace, int16_t *fh, int first, int last, int depth ) {
+	HddAsyncRing ring;
+	HddAsyncSqe *sqe;
+	HddAsyncCqe *cqe;
+	HddBenchOp *op;
+	int next = first, done = first, failed = 0;
+
+	if (hdd_async_init(&ring, depth)) {
+		return( -1 );
+	}
+	while (done < last) {
+		// Fill the ring
+		while ( (next < last) && ((sqe = hdd_async_get_sqe(&ring)) != NULL) ) {
+			op = &trace->ops[next];
+			if (op->write) {
+				hdd_async_prep_write(sqe, fh[op->file], op->data, op->len, op->off, next);
+			} else {
+				hdd_async_prep_read(sqe, fh[op->file], op->data, op->len, op->off, next);
+			}
+			next++;
+		}
+		hdd_async_submit(&ring);
+
+		// Reap what has completed, waiting for at least one
+		if (hdd_async_wait_cqe(&ring, &cqe) == -1) {
+			break;
+		}
+		do {
+			if (cqe->result < 0) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : async op %lu failed [%d]", (unsigned long)cqe->userData, cqe->result );
+				failed = 1;
+			}
+			hdd_async_cqe_seen(&ring, cqe);
+			done++;
+		} while (hdd_async_peek_cqe(&ring, &cqe) == 0);
+	}
+	hdd_async_exit(&ring);
+	return( (failed || (done != last)) ? -1 : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_digest
+// Description  : Checksum the contents of every trace file
+//
+// Inputs       : trace - the trace
+//                fh - the handles of the trace files
+// Outputs      : the checksum
+
+uint64_t bench_digest( HddBenchTrace *trace, int16_t *fh ) {
+	uint64_t digest = 1469598103934665603ULL;
+	char *buf = malloc(HDD_MAX_BLOCK_SIZE);
+	int f, i, len;
+
+	for (f=0; f<trace->nfiles; f++) {
+		len = (trace->size[f] > 0) ? hdd_pread(fh[f], buf, trace->size[f], 0) : 0;
+		for (i=0; i<len; i++) {
+			digest = (digest ^ (uint8_t)buf[i]) * 1099511628211ULL;
+		}
+		digest = (digest ^ (uint64_t)len) * 1099511628211ULL;
+	}
+	free(buf);
+	return( digest );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_async
+// Description  : Compare the synchronous API against the async ring at
+//                several queue depths on a workload
+//
+// Inputs       : argc - the number of workload files
+//                argv - the setup workloads followed by the measured one
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_async( int argc, char *argv[] ) {
+	int depths[] = { 0, 1, 8, 64 }; // 0 is the synchronous API
+	int16_t fh[MAX_HDD_FILEDESCR];
+	HddBenchTrace trace;
+	int w, d, f, r, setupOps;
+	double start, best, t;
+	uint64_t digest, expected = 0;
+
+	if (argc < 1) {
+		fprintf( stderr, "Missing workload file, use -h to see usage, aborting.\n" );
+		return( -1 );
+	}
+	memset(&trace, 0x0, sizeof(trace));
+	for (w=0; w<argc-1; w++) {
+		if (bench_load_workload(argv[w], &trace)) {
+			return( -1 );
+		}
+	}
+	setupOps = trace.nops;
+	if (bench_load_workload(argv[argc-1], &trace)) {
+		return( -1 );
+	}
+
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH async: %d ops on %d files (%d setup ops)",
+			trace.nops-setupOps, trace.nfiles, setupOps );
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH async: %8s %12s %12s", "depth", "best ms", "ops/s" );
+	for (d=0; d<(int)(sizeof(depths)/sizeof(int)); d++) {
+		best = 0;
+		for (r=0; r<repeat; r++) {
+
+			// Fresh filesystem with the setup workloads applied
+			if ( hdd_format() || hdd_mount() ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : format or mount failed." );
+				return( -1 );
+			}
+			for (f=0; f<trace.nfiles; f++) {
+				if ((fh[f] = hdd_open(trace.names[f])) == -1) {
+					return( -1 );
+				}
+			}
+			if (bench_replay_sync(&trace, fh, 0, setupOps)) {
+				return( -1 );
+			}
+
+			start = bench_now_us();
+			if ( (depths[d] == 0) ? bench_replay_sync(&trace, fh, setupOps, trace.nops) :
+					bench_replay_async(&trace, fh, setupOps, trace.nops, depths[d]) ) {
+				return( -1 );
+			}
+			t = bench_now_us() - start;
+			best = ((r == 0) || (t < best)) ? t : best;
+
+			// Every configuration must leave the same contents
+			digest = bench_digest(&trace, fh);
+			if ( (d == 0) && (r == 0) ) {
+				expected = digest;
+			} else if (digest != expected) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : depth %d left different file contents", depths[d] );
+				return( -1 );
+			}
+			if (hdd_unmount()) {
+				return( -1 );
+			}
+		}
+		if (depths[d] == 0) {
+			logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH async: %8s %12.2f %12.0f", "sync", best/1000.0, (trace.nops-setupOps)/(best/1000000.0) );
+		} else {
+			logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH async: %8d %12.2f %12.0f", depths[d], best/1000.0, (trace.nops-setupOps)/(best/1000000.0) );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_heap_bytes
+// Description  : Get the bytes of heap in use, mapped chunks included
+//
+// Inputs       : none
+// Outputs      : the bytes in use
+
+size_t bench_heap_bytes( void ) {
+	struct mallinfo2 mi = mallinfo2();
+	return( mi.uordblks + mi.hblkhd );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_files
+// Description  : Scale the file table: create directories of empty files,
+//                open every file again under a second handle, then time an
+//                eager mount and a lazy mount with its first open
+//
+// Inputs       : argc - the number of directory sizes
+//                argv - the directory sizes
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_files( int argc, char *argv[] ) {
+	int defaults[] = { 10000, 100000, 1000000 };
+	int nsizes = (argc > 0) ? argc : (int)(sizeof(defaults)/sizeof(int));
+	int s, i, files;
+	char fname[MAX_FILENAME_LENGTH];
+	double start, create, reopen, eager, lazy;
+	size_t heap;
+	int16_t fh, fh2;
+
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH files: %8s %10s %10s %12s %12s %10s", "files", "create ns", "open ns", "eager ms", "lazy us", "heap B/f" );
+	for (s=0; s<nsizes; s++) {
+		files = (argc > 0) ? atoi(argv[s]) : defaults[s];
+		if (files < 1) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : bad directory size [%d]", files );
+			return( -1 );
+		}
+		hdd_set_mount_mode(HDD_MOUNT_EAGER);
+		if ( hdd_format() || hdd_mount() || hdd_mkdir("dir") ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : format or mount failed." );
+			return( -1 );
+		}
+		heap = bench_heap_bytes();
+
+		// Every create is a new inode and handle, closed right away
+		start = bench_now_us();
+		for (i=0; i<files; i++) {
+			snprintf( fname, MAX_FILENAME_LENGTH, "dir/bench-file-%d.dat", i );
+			if ( ((fh = hdd_open(fname)) == -1) || hdd_close(fh) ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : creating [%s] failed.", fname );
+				return( -1 );
+			}
+		}
+		create = bench_now_us() - start;
+		heap = bench_heap_bytes() - heap;
+
+		// Reopen every file while a first handle on it is still open
+		start = bench_now_us();
+		for (i=0; i<files; i++) {
+			snprintf( fname, MAX_FILENAME_LENGTH, "dir/bench-file-%d.dat", i );
+			if ( ((fh = hdd_open(fname)) == -1) || ((fh2 = hdd_open(fname)) == -1) || (fh == fh2) ||
+				 hdd_close(fh2) || hdd_close(fh) ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : reopening [%s] failed.", fname );
+				return( -1 );
+			}
+		}
+		reopen = bench_now_us() - start;
+		if ( hdd_unmount() ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : unmount failed." );
+			return( -1 );
+		}
+
+		start = bench_now_us();
+		if ( hdd_mount() || hdd_unmount() ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : eager mount failed." );
+			return( -1 );
+		}
+		eager = bench_now_us() - start;
+		snprintf( fname, MAX_FILENAME_LENGTH, "dir/bench-file-%d.dat", files / 2 );
+		if ( (lazy = bench_mount_once(HDD_MOUNT_LAZY, fname)) < 0 ) {
+			return( -1 );
+		}
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH files: %8d %10.0f %10.0f %12.1f %12.1f %10.1f", files,
+				create*1000.0/files, reopen*1000.0/(2*files), eager/1000.0, lazy, (double)heap/files );
+	}
+	hdd_set_mount_mode(HDD_MOUNT_EAGER);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_namespace
+// Description  : Fill a directory with n files, then time lookups right
+//                after a lazy mount (reading the tree nodes on the way) and
+//                again once cached, a full readdir and a prefix listing
+//
+// Inputs       : argc - the number of directory sizes
+//                argv - the directory sizes
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_namespace( int argc, char *argv[] ) {
+	int defaults[] = { 10000, 100000, 1000000 };
+	int nsizes = (argc > 0) ? argc : (int)(sizeof(defaults)/sizeof(int));
+	int lookups = 1000;
+	int s, i, n, files, pass, *pick;
+	char fname[MAX_FILENAME_LENGTH], last[MAX_FILENAME_LENGTH];
+	double start, create, lookup[2], list, prefix;
+	HddDirEntry ent;
+	HddDir dir;
+	int16_t fh;
+
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH namespace: %8s %10s %10s %10s %12s %12s", "files", "create ns", "cold us", "warm ns", "readdir ns", "prefix us" );
+	for (s=0; s<nsizes; s++) {
+		files = (argc > 0) ? atoi(argv[s]) : defaults[s];
+		if ( (files < 1) || (files > 10000000) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : bad directory size [%d]", files );
+			return( -1 );
+		}
+		hdd_set_mount_mode(HDD_MOUNT_EAGER);
+		if ( hdd_format() || hdd_mount() || hdd_mkdir("ns") ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : format or mount failed." );
+			return( -1 );
+		}
+		start = bench_now_us();
+		for (i=0; i<files; i++) {
+			snprintf( fname, MAX_FILENAME_LENGTH, "ns/file-%07d", (int)(((int64_t)i * 7919) % files) );
+			if ( ((fh = hdd_open(fname)) == -1) || hdd_close(fh) ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : creating [%s] failed.", fname );
+				return( -1 );
+			}
+		}
+		create = bench_now_us() - start;
+		if ( hdd_unmount() ) {
+			return( -1 );
+		}
+
+		// Lookups of random names, first right after a lazy mount then cached
+		pick = malloc(lookups * sizeof(int));
+		for (i=0; i<lookups; i++) {
+			pick[i] = getRandomValue(0, files-1);
+		}
+		hdd_set_mount_mode(HDD_MOUNT_LAZY);
+		if ( hdd_mount() ) {
+			return( -1 );
+		}
+		for (pass=0; pass<2; pass++) {
+			start = bench_now_us();
+			for (i=0; i<lookups; i++) {
+				snprintf( fname, MAX_FILENAME_LENGTH, "ns/file-%07d", pick[i] );
+				if ( ((fh = hdd_open(fname)) == -1) || hdd_close(fh) ) {
+					logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : lookup of [%s] failed.", fname );
+					return( -1 );
+				}
+			}
+			lookup[pass] = bench_now_us() - start;
+		}
+		free(pick);
+
+		// The whole directory, which must come back complete and in order
+		start = bench_now_us();
+		if ( hdd_opendir("ns", NULL, &dir) ) {
+			return( -1 );
+		}
+		for (n=0, last[0]='\0'; (i = hdd_readdir(&dir, &ent)) == 1; n++) {
+			if ( strcmp(last, ent.name) >= 0 ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : readdir out of order at [%s].", ent.name );
+				return( -1 );
+			}
+			strcpy( last, ent.name );
+		}
+		list = bench_now_us() - start;
+		if ( (i == -1) || (n != files) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : readdir listed %d of %d files.", n, files );
+			return( -1 );
+		}
+
+		// The names sharing a prefix
+		start = bench_now_us();
+		if ( hdd_opendir("ns", "file-00001", &dir) ) {
+			return( -1 );
+		}
+		for (n=0; (i = hdd_readdir(&dir, &ent)) == 1; n++);
+		prefix = bench_now_us() - start;
+		if ( (i == -1) || (n != ((files > 200) ? 100 : ((files > 100) ? files - 100 : 0))) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : prefix listing returned %d files.", n );
+			return( -1 );
+		}
+		if ( hdd_unmount() ) {
+			return( -1 );
+		}
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH namespace: %8d %10.0f %10.1f %10.0f %12.1f %12.1f", files,
+				create*1000.0/files, lookup[0]/lookups, lookup[1]*1000.0/lookups, list*1000.0/files, prefix );
+	}
+	hdd_set_mount_mode(HDD_MOUNT_EAGER);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_coherence_ignore
+// Description  : Invalidation handler of the benchmark's own connection,
+//                which caches nothing
+//
+// Inputs       : blockID - the block written
+//                version - its new version
+// Outputs      : none
+
+void bench_coherence_ignore( HddBlockID blockID, uint32_t version ) {
+	return;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_coherence_fill
+// Description  : Fill a block of the coherence benchmark for a write
+//
+// Inputs       : buf - the block
+//                block - its index
+//                writer - the client writing it
+//                seq - its sequence number
+// Outputs      : none
+
+void bench_coherence_fill( char *buf, uint32_t block, uint32_t writer, uint64_t seq ) {
+	HddBenchStamp stamp = { block, writer, seq };
+
+	memset( buf, (int)((seq * 31 + block) & 0xff), HDD_BENCH_COHERENCE_BLOCK );
+	memcpy( buf, &stamp, sizeof(stamp) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_coherence_check
+// Description  : Check a block read by the coherence benchmark, its stamp
+//                and fill must come from the same write of that block
+//
+// Inputs       : buf - the block
+//                block - its index
+//                stamp - set to the stamp read
+// Outputs      : 0 if whole, -1 if torn
+
+int bench_coherence_check( char *buf, uint32_t block, HddBenchStamp *stamp ) {
+	uint8_t fill;
+	int i;
+
+	memcpy( stamp, buf, sizeof(HddBenchStamp) );
+	fill = (uint8_t)((stamp->seq * 31 + block) & 0xff);
+	if (stamp->block != block) {
+		return( -1 );
+	}
+	for (i=sizeof(HddBenchStamp); i<HDD_BENCH_COHERENCE_BLOCK; i++) {
+		if ((uint8_t)buf[i] != fill) {
+			return( -1 );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_coherence_client
+// Description  : One client process of the coherence benchmark: until the
+//                deadline, overwrite one of its own blocks 1 time in 10,
+//                otherwise read any block and check what it got
+//
+// Inputs       : client - index of this client
+//                clients - number of clients
+//                cached - 1 to read and write through a block cache
+//                ids - the blocks
+//                blocks - number of blocks
+//                history - the writes of each block (shared)
+//                stats - where this client reports (shared)
+//                deadline - when to stop (us)
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_coherence_client( int client, int clients, int cached, HddBlockID *ids, int blocks,
+		HddBenchHistory *history, HddBenchClient *stats, double deadline ) {
+	char buf[HDD_BENCH_COHERENCE_BLOCK];
+	HddBenchHistory *h;
+	HddBenchStamp stamp;
+	HddRequest req;
+	uint64_t n, k;
+	double start, done, bound = 0;
+	int b, ret;
+
+	srand( (unsigned)getpid() );
+	if ( getResult(hdd_client_operation(formatResponse(HDD_DEVICE, 0, HDD_INIT, 0, 0), NULL)) ) {
+		return( -1 );
+	}
+	if (cached) {
+		if ( hdd_cache_configure(cacheSpec ? cacheSpec : "default") ) {
+			return( -1 );
+		}
+		hdd_cache_coherence();
+		bound = hdd_client_coherence(hdd_cache_revoke) * 1000.0; // the channel is already open
+	}
+
+	while (bench_now_us() < deadline) {
+		memset( &req, 0x0, sizeof(req) );
+		req.flags = HDD_NULL_FLAG;
+		req.length = HDD_BENCH_COHERENCE_BLOCK;
+
+		// Overwrite one of our blocks with its next sequence number
+		if ( (rand() % 10) == 0 ) {
+			b = client + clients * (rand() % (blocks / clients));
+			h = &history[b];
+			k = h->writes;
+			bench_coherence_fill( buf, b, client, k + 1 );
+			req.op = HDD_BLOCK_OVERWRITE;
+			req.blockID = ids[b];
+			ret = cached ? hdd_cache_write(ids[b], 1, 1, buf, 0, HDD_BENCH_COHERENCE_BLOCK) : hdd_client_request(&req, buf);
+			if (ret) {
+				stats->errors++;
+				continue;
+			}
+			h->done[k % HDD_BENCH_COHERENCE_HISTORY] = bench_now_us();
+			__atomic_store_n( &h->seq[k % HDD_BENCH_COHERENCE_HISTORY], k + 1, __ATOMIC_RELEASE );
+			__atomic_store_n( &h->writes, k + 1, __ATOMIC_RELEASE );
+			stats->writes++;
+			continue;
+		}
+
+		// Read any block, then find the first write it missed
+		b = rand() % blocks;
+		h = &history[b];
+		req.op = HDD_BLOCK_READ;
+		req.blockID = ids[b];
+		start = bench_now_us();
+		ret = cached ? hdd_cache_fetch(ids[b], HDD_BENCH_COHERENCE_BLOCK, 1, buf, 0, HDD_BENCH_COHERENCE_BLOCK) : hdd_client_request(&req, buf);
+		if (ret) {
+			stats->errors++;
+			continue;
+		}
+		stats->reads++;
+		if ( bench_coherence_check(buf, b, &stamp) ) {
+			stats->torn++;
+			continue;
+		}
+		n = __atomic_load_n( &h->writes, __ATOMIC_ACQUIRE );
+		if (stamp.seq >= n) {
+			stats->checked++; // saw the latest write
+			continue;
+		}
+		k = (n - stamp.seq > HDD_BENCH_COHERENCE_HISTORY) ? n - HDD_BENCH_COHERENCE_HISTORY : stamp.seq;
+		done = h->done[k % HDD_BENCH_COHERENCE_HISTORY];
+		if (__atomic_load_n( &h->seq[k % HDD_BENCH_COHERENCE_HISTORY], __ATOMIC_ACQUIRE ) != k + 1) {
+			continue; // overwritten in the history meanwhile
+		}
+		stats->checked++;
+		if (done < start) {
+			if (start - done > stats->maxStale) {
+				stats->maxStale = start - done;
+			}
+			if (start - done > bound) {
+				stats->stale++;
+			}
+		}
+	}
+	if (cached) {
+		hdd_cache_report();
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_coherence
+// Description  : Run client processes against shared blocks, uncached and
+//                then cached, checking every read against the writes that
+//                had completed before it started
+//
+// Inputs       : argc - the number of parameters
+//                argv - [clients [seconds [blocks]]]
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_coherence( int argc, char *argv[] ) {
+	int clients = (argc > 0) ? atoi(argv[0]) : 8, seconds = (argc > 1) ? atoi(argv[1]) : 2;
+	int blocks = (argc > 2) ? atoi(argv[2]) : 256;
+	char buf[HDD_BENCH_COHERENCE_BLOCK];
+	HddBenchHistory *history;
+	HddBenchClient *stats, total;
+	HddBlockID *ids;
+	HddRequest req;
+	double start, elapsed;
+	uint32_t lease;
+	int b, c, cached, status, failed = 0;
+	pid_t pid;
+
+	if ( (clients < 1) || (clients > 256) || (seconds < 1) || (blocks < clients) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : bad coherence parameters (clients %d, seconds %d, blocks %d)", clients, seconds, blocks );
+		return( -1 );
+	}
+	if ( (cacheSpec != NULL) && (strstr(cacheSpec, "file=") != NULL) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : the coherence clients cannot share a cache file" );
+		return( -1 );
+	}
+
+	// Memory the clients share, and the blocks starting at sequence number 0
+	history = mmap( NULL, blocks * sizeof(HddBenchHistory) + clients * sizeof(HddBenchClient),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	if (history == MAP_FAILED) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : failed mapping the shared history" );
+		return( -1 );
+	}
+	memset( history, 0x0, blocks * sizeof(HddBenchHistory) );
+	stats = (HddBenchClient *)&history[blocks];
+	ids = malloc( blocks * sizeof(HddBlockID) );
+	if ( getResult(hdd_client_operation(formatResponse(HDD_DEVICE, 0, HDD_INIT, 0, 0), NULL)) ||
+		 getResult(hdd_client_operation(formatResponse(HDD_DEVICE, 0, HDD_FORMAT, 0, 0), NULL)) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : failed initializing the device" );
+		return( -1 );
+	}
+	lease = hdd_client_coherence(bench_coherence_ignore);
+	for (b=0; b<blocks; b++) {
+		bench_coherence_fill( buf, b, 0, 0 );
+		memset( &req, 0x0, sizeof(req) );
+		req.op = HDD_BLOCK_CREATE;
+		req.flags = HDD_NULL_FLAG;
+		req.length = HDD_BENCH_COHERENCE_BLOCK;
+		if ( hdd_client_request(&req, buf) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : failed creating the blocks" );
+			return( -1 );
+		}
+		ids[b] = req.blockID;
+	}
+	getResult( hdd_client_operation(formatResponse(HDD_DEVICE, 0, HDD_SAVE_AND_CLOSE, 0, 0), NULL) );
+
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH coherence: %d clients, %d blocks of %d bytes, %d s per run, lease %u ms",
+			clients, blocks, HDD_BENCH_COHERENCE_BLOCK, seconds, lease );
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH coherence: %8s %12s %10s %10s %8s %8s %14s",
+			"cache", "ops/s", "reads", "writes", "stale", "torn", "max stale ms" );
+	for (cached=0; cached<2; cached++) {
+		if ( cached && (lease == 0) ) {
+			logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH coherence: the server grants no leases, cached run skipped" );
+			break;
+		}
+		memset( stats, 0x0, clients * sizeof(HddBenchClient) );
+		start = bench_now_us();
+		for (c=0; c<clients; c++) {
+			if ( (pid = fork()) == -1 ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : fork failed" );
+				return( -1 );
+			}
+			if (pid == 0) {
+				_exit( bench_coherence_client(c, clients, cached, ids, blocks, history, &stats[c],
+						start + seconds * 1000000.0) ? 1 : 0 );
+			}
+		}
+		for (c=0; c<clients; c++) {
+			if ( (wait(&status) == -1) || !WIFEXITED(status) || WEXITSTATUS(status) ) {
+				failed = 1;
+			}
+		}
+		elapsed = bench_now_us() - start;
+
+		memset( &total, 0x0, sizeof(total) );
+		for (c=0; c<clients; c++) {
+			total.reads += stats[c].reads;
+			total.writes += stats[c].writes;
+			total.checked += stats[c].checked;
+			total.stale += stats[c].stale;
+			total.torn += stats[c].torn;
+			total.errors += stats[c].errors;
+			total.maxStale = (stats[c].maxStale > total.maxStale) ? stats[c].maxStale : total.maxStale;
+		}
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH coherence: %8s %12.0f %10lu %10lu %8lu %8lu %14.3f",
+				cached ? "on" : "off", (total.reads + total.writes) * 1000000.0 / elapsed,
+				(unsigned long)total.reads, (unsigned long)total.writes, (unsigned long)total.stale,
+				(unsigned long)total.torn, total.maxStale / 1000.0 );
+		if ( failed || total.stale || total.torn || total.errors ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : coherence violated (%lu stale, %lu torn, %lu errors%s)",
+					(unsigned long)total.stale, (unsigned long)total.torn, (unsigned long)total.errors,
+					failed ? ", a client failed" : "" );
+			failed = 1;
+			break;
+		}
+	}
+
+	free( ids );
+	munmap( history, blocks * sizeof(HddBenchHistory) + clients * sizeof(HddBenchClient) );
+	return( failed ? -1 : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_hedge_reader
+// Description  : A reader thread of the hedge benchmark, reads random
+//                blocks until the deadline and records each latency
+//
+// Inputs       : arg - the thread's HddBenchReader
+// Outputs      : NULL
+
+void *bench_hedge_reader( void *arg ) {
+	HddBenchReader *rd = arg;
+	char buf[HDD_BENCH_HEDGE_BLOCK];
+	HddRequest req;
+	double start, now, *grown;
+
+	while ( (start = bench_now_us()) < rd->deadline ) {
+		memset( &req, 0x0, sizeof(req) );
+		req.op = HDD_BLOCK_READ;
+		req.flags = HDD_NULL_FLAG;
+		req.blockID = rd->ids[rand_r(&rd->seed) % rd->blocks];
+		req.length = HDD_BENCH_HEDGE_BLOCK;
+		if ( hdd_client_request(&req, buf) ) {
+			rd->errors++;
+			continue;
+		}
+		now = bench_now_us();
+		if (rd->reads == rd->capacity) {
+			if ( (grown = realloc(rd->latency, (rd->capacity + 4096) * sizeof(double))) == NULL ) {
+				rd->errors++;
+				break;
+			}
+			rd->latency = grown;
+			rd->capacity += 4096;
+		}
+		rd->latency[rd->reads++] = now - start;
+	}
+	return( NULL );
+}
+
+// Order latencies for the percentiles
+int bench_compare_latency( const void *a, const void *b ) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return( (x > y) - (x < y) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_hedge
+// Description  : Read random blocks from concurrent threads with hedging off
+//                and then on, reporting the read latency percentiles
+//
+// Inputs       : argc - the number of parameters
+//                argv - [threads [seconds [blocks]]]
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_hedge( int argc, char *argv[] ) {
+	int threads = (argc > 0) ? atoi(argv[0]) : 8, seconds = (argc > 1) ? atoi(argv[1]) : 5;
+	int blocks = (argc > 2) ? atoi(argv[2]) : 1024;
+	double percentile[2] = { 0, hedgeOption }, elapsed, *all;
+	char buf[HDD_BENCH_HEDGE_BLOCK];
+	HddBenchReader *rd;
+	pthread_t *tids;
+	HddBlockID *ids;
+	HddRequest req;
+	uint64_t reads, hedged, won;
+	int b, t, run, n, errors;
+
+	if ( (threads < 1) || (threads > 1024) || (seconds < 1) || (blocks < 1) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : bad hedge parameters (threads %d, seconds %d, blocks %d)", threads, seconds, blocks );
+		return( -1 );
+	}
+
+	// The blocks, written to every replica
+	ids = malloc( blocks * sizeof(HddBlockID) );
+	rd = calloc( threads, sizeof(HddBenchReader) );
+	tids = malloc( threads * sizeof(pthread_t) );
+	if ( getResult(hdd_client_operation(formatResponse(HDD_DEVICE, 0, HDD_INIT, 0, 0), NULL)) ||
+		 getResult(hdd_client_operation(formatResponse(HDD_DEVICE, 0, HDD_FORMAT, 0, 0), NULL)) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : failed initializing the device" );
+		return( -1 );
+	}
+	for (b=0; b<blocks; b++) {
+		memset( buf, b & 0xff, HDD_BENCH_HEDGE_BLOCK );
+		memset( &req, 0x0, sizeof(req) );
+		req.op = HDD_BLOCK_CREATE;
+		req.flags = HDD_NULL_FLAG;
+		req.length = HDD_BENCH_HEDGE_BLOCK;
+		if ( hdd_client_request(&req, buf) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : failed creating the blocks" );
+			return( -1 );
+		}
+		ids[b] = req.blockID;
+	}
+
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH hedge: %d threads, %d blocks of %d bytes, %d s per run", threads, blocks, HDD_BENCH_HEDGE_BLOCK, seconds );
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH hedge: %8s %10s %9s %9s %9s %9s %9s %9s %8s", "hedge", "reads/s",
+			"p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms", "hedged", "won" );
+	for (run=0; run<2; run++) {
+		hdd_client_set_hedge( percentile[run] );
+		elapsed = bench_now_us();
+		for (t=0; t<threads; t++) {
+			rd[t].ids = ids;
+			rd[t].blocks = blocks;
+			rd[t].deadline = elapsed + seconds * 1000000.0;
+			rd[t].seed = (unsigned)(t * 7919 + run);
+			rd[t].reads = 0;
+			pthread_create( &tids[t], NULL, bench_hedge_reader, &rd[t] );
+		}
+		for (t=0, n=0, errors=0; t<threads; t++) {
+			pthread_join( tids[t], NULL );
+			n += rd[t].reads;
+			errors += rd[t].errors;
+		}
+		elapsed = bench_now_us() - elapsed;
+		if ( errors || (n == 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : %d reads failed", errors );
+			return( -1 );
+		}
+
+		all = malloc( n * sizeof(double) );
+		for (t=0, n=0; t<threads; t++) {
+			memcpy( &all[n], rd[t].latency, rd[t].reads * sizeof(double) );
+			n += rd[t].reads;
+		}
+		qsort( all, n, sizeof(double), bench_compare_latency );
+		hdd_client_hedges( &reads, &hedged, &won );
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH hedge: %8s %10.0f %9.2f %9.2f %9.2f %9.2f %9.2f %9lu %8lu",
+				(run == 0) ? "off" : "on", n * 1000000.0 / elapsed, all[(int)(n * 0.50)] / 1000.0,
+				all[(int)(n * 0.90)] / 1000.0, all[(int)(n * 0.99)] / 1000.0, all[(int)(n * 0.999)] / 1000.0,
+				all[n-1] / 1000.0, (unsigned long)hedged, (unsigned long)won );
+		free( all );
+		if (hedgeOption == 0) {
+			break;
+		}
+	}
+
+	for (t=0; t<threads; t++) {
+		free( rd[t].latency );
+	}
+	free( rd );
+	free( tids );
+	free( ids );
+	return( getResult(hdd_client_operation(formatResponse(HDD_DEVICE, 0, HDD_SAVE_AND_CLOSE, 0, 0), NULL)) ? -1 : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_stripe_pass
+// Description  : Time a pass over the striped file, writing or reading it
+//                in chunks, a read is checked against what was written
+//
+// Inputs       : data - the file contents
+//                size - bytes in the file
+//                chunk - bytes per call
+//                write - 1 to write the file, 0 to read it
+// Outputs      : MB/s, -1 if failure
+
+double bench_stripe_pass( char *data, uint32_t size, uint32_t chunk, int write ) {
+	char *buf = malloc( chunk );
+	uint32_t off, len;
+	double start;
+	int16_t fh;
+
+	if ( (buf == NULL) || ((fh = hdd_open("stripe-bench.dat")) == -1) ) {
+		free( buf );
+		return( -1 );
+	}
+	start = bench_now_us();
+	for (off=0; off<size; off+=len) {
+		len = (size - off < chunk) ? size - off : chunk;
+		if ( write ? (hdd_pwrite(fh, data + off, len, off) != len) :
+					 ((hdd_pread(fh, buf, len, off) != len) || (memcmp(buf, data + off, len) != 0)) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : %s at %u failed or read wrong data", write ? "write" : "read", off );
+			free( buf );
+			hdd_close( fh );
+			return( -1 );
+		}
+	}
+	start = bench_now_us() - start;
+	free( buf );
+	hdd_close( fh );
+	return( size / start );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_stripe
+// Description  : Measure the aggregate throughput of a striped file against
+//                the stripe width, with parity the degraded read rate, and
+//                the parity coding rate of each kernel
+//
+// Inputs       : argc - the number of arguments
+//                argv - file MiB and chunk KiB
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_stripe( int argc, char *argv[] ) {
+	char *kernels[] = { "scalar", "ssse3", "avx2" };
+	uint32_t size = (uint32_t)((argc > 0) ? atoi(argv[0]) : 64) << 20, chunk = (uint32_t)((argc > 1) ? atoi(argv[1]) : 1024) << 10;
+	uint8_t *data[HDD_STRIPE_MAX_SERVERS], *parity[HDD_STRIPE_MAX_SERVERS], *units;
+	uint32_t unit = HDD_STRIPE_UNIT_KB * 1024, i;
+	char *contents, *spec, *first, *p, *names[HDD_STRIPE_MAX_SERVERS];
+	double write, read, degraded, start;
+	int n, w, m = 0, k, r, j;
+
+	if ( (stripeSpec == NULL) || (size == 0) || (size > HDD_STRIPE_MAX_FILE) || (chunk == 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : stripe needs the servers (-S), a file under 2 GiB and a chunk size" );
+		return( -1 );
+	}
+	if ( (p = strstr(layoutSpec, "parity=")) != NULL ) {
+		m = atoi( p + 7 );
+	}
+	if ( (p = strstr(layoutSpec, "unit=")) != NULL ) {
+		unit = atoi( p + 5 ) * 1024;
+	}
+	spec = strdup( stripeSpec );
+	first = strdup( stripeSpec );
+	for (n=0, p=strtok(spec, ","); (p != NULL) && (n < HDD_STRIPE_MAX_SERVERS); p=strtok(NULL, ",")) {
+		names[n++] = p;
+	}
+	if ( (contents = malloc(size)) == NULL ) {
+		return( -1 );
+	}
+	for (i=0; i<size; i++) {
+		contents[i] = (char)(i * 2654435761u >> 24);
+	}
+
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH stripe: %u MiB file in %u KiB chunks, %u KiB units, %d parity", size >> 20, chunk >> 10, unit >> 10, m );
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH stripe: %6s %8s %12s %12s %14s", "width", "data", "write MB/s", "read MB/s", "degraded MB/s" );
+	for (w=m+1; w<=n; w++) {
+		// The first w servers
+		for (j=0, first[0]='\0'; j<w; j++) {
+			strcat( first, names[j] );
+			strcat( first, (j < w - 1) ? "," : "" );
+		}
+		if ( hdd_stripe_set_servers(first) || hdd_format() || hdd_mount() ||
+			 ((write = bench_stripe_pass(contents, size, chunk, 1)) < 0) || hdd_unmount() ||
+			 hdd_mount() || ((read = bench_stripe_pass(contents, size, chunk, 0)) < 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : stripe over %d servers failed", w );
+			return( -1 );
+		}
+		degraded = 0;
+		if (m > 0) {
+			hdd_stripe_fail( 0 );
+			if ( (degraded = bench_stripe_pass(contents, size, chunk, 0)) < 0 ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : degraded read over %d servers failed", w );
+				return( -1 );
+			}
+		}
+		if ( hdd_unmount() ) {
+			return( -1 );
+		}
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH stripe: %6d %8d %12.1f %12.1f %14.1f", w, w - m, write, read, degraded );
+	}
+
+	// The parity of HDD_BENCH_STRIPE_UNITS stripes, k data units each
+	k = (n - m > 1) ? n - m : 4;
+	r = (m > 0) ? m : 2;
+	if ( (units = malloc((size_t)(k + r) * unit)) == NULL ) {
+		return( -1 );
+	}
+	for (i=0; i<(uint32_t)(k + r) * unit; i++) {
+		units[i] = (uint8_t)(i * 2654435761u >> 24);
+	}
+	for (j=0; j<k; j++) {
+		data[j] = units + (size_t)j * unit;
+	}
+	for (j=0; j<r; j++) {
+		parity[j] = units + (size_t)(k + j) * unit;
+	}
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH stripe: %d+%d coding, %8s %12s", k, r, "kernel", "MB/s data" );
+	for (j=0; j<3; j++) {
+		if ( hdd_stripe_set_kernel(kernels[j]) ) {
+			continue; // not on this CPU
+		}
+		start = bench_now_us();
+		for (i=0; i<HDD_BENCH_STRIPE_UNITS; i++) {
+			hdd_stripe_encode( k, r, data, parity, unit );
+		}
+		start = bench_now_us() - start;
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH stripe: %d+%d coding, %8s %12.1f", k, r, kernels[j],
+				(double)HDD_BENCH_STRIPE_UNITS * k * unit / start );
+	}
+	hdd_stripe_set_kernel( "auto" );
+	free( units );
+	free( contents );
+	free( spec );
+	free( first );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_journal_creator
+// Description  : A thread of the journal benchmark, creates its files in
+//                its own directory, writing and syncing each
+//
+// Inputs       : arg - the thread's HddBenchCreator
+// Outputs      : NULL
+
+void *bench_journal_creator( void *arg ) {
+	HddBenchCreator *cr = arg;
+	char path[MAX_FILENAME_LENGTH];
+	int16_t fh;
+	int i;
+
+	for (i=0; i<cr->files; i++) {
+		snprintf( path, sizeof(path), "t%d/f%d", cr->thread, i );
+		if ( ((fh = hdd_open(path)) == -1) ||
+			 (hdd_pwrite(fh, cr->data, HDD_BENCH_JOURNAL_WRITE, 0) != HDD_BENCH_JOURNAL_WRITE) ||
+			 hdd_fsync(fh) || hdd_close(fh) ) {
+			cr->errors++;
+		}
+	}
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_journal
+// Description  : Create, write and fsync files from concurrent threads, with
+//                fsync saving the directory and then committing to the
+//                journal, and check the journaled files survive a remount
+//                without an unmount
+//
+// Inputs       : argc - the number of parameters
+//                argv - [threads [files]]
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_journal( int argc, char *argv[] ) {
+	int threads = (argc > 0) ? atoi(argv[0]) : 8, files = (argc > 1) ? atoi(argv[1]) : 256;
+	uint32_t journal = (journalOption > 0) ? journalOption : HDD_BENCH_JOURNAL_KB;
+	char data[HDD_BENCH_JOURNAL_WRITE], buf[HDD_BENCH_JOURNAL_WRITE], path[MAX_FILENAME_LENGTH];
+	uint64_t records, groups, compactions;
+	HddBenchCreator *cr;
+	pthread_t *tids;
+	double elapsed;
+	int run, t, i, errors;
+	int16_t fh;
+
+	if ( (threads < 1) || (threads > 1024) || (files < 1) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : bad journal parameters (threads %d, files %d)", threads, files );
+		return( -1 );
+	}
+	cr = calloc( threads, sizeof(HddBenchCreator) );
+	tids = malloc( threads * sizeof(pthread_t) );
+	for (i=0; i<HDD_BENCH_JOURNAL_WRITE; i++) {
+		data[i] = (char)(i * 2654435761u >> 24);
+	}
+
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH journal: %d threads creating %d files each, %d bytes per file", threads, files, HDD_BENCH_JOURNAL_WRITE );
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH journal: %8s %10s %10s %12s %12s", "fsync", "files/s", "records", "per group", "compactions" );
+	for (run=0; run<2; run++) {
+		hdd_set_journal( (run == 0) ? 0 : journal );
+		if ( hdd_format() || hdd_mount() ) {
+			return( -1 );
+		}
+		for (t=0; t<threads; t++) {
+			snprintf( path, sizeof(path), "t%d", t );
+			if ( hdd_mkdir(path) ) {
+				return( -1 );
+			}
+		}
+		elapsed = bench_now_us();
+		for (t=0; t<threads; t++) {
+			cr[t].thread = t;
+			cr[t].files = files;
+			cr[t].data = data;
+			cr[t].errors = 0;
+			pthread_create( &tids[t], NULL, bench_journal_creator, &cr[t] );
+		}
+		for (t=0, errors=0; t<threads; t++) {
+			pthread_join( tids[t], NULL );
+			errors += cr[t].errors;
+		}
+		elapsed = bench_now_us() - elapsed;
+		if ( errors ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : %d file creations failed", errors );
+			return( -1 );
+		}
+		hdd_journal_stats( &records, &groups, &compactions );
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH journal: %8s %10.0f %10lu %12.2f %12lu", (run == 0) ? "save" : "journal",
+				(double)threads * files * 1000000.0 / elapsed, (unsigned long)records,
+				(groups == 0) ? 0.0 : (double)records / groups, (unsigned long)compactions );
+
+		// The journal has to bring every file back, as after a crash
+		if ( (run == 1) && hdd_mount() ) {
+			return( -1 );
+		}
+		for (t=0; (run == 1) && (t<threads); t++) {
+			for (i=0; i<files; i++) {
+				snprintf( path, sizeof(path), "t%d/f%d", t, i );
+				if ( ((fh = hdd_open(path)) == -1) || (hdd_pread(fh, buf, HDD_BENCH_JOURNAL_WRITE, 0) != HDD_BENCH_JOURNAL_WRITE) ||
+					 memcmp(buf, data, HDD_BENCH_JOURNAL_WRITE) || hdd_close(fh) ) {
+					logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : journaled file %s lost", path );
+					return( -1 );
+				}
+			}
+		}
+		if ( hdd_unmount() ) {
+			return( -1 );
+		}
+	}
+	hdd_set_journal( journalOption );
+	free( cr );
+	free( tids );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_pack_check
+// Description  : Read back every file of the pack benchmark in name order,
+//                byte pos of file i is (i * 31 + pos * 7 + grown)
+//
+// Inputs       : files - the files
+//                size - the size of the files not grown
+//                grown - 1 once every other file was rewritten larger
+//                buf - a buffer of size plus the growth
+// Outputs      : 0 if every file matches, -1 if not
+
+int bench_pack_check( int files, int size, int grown, char *buf ) {
+	char path[MAX_FILENAME_LENGTH];
+	int i, pos, length;
+	int16_t fh;
+
+	for (i=0; i<files; i++) {
+		snprintf( path, sizeof(path), "p/f%07d", i );
+		length = size + ((grown && (i % 2)) ? HDD_BENCH_PACK_GROWTH : 0);
+		if ( ((fh = hdd_open(path)) == -1) || (hdd_pread(fh, buf, length + 1, 0) != length) || hdd_close(fh) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : read of %s failed", path );
+			return( -1 );
+		}
+		for (pos=0; pos<length; pos++) {
+			if ( buf[pos] != (char)(i * 31 + pos * 7 + (length > size)) ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : %s differs at %d", path, pos );
+				return( -1 );
+			}
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_pack
+// Description  : Compare small files in blocks of their own with small
+//                files packed into shared containers: the block reads and
+//                time to read a directory of them back after a remount, and
+//                what compacting reclaims after every other file is
+//                rewritten larger
+//
+// Inputs       : argc - the number of parameters
+//                argv - [files [size]]
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_pack( int argc, char *argv[] ) {
+	int files = (argc > 0) ? atoi(argv[0]) : 1024, size = (argc > 1) ? atoi(argv[1]) : 1024;
+	uint32_t pack = (packOption > 0) ? packOption : (uint32_t)size + HDD_BENCH_PACK_GROWTH;
+	uint64_t reads, before, hedged, won, containers, whole, freed, moved;
+	char path[MAX_FILENAME_LENGTH], *buf;
+	double write, read;
+	int run, i, pos, length;
+	int16_t fh;
+
+	if ( (files < 1) || (files > 1000000) || (size < 1) || (size + HDD_BENCH_PACK_GROWTH > HDD_MAX_BLOCK_SIZE) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : bad pack parameters (files %d, size %d)", files, size );
+		return( -1 );
+	}
+	buf = malloc( size + HDD_BENCH_PACK_GROWTH + 1 );
+
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH pack: %d files of %d bytes in one directory", files, size );
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH pack: %8s %10s %10s %12s %12s %10s %10s", "packed", "writes/s", "reads/s",
+			"block reads", "per file", "freed", "moved" );
+	for (run=0; run<2; run++) {
+		hdd_set_pack( (run == 0) ? 0 : pack );
+		if ( hdd_format() || hdd_mount() || hdd_mkdir("p") ) {
+			return( -1 );
+		}
+		write = bench_now_us();
+		for (i=0; i<files; i++) {
+			for (pos=0; pos<size; pos++) {
+				buf[pos] = (char)(i * 31 + pos * 7);
+			}
+			snprintf( path, sizeof(path), "p/f%07d", i );
+			if ( ((fh = hdd_open(path)) == -1) || (hdd_pwrite(fh, buf, size, 0) != size) || hdd_close(fh) ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : write of %s failed", path );
+				return( -1 );
+			}
+		}
+		write = bench_now_us() - write;
+
+		// Read them back from a fresh mount, in the order a directory walk would
+		if ( hdd_unmount() || hdd_mount() ) {
+			return( -1 );
+		}
+		hdd_pack_compact(); // the compactor's pass after mounting is done before timing
+		hdd_client_hedges( &before, &hedged, &won );
+		read = bench_now_us();
+		if ( bench_pack_check(files, size, 0, buf) ) {
+			return( -1 );
+		}
+		read = bench_now_us() - read;
+		hdd_client_hedges( &reads, &hedged, &won );
+		reads -= before;
+
+		// Every other file grows, leaving its old copy dead
+		for (i=1; i<files; i+=2) {
+			length = size + HDD_BENCH_PACK_GROWTH;
+			for (pos=0; pos<length; pos++) {
+				buf[pos] = (char)(i * 31 + pos * 7 + 1);
+			}
+			snprintf( path, sizeof(path), "p/f%07d", i );
+			if ( ((fh = hdd_open(path)) == -1) || (hdd_pwrite(fh, buf, length, 0) != length) || hdd_close(fh) ) {
+				logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : rewrite of %s failed", path );
+				return( -1 );
+			}
+		}
+		while ( hdd_pack_compact() > 0 );
+		hdd_pack_stats( &containers, &whole, &freed, &moved );
+		if ( bench_pack_check(files, size, 1, buf) || hdd_unmount() ) {
+			return( -1 );
+		}
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH pack: %8s %10.0f %10.0f %12lu %12.3f %10lu %10lu", (run == 0) ? "no" : "yes",
+				files * 1000000.0 / write, files * 1000000.0 / read, (unsigned long)reads,
+				(double)reads / files, (unsigned long)freed, (unsigned long)moved );
+	}
+	hdd_set_pack( packOption );
+	free( buf );
+	return( 0 );
+}
+
+// The class a wire trace request is reported under
+int bench_wire_class( HddBitCmd cmd ) {
+	if (getFlag(cmd) == HDD_META_BLOCK) {
+		return( 4 );
+	}
+	return( (getFlag(cmd) == HDD_NULL_FLAG) ? getOpCode(cmd) : 5 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_wire_recv
+// Description  : Receive the response to the oldest request of the wire
+//                replay in flight, mapping the block a create was given
+//
+// Inputs       : w - the replay
+// Outputs      : none
+
+void bench_wire_recv( HddBenchWire *w ) {
+	HddBenchWireSent *s = &w->ring[w->head];
+	HddWireRecord *rec = &w->recs[s->record];
+	int ret = hdd_client_recv_request( &s->req, (s->req.op == HDD_BLOCK_READ) ? w->scratch : NULL );
+
+	w->latency[s->record] = (ret == 0) ? bench_now_us() - s->sent : -1;
+	if ( (uint32_t)getR(rec->resp) != s->req.result ) {
+		w->mismatch++;
+	}
+	if ( (s->req.op == HDD_BLOCK_CREATE) && (getID(rec->resp) != 0) && ((uint32_t)getID(rec->resp) < w->mapSize) ) {
+		w->map[getID(rec->resp)] = (ret == 0) ? s->req.blockID : 0;
+	}
+	w->head = (w->head + 1) % w->depth;
+	w->inflight--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_wire_send
+// Description  : Send a block request of the wire replay, first receiving
+//                what it has to wait for: a free slot, and the create of
+//                the block it names
+//
+// Inputs       : w - the replay
+//                r - index of the record
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_wire_send( HddBenchWire *w, uint32_t r ) {
+	HddWireRecord *rec = &w->recs[r];
+	HddBenchWireSent *s;
+	HddBlockID block = (HddBlockID)getID(rec->cmd);
+
+	while ( (w->inflight == w->depth) ||
+			((block < w->mapSize) && (w->map[block] == HDD_BENCH_WIRE_PENDING) && (w->inflight > 0)) ) {
+		bench_wire_recv( w );
+	}
+	s = &w->ring[(w->head + w->inflight) % w->depth];
+	memset( &s->req, 0x0, sizeof(HddRequest) );
+	s->record = r;
+	s->req.op = getOpCode(rec->cmd);
+	s->req.flags = getFlag(rec->cmd);
+	s->req.offset = rec->offset;
+	s->req.length = getBlockSize(rec->cmd);
+	s->req.blockID = block;
+	if ( (s->req.op != HDD_BLOCK_CREATE) && (block < w->mapSize) && (w->map[block] != 0) ) {
+		s->req.blockID = w->map[block];
+	}
+	if ( (s->req.op == HDD_BLOCK_CREATE) && (getID(rec->resp) != 0) && ((uint32_t)getID(rec->resp) < w->mapSize) ) {
+		w->map[getID(rec->resp)] = HDD_BENCH_WIRE_PENDING;
+	}
+	s->sent = bench_now_us();
+	if ( hdd_client_send_request(&s->req, (s->req.op == HDD_BLOCK_READ) ? w->scratch : w->payload) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : failed sending trace record %u", r );
+		return( -1 );
+	}
+	w->inflight++;
+	return( 0 );
+}
+
+// Print the latency percentiles of one class, replayed and recorded
+void bench_wire_report( char *name, double *replayed, double *recorded, uint32_t n ) {
+	if (n == 0) {
+		return;
+	}
+	qsort( replayed, n, sizeof(double), bench_compare_latency );
+	qsort( recorded, n, sizeof(double), bench_compare_latency );
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH wire: %10s %8u %9.1f %9.1f %9.1f | %9.1f %9.1f %9.1f", name, n,
+			replayed[n / 2], replayed[(uint32_t)(n * 0.99)], replayed[n - 1], recorded[n / 2],
+			recorded[(uint32_t)(n * 0.99)], recorded[n - 1] );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_wire
+// Description  : Replay a wire trace against the server, as fast as the
+//                server answers or at the recorded pacing, and report the
+//                latency of each class of request next to the recorded one
+//
+// Inputs       : argc - the number of parameters
+//                argv - <trace> [paced [depth]]
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_wire( int argc, char *argv[] ) {
+	char *names[HDD_BENCH_WIRE_CLASSES] = { "create", "read", "overwrite", "delete", "metablock", "device" };
+	int paced = (argc > 1) ? atoi(argv[1]) : 0;
+	double *replayed, *recorded, start, due, elapsed;
+	uint32_t r, c, n, failed = 0, maxLength = 0;
+	HddWireHeader hdr;
+	HddBenchWire w;
+	HddBitResp resp;
+	FILE *fhandle;
+	long bytes;
+
+	if (argc < 1) {
+		fprintf( stderr, "Missing wire trace, use -h to see usage, aborting.\n" );
+		return( -1 );
+	}
+	memset( &w, 0x0, sizeof(w) );
+	w.depth = (argc > 2) ? atoi(argv[2]) : (paced ? 64 : 1);
+	if ( (w.depth < 1) || (w.depth > 4096) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : bad replay depth %u", w.depth );
+		return( -1 );
+	}
+
+	// The whole trace is read up front, so the replay does no file I/O
+	if ( (fhandle = fopen(argv[0], "rb")) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : failed opening wire trace [%s]", argv[0] );
+		return( -1 );
+	}
+	fseek( fhandle, 0, SEEK_END );
+	bytes = ftell( fhandle ) - (long)sizeof(hdr);
+	fseek( fhandle, 0, SEEK_SET );
+	if ( (bytes < 0) || (fread(&hdr, sizeof(hdr), 1, fhandle) != 1) || (hdr.magic != HDD_WIRE_MAGIC) ||
+		 (hdr.version != HDD_WIRE_VERSION) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : [%s] is not a version %d wire trace", argv[0], HDD_WIRE_VERSION );
+		fclose( fhandle );
+		return( -1 );
+	}
+	w.nrecs = bytes / sizeof(HddWireRecord);
+	w.recs = malloc( (size_t)w.nrecs * sizeof(HddWireRecord) + 1 );
+	if ( (w.recs == NULL) || (fread(w.recs, sizeof(HddWireRecord), w.nrecs, fhandle) != w.nrecs) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : failed reading wire trace [%s]", argv[0] );
+		fclose( fhandle );
+		return( -1 );
+	}
+	fclose( fhandle );
+	for (r=0; r<w.nrecs; r++) {
+		w.mapSize = ((uint32_t)getID(w.recs[r].resp) >= w.mapSize) ? (uint32_t)getID(w.recs[r].resp) + 1 : w.mapSize;
+		w.mapSize = ((uint32_t)getID(w.recs[r].cmd) >= w.mapSize) ? (uint32_t)getID(w.recs[r].cmd) + 1 : w.mapSize;
+		maxLength = ((uint32_t)getBlockSize(w.recs[r].cmd) > maxLength) ? (uint32_t)getBlockSize(w.recs[r].cmd) : maxLength;
+	}
+	w.map = calloc( w.mapSize, sizeof(HddBlockID) );
+	w.ring = calloc( w.depth, sizeof(HddBenchWireSent) );
+	w.payload = malloc( maxLength + 1 );
+	w.scratch = malloc( maxLength + 1 );
+	w.latency = calloc( w.nrecs + 1, sizeof(double) );
+	replayed = malloc( (w.nrecs + 1) * sizeof(double) );
+	recorded = malloc( (w.nrecs + 1) * sizeof(double) );
+	if ( !w.map || !w.ring || !w.payload || !w.scratch || !w.latency || !replayed || !recorded ) {
+		return( -1 );
+	}
+	for (r=0; r<maxLength; r++) {
+		w.payload[r] = (char)(r * 2654435761u >> 24);
+	}
+
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH wire: %u requests over %.1f s recorded%s, replayed %s at depth %u", w.nrecs,
+			(w.nrecs > 0) ? w.recs[w.nrecs-1].start / 1000000.0 : 0.0, (hdr.flags & HDD_WIRE_HASHED) ? " with payload hashes" : "",
+			paced ? "at the recorded pacing" : "as fast as possible", w.depth );
+
+	// A trace taken after the client connected starts on a connection made here
+	if ( (w.nrecs == 0) || (bench_wire_class(w.recs[0].cmd) != 5) || (getFlag(w.recs[0].cmd) != HDD_INIT) ) {
+		if ( getResult(hdd_client_operation(formatResponse(HDD_DEVICE, 0, HDD_INIT, 0, 0), NULL)) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BENCH : failed connecting to the server" );
+			return( -1 );
+		}
+	}
+	start = bench_now_us();
+	hdd_client_lock();
+	for (r=0; r<w.nrecs; r++) {
+		if (paced) {
+			due = start + (w.recs[r].start - w.recs[0].start);
+			while ( (w.inflight > 0) && (bench_now_us() < due) ) {
+				bench_wire_recv( &w );
+			}
+			while ( (elapsed = due - bench_now_us()) > 0 ) {
+				usleep( (useconds_t)elapsed );
+			}
+		}
+
+		// Device requests go on the connection alone, everything before
+		// them is answered first
+		if (bench_wire_class(w.recs[r].cmd) == 5) {
+			while (w.inflight > 0) {
+				bench_wire_recv( &w );
+			}
+			hdd_client_unlock();
+			elapsed = bench_now_us();
+			resp = hdd_client_operation( w.recs[r].cmd, NULL );
+			w.latency[r] = bench_now_us() - elapsed;
+			if ( getResult(resp) != getR(w.recs[r].resp) ) {
+				w.mismatch++;
+			}
+			if (getFlag(w.recs[r].cmd) == HDD_FORMAT) {
+				memset( w.map, 0x0, w.mapSize * sizeof(HddBlockID) ); // block IDs start over
+			}
+			hdd_client_lock();
+			continue;
+		}
+		if ( bench_wire_send(&w, r) ) {
+			failed = 1;
+			break;
+		}
+	}
+	while (w.inflight > 0) {
+		bench_wire_recv( &w );
+	}
+	hdd_client_unlock();
+	elapsed = bench_now_us() - start;
+
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH wire: %.1f ms, %.0f requests/s, %u results differ from the recorded ones",
+			elapsed / 1000.0, (elapsed > 0) ? r * 1000000.0 / elapsed : 0.0, w.mismatch );
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH wire: %10s %8s %9s %9s %9s | %9s %9s %9s", "request", "count",
+			"p50 us", "p99 us", "max us", "rec p50", "rec p99", "rec max" );
+	for (c=0; c<HDD_BENCH_WIRE_CLASSES; c++) {
+		for (r=0, n=0; r<w.nrecs; r++) {
+			if ( (bench_wire_class(w.recs[r].cmd) == (int)c) && (w.latency[r] >= 0) ) {
+				replayed[n] = w.latency[r];
+				recorded[n++] = w.recs[r].latency;
+			}
+		}
+		bench_wire_report( names[c], replayed, recorded, n );
+	}
+	for (r=0, n=0; r<w.nrecs; r++) {
+		n += (w.latency[r] < 0) ? 1 : 0;
+	}
+	if (n > 0) {
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_BENCH wire: %u requests failed", n );
+	}
+
+	free( w.recs );
+	free( w.map );
+	free( w.ring );
+	free( w.payload );
+	free( w.scratch );
+	free( w.latency );
+	free( replayed );
+	free( recorded );
+	return( failed ? -1 : 0 );
+}
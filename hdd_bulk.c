@@ -0,0 +1,778 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_bulk.c
+//  Description   : This is the bulk import/export tool for the HDD
+//                  filesystem. Many host files (or whole directory trees) are
+//                  streamed in chunks through a bounded pipeline: a host-side
+//                  thread reads (import) or writes (export) chunks while the
+//                  main thread keeps the HDD transfers of every file in
+//                  flight on the asynchronous ring.
+//
+
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+// Project Includes
+#include <hdd_driver.h>
+#include <hdd_network.h>
+#include <hdd_file_io.h>
+#include <hdd_async.h>
+#include <hdd_stripe.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define HDD_BULK_ARGUMENTS "hvfoc:q:C:a:p:S:E:"
+#define HDD_BULK_DEFAULT_CHUNK (256*1024) // bytes per transfer
+#define HDD_BULK_DEFAULT_DEPTH 16         // transfers in flight
+#define HDD_BULK_MAX_DEPTH 1024
+#define USAGE \
+	"USAGE: hdd_bulk [-h] [-v] [-f] [-o] [-c <chunk>] [-q <depth>] [-C <dir>] [-a <ip addr>] [-p <port>]\n" \
+	"                [-S <servers>] [-E <layout>]\n" \
+	"                import <host path> ... | export <hdd file> ...\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -f - format the device before importing\n" \
+	"    -o - overwrite existing host files when exporting\n" \
+	"    -c - chunk size in bytes (default 262144)\n" \
+	"    -q - chunk transfers in flight (default 16)\n" \
+	"    -C - host directory exported files are written under (default .)\n" \
+	"    -a - IP address of server to connect to.\n" \
+	"    -p - port number of server to connect to.\n" \
+	"    -S - stripe large files across these servers, a comma separated list\n" \
+	"         of [<ip>:]<port> (the IP defaults to the one of -a)\n" \
+	"    -E - stripe layout, \"default\" or a comma separated list of parity=<m>\n" \
+	"         (Reed-Solomon parity units per stripe), unit=<KiB>, min=<KiB>\n" \
+	"         (the size from which a file is striped)\n" \
+	"\n" \
+	"    import - copy host files, directories are walked recursively and\n" \
+	"             each file is stored under its relative path\n" \
+	"    export - copy HDD files to the host\n" \
+	"\n" \
+
+// A file being transferred
+typedef struct {
+	char      *host;      // the host path
+	char      *name;      // the HDD file name
+	int16_t    fd;        // the HDD file handle
+	int        hostfd;    // the host file, -1 when not open (export)
+	char      *map;       // the mapped host file (import)
+	uint32_t   size;      // bytes in the file
+	uint32_t   chunks;    // chunks making up the file (import, set by the reader)
+	uint32_t   done;      // chunks transferred
+	uint32_t   written;   // bytes written to the host (export)
+	int        failed;    // set if any chunk failed
+} HddBulkFile;
+
+// One chunk moving through the pipeline
+typedef struct {
+	int       file;   // index in the file table
+	uint32_t  off;    // position in the file
+	int32_t   len;    // bytes in the chunk
+	char     *data;   // the bytes, in the mapping (import) or a pool buffer (export)
+} HddBulkChunk;
+
+// A bounded queue of chunks between two stages
+typedef struct {
+	HddBulkChunk   **items;    // ring of queued chunks
+	int              capacity; // ring size
+	int              head;     // next chunk to take
+	int              count;    // chunks queued
+	int              closed;   // no more chunks will be added
+	pthread_mutex_t  lock;
+	pthread_cond_t   changed;
+} HddBulkQueue;
+
+//
+// Global Data
+HddBulkFile  *files = NULL;         // the files being transferred
+int           nfiles = 0;           // number of files
+int           capacity = 0;         // allocated files
+int32_t       chunkSize = HDD_BULK_DEFAULT_CHUNK;
+int           depth = HDD_BULK_DEFAULT_DEPTH;
+int           overwrite = 0;        // export replaces host files
+char         *hostDir = ".";        // export destination
+HddBulkQueue  freeQueue;            // chunks ready for reuse
+HddBulkQueue  readyQueue;           // chunks handed to the next stage
+
+//
+// Functional Prototypes
+
+int bulk_import( int argc, char *argv[] );
+int bulk_export( int argc, char *argv[] );
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_now_us
+// Description  : Get a monotonic timestamp in microseconds
+//
+// Inputs       : none
+// Outputs      : the timestamp
+
+double bulk_now_us( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return( (double)ts.tv_sec * 1000000.0 + (double)ts.tv_nsec / 1000.0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_init
+// Description  : Create an empty queue
+//
+// Inputs       : q - the queue
+//                size - the most chunks it holds
+// Outputs      : 0 if successful, -1 if failure
+
+int queue_init( HddBulkQueue *q, int size ) {
+	if ( (q->items = calloc(size, sizeof(HddBulkChunk *))) == NULL ) {
+		return( -1 );
+	}
+	q->capacity = size;
+	q->head = q->count = q->closed = 0;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->changed, NULL);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_push
+// Description  : Add a chunk, the queue is sized so it never overflows
+//
+// Inputs       : q - the queue
+//                c - the chunk
+// Outputs      : none
+
+void queue_push( HddBulkQueue *q, HddBulkChunk *c ) {
+	pthread_mutex_lock(&q->lock);
+	q->items[(q->head + q->count) % q->capacity] = c;
+	q->count++;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_pop
+// Description  : Take the oldest chunk
+//
+// Inputs       : q - the queue
+//                wait - block until there is a chunk or the queue is closed
+// Outputs      : the chunk, NULL if there is none
+
+HddBulkChunk *queue_pop( HddBulkQueue *q, int wait ) {
+	HddBulkChunk *c = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while ( wait && (q->count == 0) && !q->closed ) {
+		pthread_cond_wait(&q->changed, &q->lock);
+	}
+	if (q->count > 0) {
+		c = q->items[q->head];
+		q->head = (q->head + 1) % q->capacity;
+		q->count--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return( c );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_close
+// Description  : Wake the consumer, no more chunks will be added
+//
+// Inputs       : q - the queue
+// Outputs      : none
+
+void queue_close( HddBulkQueue *q ) {
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_file
+// Description  : Add a file to the transfer table
+//
+// Inputs       : host - the host path
+//                name - the HDD name
+// Outputs      : 0 if successful, -1 if failure
+
+int add_file( char *host, char *name ) {
+	HddBulkFile *f;
+
+	if ( (strlen(name) == 0) || (strlen(name) >= MAX_FILENAME_LENGTH) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BULK : bad file name [%s]", name );
+		return( -1 );
+	}
+	if ( nfiles >= MAX_HDD_FILEDESCR ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BULK : more than %d files", MAX_HDD_FILEDESCR );
+		return( -1 );
+	}
+	if ( nfiles == capacity ) {
+		capacity = capacity ? capacity * 2 : 64;
+		if ( (files = realloc(files, capacity * sizeof(HddBulkFile))) == NULL ) {
+			return( -1 );
+		}
+	}
+	f = &files[nfiles++];
+	memset(f, 0, sizeof(HddBulkFile));
+	f->host = strdup(host);
+	f->name = strdup(name);
+	f->fd = -1;
+	f->hostfd = -1;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_tree
+// Description  : Add a host file, or every file below a host directory
+//
+// Inputs       : path - the host path
+// Outputs      : 0 if successful, -1 if failure
+
+int add_tree( char *path ) {
+	struct stat st;
+	struct dirent *ent;
+	DIR *dir;
+	char child[PATH_MAX], *name;
+	int ret = 0;
+
+	if ( stat(path, &st) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BULK : stat of [%s] failed, error=%s", path, strerror(errno) );
+		return( -1 );
+	}
+	if ( !S_ISDIR(st.st_mode) ) {
+		// The HDD name is the path without leading "./" and "/"
+		for (name = path; (*name == '/') || ((name[0] == '.') && (name[1] == '/')); name += (*name == '/') ? 1 : 2);
+		return( add_file(path, name) );
+	}
+
+	if ( (dir = opendir(path)) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BULK : opendir of [%s] failed, error=%s", path, strerror(errno) );
+		return( -1 );
+	}
+	while ( (ret == 0) && ((ent = readdir(dir)) != NULL) ) {
+		if ( (strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0) ) {
+			continue;
+		}
+		snprintf( child, PATH_MAX, "%s/%s", path, ent->d_name );
+		ret = add_tree(child);
+	}
+	closedir(dir);
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_hdd_files
+// Description  : Mount and open every file in the table
+//
+// Inputs       : format - format the device first
+//                create - create the HDD directories on the way to each file
+// Outputs      : 0 if successful, -1 if failure
+
+int open_hdd_files( int format, int create ) {
+	HddBlockID blockID;
+	int32_t blockSize;
+	char *p;
+	int i;
+
+	if ( (format && hdd_format()) || hdd_mount() ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BULK : format or mount failed." );
+		return( -1 );
+	}
+	if (chunkSize > hdd_client_max_block_size()) {
+		chunkSize = hdd_client_max_block_size(); // a v1 server
+	}
+	for (i=0; i<nfiles; i++) {
+		for (p=strchr(files[i].name + 1, '/'); create && (p != NULL); p=strchr(p + 1, '/')) {
+			*p = '\0';
+			hdd_mkdir(files[i].name); // fails harmlessly if it exists
+			*p = '/';
+		}
+		if ( (files[i].fd = hdd_open(files[i].name)) == -1 ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BULK : open of [%s] failed.", files[i].name );
+			return( -1 );
+		}
+		lockFile(files[i].fd, 0, 1);
+		hdd_entry_get(files[i].fd, &blockID, &blockSize);
+		unlockFile(files[i].fd);
+		files[i].size = blockSize; // 0 while empty, inline files have no block
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_hdd_files
+// Description  : Close every file and unmount
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int close_hdd_files( void ) {
+	int i;
+
+	for (i=0; i<nfiles; i++) {
+		if (files[i].fd != -1) {
+			hdd_close(files[i].fd);
+		}
+	}
+	return( hdd_unmount() ? -1 : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : report
+// Description  : Log the aggregate rate of a transfer
+//
+// Inputs       : what - import or export
+//                start - when the transfer started
+// Outputs      : the number of failed files
+
+int report( char *what, double start ) {
+	double secs = (bulk_now_us() - start) / 1000000.0;
+	uint64_t bytes = 0;
+	int i, failed = 0;
+
+	for (i=0; i<nfiles; i++) {
+		if (files[i].failed) {
+			failed++;
+		} else {
+			bytes += files[i].size;
+		}
+	}
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_BULK %s: %d files (%d failed), %llu bytes in %.3f s, %.2f MB/s",
+			what, nfiles, failed, (unsigned long long)bytes, secs,
+			(secs > 0) ? (double)bytes / (1024.0 * 1024.0) / secs : 0.0 );
+	return( failed );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the HDD bulk tool
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+	// Local variables
+	int ch, format = 0, i, ret;
+
+	// Process the command line parameters
+	initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	while ((ch = getopt(argc, argv, HDD_BULK_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			enableLogLevels( LOG_INFO_LEVEL );
+			break;
+
+		case 'f': // Format before importing
+			format = 1;
+			break;
+
+		case 'o': // Overwrite host files
+			overwrite = 1;
+			break;
+
+		case 'c': // Chunk size
+			if ( (sscanf( optarg, "%d", &chunkSize ) != 1) || (chunkSize < 1) || (chunkSize > HDD_V2_MAX_BLOCK_SIZE) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad chunk size [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'q': // Transfers in flight
+			if ( (sscanf( optarg, "%d", &depth ) != 1) || (depth < 1) || (depth > HDD_BULK_MAX_DEPTH) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad queue depth [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'C': // Export destination
+			hostDir = optarg;
+			break;
+
+		case 'a': // Get the IP address
+			if (inet_addr(optarg) == INADDR_NONE) {
+				logMessage( LOG_ERROR_LEVEL, "Bad IP address [%s]", optarg );
+				return(-1);
+			}
+			hdd_network_address = (unsigned char *)strdup(optarg);
+			break;
+
+		case 'p': // Get the port
+			hdd_network_port = (unsigned short)atoi(optarg);
+			break;
+
+		case 'S': // Set the stripe servers
+			if ( hdd_stripe_set_servers(optarg) ) {
+				return(-1);
+			}
+			break;
+
+		case 'E': // Set the stripe layout
+			if ( hdd_stripe_configure(optarg) ) {
+				return(-1);
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// The command should be the next option
+	if ( optind + 1 >= argc ) {
+		fprintf( stderr, "Missing command or files, use -h to see usage, aborting.\n" );
+		return( -1 );
+	}
+
+	// Both stages share a pool of 2 * depth chunks
+	if ( queue_init(&freeQueue, depth * 2) || queue_init(&readyQueue, depth * 2) ) {
+		return( -1 );
+	}
+
+	if ( strcmp(argv[optind], "import") == 0 ) {
+		for (i=optind+1; i<argc; i++) {
+			if ( add_tree(argv[i]) ) {
+				return( -1 );
+			}
+		}
+		if ( open_hdd_files(format, 1) ) {
+			return( -1 );
+		}
+		ret = bulk_import(argc-optind-1, &argv[optind+1]);
+	} else if ( strcmp(argv[optind], "export") == 0 ) {
+		for (i=optind+1; i<argc; i++) {
+			if ( add_file(argv[i], argv[i]) ) {
+				return( -1 );
+			}
+		}
+		if ( open_hdd_files(0, 0) ) {
+			return( -1 );
+		}
+		ret = bulk_export(argc-optind-1, &argv[optind+1]);
+	} else {
+		fprintf( stderr, "Unknown command [%s], use -h to see usage, aborting.\n", argv[optind] );
+		return( -1 );
+	}
+
+	if ( close_hdd_files() ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BULK : unmount failed." );
+		return( -1 );
+	}
+	return( ret ? -1 : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : import_reader
+// Description  : The host read stage, maps each host file and queues its
+//                chunks in order; the mapping is handed to the HDD write
+//                without copying
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+void *import_reader( void *arg ) {
+	HddBulkFile *f;
+	HddBulkChunk *c;
+	struct stat st;
+	uint32_t off;
+	int i, fd;
+
+	for (i=0; i<nfiles; i++) {
+		f = &files[i];
+		if ( ((fd = open(f->host, O_RDONLY)) == -1) || (fstat(fd, &st) == -1) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BULK : open of [%s] failed, error=%s", f->host, strerror(errno) );
+			f->failed = 1;
+			if (fd != -1) {
+				close(fd);
+			}
+			continue;
+		}
+		if (st.st_size < f->size) {
+			// Writes cannot shrink a file, importing over it would leave a stale tail
+			logMessage( LOG_ERROR_LEVEL, "HDD_BULK : [%s] already holds more data, format with -f", f->name );
+			f->size = 0;
+			f->failed = 1;
+			close(fd);
+			continue;
+		}
+		if ( ((st.st_size > hdd_client_max_block_size()) && !hdd_stripe_fits(st.st_size)) ||
+			 ((st.st_size > 0) && ((f->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BULK : [%s] is too large or cannot be mapped", f->host );
+			f->map = NULL;
+			f->failed = 1;
+			close(fd);
+			continue;
+		}
+		close(fd); // the mapping stays valid
+		if (st.st_size > 0) {
+			madvise(f->map, st.st_size, MADV_SEQUENTIAL|MADV_WILLNEED);
+		}
+		f->size = st.st_size;
+		f->chunks = (f->size + chunkSize - 1) / chunkSize;
+
+		// Chunks go out in order, the ring keeps writes to one file in order
+		for (off=0; off<f->size; off+=chunkSize) {
+			c = queue_pop(&freeQueue, 1);
+			c->file = i;
+			c->off = off;
+			c->len = (f->size - off < (uint32_t)chunkSize) ? (int32_t)(f->size - off) : chunkSize;
+			c->data = f->map + off;
+			queue_push(&readyQueue, c);
+		}
+	}
+	queue_close(&readyQueue);
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_import
+// Description  : Write the host files to the HDD, the reader thread feeds
+//                chunks and this thread keeps up to depth of them in flight
+//
+// Inputs       : argc - the number of paths
+//                argv - the paths
+// Outputs      : 0 if successful, -1 if failure
+
+int bulk_import( int argc, char *argv[] ) {
+	HddBulkChunk *pool, *c;
+	HddBulkFile *f;
+	HddAsyncRing ring;
+	HddAsyncSqe *sqe;
+	HddAsyncCqe *cqe;
+	pthread_t reader;
+	int i, inflight = 0;
+	double start;
+
+	if ( ((pool = calloc(depth * 2, sizeof(HddBulkChunk))) == NULL) || hdd_async_init(&ring, depth) ) {
+		return( -1 );
+	}
+	for (i=0; i<depth*2; i++) {
+		queue_push(&freeQueue, &pool[i]);
+	}
+
+	start = bulk_now_us();
+	pthread_create(&reader, NULL, import_reader, NULL);
+	for (;;) {
+		// Submit the ready chunks, only block if nothing is in flight
+		while ( (inflight < depth) && ((c = queue_pop(&readyQueue, inflight == 0)) != NULL) ) {
+			sqe = hdd_async_get_sqe(&ring);
+			hdd_async_prep_write(sqe, files[c->file].fd, c->data, c->len, c->off, (uint64_t)(uintptr_t)c);
+			inflight++;
+		}
+		if (inflight == 0) {
+			break; // the reader is done and every chunk is written
+		}
+		hdd_async_submit(&ring);
+
+		// Retire the completed chunks
+		if ( hdd_async_wait_cqe(&ring, &cqe) == 0 ) {
+			do {
+				c = (HddBulkChunk *)(uintptr_t)cqe->userData;
+				f = &files[c->file];
+				if (cqe->result != c->len) {
+					logMessage( LOG_ERROR_LEVEL, "HDD_BULK : write of [%s] at %u failed.", f->name, c->off );
+					f->failed = 1;
+				}
+				hdd_async_cqe_seen(&ring, cqe);
+				inflight--;
+				if (++f->done == f->chunks) {
+					munmap(f->map, f->size);
+					f->map = NULL;
+					logMessage( LOG_INFO_LEVEL, "HDD_BULK : imported [%s] (%u bytes)", f->name, f->size );
+				}
+				queue_push(&freeQueue, c);
+			} while ( hdd_async_peek_cqe(&ring, &cqe) == 0 );
+		}
+	}
+	pthread_join(reader, NULL);
+	hdd_async_exit(&ring);
+	free(pool);
+
+	return( report("import", start) ? -1 : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_host_file
+// Description  : Create the host file for an export, and its directories
+//
+// Inputs       : f - the file
+// Outputs      : the host file descriptor, -1 if failure
+
+int open_host_file( HddBulkFile *f ) {
+	char path[PATH_MAX], *p;
+	int fd;
+
+	snprintf( path, PATH_MAX, "%s/%s", hostDir, f->name );
+	for (p=strchr(path + 1, '/'); p != NULL; p=strchr(p + 1, '/')) {
+		*p = '\0';
+		mkdir(path, S_IRWXU|S_IRGRP|S_IXGRP);
+		*p = '/';
+	}
+	if ( (fd = open(path, O_WRONLY|O_CREAT|(overwrite ? O_TRUNC : O_EXCL), S_IRUSR|S_IWUSR|S_IRGRP)) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_BULK : create of [%s] failed, error=%s", path, strerror(errno) );
+	}
+	return( fd );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : export_writer
+// Description  : The host write stage, writes each chunk at its position and
+//                closes a host file once all of its bytes are written
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+void *export_writer( void *arg ) {
+	HddBulkFile *f;
+	HddBulkChunk *c;
+	int i;
+
+	while ( (c = queue_pop(&readyQueue, 1)) != NULL ) {
+		f = &files[c->file];
+		if ( !f->failed && (f->hostfd == -1) && ((f->hostfd = open_host_file(f)) == -1) ) {
+			f->failed = 1;
+		}
+		if ( !f->failed && (c->len > 0) && (pwrite(f->hostfd, c->data, c->len, c->off) != c->len) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_BULK : write of [%s] failed, error=%s", f->host, strerror(errno) );
+			f->failed = 1;
+		}
+		f->written += c->len;
+		if ( (f->hostfd != -1) && (f->written == f->size) ) {
+			close(f->hostfd);
+			f->hostfd = -1;
+			logMessage( LOG_INFO_LEVEL, "HDD_BULK : exported [%s] (%u bytes)", f->name, f->size );
+		}
+		queue_push(&freeQueue, c);
+	}
+
+	// Files with failed chunks never reach their size
+	for (i=0; i<nfiles; i++) {
+		if (files[i].hostfd != -1) {
+			close(files[i].hostfd);
+			files[i].hostfd = -1;
+		}
+	}
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_export
+// Description  : Read the HDD files to the host, this thread keeps up to
+//                depth chunk reads in flight and the writer thread stores
+//                them; both share a fixed pool of chunk buffers
+//
+// Inputs       : argc - the number of files
+//                argv - the files
+// Outputs      : 0 if successful, -1 if failure
+
+int bulk_export( int argc, char *argv[] ) {
+	HddBulkChunk *pool, *c;
+	HddBulkFile *f;
+	HddAsyncRing ring;
+	HddAsyncSqe *sqe;
+	HddAsyncCqe *cqe;
+	pthread_t writer;
+	char *buffers;
+	int i, next = 0, inflight = 0;
+	uint32_t off = 0;
+	double start;
+
+	if ( ((pool = calloc(depth * 2, sizeof(HddBulkChunk))) == NULL) ||
+		 ((buffers = malloc((size_t)depth * 2 * chunkSize)) == NULL) || hdd_async_init(&ring, depth) ) {
+		return( -1 );
+	}
+	for (i=0; i<depth*2; i++) {
+		pool[i].data = buffers + (size_t)i * chunkSize;
+		queue_push(&freeQueue, &pool[i]);
+	}
+
+	start = bulk_now_us();
+	pthread_create(&writer, NULL, export_writer, NULL);
+	while ( (next < nfiles) || (inflight > 0) ) {
+		// Start reads while there are buffers, only block if nothing is in flight
+		while ( (next < nfiles) && (inflight < depth) && ((c = queue_pop(&freeQueue, inflight == 0)) != NULL) ) {
+			f = &files[next];
+			c->file = next;
+			c->off = off;
+			c->len = (f->size - off < (uint32_t)chunkSize) ? (int32_t)(f->size - off) : chunkSize;
+			if (c->len == 0) {
+				queue_push(&readyQueue, c); // an empty file, the writer just creates it
+			} else {
+				sqe = hdd_async_get_sqe(&ring);
+				hdd_async_prep_read(sqe, f->fd, c->data, c->len, c->off, (uint64_t)(uintptr_t)c);
+				inflight++;
+			}
+			off += c->len;
+			if (off >= f->size) {
+				next++;
+				off = 0;
+			}
+		}
+		if (inflight == 0) {
+			continue;
+		}
+		hdd_async_submit(&ring);
+
+		// Hand the completed chunks to the writer
+		if ( hdd_async_wait_cqe(&ring, &cqe) == 0 ) {
+			do {
+				c = (HddBulkChunk *)(uintptr_t)cqe->userData;
+				if (cqe->result != c->len) {
+					logMessage( LOG_ERROR_LEVEL, "HDD_BULK : read of [%s] at %u failed.", files[c->file].name, c->off );
+					files[c->file].failed = 1;
+				}
+				hdd_async_cqe_seen(&ring, cqe);
+				inflight--;
+				queue_push(&readyQueue, c);
+			} while ( hdd_async_peek_cqe(&ring, &cqe) == 0 );
+		}
+	}
+	queue_close(&readyQueue);
+	pthread_join(writer, NULL);
+	hdd_async_exit(&ring);
+	free(buffers);
+	free(pool);
+
+	return( report("export", start) ? -1 : 0 );
+}
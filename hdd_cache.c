@@ -0,0 +1,1391 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_cache.c
+//  Description   : This is the implementation of the two tier client block
+//                  cache. A block is in at most one tier at a time:
+//
+//                    RAM   - an LRU list of whole blocks, bounded in bytes
+//                    file  - an LRU list of blocks stored in fixed size
+//                            slots of the cache file, a block takes a chain
+//                            of slots. The file is mapped, or with direct=1
+//                            read and written a slot at a time with O_DIRECT
+//                            so it does not also fill the page cache
+//                    ghost - an LRU list of blocks only remembered by their
+//                            access count, bounded by the slot count
+//
+//                  Blocks enter RAM when read or written. When RAM is full
+//                  the least recently used block is demoted to the file if
+//                  it was accessed at least "admit" times (counting accesses
+//                  before it last left the cache), otherwise it becomes a
+//                  ghost. A file hit promotes the block back to RAM.
+//                  Writes update the RAM copy and drop a file copy.
+//
+//                  On unmount the RAM blocks are moved to the file and the
+//                  file tier's index (block, size, generation, checksum and
+//                  slot chain of each block) is written to <file>.idx. It
+//                  is read back when the cache is set up and removed at the
+//                  next mount, from then on the slots are reused. A
+//                  restored block is served only if the file system is the
+//                  one it was saved for and the directory still has the
+//                  generation it was cached at, and its checksum is checked
+//                  when it is promoted.
+//
+//                  Other clients may write the same blocks. When the server
+//                  grants leases, a copy carries the block's version and is
+//                  served only until its lease runs out, then the next read
+//                  asks the server for the block unless it still has that
+//                  version. Writes by other clients arrive on the
+//                  invalidation channel and drop older copies right away;
+//                  the last invalidations are kept in a ring so a read or
+//                  write in flight when one arrives does not cache what it
+//                  brings back as current.
+//
+
+//
+
+// Include Files
+#define _GNU_SOURCE // O_DIRECT
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// Project Include Files
+#include <hdd_cache.h>
+#include <hdd_network.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_hashtable.h>
+
+// Defines
+#define HDD_CACHE_DIRECT_ALIGN 4096   // O_DIRECT buffer, offset and length alignment
+#define HDD_CACHE_NO_SLOT 0xffffffff  // end of a slot chain
+#define HDD_CACHE_MIN_GHOSTS 1024     // ghosts remembered without a file tier
+#define HDD_CACHE_INDEX_BITS 12       // initial index size, it grows as needed
+#define HDD_CACHE_SAVE_MAGIC 0x48444443 // "HDDC"
+#define HDD_CACHE_SAVE_VERSION 2
+#define HDD_CACHE_REVOKE_RING 1024    // invalidations remembered for requests in flight
+
+// A block known to the cache
+typedef struct HddCacheEntry {
+	HddBlockID            blockID;
+	uint32_t              size;   // bytes of the block
+	uint8_t               tier;   // HDD_CACHE_TIER_TYPES
+	uint32_t              refs;   // accesses seen, kept while a ghost
+	uint32_t              generation; // the directory's generation of the contents
+	char                 *data;   // RAM tier: the block
+	uint32_t              slot;   // file tier: first slot of the chain
+	uint64_t              checksum;   // file tier: of the contents, checked on promotion
+	uint32_t              version;    // the server's version of the contents, 0 if unknown
+	double                expires;    // end of the lease (ms, monotonic)
+	uint8_t               writing;    // 1 while this client overwrites the block
+	struct HddCacheEntry *prev;   // towards the most recently used of its list
+	struct HddCacheEntry *next;   // towards the least recently used
+} HddCacheEntry;
+
+// An LRU list, most recently used at the head
+typedef struct {
+	HddCacheEntry *head;
+	HddCacheEntry *tail;
+	uint64_t       count;
+} HddCacheList;
+
+// The saved index of the file tier is this header followed by count
+// records, least recently used first, each followed by its slot chain
+typedef struct {
+	uint32_t magic;     // HDD_CACHE_SAVE_MAGIC
+	uint32_t version;   // HDD_CACHE_SAVE_VERSION
+	uint64_t fsid;      // the file system the blocks belong to
+	uint32_t slotBytes; // the geometry the chains are for
+	uint32_t slots;
+	uint64_t count;     // records
+} HddCacheSaveHeader;
+
+typedef struct {
+	HddBlockID blockID;
+	uint32_t   size;
+	uint32_t   generation;
+	uint32_t   refs;
+	uint32_t   version;
+	uint64_t   checksum;
+} HddCacheSaveRecord;
+
+// An invalidation received from the server
+typedef struct {
+	HddBlockID blockID; // HDD_NO_BLOCK for all of them
+	uint32_t   version; // the block's new version
+} HddCacheRevoke;
+
+// The counters of a tier
+typedef struct {
+	uint64_t hits;      // reads served by the tier
+	uint64_t misses;    // reads the tier was looked up for and did not have
+	uint64_t inserts;   // blocks placed in the tier (RAM: read or written, file: admitted)
+	uint64_t rejected;  // blocks turned away (file: seen too few times or too large)
+	uint64_t evictions; // blocks pushed out of the tier to make room
+	uint64_t updates;   // writes applied to a cached block (file: dropping it)
+} HddCacheTierStats;
+
+//
+// Global Data
+uint64_t        cacheRamBytes = (uint64_t)HDD_CACHE_RAM_KB * 1024;   // RAM tier capacity
+uint64_t        cacheFileBytes = (uint64_t)HDD_CACHE_FILE_MB << 20;  // file tier capacity
+uint32_t        cacheSlotBytes = HDD_CACHE_SLOT_KB * 1024;           // file tier allocation unit
+uint32_t        cacheAdmit = HDD_CACHE_ADMIT;                        // accesses before file admission
+int             cacheDirect = 0;                                     // 1 for O_DIRECT slot I/O
+char           *cachePath = NULL;                                    // the cache file, NULL for RAM only
+int             cacheEnabled = 0;
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+HTable          cacheIndex;                 // block ID to its HddCacheEntry
+HddCacheList    cacheList[HDD_CACHE_TIERS + 1]; // per tier LRU, ghosts last
+uint64_t        cacheRamUsed = 0;           // bytes in the RAM tier
+uint64_t        cacheFsid = 0;              // file system the blocks belong to, 0 if none yet
+uint32_t        cacheLeaseMs = 0;           // lease term of a copy, 0 if copies never expire
+HddCacheRevoke  cacheRevokeRing[HDD_CACHE_REVOKE_RING]; // the last invalidations
+uint64_t        cacheRevokes = 0;           // invalidations received
+
+// The file tier
+int       cacheFd = -1;
+char     *cacheMap = NULL;    // the mapped file, NULL with direct I/O
+size_t    cacheMapBytes = 0;  // length of the mapping
+char     *cacheBounce = NULL; // a slot sized aligned buffer for direct I/O
+uint32_t  cacheSlots = 0;     // slots in the file
+uint32_t *cacheSlotNext;      // next slot of a chain or of the free list
+uint32_t  cacheSlotFree = HDD_CACHE_NO_SLOT, cacheSlotsFree = 0;
+
+// Counters
+HddCacheTierStats cacheStats[HDD_CACHE_TIERS];
+uint64_t          cachePromotions = 0, cacheDemotions = 0;
+uint64_t          cacheStale = 0;    // copies dropped for an old generation or a bad checksum
+uint64_t          cacheRestored = 0; // blocks read back from a saved index
+uint64_t          cacheExpired = 0;  // reads of a copy whose lease ran out
+uint64_t          cacheRenewed = 0;  // expired copies the server confirmed current
+uint64_t          cacheRevoked = 0;  // copies dropped for another client's write
+
+//
+// Helper functions
+
+// Take an entry out of its list
+void cacheUnlink(HddCacheEntry *e) {
+	HddCacheList *l = &cacheList[e->tier];
+
+	if (e->prev != NULL) {
+		e->prev->next = e->next;
+	} else {
+		l->head = e->next;
+	}
+	if (e->next != NULL) {
+		e->next->prev = e->prev;
+	} else {
+		l->tail = e->prev;
+	}
+	e->prev = e->next = NULL;
+	l->count--;
+}
+
+// Put an entry at the head of the list of tier
+void cachePush(HddCacheEntry *e, uint8_t tier) {
+	HddCacheList *l = &cacheList[tier];
+
+	e->tier = tier;
+	e->prev = NULL;
+	e->next = l->head;
+	if (l->head != NULL) {
+		l->head->prev = e;
+	} else {
+		l->tail = e;
+	}
+	l->head = e;
+	l->count++;
+}
+
+// Checksum of a block's contents
+uint64_t cacheChecksum(char *data, uint32_t size) {
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ size, w;
+	uint32_t i;
+
+	for (i = 0; i + sizeof(w) <= size; i += sizeof(w)) {
+		memcpy(&w, data + i, sizeof(w));
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 29;
+	}
+	for (; i < size; i++) {
+		h = (h ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+	}
+	return( h );
+}
+
+// Path of the saved index of the cache file
+void cacheSavePath(char *path, size_t size) {
+	snprintf(path, size, "%s.idx", cachePath);
+}
+
+// Slots a block of size bytes takes
+uint32_t cacheSlotsFor(uint32_t size) {
+	return( (size + cacheSlotBytes - 1) / cacheSlotBytes );
+}
+
+// Return the slot chain starting at slot to the free list
+void cacheFreeSlots(uint32_t slot) {
+	uint32_t next;
+
+	for (; slot != HDD_CACHE_NO_SLOT; slot = next) {
+		next = cacheSlotNext[slot];
+		cacheSlotNext[slot] = cacheSlotFree;
+		cacheSlotFree = slot;
+		cacheSlotsFree++;
+	}
+}
+
+// Free what an entry stores in its tier, it stays in its list
+void cacheDropData(HddCacheEntry *e) {
+	if (e->tier == HDD_CACHE_TIER_RAM) {
+		cacheRamUsed -= e->size;
+		free(e->data);
+		e->data = NULL;
+	} else if (e->tier == HDD_CACHE_TIER_FILE) {
+		cacheFreeSlots(e->slot);
+		e->slot = HDD_CACHE_NO_SLOT;
+	}
+}
+
+// Forget an entry altogether
+void cacheForget(HddCacheEntry *e) {
+	cacheDropData(e);
+	cacheUnlink(e);
+	deleteValueFromHashTable(&cacheIndex, e->blockID);
+	free(e);
+}
+
+// Turn an entry that left the cache into a ghost, forgetting the oldest
+// ghosts beyond the limit
+void cacheMakeGhost(HddCacheEntry *e) {
+	uint64_t limit = (cacheSlots > HDD_CACHE_MIN_GHOSTS) ? cacheSlots : HDD_CACHE_MIN_GHOSTS;
+
+	cacheDropData(e);
+	cacheUnlink(e);
+	cachePush(e, HDD_CACHE_GHOST);
+	while (cacheList[HDD_CACHE_GHOST].count > limit) {
+		cacheForget(cacheList[HDD_CACHE_GHOST].tail);
+	}
+}
+
+// Forget every entry
+void cacheForgetAll(void) {
+	int tier;
+
+	for (tier = 0; tier <= HDD_CACHE_TIERS; tier++) {
+		while (cacheList[tier].head != NULL) {
+			cacheForget(cacheList[tier].head);
+		}
+	}
+}
+
+// Current time on the monotonic clock in ms
+double cacheNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return( (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0 );
+}
+
+// Is version a older than version b? (they wrap)
+int cacheOlder(uint32_t a, uint32_t b) {
+	return( (int32_t)(a - b) < 0 );
+}
+
+// Was the block invalidated past version since the invalidation count was
+// since? If the ring has wrapped nobody knows, assume it was
+int cacheRevokedSince(HddBlockID blockID, uint32_t version, uint64_t since) {
+	HddCacheRevoke *r;
+	uint64_t i;
+
+	if (cacheRevokes - since > HDD_CACHE_REVOKE_RING) {
+		return( 1 );
+	}
+	for (i = since; i < cacheRevokes; i++) {
+		r = &cacheRevokeRing[i % HDD_CACHE_REVOKE_RING];
+		if ( (r->blockID == HDD_NO_BLOCK) || ((r->blockID == blockID) && ((version == 0) || cacheOlder(version, r->version))) ) {
+			return( 1 );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheSlotIO
+// Description  : Read or write part of a slot of the cache file
+//
+// Inputs       : slot - the slot
+//                buf - the data
+//                len - bytes, at most a slot, from the start of the slot
+//                write - 1 to write, 0 to read
+// Outputs      : 0 if successful, -1 if failure
+
+int cacheSlotIO(uint32_t slot, char *buf, uint32_t len, int write) {
+	off_t pos = (off_t)slot * cacheSlotBytes;
+	ssize_t done;
+
+	if (cacheMap != NULL) {
+		if (write) {
+			memcpy(cacheMap + pos, buf, len);
+		} else {
+			memcpy(buf, cacheMap + pos, len);
+		}
+		return( 0 );
+	}
+
+	// Direct I/O moves whole slots through the aligned buffer
+	if (write) {
+		memcpy(cacheBounce, buf, len);
+		done = pwrite(cacheFd, cacheBounce, cacheSlotBytes, pos);
+	} else {
+		done = pread(cacheFd, cacheBounce, cacheSlotBytes, pos);
+		memcpy(buf, cacheBounce, len);
+	}
+	if (done != cacheSlotBytes) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : %s of slot %u failed [%s]", write ? "write" : "read",
+				   slot, (done == -1) ? strerror(errno) : "short transfer");
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheFileStore
+// Description  : Write a RAM block into a new slot chain, evicting the least
+//                recently used file blocks until there are enough free slots
+//
+// Inputs       : e - the entry, in the RAM tier
+// Outputs      : the first slot of the chain, HDD_CACHE_NO_SLOT if failure
+
+uint32_t cacheFileStore(HddCacheEntry *e) {
+	uint32_t need = cacheSlotsFor(e->size), first = HDD_CACHE_NO_SLOT, *link = &first, slot, off, len;
+
+	if ( (need == 0) || (need > cacheSlots) ) {
+		return( HDD_CACHE_NO_SLOT );
+	}
+	while (cacheSlotsFree < need) {
+		cacheStats[HDD_CACHE_TIER_FILE].evictions++;
+		cacheMakeGhost(cacheList[HDD_CACHE_TIER_FILE].tail);
+	}
+	e->checksum = cacheChecksum(e->data, e->size);
+
+	for (off = 0; off < e->size; off += len) {
+		slot = cacheSlotFree;
+		cacheSlotFree = cacheSlotNext[slot];
+		cacheSlotsFree--;
+		cacheSlotNext[slot] = HDD_CACHE_NO_SLOT;
+		*link = slot;
+		link = &cacheSlotNext[slot];
+
+		len = (e->size - off < cacheSlotBytes) ? e->size - off : cacheSlotBytes;
+		if (cacheSlotIO(slot, e->data + off, len, 1) == -1) {
+			cacheFreeSlots(first);
+			return( HDD_CACHE_NO_SLOT );
+		}
+	}
+	return( first );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheDemote
+// Description  : Move the least recently used RAM block out of RAM, to the
+//                file tier if it is admitted, else it becomes a ghost
+//
+// Inputs       : none
+// Outputs      : none
+
+void cacheDemote(void) {
+	HddCacheEntry *e = cacheList[HDD_CACHE_TIER_RAM].tail;
+	uint32_t slot;
+
+	cacheStats[HDD_CACHE_TIER_RAM].evictions++;
+	if (cacheSlots == 0) {
+		cacheMakeGhost(e);
+		return;
+	}
+	if ( (e->refs < cacheAdmit) || ((slot = cacheFileStore(e)) == HDD_CACHE_NO_SLOT) ) {
+		cacheStats[HDD_CACHE_TIER_FILE].rejected++;
+		cacheMakeGhost(e);
+		return;
+	}
+	cacheDropData(e);
+	cacheUnlink(e);
+	e->slot = slot;
+	cachePush(e, HDD_CACHE_TIER_FILE);
+	cacheStats[HDD_CACHE_TIER_FILE].inserts++;
+	cacheDemotions++;
+}
+
+// Demote RAM blocks until size more bytes fit
+void cacheRamReserve(uint32_t size) {
+	while ( (cacheRamUsed + size > cacheRamBytes) && (cacheList[HDD_CACHE_TIER_RAM].tail != NULL) ) {
+		cacheDemote();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cachePromote
+// Description  : Move a file block back to RAM
+//
+// Inputs       : e - the entry, in the file tier
+// Outputs      : 0 if successful, -1 if failure (the entry is forgotten)
+
+int cachePromote(HddCacheEntry *e) {
+	uint32_t slot, off, len;
+	char *data;
+
+	if ( (data = malloc(e->size)) == NULL ) {
+		cacheForget(e);
+		return( -1 );
+	}
+	for (slot = e->slot, off = 0; off < e->size; off += len, slot = cacheSlotNext[slot]) {
+		len = (e->size - off < cacheSlotBytes) ? e->size - off : cacheSlotBytes;
+		if (cacheSlotIO(slot, data + off, len, 0) == -1) {
+			free(data);
+			cacheForget(e);
+			return( -1 );
+		}
+	}
+	if (cacheChecksum(data, e->size) != e->checksum) {
+		logMessage(LOG_WARNING_LEVEL, "HDD_CACHE : block %u has a bad checksum in the cache file, dropped", e->blockID);
+		cacheStale++;
+		free(data);
+		cacheForget(e);
+		return( -1 );
+	}
+
+	// Out of the file first, so the demotions making room can use its slots
+	cacheDropData(e);
+	cacheUnlink(e);
+	cacheRamReserve(e->size);
+	e->data = data;
+	cacheRamUsed += e->size;
+	cachePush(e, HDD_CACHE_TIER_RAM);
+	cachePromotions++;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheLoadIndex
+// Description  : Restore the file tier from its saved index, if there is one
+//                for this geometry. The index is removed once read, the slots
+//                it names are reused from here on
+//
+// Inputs       : none
+// Outputs      : none
+
+void cacheLoadIndex(void) {
+	char path[4096];
+	HddCacheSaveHeader hdr;
+	HddCacheSaveRecord rec;
+	HddCacheEntry *e;
+	uint32_t *chain = NULL, need, k, i;
+	uint8_t *used = NULL;
+	uint64_t n;
+	FILE *f;
+
+	cacheSavePath(path, sizeof(path));
+	if ( (f = fopen(path, "r")) == NULL ) {
+		return;
+	}
+	if ( (fread(&hdr, sizeof(hdr), 1, f) != 1) || (hdr.magic != HDD_CACHE_SAVE_MAGIC) ||
+		 (hdr.version != HDD_CACHE_SAVE_VERSION) || (hdr.slotBytes != cacheSlotBytes) || (hdr.slots != cacheSlots) ) {
+		logMessage(LOG_WARNING_LEVEL, "HDD_CACHE : [%s] is not an index for this cache file, starting cold", path);
+		fclose(f);
+		unlink(path);
+		return;
+	}
+	if ( ((chain = malloc(cacheSlots * sizeof(uint32_t))) == NULL) || ((used = calloc(cacheSlots, 1)) == NULL) ) {
+		free(chain);
+		fclose(f);
+		return;
+	}
+
+	// Records are least recently used first, each goes to the head
+	for (n = 0; n < hdr.count; n++) {
+		if ( (fread(&rec, sizeof(rec), 1, f) != 1) || (rec.size == 0) ||
+			 ((need = cacheSlotsFor(rec.size)) > cacheSlots) || (fread(chain, sizeof(uint32_t), need, f) != need) ||
+			 (findValueInHashTable(&cacheIndex, rec.blockID) != NULL) ) {
+			break;
+		}
+		for (k = 0; (k < need) && (chain[k] < cacheSlots) && !used[chain[k]]; k++) {
+			used[chain[k]] = 1;
+		}
+		if ( (k < need) || ((e = calloc(1, sizeof(HddCacheEntry))) == NULL) ) {
+			while (k-- > 0) {
+				used[chain[k]] = 0;
+			}
+			break;
+		}
+		for (k = 0; k < need; k++) {
+			cacheSlotNext[chain[k]] = (k + 1 < need) ? chain[k + 1] : HDD_CACHE_NO_SLOT;
+		}
+		e->blockID = rec.blockID;
+		e->size = rec.size;
+		e->generation = rec.generation;
+		e->refs = rec.refs;
+		e->version = rec.version; // its lease is over, revalidated on first use
+		e->checksum = rec.checksum;
+		e->slot = chain[0];
+		insertValueInHashTable(&cacheIndex, e->blockID, e);
+		cachePush(e, HDD_CACHE_TIER_FILE);
+	}
+	if (n < hdr.count) {
+		logMessage(LOG_WARNING_LEVEL, "HDD_CACHE : [%s] is damaged, %llu of %llu blocks restored", path,
+				   (unsigned long long)n, (unsigned long long)hdr.count);
+	}
+
+	// The free list is every slot no chain uses
+	cacheSlotFree = HDD_CACHE_NO_SLOT;
+	cacheSlotsFree = 0;
+	for (i = cacheSlots; i-- > 0; ) {
+		if (!used[i]) {
+			cacheSlotNext[i] = cacheSlotFree;
+			cacheSlotFree = i;
+			cacheSlotsFree++;
+		}
+	}
+	cacheFsid = hdr.fsid;
+	cacheRestored = n;
+	logMessage(LOG_OUTPUT_LEVEL, "HDD_CACHE : restored %llu blocks (%llu KiB) from [%s]", (unsigned long long)n,
+			   (unsigned long long)(cacheSlots - cacheSlotsFree) * cacheSlotBytes / 1024, path);
+	free(chain);
+	free(used);
+	fclose(f);
+	unlink(path);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheOpenFile
+// Description  : Create the cache file and set up its slots
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int cacheOpenFile(void) {
+	uint32_t i;
+
+	cacheSlots = cacheFileBytes / cacheSlotBytes;
+	if (cacheSlots == 0) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : file tier smaller than a slot");
+		return( -1 );
+	}
+	cacheFd = open(cachePath, O_RDWR | O_CREAT | (cacheDirect ? O_DIRECT : 0), 0600);
+	if ( (cacheFd == -1) && cacheDirect && (errno == EINVAL) ) {
+		logMessage(LOG_WARNING_LEVEL, "HDD_CACHE : [%s] does not support O_DIRECT, using buffered I/O", cachePath);
+		cacheFd = open(cachePath, O_RDWR | O_CREAT, 0600);
+	}
+	if ( (cacheFd == -1) || (ftruncate(cacheFd, (off_t)cacheSlots * cacheSlotBytes) == -1) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : cannot set up [%s] [%s]", cachePath, strerror(errno));
+		return( -1 );
+	}
+
+	if (cacheDirect) {
+		cacheBounce = aligned_alloc(HDD_CACHE_DIRECT_ALIGN, cacheSlotBytes);
+	} else if ( (cacheMap = mmap(NULL, (size_t)cacheSlots * cacheSlotBytes, PROT_READ | PROT_WRITE,
+								 MAP_SHARED, cacheFd, 0)) != MAP_FAILED ) {
+		cacheMapBytes = (size_t)cacheSlots * cacheSlotBytes;
+	} else {
+		cacheMap = NULL;
+		logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : cannot map [%s] [%s]", cachePath, strerror(errno));
+		return( -1 );
+	}
+	if ( (cacheSlotNext = malloc(cacheSlots * sizeof(uint32_t))) == NULL || (cacheDirect && (cacheBounce == NULL)) ) {
+		return( -1 );
+	}
+	for (i = 0; i < cacheSlots; i++) {
+		cacheSlotNext[i] = (i + 1 < cacheSlots) ? i + 1 : HDD_CACHE_NO_SLOT;
+	}
+	cacheSlotFree = 0;
+	cacheSlotsFree = cacheSlots;
+	cacheLoadIndex();
+	return( 0 );
+}
+
+// Close the cache file, the cache must be empty
+void cacheCloseFile(void) {
+	if (cacheMap != NULL) {
+		munmap(cacheMap, cacheMapBytes); // the slot size may have been reconfigured
+		cacheMap = NULL;
+	}
+	if (cacheFd != -1) {
+		close(cacheFd);
+		cacheFd = -1;
+	}
+	free(cacheBounce);
+	free(cacheSlotNext);
+	cacheBounce = NULL;
+	cacheSlotNext = NULL;
+	cacheSlots = cacheSlotsFree = 0;
+	cacheSlotFree = HDD_CACHE_NO_SLOT;
+}
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_configure
+// Description  : Enable the cache with the given parameters
+//
+// Inputs       : spec - "default" or a comma separated list of key=value
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_cache_configure( char *spec ) {
+	char *copy, *item, *save, *value;
+	double number;
+	int ret = 0;
+
+	if ( (copy = strdup(spec)) == NULL ) {
+		return( -1 );
+	}
+	for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		if (strcmp(item, "default") == 0) {
+			continue;
+		}
+		if ( ((value = strchr(item, '=')) == NULL) ) {
+			ret = -1;
+			break;
+		}
+		*value++ = '\0';
+		if (strcmp(item, "file") == 0) {
+			free(cachePath);
+			cachePath = strdup(value);
+		} else if ( (sscanf(value, "%lf", &number) != 1) || (number < 0) ) {
+			ret = -1;
+		} else if ( (strcmp(item, "ram") == 0) && (number >= 1) ) {
+			cacheRamBytes = number * 1024;
+		} else if ( (strcmp(item, "size") == 0) && (number > 0) ) {
+			cacheFileBytes = number * 1024 * 1024;
+		} else if ( (strcmp(item, "slot") == 0) && (number >= 4) && ((uint32_t)number % 4 == 0) ) {
+			cacheSlotBytes = (uint32_t)number * 1024; // whole pages, for O_DIRECT
+		} else if (strcmp(item, "admit") == 0) {
+			cacheAdmit = number;
+		} else if (strcmp(item, "direct") == 0) {
+			cacheDirect = (number != 0);
+		} else {
+			ret = -1;
+		}
+		if (ret == -1) {
+			break;
+		}
+	}
+	if (ret == -1) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_CACHE : bad cache parameter [%s] in [%s]", item, spec );
+	}
+	free(copy);
+	if (ret == -1) {
+		return( -1 );
+	}
+
+	// Set up the tiers
+	pthread_mutex_lock(&cacheLock);
+	if (cacheEnabled) {
+		pthread_mutex_unlock(&cacheLock);
+		hdd_cache_reset();
+		pthread_mutex_lock(&cacheLock);
+		cacheCloseFile();
+		cleanupHashTable(&cacheIndex);
+		cacheEnabled = 0;
+	}
+	initHashTable(&cacheIndex, HDD_CACHE_INDEX_BITS);
+	memset(cacheStats, 0x0, sizeof(cacheStats));
+	cachePromotions = cacheDemotions = cacheStale = cacheRestored = 0;
+	cacheExpired = cacheRenewed = cacheRevoked = 0;
+	cacheFsid = 0;
+	if ( (cachePath != NULL) && (cacheOpenFile() == -1) ) {
+		cacheCloseFile();
+		cleanupHashTable(&cacheIndex);
+		pthread_mutex_unlock(&cacheLock);
+		return( -1 );
+	}
+	cacheEnabled = 1;
+	pthread_mutex_unlock(&cacheLock);
+
+	if (cachePath == NULL) {
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_CACHE : RAM tier %llu KiB, no file tier", (unsigned long long)cacheRamBytes / 1024 );
+	} else {
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_CACHE : RAM tier %llu KiB, file tier [%s] %u slots of %u KiB (%s), admitted after %u accesses",
+					(unsigned long long)cacheRamBytes / 1024, cachePath, cacheSlots, cacheSlotBytes / 1024,
+					(cacheMap != NULL) ? "mapped" : "direct I/O", cacheAdmit );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_fits
+// Description  : Does the cache take a block of this size?
+//
+// Inputs       : size - the bytes of the block
+// Outputs      : 1 if it does, 0 if not (or the cache is off)
+
+int hdd_cache_fits( uint32_t size ) {
+	return( cacheEnabled && (size > 0) && (size <= cacheRamBytes / HDD_CACHE_MAX_FRACTION) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_read
+// Description  : Read a range of a cached block, from RAM or promoting it
+//                from the file tier. A copy whose lease ran out is kept but
+//                not served
+//
+// Inputs       : blockID - the block
+//                size - its size, a cached copy of another size is stale
+//                generation - its generation, a copy of another one is stale
+//                buf - the buffer to read into
+//                off, len - the range
+// Outputs      : 1 on a hit, 0 on a miss
+
+int hdd_cache_read( HddBlockID blockID, uint32_t size, uint32_t generation, void *buf, uint32_t off, uint32_t len ) {
+	HddCacheEntry *e;
+
+	if (!cacheEnabled) {
+		return( 0 );
+	}
+	pthread_mutex_lock(&cacheLock);
+	e = findValueInHashTable(&cacheIndex, blockID);
+	if ( (e != NULL) && (e->tier != HDD_CACHE_GHOST) && ((e->size != size) || (e->generation != generation)) ) {
+		cacheStale++;
+		cacheMakeGhost(e);
+	}
+	if ( (e == NULL) || (e->tier == HDD_CACHE_GHOST) ) {
+		cacheStats[HDD_CACHE_TIER_RAM].misses++;
+		if (cacheSlots > 0) {
+			cacheStats[HDD_CACHE_TIER_FILE].misses++;
+		}
+		pthread_mutex_unlock(&cacheLock);
+		return( 0 );
+	}
+	if ( (cacheLeaseMs > 0) && (e->expires <= cacheNow()) ) {
+		cacheExpired++; // hdd_cache_fetch asks the server if it is still current
+		pthread_mutex_unlock(&cacheLock);
+		return( 0 );
+	}
+
+	if (e->tier == HDD_CACHE_TIER_FILE) {
+		cacheStats[HDD_CACHE_TIER_RAM].misses++;
+		if (cachePromote(e) == -1) {
+			cacheStats[HDD_CACHE_TIER_FILE].misses++;
+			pthread_mutex_unlock(&cacheLock);
+			return( 0 );
+		}
+		cacheStats[HDD_CACHE_TIER_FILE].hits++;
+	} else {
+		cacheStats[HDD_CACHE_TIER_RAM].hits++;
+		cacheUnlink(e);
+		cachePush(e, HDD_CACHE_TIER_RAM);
+	}
+	e->refs++;
+	memcpy(buf, e->data + off, len);
+	pthread_mutex_unlock(&cacheLock);
+	return( 1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cacheStore
+// Description  : Put a copy of a block in the RAM tier, leased from when it
+//                was asked for unless it was invalidated since
+//
+// Inputs       : blockID - the block
+//                generation - the directory's generation of the contents
+//                version - the server's version of the contents
+//                start - when the request bringing it was sent
+//                since - the invalidation count then
+//                data - its contents
+//                size - its size
+// Outputs      : none
+
+void cacheStore( HddBlockID blockID, uint32_t generation, uint32_t version, double start, uint64_t since, void *data, uint32_t size ) {
+	HddCacheEntry *e;
+	char *copy;
+
+	if ( !hdd_cache_fits(size) || ((copy = malloc(size)) == NULL) ) {
+		return;
+	}
+	memcpy(copy, data, size);
+
+	pthread_mutex_lock(&cacheLock);
+	if ( (e = findValueInHashTable(&cacheIndex, blockID)) != NULL ) {
+		cacheMakeGhost(e); // replaced, an access more
+		cacheUnlink(e);
+	} else {
+		if ( (e = calloc(1, sizeof(HddCacheEntry))) == NULL ) {
+			pthread_mutex_unlock(&cacheLock);
+			free(copy);
+			return;
+		}
+		e->blockID = blockID;
+		insertValueInHashTable(&cacheIndex, blockID, e);
+	}
+	cacheRamReserve(size);
+	e->size = size;
+	e->generation = generation;
+	e->version = version;
+	e->expires = cacheRevokedSince(blockID, version, since) ? 0 : start + cacheLeaseMs;
+	e->data = copy;
+	e->slot = HDD_CACHE_NO_SLOT;
+	e->refs++;
+	cacheRamUsed += size;
+	cachePush(e, HDD_CACHE_TIER_RAM);
+	cacheStats[HDD_CACHE_TIER_RAM].inserts++;
+	pthread_mutex_unlock(&cacheLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_insert
+// Description  : Put a copy of a block in the RAM tier
+//
+// Inputs       : blockID - the block
+//                generation - the directory's generation of the contents
+//                version - the server's version of the contents, 0 if unknown
+//                data - its contents
+//                size - its size
+// Outputs      : none
+
+void hdd_cache_insert( HddBlockID blockID, uint32_t generation, uint32_t version, void *data, uint32_t size ) {
+	if (cacheEnabled) {
+		cacheStore(blockID, generation, version, cacheNow(), cacheRevokes, data, size);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_fetch
+// Description  : Read a range of a block through the cache: a hit is served
+//                locally, else the whole block is read from the server and
+//                cached. An expired copy is sent as a version to revalidate,
+//                the server answers without the block if it is unchanged
+//
+// Inputs       : blockID - the block
+//                size - its size
+//                generation - the directory's generation of the contents
+//                buf - the buffer to read into
+//                off, len - the range
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_cache_fetch( HddBlockID blockID, uint32_t size, uint32_t generation, void *buf, uint32_t off, uint32_t len ) {
+	HddCacheEntry *e;
+	HddRequest req;
+	uint64_t since;
+	uint32_t held;
+	double start;
+	char *block;
+
+	if (hdd_cache_read(blockID, size, generation, buf, off, len) == 1) {
+		return( 0 );
+	}
+	if ( (block = malloc(size)) == NULL ) {
+		return( -1 );
+	}
+	do {
+		pthread_mutex_lock(&cacheLock);
+		e = findValueInHashTable(&cacheIndex, blockID);
+		held = ( (cacheLeaseMs > 0) && (e != NULL) && (e->tier != HDD_CACHE_GHOST) &&
+				 (e->size == size) && (e->generation == generation) ) ? e->version : 0;
+		since = cacheRevokes;
+		pthread_mutex_unlock(&cacheLock);
+
+		memset(&req, 0x0, sizeof(req));
+		req.op = HDD_BLOCK_READ;
+		req.flags = HDD_NULL_FLAG;
+		req.blockID = blockID;
+		req.length = size;
+		req.version = held;
+		start = cacheNow();
+		if (hdd_client_request(&req, block) == -1) {
+			free(block);
+			return( -1 );
+		}
+		if ( (held != 0) && (req.length == 0) ) {
+			// Unchanged, lease the copy again unless it was invalidated meanwhile
+			pthread_mutex_lock(&cacheLock);
+			e = findValueInHashTable(&cacheIndex, blockID);
+			if ( (e != NULL) && (e->tier != HDD_CACHE_GHOST) && (e->version == held) && !cacheRevokedSince(blockID, held, since) ) {
+				e->expires = start + cacheLeaseMs;
+				cacheRenewed++;
+			}
+			pthread_mutex_unlock(&cacheLock);
+			if (hdd_cache_read(blockID, size, generation, buf, off, len) == 1) {
+				free(block);
+				return( 0 );
+			}
+		}
+	} while ( (held != 0) && (req.length == 0) ); // the copy went meanwhile, read the block
+
+	cacheStore(blockID, generation, req.version, start, since, block, size);
+	memcpy(buf, block + off, len);
+	free(block);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_write
+// Description  : Overwrite a range of a block on the server and apply it to
+//                the cached copy. With leases the copy's version goes with
+//                the write, a copy another client wrote meanwhile is dropped
+//
+// Inputs       : blockID - the block
+//                from - the directory's generation before the write
+//                to - its generation after the write
+//                data - the bytes to write
+//                off, len - the range
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_cache_write( HddBlockID blockID, uint32_t from, uint32_t to, void *data, uint32_t off, uint32_t len ) {
+	HddCacheEntry *e;
+	HddRequest req;
+	uint64_t since = 0;
+	uint32_t held = 0;
+	double start;
+	int ret;
+
+	memset(&req, 0x0, sizeof(req));
+	req.op = HDD_BLOCK_OVERWRITE;
+	req.flags = HDD_NULL_FLAG;
+	req.blockID = blockID;
+	req.offset = off;
+	req.length = len;
+	if (!cacheEnabled) {
+		return( hdd_client_request(&req, data) );
+	}
+
+	pthread_mutex_lock(&cacheLock);
+	if ( ((e = findValueInHashTable(&cacheIndex, blockID)) != NULL) && (e->tier != HDD_CACHE_GHOST) ) {
+		held = (cacheLeaseMs > 0) ? e->version : 0;
+		e->writing = 1; // the invalidation of this write may come back before its response
+	}
+	since = cacheRevokes;
+	pthread_mutex_unlock(&cacheLock);
+	req.version = held;
+	start = cacheNow();
+	ret = hdd_client_request(&req, data);
+
+	pthread_mutex_lock(&cacheLock);
+	if ( (e = findValueInHashTable(&cacheIndex, blockID)) != NULL ) {
+		e->writing = 0;
+		if (ret == -1) {
+			cacheForget(e); // the block is in an unknown state
+		} else if (e->tier != HDD_CACHE_GHOST) {
+			cacheStats[e->tier].updates++;
+			if ( (cacheLeaseMs > 0) && ((held == 0) || (req.version == 0) || cacheRevokedSince(blockID, req.version, since)) ) {
+				cacheStale++; // the copy had missed another write
+				cacheMakeGhost(e);
+			} else if ( (e->tier == HDD_CACHE_TIER_RAM) && (e->generation == from) && (off + len <= e->size) ) {
+				memcpy(e->data + off, data, len);
+				e->generation = to;
+				e->version = req.version;
+				e->expires = start + cacheLeaseMs;
+			} else {
+				cacheMakeGhost(e);
+			}
+		}
+	}
+	pthread_mutex_unlock(&cacheLock);
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_update
+// Description  : Apply a write to a cached block, the RAM copy is written
+//                through and a file copy is dropped
+//
+// Inputs       : blockID - the block
+//                from - the directory's generation before the write
+//                to - its generation after the write
+//                data - the bytes written
+//                off, len - the range written
+// Outputs      : none
+
+void hdd_cache_update( HddBlockID blockID, uint32_t from, uint32_t to, void *data, uint32_t off, uint32_t len ) {
+	HddCacheEntry *e;
+
+	if (!cacheEnabled) {
+		return;
+	}
+	pthread_mutex_lock(&cacheLock);
+	if ( ((e = findValueInHashTable(&cacheIndex, blockID)) != NULL) && (e->tier != HDD_CACHE_GHOST) ) {
+		cacheStats[e->tier].updates++;
+		if ( (e->tier == HDD_CACHE_TIER_RAM) && (e->generation == from) && (off + len <= e->size) ) {
+			memcpy(e->data + off, data, len);
+			e->generation = to;
+			e->expires = 0; // the version it now has is not known, ask before serving it again
+		} else {
+			cacheMakeGhost(e);
+		}
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_invalidate
+// Description  : Forget a block, its ID may be handed out again
+//
+// Inputs       : blockID - the block
+// Outputs      : none
+
+void hdd_cache_invalidate( HddBlockID blockID ) {
+	HddCacheEntry *e;
+
+	if (!cacheEnabled) {
+		return;
+	}
+	pthread_mutex_lock(&cacheLock);
+	if ( (e = findValueInHashTable(&cacheIndex, blockID)) != NULL ) {
+		cacheForget(e);
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_reset
+// Description  : Forget every block, the counters are kept
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_cache_reset( void ) {
+	if (!cacheEnabled) {
+		return;
+	}
+	pthread_mutex_lock(&cacheLock);
+	cacheForgetAll();
+	pthread_mutex_unlock(&cacheLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_revoke
+// Description  : Another client wrote a block (called from the invalidation
+//                channel), a copy of an older version is dropped. A copy
+//                this client is writing is left to hdd_cache_write
+//
+// Inputs       : blockID - the block, HDD_NO_BLOCK if the store was formatted
+//                version - its new version
+// Outputs      : none
+
+void hdd_cache_revoke( HddBlockID blockID, uint32_t version ) {
+	HddCacheEntry *e;
+
+	if (!cacheEnabled) {
+		return;
+	}
+	pthread_mutex_lock(&cacheLock);
+	cacheRevokeRing[cacheRevokes % HDD_CACHE_REVOKE_RING].blockID = blockID;
+	cacheRevokeRing[cacheRevokes % HDD_CACHE_REVOKE_RING].version = version;
+	cacheRevokes++;
+	if (blockID == HDD_NO_BLOCK) {
+		cacheForgetAll(); // block IDs start over
+	} else if ( ((e = findValueInHashTable(&cacheIndex, blockID)) != NULL) && (e->tier != HDD_CACHE_GHOST) &&
+				!e->writing && ((e->version == 0) || cacheOlder(e->version, version)) ) {
+		cacheRevoked++;
+		cacheMakeGhost(e);
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_coherence
+// Description  : Subscribe to the invalidations of the connection just made
+//                and lease copies for the term the server grants
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_cache_coherence( void ) {
+	uint32_t lease;
+
+	if (!cacheEnabled) {
+		return;
+	}
+	lease = hdd_client_coherence(hdd_cache_revoke);
+	pthread_mutex_lock(&cacheLock);
+	if ( (lease > 0) && (lease != cacheLeaseMs) ) {
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_CACHE : copies leased for %u ms, invalidated by other clients' writes", lease );
+	}
+	cacheLeaseMs = lease;
+	pthread_mutex_unlock(&cacheLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_mount
+// Description  : Keep the cached blocks only if they belong to the file system
+//                mounted, and retire the saved index now that slots are reused
+//
+// Inputs       : fsid - the ID of the mounted file system
+// Outputs      : none
+
+void hdd_cache_mount( uint64_t fsid ) {
+	char path[4096];
+
+	if (!cacheEnabled) {
+		return;
+	}
+	if (cacheFsid != fsid) {
+		hdd_cache_reset();
+		cacheFsid = fsid;
+	}
+	if (cachePath != NULL) {
+		cacheSavePath(path, sizeof(path));
+		unlink(path);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_save
+// Description  : Move the RAM blocks to the file tier and write its index
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_cache_save( void ) {
+	char path[4096], temp[4096 + 8];
+	HddCacheSaveHeader hdr = { .magic = HDD_CACHE_SAVE_MAGIC, .version = HDD_CACHE_SAVE_VERSION };
+	HddCacheSaveRecord rec;
+	HddCacheEntry *e;
+	uint32_t slot;
+	FILE *f;
+	int ok;
+
+	if ( !cacheEnabled || (cacheSlots == 0) || (cacheFsid == 0) ) {
+		return;
+	}
+	pthread_mutex_lock(&cacheLock);
+
+	// Least recently used first, so the most recent end up at the head
+	while ( (e = cacheList[HDD_CACHE_TIER_RAM].tail) != NULL ) {
+		if ( (slot = cacheFileStore(e)) == HDD_CACHE_NO_SLOT ) {
+			cacheMakeGhost(e);
+			continue;
+		}
+		cacheDropData(e);
+		cacheUnlink(e);
+		e->slot = slot;
+		cachePush(e, HDD_CACHE_TIER_FILE);
+	}
+	ok = (cacheMap != NULL) ? (msync(cacheMap, cacheMapBytes, MS_SYNC) == 0) : (fsync(cacheFd) == 0);
+
+	// The index is written aside and renamed over, a crash leaves none
+	hdr.fsid = cacheFsid;
+	hdr.slotBytes = cacheSlotBytes;
+	hdr.slots = cacheSlots;
+	hdr.count = cacheList[HDD_CACHE_TIER_FILE].count;
+	cacheSavePath(path, sizeof(path));
+	snprintf(temp, sizeof(temp), "%s.tmp", path);
+	if ( ok && ((f = fopen(temp, "w")) != NULL) ) {
+		ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1);
+		for (e = cacheList[HDD_CACHE_TIER_FILE].tail; ok && (e != NULL); e = e->prev) {
+			rec.blockID = e->blockID;
+			rec.size = e->size;
+			rec.generation = e->generation;
+			rec.refs = e->refs;
+			rec.version = e->version;
+			rec.checksum = e->checksum;
+			ok = (fwrite(&rec, sizeof(rec), 1, f) == 1);
+			for (slot = e->slot; ok && (slot != HDD_CACHE_NO_SLOT); slot = cacheSlotNext[slot]) {
+				ok = (fwrite(&slot, sizeof(slot), 1, f) == 1);
+			}
+		}
+		ok = (fclose(f) == 0) && ok && (rename(temp, path) == 0);
+	} else {
+		ok = 0;
+	}
+	if (ok) {
+		logMessage(LOG_OUTPUT_LEVEL, "HDD_CACHE : saved %llu blocks (%llu KiB) to [%s]", (unsigned long long)hdr.count,
+				   (unsigned long long)(cacheSlots - cacheSlotsFree) * cacheSlotBytes / 1024, path);
+	} else {
+		logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : cannot save the index [%s] [%s]", path, strerror(errno));
+		unlink(temp);
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_cache_report
+// Description  : Log the counters of each tier
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_cache_report( void ) {
+	static const char *tierName[HDD_CACHE_TIERS] = { "ram", "file" };
+	HddCacheTierStats *s;
+	uint64_t used[HDD_CACHE_TIERS];
+	int tier;
+
+	if (!cacheEnabled) {
+		return;
+	}
+	pthread_mutex_lock(&cacheLock);
+	used[HDD_CACHE_TIER_RAM] = cacheRamUsed;
+	used[HDD_CACHE_TIER_FILE] = (uint64_t)(cacheSlots - cacheSlotsFree) * cacheSlotBytes;
+	for (tier = 0; tier < HDD_CACHE_TIERS; tier++) {
+		if ( (tier == HDD_CACHE_TIER_FILE) && (cacheSlots == 0) ) {
+			continue;
+		}
+		s = &cacheStats[tier];
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_CACHE : %-4s %llu blocks in %llu KiB, %llu hits, %llu misses (%.1f%% hits), "
+					"%llu inserted, %llu rejected, %llu evicted, %llu updated", tierName[tier],
+					(unsigned long long)cacheList[tier].count, (unsigned long long)used[tier] / 1024,
+					(unsigned long long)s->hits, (unsigned long long)s->misses,
+					(s->hits + s->misses) ? 100.0 * s->hits / (s->hits + s->misses) : 0.0,
+					(unsigned long long)s->inserts, (unsigned long long)s->rejected,
+					(unsigned long long)s->evictions, (unsigned long long)s->updates );
+	}
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_CACHE : %llu promotions (file to ram), %llu demotions (ram to file), %llu ghosts, "
+				"%llu restored, %llu stale", (unsigned long long)cachePromotions, (unsigned long long)cacheDemotions,
+				(unsigned long long)cacheList[HDD_CACHE_GHOST].count, (unsigned long long)cacheRestored,
+				(unsigned long long)cacheStale );
+	if (cacheLeaseMs > 0) {
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_CACHE : %u ms leases, %llu expired, %llu renewed unchanged, %llu copies invalidated "
+					"by other clients", cacheLeaseMs, (unsigned long long)cacheExpired, (unsigned long long)cacheRenewed,
+					(unsigned long long)cacheRevoked );
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddCacheUnitTest
+// Description  : Perform a test of the cache tiers: blocks cycled through a
+//                small RAM tier must come back intact from RAM or the file,
+//                and only blocks seen twice may reach the file
+//
+// Inputs       : None
+// Outputs      : 0 if successful or -1 if failure
+
+int hddCacheUnitTest( void ) {
+	char path[] = "/tmp/hdd_cache_XXXXXX", spec[128], block[8192], out[8192];
+	uint32_t i, round, size, blocks = 24, warm = 0;
+	int fd, ret = 0;
+
+	// A RAM tier of 8 blocks in front of a file tier of 32 slots
+	if ( (fd = mkstemp(path)) == -1 ) {
+		return( -1 );
+	}
+	close(fd);
+	snprintf(spec, sizeof(spec), "ram=64,file=%s,size=1,slot=32,admit=2", path);
+	if (hdd_cache_configure(spec) == -1) {
+		unlink(path);
+		return( -1 );
+	}
+	hdd_cache_mount(42);
+
+	// Each round reads what the last wrote (its generation is the round)
+	for (round = 0; (round < 3) && (ret == 0); round++) {
+		for (i = 1; (i <= blocks) && (ret == 0); i++) {
+			size = 1000 + (i * 997) % 7000;
+			memset(block, (int)(i + round - 1), size); // written last round
+			if (hdd_cache_read(i, size, round, out, 0, size) == 1) {
+				if ( (round == 0) || (memcmp(out, block, size) != 0) ) {
+					logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : block %u wrong in round %u", i, round);
+					ret = -1;
+				}
+				memset(block, (int)(i + round), size);
+				hdd_cache_update(i, round, round + 1, block, 0, size);
+			} else {
+				memset(block, (int)(i + round), size);
+				hdd_cache_insert(i, round + 1, 0, block, size);
+			}
+			if ( (round == 0) && (cacheDemotions != 0) ) {
+				logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : block seen once admitted to the file");
+				ret = -1;
+			}
+		}
+	}
+	if ( (ret == 0) && ((cacheDemotions == 0) || (cachePromotions == 0)) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : no demotions or promotions");
+		ret = -1;
+	}
+	hdd_cache_report();
+
+	// Save, set the cache up again as a new process would and mount the same
+	// file system: every block comes back, but not at a newer generation
+	hdd_cache_save();
+	if ( (ret == 0) && (hdd_cache_configure(spec) == 0) ) {
+		hdd_cache_mount(42);
+		for (i = 1; i <= blocks; i++) {
+			size = 1000 + (i * 997) % 7000;
+			memset(block, (int)(i + round - 1), size);
+			if ( (hdd_cache_read(i, size, round, out, 0, size) == 1) && (memcmp(out, block, size) == 0) ) {
+				warm++;
+			}
+		}
+		if ( (warm != blocks) || (hdd_cache_read(1, 1000 + 997, round + 1, out, 0, 1) == 1) ) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : %u of %u blocks restored, or a stale one served", warm, blocks);
+			ret = -1;
+		}
+		hdd_cache_mount(43); // another file system
+		if (hdd_cache_read(2, 1000 + 2 * 997, round, out, 0, 1) == 1) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : block of another file system served");
+			ret = -1;
+		}
+	} else {
+		ret = -1;
+	}
+
+	// Leased copies: an invalidation past the copy's version drops it, an
+	// older one does not, and an expired copy is not served
+	cacheLeaseMs = 50;
+	memset(block, 7, 1000);
+	hdd_cache_insert(7, 1, 10, block, 1000);
+	hdd_cache_revoke(7, 9);
+	if ( (ret == 0) && (hdd_cache_read(7, 1000, 1, out, 0, 1000) == 0) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : copy dropped for an older version");
+		ret = -1;
+	}
+	hdd_cache_revoke(7, 11);
+	if ( (ret == 0) && (hdd_cache_read(7, 1000, 1, out, 0, 1000) == 1) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : invalidated copy served");
+		ret = -1;
+	}
+	hdd_cache_insert(7, 1, 12, block, 1000);
+	usleep(60 * 1000);
+	if ( (ret == 0) && (hdd_cache_read(7, 1000, 1, out, 0, 1000) == 1) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_CACHE : copy served past its lease");
+		ret = -1;
+	}
+	cacheLeaseMs = 0;
+
+	// Leave the cache off
+	hdd_cache_reset();
+	pthread_mutex_lock(&cacheLock);
+	cacheCloseFile();
+	cleanupHashTable(&cacheIndex);
+	cacheEnabled = 0;
+	pthread_mutex_unlock(&cacheLock);
+	free(cachePath);
+	cachePath = NULL;
+	unlink(path);
+	cacheRamBytes = (uint64_t)HDD_CACHE_RAM_KB * 1024;
+	cacheFileBytes = (uint64_t)HDD_CACHE_FILE_MB << 20;
+	cacheSlotBytes = HDD_CACHE_SLOT_KB * 1024;
+
+	if (ret == 0) {
+		logMessage(LOG_OUTPUT_LEVEL, "HDD_CACHE Unit Test: %u blocks cycled through both tiers, saved and restored, leases honored.", blocks);
+	}
+	return( ret );
+}
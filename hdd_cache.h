@@ -0,0 +1,119 @@
+#ifndef HDD_CACHE_INCLUDED
+#define HDD_CACHE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_cache.h
+//  Description    : This is the header file for the client block cache. Whole
+//                   blocks are kept in two tiers: RAM, and a large local file
+//                   (an SSD) that blocks evicted from RAM are demoted to if
+//                   they were seen at least "admit" times. A hit in the file
+//                   tier promotes the block back to RAM. Blocks that were
+//                   not admitted (or were evicted from the file) are
+//                   remembered as ghosts so a later access counts as seen
+//                   again. The file tier and its index are saved on
+//                   unmount and restored when the cache is set up; each
+//                   block carries the generation (mount session) of its
+//                   last write from the directory, so a copy written
+//                   over since is never served. When the server grants
+//                   leases, copies also carry the block's version and are
+//                   served only for the lease term or until the server
+//                   reports another client's write.
+//
+
+//
+
+// Include files
+#include <stdint.h>
+
+// Project include files
+#include <hdd_driver.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Defines
+#define HDD_CACHE_RAM_KB (64 * 1024)  // default RAM tier size
+#define HDD_CACHE_FILE_MB 1024        // default file tier size
+#define HDD_CACHE_SLOT_KB 16          // default file tier allocation unit
+#define HDD_CACHE_ADMIT 2             // default accesses before a block is admitted to the file
+#define HDD_CACHE_MAX_FRACTION 4      // largest cached block is this fraction of the RAM tier
+
+// These are the tiers
+typedef enum {
+	HDD_CACHE_TIER_RAM  = 0, // Block data in memory
+	HDD_CACHE_TIER_FILE = 1, // Block data in the cache file
+	HDD_CACHE_TIERS     = 2,
+	HDD_CACHE_GHOST     = 2, // Not cached, only its access count is remembered
+} HDD_CACHE_TIER_TYPES;
+
+//
+// Functional Prototypes
+
+int hdd_cache_configure( char *spec );
+	// Enable the cache, spec is "default" or a comma separated list of
+	// ram=<KiB>, file=<path>, size=<MiB>, slot=<KiB>, admit=<n>, direct=0|1
+	// (the file tier is only used with file=)
+
+int hdd_cache_fits( uint32_t size );
+	// 1 if the cache is enabled and takes blocks of size bytes
+
+int hdd_cache_read( HddBlockID blockID, uint32_t size, uint32_t generation, void *buf, uint32_t off, uint32_t len );
+	// Copy len bytes at off of a cached block of size bytes into buf, the
+	// copy must be of the generation the directory has, returns 1 on a hit,
+	// 0 on a miss
+
+void hdd_cache_insert( HddBlockID blockID, uint32_t generation, uint32_t version, void *data, uint32_t size );
+	// Cache (a copy of) the whole contents of a block just read or written,
+	// version is the one the server gave it (0 if unknown)
+
+int hdd_cache_fetch( HddBlockID blockID, uint32_t size, uint32_t generation, void *buf, uint32_t off, uint32_t len );
+	// Read len bytes at off of a block of size bytes through the cache,
+	// reading (or revalidating) the whole block on a miss, returns 0 if
+	// successful, -1 if failure
+
+int hdd_cache_write( HddBlockID blockID, uint32_t from, uint32_t to, void *data, uint32_t off, uint32_t len );
+	// Overwrite a range of the block on the device (v2) and in a cached
+	// copy of generation "from", which becomes "to", returns 0 if successful
+
+void hdd_cache_update( HddBlockID blockID, uint32_t from, uint32_t to, void *data, uint32_t off, uint32_t len );
+	// A range of the block was overwritten on the device, a copy of
+	// generation "from" is updated to generation "to", others are dropped
+
+void hdd_cache_invalidate( HddBlockID blockID );
+	// The block was deleted (or is in an unknown state), forget it
+
+void hdd_cache_reset( void );
+	// Drop every cached block (format)
+
+void hdd_cache_revoke( HddBlockID blockID, uint32_t version );
+	// Another client gave the block a new version, drop an older copy
+	// (HDD_NO_BLOCK drops them all)
+
+void hdd_cache_coherence( void );
+	// Called once connected: lease copies for the server's term and
+	// subscribe to its invalidations
+
+void hdd_cache_mount( uint64_t fsid );
+	// A file system was mounted, blocks cached (or restored from the cache
+	// file) for another one are dropped
+
+void hdd_cache_save( void );
+	// Move the RAM blocks to the cache file and write its index next to
+	// it, so the next process mounting the same file system starts warm
+
+void hdd_cache_report( void );
+	// Log the counters of each tier
+
+//
+// Unit testing for the module
+
+int hddCacheUnitTest( void );
+	// Perform a test of the cache tiers (leaves the cache disabled)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,6 +2,10 @@
 //
 //  File          : hdd_client.c
 //  Description   : This is the client side of the CRUD communication protocol.
+//                  The store may be copied on several servers (replicas):
+//                  writes and device requests go to every one of them,
+//                  reads to the least busy, and a read slower than most is
+//                  hedged with a second copy to another replica.
 //
 
 //
@@ -10,293 +14,1310 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
 
 // Project Include Files
 #include <hdd_network.h>
+#include <hdd_sched.h>
+#include <hdd_trace.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 #include <hdd_driver.h>
 
+// Defines
+#define HDD_CLIENT_LATENCY_SAMPLES 1024 // recent read latencies the hedge timeout is taken from
+#define HDD_CLIENT_LATENCY_MIN 32       // reads measured before any is hedged
+#define HDD_CLIENT_LATENCY_EVERY 64     // reads between updates of the hedge timeout
+#define HDD_CLIENT_DEPTH 4              // scheduled requests in flight per replica, the rest wait in the scheduler's order
 
-// Get BlockID from HddBitCmd
-int32_t getID(HddBitCmd command){
-	int32_t blockID;
-	command = command << 32; // shift left 32 bits to remove flags, block size, and op
-	command = command >> 32; // shift right 32 bits to make command lsb
-	blockID = command; 
-	
-	return blockID;
+// A request sent to one or more replicas: a read goes to one (and a hedged
+// copy to a second), everything else to all of them
+typedef struct HddClientSent {
+	HddRequest  req;        // the request, its response fields once answered
+	void       *buf;        // the caller's payload buffer, NULL once answered
+	HddRequest  resp;       // first response to a mirrored request
+	int         respFrom;   // replica that sent resp, -1 for none yet
+	int         mirrored;   // 1 if sent to every replica
+	int         pending;    // responses still to come
+	int         answered;   // 1 once req holds the answer
+	int         held;       // 1 until the caller has taken the answer
+	int         replica;    // replica a read was sent to first
+	int         hedged;     // 1 once a second copy of the read went out
+	double      sent;       // when it was first sent (ms)
+	double      made;       // when the caller sent it, for the wire trace (ms)
+	struct HddClientSent *next; // free list, or the pipelined requests in order
+} HddClientSent;
+
+// A connection to one server holding a copy of the store
+typedef struct {
+	char           *address;  // its IP, NULL for hdd_network_address
+	unsigned short  port;     // its port, 0 for hdd_network_port
+	int             fd;       // the connection, -1 if closed
+	int             protocol; // negotiated for the connection
+	int             diverged; // 1 once it answered a write unlike the others
+	uint32_t        sendTag;  // tag of the next v2 request
+	uint32_t        recvTag;  // tag of the next v2 response expected
+	HddClientSent **queue;    // requests waiting for its response, in order
+	uint32_t        head;     // index of the oldest in queue
+	uint32_t        count;    // requests in queue
+	uint32_t        capacity; // entries allocated for queue
+	uint64_t        reads;    // reads sent here first
+	uint64_t        hedges;   // hedged copies of reads sent here
+	uint64_t        wins;     // hedged copies answered before the first copy
+} HddClientReplica;
+
+HddClientReplica replicas[HDD_MAX_REPLICAS] = { { NULL, 0, -1 } }; // the first is the primary
+int replicaCount = 1;                  // replicas configured
+uint32_t nextReplica = 0;              // where the search for an idle replica starts
+pthread_mutex_t socketLock = PTHREAD_MUTEX_INITIALIZER; // the connections, one holder at a time
+int protocolVersion = HDD_PROTOCOL_V1; // negotiated for the current connection
+int protocolOffer = HDD_PROTOCOL_V2;   // highest version offered when connecting
+HddClientSent *freeSent = NULL;        // request records for reuse
+HddClientSent *sentFirst = NULL;       // requests sent with hdd_client_send_request, oldest
+HddClientSent *sentLast = NULL;        // and newest
+char *scratch = NULL;                  // payload of reads answered by another replica first
+uint64_t scratchSize = 0;              // bytes allocated for scratch
+double hedgePercentile = HDD_HEDGE_PERCENTILE; // hedge reads slower than this, 0 for never
+double hedgeAfterMs = 0;               // current hedge timeout, 0 until enough reads were measured
+double latency[HDD_CLIENT_LATENCY_SAMPLES]; // recent read latencies (ms)
+uint64_t latencyCount = 0;             // read latencies measured
+pthread_mutex_t schedLock = PTHREAD_MUTEX_INITIALIZER; // protects the scheduler queue
+pthread_cond_t schedDone = PTHREAD_COND_INITIALIZER;   // broadcast when dispatched requests complete
+HddSched clientSched;                  // block requests waiting for the connection
+int dispatching = 0;                   // 1 while a thread dispatches the queue
+HddSchedReq *inflight[HDD_SCHED_BATCH]; // scheduled requests sent and not yet completed
+HddClientSent *inflightSent[HDD_SCHED_BATCH]; // and their records
+int inflightCount = 0;                 // entries in inflight
+uint32_t leaseMs = 0;                  // lease term the server grants, 0 for none
+int callbackfd = -1;                   // the invalidation channel
+pthread_t callbackThread;              // reads the invalidation channel
+void (*invalidateBlock)(HddBlockID blockID, uint32_t version) = NULL; // called for each invalidation
+pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER; // the wire trace
+FILE *traceFile = NULL;                // wire trace being recorded, NULL for none
+int traceHash = 0;                     // 1 to hash the payloads
+double traceStart = 0;                 // when recording started (ms)
+uint64_t traceRecords = 0;             // requests recorded
+
+HddBitResp hdd_client_exchange(HddBitCmd cmd, void *buf);
+
+// Current time on the monotonic clock in ms
+double clientNow(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
 }
 
-// Get the operation code from HddBitCmd
-int getOpCode(uint64_t command){
-	int opCode; 
-	command = command >> 62;
-	opCode = command; 
-	return opCode; 
+// Connect a new socket to a replica, returns it or -1 on failure
+int openConnection(HddClientReplica *rep){
+	char *ip = (rep->address != NULL) ? rep->address : ((hdd_network_address != NULL) ? (char *)hdd_network_address : HDD_DEFAULT_IP);
+	unsigned short port = (rep->port != 0) ? rep->port : ((hdd_network_port != 0) ? hdd_network_port : HDD_DEFAULT_PORT);
+
+	return connectServer(ip, port);
 }
 
-int32_t getBlockSize(uint64_t command){
-	int blockSize; 
-	command = command << 2; // remove op code
-	command = command >> 38; // reove flags, r, and block ID
-	blockSize = command; 
-	return blockSize; 
+// Read invalidations until the channel closes, each is handed to the cache
+void *callbackReader(void *arg){
+	uint8_t hdr[HDD_V2_HEADER_SIZE];
+	HddRequest msg;
+	int32_t total;
+	int r;
+
+	while (1){
+		for (total = 0; total < HDD_V2_HEADER_SIZE; total = total + r){
+			r = read(callbackfd, hdr + total, HDD_V2_HEADER_SIZE - total);
+			if (r == -1 && errno == EINTR){
+				r = 0;
+			}
+			else if (r <= 0){
+				logMessage(LOG_INFO_LEVEL, "HDD_CLIENT : invalidation channel closed, cached copies last their lease");
+				return NULL;
+			}
+		}
+		if (hdd_v2_decode(hdr, &msg) == -1){
+			logMessage(LOG_ERROR_LEVEL, "HDD_CLIENT : bad invalidation message");
+			return NULL;
+		}
+		if (msg.flags == HDD_FORMAT){
+			invalidateBlock(HDD_NO_BLOCK, 0);
+		}
+		else{
+			invalidateBlock((HddBlockID)msg.blockID, msg.version);
+		}
+	}
+	return NULL;
 }
 
-int getFlag(HddBitCmd command){
-	command = command << 28;
-	command = command >> 61;
-	return command; 
+// Close the invalidation channel, if open
+void closeCallback(){
+	if (callbackfd == -1){
+		return;
+	}
+	shutdown(callbackfd, SHUT_RDWR); // wakes the reader
+	pthread_join(callbackThread, NULL);
+	close(callbackfd);
+	callbackfd = -1;
 }
 
-int getR(HddBitCmd command){
-	int result;
+// Does the v2 request carry a block payload to the server?
+int requestHasPayload(HddRequest *req){
+	return (req->flags == HDD_NULL_FLAG || req->flags == HDD_META_BLOCK) && (req->op == HDD_BLOCK_CREATE || req->op == HDD_BLOCK_OVERWRITE);
+}
 
-	command = command << 31; // shift left 31 bits to remove flags, block size and op
-	command = command >> 63; // shift right 63 to make command lsb  
-	result = command; 
-	
-	return result; // value of either 0 on success or 1 on failure 
+// Is the request a read, which any one replica can answer?
+int requestIsRead(HddRequest *req){
+	return (req->flags == HDD_NULL_FLAG || req->flags == HDD_META_BLOCK) && req->op == HDD_BLOCK_READ;
 }
 
-HddBitResp formatResponse(uint64_t op, uint64_t blockSize, uint64_t flags, uint64_t r, uint64_t blockID){
-	op = op << 62; 
-	blockSize = blockSize << 36;
-	flags = flags << 33; 
-	r = r << 32; 
-	HddBitResp response = op | blockSize | flags | r | blockID;
-	return response; 
+// Fill a v2 request from a v1 command
+void commandToRequest(HddBitCmd cmd, HddRequest *req){
+	memset(req, 0, sizeof(HddRequest));
+	req->op = getOpCode(cmd);
+	req->flags = getFlag(cmd);
+	req->blockID = (uint32_t)getID(cmd);
+	req->length = getBlockSize(cmd);
 }
 
-int socketfd = -1; 
+// FNV-1a of a payload
+uint32_t traceHashBytes(void *buf, uint64_t len){
+	uint8_t *p = buf;
+	uint32_t hash = 2166136261u;
+	uint64_t i;
+	for (i = 0; i < len; i++){
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+	return hash;
+}
 
-int initConnection(){
-	//uint32_t value; 
-	struct sockaddr_in caddr; 
-	char *ip = HDD_DEFAULT_IP;
+// Record a request and its response in the wire trace. The request's payload
+// is in buf for a create or overwrite, the response's for a read
+void traceRequest(HddRequest *req, HddRequest *resp, void *buf, double made){
+	HddWireRecord rec;
+	double now = clientNow();
 
-	caddr.sin_family = AF_INET;
-	caddr.sin_port = htons(19876); // DO WE USE DEFAULT PORT HERE? 
-	if ( inet_aton(ip, &caddr.sin_addr) == 0 ){
-		return -1;
+	memset(&rec, 0, sizeof(rec));
+	rec.start = (uint64_t)((made - traceStart) * 1000.0);
+	rec.latency = (uint32_t)((now - made) * 1000.0);
+	rec.cmd = formatResponse(req->op, req->length, req->flags, 0, req->blockID);
+	rec.resp = formatResponse(resp->op, resp->length, resp->flags, resp->result, resp->blockID);
+	rec.offset = req->offset;
+	rec.version = req->version;
+	rec.respVersion = resp->version;
+	if (traceHash && buf != NULL){
+		if (requestHasPayload(req)){
+			rec.hash = traceHashBytes(buf, req->length);
+		}
+		else if (requestIsRead(req) && resp->result == 0){
+			rec.hash = traceHashBytes(buf, resp->length);
+		}
 	}
-	socketfd = socket(PF_INET, SOCK_STREAM, 0);
-	// Error on socket creation 
-	if (socketfd == -1){
-		printf("Error on socket creation\n");
-		return -1;
+	pthread_mutex_lock(&traceLock);
+	if (traceFile != NULL){
+		if (fwrite(&rec, sizeof(rec), 1, traceFile) != 1){
+			logMessage(LOG_ERROR_LEVEL, "HDD_CLIENT : failed writing the wire trace, recording stopped");
+			fclose(traceFile);
+			traceFile = NULL;
+		}
+		else{
+			traceRecords++;
+		}
 	}
-	// Error on socket connect
-	int connection = connect(socketfd, (const struct sockaddr *)&caddr, sizeof(struct sockaddr));
-	if (connection == -1){
-		printf("Error on socket connect\n");
-		return -1;
+	pthread_mutex_unlock(&traceLock);
+}
+
+// Stop recording at exit, flushing what is buffered
+void traceStop(){
+	hdd_client_trace(NULL);
+}
+
+// Take a request record, from the free list if there is one
+HddClientSent *allocSent(){
+	HddClientSent *rec = freeSent;
+
+	if (rec != NULL){
+		freeSent = rec->next;
+	}
+	else if ((rec = malloc(sizeof(HddClientSent))) == NULL){
+		return NULL;
 	}
+	memset(rec, 0, sizeof(HddClientSent));
+	rec->respFrom = -1;
+	rec->replica = -1;
+	return rec;
+}
 
-	return 0; 
+// Give a record back once the caller took its answer and every response arrived
+void releaseSent(HddClientSent *rec){
+	if (!rec->held && rec->pending == 0){
+		rec->next = freeSent;
+		freeSent = rec;
+	}
+}
 
+// Finish a record, the caller's buffer is not written after this
+void answerSent(HddClientSent *rec, HddRequest *resp){
+	rec->req.result = resp->result;
+	rec->req.version = resp->version;
+	rec->req.blockID = resp->blockID;
+	rec->req.length = resp->length;
+	rec->answered = 1;
+	rec->buf = NULL;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : hdd_client_operation
-// Description  : This the client operation that sends a request to the CRUD
-//                server.   It will:
-//
-//                1) if INIT make a connection to the server
-//                2) send any request to the server, returning results
-//                3) if CLOSE, will close the connection
-//
-// Inputs       : cmd - the request opcode for the command
-//                buf - the block to be read/written from (READ/WRITE)
-// Outputs      : the response structure encoded as needed
-HddBitResp hdd_client_operation(HddBitCmd cmd, void *buf) {
-	HddBitResp fail = formatResponse(0,0,0,1,0);
-	int flag = getFlag(cmd); 
-	int op = getOpCode(cmd);
-	int32_t size = getBlockSize(cmd); 
-	// Convert value into network byte order to send
-	uint64_t value = htonll64(cmd);
-	HddBitResp response = 0; 
+// Finish a record as failed
+void failSent(HddClientSent *rec){
+	rec->req.result = 1;
+	rec->answered = 1;
+	rec->buf = NULL;
+}
 
-	if (flag == HDD_INIT){
-		int initial = initConnection();
-		printf("Initialize happened\n");
-		if (initial == -1){
-			return fail; 
+// Add a read latency, every HDD_CLIENT_LATENCY_EVERY reads the hedge timeout
+// is taken again at the percentile of the recent ones
+int compareLatency(const void *a, const void *b){
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+void sampleLatency(double ms){
+	double sorted[HDD_CLIENT_LATENCY_SAMPLES];
+	uint64_t n;
+
+	latency[latencyCount++ % HDD_CLIENT_LATENCY_SAMPLES] = ms;
+	if (latencyCount < HDD_CLIENT_LATENCY_MIN || (latencyCount != HDD_CLIENT_LATENCY_MIN && latencyCount % HDD_CLIENT_LATENCY_EVERY != 0)){
+		return;
+	}
+	n = (latencyCount < HDD_CLIENT_LATENCY_SAMPLES) ? latencyCount : HDD_CLIENT_LATENCY_SAMPLES;
+	memcpy(sorted, latency, n * sizeof(double));
+	qsort(sorted, n, sizeof(double), compareLatency);
+	hedgeAfterMs = sorted[(uint64_t)((n - 1) * hedgePercentile / 100.0)];
+}
+
+// The live replica with the fewest requests outstanding other than except,
+// -1 if there is none
+int pickReplica(int except){
+	int i, r, best = -1;
+
+	for (i = 0; i < replicaCount; i++){
+		r = (nextReplica + i) % replicaCount;
+		if (r != except && replicas[r].fd != -1 && (best == -1 || replicas[r].count < replicas[best].count)){
+			best = r;
 		}
 	}
+	nextReplica++;
+	return best;
+}
 
-	if (flag == HDD_INIT || flag == HDD_FORMAT || flag == HDD_SAVE_AND_CLOSE){
-		if(op == HDD_DEVICE){
-			// Send HddBitCmd and recieve HddBitResp
-			printf("HDD_DEVICE OP\n");
+// Send a request on a replica's connection and queue it for the response,
+// returns 0 on success, -1 on failure
+int sendOn(int i, HddClientSent *rec){
+	HddClientReplica *rep = &replicas[i];
+	uint8_t hdr[HDD_V2_HEADER_SIZE];
+	HddRequest req = rec->req;
+	HddClientSent **grown;
+	uint64_t value;
+	uint32_t k;
+	int32_t blen = requestHasPayload(&req) ? (int32_t)req.length : 0;
 
-			int w = write(socketfd, &value, sizeof(value)); // Send the data to server 
-			if (w != sizeof(value)){
-				int total = w;
-				while(total!= sizeof(value)){
-					int w = write(socketfd, &value + total, sizeof(value) - total);
-					total = total + w; 
-				} 
-			}
+	if (rep->count == rep->capacity){
+		grown = malloc((rep->capacity ? rep->capacity * 2 : 64) * sizeof(HddClientSent *));
+		if (grown == NULL){
+			return -1;
+		}
+		for (k = 0; k < rep->count; k++){
+			grown[k] = rep->queue[(rep->head + k) % rep->capacity];
+		}
+		free(rep->queue);
+		rep->queue = grown;
+		rep->head = 0;
+		rep->capacity = rep->capacity ? rep->capacity * 2 : 64;
+	}
+	if (protocolVersion == HDD_PROTOCOL_V2){
+		req.tag = rep->sendTag++;
+		req.result = 0;
+		hdd_v2_encode(&req, hdr);
+		if (sendParts(rep->fd, hdr, HDD_V2_HEADER_SIZE, rec->buf, blen) == -1){
+			return -1;
+		}
+	}
+	else{
+		value = htonll64(formatResponse(req.op, req.length, req.flags, 0, req.blockID));
+		if (sendParts(rep->fd, &value, sizeof(value), rec->buf, blen) == -1){
+			return -1;
+		}
+	}
+	rep->queue[(rep->head + rep->count) % rep->capacity] = rec;
+	rep->count++;
+	rec->pending++;
+	return 0;
+}
 
-			printf("Write passed\n");
+// Close a replica's connection, reads it still owed are sent to another
+// replica and mirrored requests complete with the others' responses
+void dropReplica(int i, char *why){
+	HddClientReplica *rep = &replicas[i];
+	HddClientSent *rec;
+	int j;
 
-			// DO WE NEED TO CHECK THAT OP TYPE MATCHES INITIAL OP TYPE? 
-			int r = read(socketfd, &value, sizeof(value)); // Receive data
-			if (r != sizeof(value)){
-				int total = r;
-				while(total!= sizeof(value)){
-					int w = read(socketfd, &value + total, sizeof(value) - total);
-					total = total + w; 
-				} 
+	if (rep->fd == -1){
+		return;
+	}
+	if (why != NULL){
+		logMessage(LOG_ERROR_LEVEL, "HDD_CLIENT : dropping replica %d, %s", i, why);
+	}
+	close(rep->fd);
+	rep->fd = -1;
+	rep->diverged = 0;
+	while (rep->count > 0){
+		rec = rep->queue[rep->head];
+		rep->head = (rep->head + 1) % rep->capacity;
+		rep->count--;
+		rec->pending--;
+		if (!rec->answered && rec->pending == 0){
+			if (rec->mirrored && rec->respFrom != -1){
+				answerSent(rec, &rec->resp);
+			}
+			else if (rec->mirrored || (j = pickReplica(i)) == -1 || sendOn(j, rec) == -1){
+				failSent(rec);
 			}
+			else{
+				rec->replica = j; // failed over, not a hedge
+			}
+		}
+		releaseSent(rec);
+	}
+}
 
-			printf("Read passed\n");
+// Take a mirrored request's response from replica i: the lowest numbered
+// replica answering is the reference, one that answered differently has
+// diverged (another client's writes reached only some replicas) and is dropped
+void mirroredResponse(HddClientSent *rec, int i, HddRequest *resp){
+	int other;
 
-			response = ntohll64(value); // Convert returned value to host byte order
+	if (rec->respFrom == -1){
+		rec->resp = *resp;
+		rec->respFrom = i;
+	}
+	else if (resp->result != rec->resp.result || resp->blockID != rec->resp.blockID || resp->version != rec->resp.version){
+		other = rec->respFrom;
+		if (i < other){
+			rec->resp = *resp;
+			rec->respFrom = i;
+			i = other;
+		}
+		replicas[i].diverged = 1;
+	}
+	if (rec->pending == 0){
+		answerSent(rec, &rec->resp);
+	}
+}
 
+// Receive the response to the oldest request queued on replica i, returns 0
+// on success, -1 if the connection failed
+int recvOn(int i){
+	HddClientReplica *rep = &replicas[i];
+	HddClientSent *rec = rep->queue[rep->head];
+	uint8_t hdr[HDD_V2_HEADER_SIZE];
+	HddRequest resp = rec->req;
+	uint64_t value;
+	void *into = rec->buf;
 
-			// Close the socket close(socketfh) and set it to -1 (on save and close request)
-			if (flag == HDD_SAVE_AND_CLOSE){
-				close(socketfd);
-				socketfd = -1; 
-				printf("SOCKET CLOSED\n");
+	if (rec->answered && requestIsRead(&rec->req)){
+		if (scratchSize < rec->req.length){
+			free(scratch);
+			if ((scratch = malloc(rec->req.length)) == NULL){
+				scratchSize = 0;
+				return -1;
+			}
+			scratchSize = rec->req.length;
+		}
+		into = scratch; // another replica answered first
+	}
+	if (protocolVersion == HDD_PROTOCOL_V2){
+		if (recvAll(rep->fd, hdr, HDD_V2_HEADER_SIZE) == -1){
+			return -1;
+		}
+		if (hdd_v2_decode(hdr, &resp) == -1 || resp.tag != rep->recvTag++){
+			logMessage(LOG_ERROR_LEVEL, "HDD_CLIENT : bad v2 response (tag %u)", resp.tag);
+			return -1;
+		}
+		if (requestIsRead(&rec->req) && resp.result == 0){
+			if (resp.length == 0 && rec->req.version != 0 && resp.version == rec->req.version){
+				// the cached copy is current, no payload follows
+			}
+			else if (resp.length != rec->req.length || recvAll(rep->fd, into, (int32_t)resp.length) == -1){
+				return -1;
 			}
+		}
+	}
+	else{
+		if (recvAll(rep->fd, &value, sizeof(value)) == -1){
+			return -1;
+		}
+		value = ntohll64(value);
+		if (requestIsRead(&rec->req) && recvAll(rep->fd, into, (int32_t)rec->req.length) == -1){
+			return -1;
+		}
+		resp.result = getR(value);
+		resp.blockID = (uint32_t)getID(value);
+		resp.length = getBlockSize(value);
+		resp.version = 0; // v1 has no versions
+	}
+	rep->head = (rep->head + 1) % rep->capacity;
+	rep->count--;
+	rec->pending--;
 
-			return response; // return response from server in host byte order
+	if (rec->mirrored){
+		mirroredResponse(rec, i, &resp);
+	}
+	else{
+		if (i == rec->replica && replicaCount > 1){
+			sampleLatency(clientNow() - rec->sent);
+		}
+		if (!rec->answered){
+			if (i != rec->replica){
+				rep->wins++;
+			}
+			answerSent(rec, &resp);
 		}
-		return fail; 
 	}
+	releaseSent(rec);
+	return 0;
+}
+
+// Send a request to the replicas it goes to, returns its record (which may
+// already be answered as failed), NULL if it could not be sent at all
+HddClientSent *submitSent(HddRequest *req, void *buf){
+	HddClientSent *rec;
+	int i;
+
+	if ((rec = allocSent()) == NULL){
+		return NULL;
+	}
+	rec->req = *req;
+	rec->buf = buf;
+	rec->held = 1;
+	rec->sent = (replicaCount > 1) ? clientNow() : 0; // only a replicated read can be hedged
+	rec->mirrored = !requestIsRead(req);
+	if (rec->mirrored){
+		for (i = 0; i < replicaCount; i++){
+			if (replicas[i].fd != -1 && sendOn(i, rec) == -1){
+				dropReplica(i, "failed sending a request");
+			}
+		}
+	}
+	else{
+		while ((i = pickReplica(-1)) != -1 && sendOn(i, rec) == -1){
+			dropReplica(i, "failed sending a request");
+		}
+		if (i != -1){
+			rec->replica = i;
+			replicas[i].reads++;
+		}
+	}
+	if (rec->pending == 0){
+		rec->held = 0;
+		releaseSent(rec);
+		return NULL;
+	}
+	return rec;
+}
+
+// Number of replicas connected
+int liveReplicas(){
+	int i, live = 0;
 
-	if (flag == HDD_NULL_FLAG || flag == HDD_META_BLOCK){
-		if (op == HDD_BLOCK_CREATE || op == HDD_BLOCK_OVERWRITE){
-			// Send HddBitCmd and bytes of block
-			// Receive HddBitResp
+	for (i = 0; i < replicaCount; i++){
+		live += (replicas[i].fd != -1);
+	}
+	return live;
+}
 
-			printf("OP IS CREATE OR OVERWRITE\n");
+// Milliseconds until the next read is due a hedged copy, -1 if none is
+int hedgeTimeout(double now){
+	HddClientReplica *rep;
+	HddClientSent *rec;
+	double due = -1;
+	uint32_t k;
+	int i;
 
-			int sizeWritten = write(socketfd, &value, sizeof(value));
-			if (sizeWritten != sizeof(value)){
-				int total = sizeWritten;
-				while(total!= sizeof(value)){
-					int w = write(socketfd, &value + total, sizeof(value) - total);
-					total = total + w; 
-				} 
+	if (hedgePercentile <= 0 || hedgeAfterMs <= 0 || liveReplicas() < 2){
+		return -1;
+	}
+	for (i = 0; i < replicaCount; i++){
+		rep = &replicas[i];
+		for (k = 0; k < rep->count; k++){
+			rec = rep->queue[(rep->head + k) % rep->capacity];
+			if (!rec->mirrored && !rec->answered && !rec->hedged && (due < 0 || rec->sent + hedgeAfterMs < due)){
+				due = rec->sent + hedgeAfterMs;
 			}
+		}
+	}
+	if (due < 0){
+		return -1;
+	}
+	return (due <= now) ? 0 : (int)(due - now) + 1; // poll counts whole ms
+}
 
-			int w2 = write(socketfd, buf, size); 
-			if (w2 != size){
-				int total = w2; 
-				while(total != size){
-					int w = write(socketfd, buf + total, size- total);
-					total= total + w; 
-				}
+// Send a second copy of every read waiting longer than the hedge timeout to
+// the least loaded other replica
+void hedgeReads(double now){
+	HddClientReplica *rep;
+	HddClientSent *rec;
+	uint32_t k;
+	int i, j;
+
+	for (i = 0; i < replicaCount; i++){
+		rep = &replicas[i];
+		for (k = 0; k < rep->count; k++){
+			rec = rep->queue[(rep->head + k) % rep->capacity];
+			if (rec->mirrored || rec->answered || rec->hedged || rec->sent + hedgeAfterMs > now){
+				continue;
+			}
+			rec->hedged = 1;
+			if ((j = pickReplica(i)) == -1){
+				continue;
 			}
+			if (sendOn(j, rec) == -1){
+				shutdown(replicas[j].fd, SHUT_RDWR); // dropped when it is next used
+				continue;
+			}
+			replicas[j].hedges++;
+		}
+	}
+}
 
-			printf("first 2 writes happened\n");
+// Receive the responses that are ready (waiting for at least one), reads
+// that are slow to answer are hedged on the way, returns -1 if nothing is
+// waiting for a response
+int pollReplicas(){
+	struct pollfd fds[HDD_MAX_REPLICAS];
+	int map[HDD_MAX_REPLICAS];
+	int i, n, ready, timeout;
 
-			int r = read(socketfd, &value, sizeof(value)); 
-			if (r != sizeof(value)){
-				printf("WHILE LOOOP HIT \n");
-				int totalRead = r; 
-				while(totalRead != sizeof(value)){
-					int w = read(socketfd, &value + totalRead, sizeof(value)- totalRead);
-					totalRead= totalRead + w; 
-				}
+	for (i = 0, n = 0; i < replicaCount; i++){
+		if (replicas[i].fd != -1 && replicas[i].count > 0){
+			fds[n].fd = replicas[i].fd;
+			fds[n].events = POLLIN;
+			fds[n].revents = 0;
+			map[n++] = i;
+		}
+	}
+	if (n == 0){
+		return -1;
+	}
+	timeout = hedgeTimeout(clientNow());
+	if (n == 1 && timeout == -1){
+		if (recvOn(map[0]) == -1){
+			dropReplica(map[0], "its connection failed");
+		}
+	}
+	else if ((ready = poll(fds, n, timeout)) == 0){
+		hedgeReads(clientNow());
+	}
+	else if (ready == -1 && errno != EINTR){
+		logMessage(LOG_ERROR_LEVEL, "HDD_CLIENT : poll failed [%s]", strerror(errno));
+		return -1;
+	}
+	else{
+		for (i = 0; i < n && ready > 0; i++){
+			if (fds[i].revents != 0 && replicas[map[i]].count > 0 && recvOn(map[i]) == -1){
+				dropReplica(map[i], "its connection failed");
 			}
+		}
+	}
+	for (i = 0; i < replicaCount; i++){
+		if (replicas[i].diverged){
+			dropReplica(i, "it answered a write unlike the others");
+		}
+	}
+	return 0;
+}
 
-			printf("READS happened\n");
+// Receive responses until the request is answered, returns 0 if the server
+// succeeded
+int waitSent(HddClientSent *rec){
+	while (!rec->answered){
+		if (pollReplicas() == -1){
+			failSent(rec);
+		}
+	}
+	return (rec->req.result == 0) ? 0 : -1;
+}
 
-			response = ntohll64(value); 
+// Copy the answer out to the caller's request and release the record
+void takeSent(HddClientSent *rec, HddRequest *req){
+	req->result = rec->req.result;
+	req->version = rec->req.version;
+	req->blockID = rec->req.blockID;
+	req->length = rec->req.length;
+	rec->held = 0;
+	releaseSent(rec);
+}
+
+// Connect to a replica and exchange the INIT, v2 is offered if allowed,
+// returns the server's response or a failure
+HddBitResp initReplica(int i, HddBitCmd cmd){
+	HddClientReplica *rep = &replicas[i];
+	uint64_t value;
 
-			printf("RETURN HAPPENED FOR CREATE/OVERWRITE\n");
-			return response; 
+	rep->protocol = HDD_PROTOCOL_V1;
+	rep->sendTag = rep->recvTag = 0;
+	rep->diverged = 0;
+	if ((rep->fd = openConnection(rep)) == -1){
+		return formatResponse(0,0,0,1,0);
+	}
+
+	// Offer v2 in the INIT, a v1 server echoes the block ID back unchanged
+	if (protocolOffer >= HDD_PROTOCOL_V2){
+		cmd = formatResponse(HDD_DEVICE, 0, HDD_INIT, 0, HDD_V2_HELLO);
+	}
+	value = htonll64(cmd);
+	if (sendParts(rep->fd, &value, sizeof(value), NULL, 0) == -1 || recvAll(rep->fd, &value, sizeof(value)) == -1){
+		logMessage(LOG_ERROR_LEVEL, "HDD_CLIENT : failed exchanging the INIT [%s]", strerror(errno));
+		dropReplica(i, NULL);
+		return formatResponse(0,0,0,1,0);
+	}
+	value = ntohll64(value);
+	if (getR(value) == 0 && getID(value) == HDD_V2_ACCEPT){
+		rep->protocol = HDD_PROTOCOL_V2;
+	}
+	return value;
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_send
+// Description  : Sends the request half of an exchange: the command and, for
+//                create and overwrite, the block. Several requests can be
+//                sent before their responses are received (pipelining), the
+//                caller must hold the connection (hdd_client_lock)
+//
+// Inputs       : cmd - the request opcode for the command
+//                buf - the block to be written (CREATE/OVERWRITE)
+// Outputs      : 0 if successful, -1 if failure
+int hdd_client_send(HddBitCmd cmd, void *buf) {
+	HddRequest req;
+
+	commandToRequest(cmd, &req);
+	return hdd_client_send_request(&req, buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_recv
+// Description  : Receives the response half of an exchange, responses arrive
+//                in the order the requests were sent. The caller must hold
+//                the connection (hdd_client_lock)
+//
+// Inputs       : cmd - the command this is the response to
+//                buf - the block to be read into (READ)
+// Outputs      : the response structure encoded as needed
+HddBitResp hdd_client_recv(HddBitCmd cmd, void *buf) {
+	HddRequest req;
+
+	commandToRequest(cmd, &req);
+	if (hdd_client_recv_request(&req, buf) == -1 && req.result == 0){
+		req.result = 1;
+	}
+	return formatResponse(req.op, req.length, req.flags, req.result, (uint32_t)req.blockID);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_send_request
+// Description  : Sends a request without waiting for its response, the
+//                caller must hold the connection. Against a v1 server only
+//                whole-block requests (offset 0, a v1 sized length) can be
+//                carried. A read goes to one replica, anything else to all
+//
+// Inputs       : req - the request
+//                buf - the bytes to be written (CREATE/OVERWRITE), or read
+//                      into (READ) when the response is received
+// Outputs      : 0 if successful, -1 if failure
+int hdd_client_send_request(HddRequest *req, void *buf) {
+	HddClientSent *rec;
+
+	if (protocolVersion != HDD_PROTOCOL_V2 && (req->offset != 0 || req->length > HDD_MAX_BLOCK_SIZE || req->blockID > UINT32_MAX)){
+		return -1; // a range or a large block needs v2
+	}
+	if ((rec = submitSent(req, buf)) == NULL){
+		return -1;
+	}
+	rec->made = (traceFile != NULL) ? clientNow() : 0;
+	rec->next = NULL;
+	if (sentLast != NULL){
+		sentLast->next = rec;
+	}
+	else{
+		sentFirst = rec;
+	}
+	sentLast = rec;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_recv_request
+// Description  : Receives the response to the oldest request sent, the
+//                caller must hold the connection
+//
+// Inputs       : req - the request, the response fields are filled in
+//                buf - the buffer to read into (READ)
+// Outputs      : 0 if the server succeeded, -1 if failure
+int hdd_client_recv_request(HddRequest *req, void *buf) {
+	HddClientSent *rec = sentFirst;
+	HddRequest sent = *req;
+	double made;
+
+	if (rec == NULL){
+		req->result = 1;
+		return -1;
+	}
+	if ((sentFirst = rec->next) == NULL){
+		sentLast = NULL;
+	}
+	made = rec->made;
+	waitSent(rec);
+	takeSent(rec, req);
+	if (traceFile != NULL && made > 0){
+		traceRequest(&sent, req, buf, made);
+	}
+	return (req->result == 0) ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_dispatch
+// Description  : One pass of the dispatcher, which holds socketLock and
+//                schedLock: send queued requests in the scheduler's order
+//                until HDD_CLIENT_DEPTH per replica (at most
+//                HDD_SCHED_BATCH) are in flight, then receive what
+//                answers next and complete those requests. A slow response
+//                holds back only its own request
+//
+// Inputs       : none
+// Outputs      : none
+void hdd_client_dispatch(void) {
+	HddClientSent *rec;
+	HddSchedReq *q;
+	int i;
+
+	while (inflightCount < HDD_SCHED_BATCH && inflightCount < HDD_CLIENT_DEPTH * liveReplicas() && (q = hdd_sched_peek(&clientSched)) != NULL){
+		hdd_sched_take(&clientSched, q);
+		pthread_mutex_unlock(&schedLock);
+		rec = submitSent(&q->req, q->buf);
+		pthread_mutex_lock(&schedLock);
+		if (rec == NULL){
+			logMessage(LOG_ERROR_LEVEL, "HDD_CLIENT : failed sending request [%s]", strerror(errno));
+			q->req.result = 1;
+			hdd_sched_complete(q);
+			continue;
 		}
+		inflight[inflightCount] = q;
+		inflightSent[inflightCount++] = rec;
+	}
 
-		if (op == HDD_BLOCK_READ){
-			// Send HddBitCmd
-			// Receive HddBitResp and bytes of block
-			int w = write(socketfd, &value, sizeof(value));
- 
-			if (w != sizeof(value)){
-				int totalWritten = w; 
-				while(totalWritten != sizeof(value)){
-					int w = write(socketfd, &value + totalWritten, sizeof(value)- totalWritten);
-					totalWritten= totalWritten + w; 
-				} 
-			}
+	pthread_mutex_unlock(&schedLock);
+	pollReplicas();
+	pthread_mutex_lock(&schedLock);
+	for (i = 0; i < inflightCount; ){
+		if (!inflightSent[i]->answered){
+			i++;
+			continue;
+		}
+		takeSent(inflightSent[i], &inflight[i]->req);
+		hdd_sched_complete(inflight[i]);
+		inflightCount--;
+		inflight[i] = inflight[inflightCount];
+		inflightSent[i] = inflightSent[inflightCount];
+	}
+	pthread_cond_broadcast(&schedDone);
+}
 
-			printf("OP IS READ, first write happened\n");
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_schedule
+// Description  : Queues a block request with the I/O scheduler and waits for
+//                its response. The first waiting thread that finds nobody
+//                dispatching takes the connections and keeps the queue
+//                flowing in the scheduler's order until its own request
+//                completes, then hands what is still queued or in flight
+//                to a waiting thread
+//
+// Inputs       : r - the request, the response fields are filled in
+// Outputs      : 0 if the server succeeded, -1 if failure
+int hdd_client_schedule(HddSchedReq *r) {
+	pthread_mutex_lock(&schedLock);
+	clientSched.merge = (protocolVersion == HDD_PROTOCOL_V2) ? HDD_SCHED_MERGE_RANGES : HDD_SCHED_MERGE_SAME;
+	if (hdd_sched_add(&clientSched, r) == -1){
+		pthread_mutex_unlock(&schedLock);
+		r->req.result = 1;
+		return -1;
+	}
+	while (!r->done){
+		if (dispatching){
+			pthread_cond_wait(&schedDone, &schedLock);
+			continue;
+		}
+		dispatching = 1;
+		pthread_mutex_unlock(&schedLock);
+		pthread_mutex_lock(&socketLock);
+		pthread_mutex_lock(&schedLock);
+		while (!r->done){
+			hdd_client_dispatch();
+		}
+		pthread_mutex_unlock(&socketLock);
+		dispatching = 0; // a waiting thread takes over what is still queued
+		pthread_cond_broadcast(&schedDone);
+	}
+	pthread_mutex_unlock(&schedLock);
+	return (r->req.result == 0) ? 0 : -1;
+}
 
-			int r = read(socketfd, &value, sizeof(value)); 
-			if (r != sizeof(value)){
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_device
+// Description  : Exchanges a device request (INIT, FORMAT, SAVE_AND_CLOSE)
+//                on the connection directly, they are not scheduled
+//
+// Inputs       : cmd - the request opcode for the command
+//                buf - unused, passed through
+// Outputs      : the response structure encoded as needed
+HddBitResp hdd_client_device(HddBitCmd cmd, void *buf) {
+	HddBitResp response;
 
-				int totalRead = r; 
-				while(totalRead != sizeof(value)){
-					int w = read(socketfd, &value + totalRead, sizeof(value)- totalRead);
-					totalRead= totalRead + w; 
-				}
-			}
+	pthread_mutex_lock(&socketLock);
+	response = hdd_client_exchange(cmd, buf);
+	if (getFlag(cmd) == HDD_SAVE_AND_CLOSE){
+		pthread_mutex_lock(&schedLock);
+		hdd_sched_report(&clientSched, "client");
+		pthread_mutex_unlock(&schedLock);
+		if (replicaCount > 1){
+			hdd_client_report();
+		}
+	}
+	pthread_mutex_unlock(&socketLock);
+	return response;
+}
 
-			int r2 = read(socketfd, buf, size);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_request
+// Description  : Exchanges a request on the shared connection. Against a v1
+//                server only whole-block requests (offset 0, a v1 sized
+//                length) can be carried
+//
+// Inputs       : req - the request, the response fields are filled in
+//                buf - the bytes to be read/written (READ/CREATE/OVERWRITE)
+// Outputs      : 0 if the server succeeded, -1 if failure
+int hdd_client_request(HddRequest *req, void *buf) {
+	double made = (traceFile != NULL) ? clientNow() : 0;
+	HddRequest sent = *req;
+	HddBitResp response;
+	HddSchedReq r;
+	int ret;
 
-			if (r2 != size){
-				int totalRead = r2; 
-				while(totalRead != size){
-					int w = read(socketfd, buf + totalRead, size-totalRead);
-	
-					totalRead= totalRead + w; 
-				}
-			}
-			
-			printf("OP IS READ, first 2 reads happened\n");
+	if (req->flags != HDD_NULL_FLAG && req->flags != HDD_META_BLOCK){
+		if (req->offset != 0 || req->length > HDD_MAX_BLOCK_SIZE || req->blockID > UINT32_MAX){
+			req->result = 1;
+			return -1;
+		}
+		response = hdd_client_device(formatResponse(req->op, req->length, req->flags, 0, req->blockID), buf);
+		req->result = getR(response);
+		req->blockID = (uint32_t)getID(response);
+		req->length = getBlockSize(response);
+		ret = (req->result == 0) ? 0 : -1;
+	}
+	else{
+		memset(&r, 0x0, sizeof(r));
+		r.req = *req;
+		r.buf = buf;
+		ret = hdd_client_schedule(&r);
+		*req = r.req;
+	}
+	if (made > 0){
+		traceRequest(&sent, req, buf, made);
+	}
+	return ret;
+}
 
-			response = ntohll64(value); 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_protocol
+// Description  : The protocol version negotiated for the current connection
+//
+// Inputs       : none
+// Outputs      : HDD_PROTOCOL_V1 or HDD_PROTOCOL_V2
+int hdd_client_protocol(void) {
+	return protocolVersion;
+}
 
-			printf("OP IS READ, response is returned \n");
-			return response; 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_set_protocol
+// Description  : Limit the protocol version offered on the next connection
+//
+// Inputs       : version - HDD_PROTOCOL_V1 or HDD_PROTOCOL_V2
+// Outputs      : none
+void hdd_client_set_protocol(int version) {
+	protocolOffer = version;
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_set_replicas
+// Description  : Add servers holding copies of the store: writes are
+//                mirrored to all of them (and the primary) and reads are
+//                spread across them, takes effect at the next INIT
+//
+// Inputs       : spec - comma separated list of [<ip>:]<port>, the IP
+//                       defaults to the primary's
+// Outputs      : 0 if successful, -1 if failure
+int hdd_client_set_replicas(char *spec) {
+	char *copy = strdup(spec), *item, *save = NULL, *colon;
+	unsigned int port;
 
+	for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)){
+		colon = strrchr(item, ':');
+		if (replicaCount == HDD_MAX_REPLICAS || sscanf(colon ? colon + 1 : item, "%u", &port) != 1 || port == 0 || port > 65535){
+			logMessage(LOG_ERROR_LEVEL, "HDD_CLIENT : bad replica [%s] (at most %d servers)", item, HDD_MAX_REPLICAS);
+			free(copy);
+			return -1;
 		}
+		memset(&replicas[replicaCount], 0, sizeof(HddClientReplica));
+		replicas[replicaCount].address = colon ? strndup(item, colon - item) : NULL;
+		replicas[replicaCount].port = (unsigned short)port;
+		replicas[replicaCount].fd = -1;
+		replicaCount++;
+	}
+	free(copy);
+	return 0;
+}
 
-		if (op == HDD_BLOCK_DELETE){
-			// Send HddBitCmd
-			// Receive HddBitResp
-			int w = write(socketfd, &value, sizeof(value)); // Send the data to server 
-			if (w != sizeof(value)){
-				int total = w;
-				while(total!= sizeof(value)){
-					int w = write(socketfd, &value + total, sizeof(value) - total);
-					total = total + w; 
-				} 
-			}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_set_hedge
+// Description  : Set when a read is hedged: once it has waited longer than
+//                the given percentile of recent read latencies, a second
+//                copy goes to another replica and the first answer is used.
+//                The latencies and counters start over
+//
+// Inputs       : percentile - 0 < percentile < 100, 0 to never hedge
+// Outputs      : none
+void hdd_client_set_hedge(double percentile) {
+	int i;
+
+	pthread_mutex_lock(&socketLock);
+	hedgePercentile = percentile;
+	hedgeAfterMs = 0;
+	latencyCount = 0;
+	for (i = 0; i < replicaCount; i++){
+		replicas[i].reads = replicas[i].hedges = replicas[i].wins = 0;
+	}
+	pthread_mutex_unlock(&socketLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_hedges
+// Description  : The hedging counters since the last hdd_client_set_hedge
+//
+// Inputs       : reads - set to the reads sent
+//                hedged - set to the second copies sent
+//                won - set to the second copies answered first
+// Outputs      : none
+void hdd_client_hedges(uint64_t *reads, uint64_t *hedged, uint64_t *won) {
+	int i;
+
+	*reads = *hedged = *won = 0;
+	pthread_mutex_lock(&socketLock);
+	for (i = 0; i < replicaCount; i++){
+		*reads += replicas[i].reads;
+		*hedged += replicas[i].hedges;
+		*won += replicas[i].wins;
+	}
+	pthread_mutex_unlock(&socketLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_report
+// Description  : Log the reads each replica served and the hedging counters
+//
+// Inputs       : none
+// Outputs      : none
+void hdd_client_report(void) {
+	int i;
+
+	for (i = 0; i < replicaCount; i++){
+		logMessage(LOG_INFO_LEVEL, "HDD_CLIENT : replica %d served %lu reads, %lu hedged copies (%lu answered first)", i,
+				   (unsigned long)replicas[i].reads, (unsigned long)replicas[i].hedges, (unsigned long)replicas[i].wins);
+	}
+	if (hedgePercentile > 0){
+		logMessage(LOG_INFO_LEVEL, "HDD_CLIENT : reads hedged after %.2f ms (p%g of the last %lu)", hedgeAfterMs, hedgePercentile,
+				   (unsigned long)((latencyCount < HDD_CLIENT_LATENCY_SAMPLES) ? latencyCount : HDD_CLIENT_LATENCY_SAMPLES));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_max_block_size
+// Description  : The largest block the current connection can carry
+//
+// Inputs       : none
+// Outputs      : the size in bytes
+int32_t hdd_client_max_block_size(void) {
+	return (protocolVersion == HDD_PROTOCOL_V2) ? HDD_V2_MAX_BLOCK_SIZE : HDD_MAX_BLOCK_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_coherence
+// Description  : Open the invalidation channel for the current connection
+//                (once), a thread reads it and calls invalidate for each
+//                block another client writes. Without the channel cached
+//                copies are still bounded by the lease term
+//
+// Inputs       : invalidate - called with the block and its new version,
+//                             HDD_NO_BLOCK and 0 when the store is formatted
+// Outputs      : the lease term in ms, 0 if the server grants none
+uint32_t hdd_client_coherence(void (*invalidate)(HddBlockID blockID, uint32_t version)) {
+	HddBitCmd cmd = formatResponse(HDD_DEVICE, 0, HDD_INIT, 0, HDD_V2_CALLBACK);
+	HddBitResp response;
+	uint32_t lease;
+
+	pthread_mutex_lock(&socketLock);
+	lease = leaseMs;
+	if (lease == 0 || callbackfd != -1){
+		pthread_mutex_unlock(&socketLock);
+		return lease;
+	}
+	invalidateBlock = invalidate;
+	if ((callbackfd = openConnection(&replicas[0])) == -1){
+		pthread_mutex_unlock(&socketLock);
+		return lease;
+	}
+	cmd = htonll64(cmd);
+	if (write(callbackfd, &cmd, sizeof(cmd)) != sizeof(cmd) || read(callbackfd, &response, sizeof(response)) != sizeof(response) ||
+		getR(ntohll64(response)) != 0 || pthread_create(&callbackThread, NULL, callbackReader, NULL) != 0){
+		logMessage(LOG_WARNING_LEVEL, "HDD_CLIENT : no invalidation channel, cached copies last their lease");
+		close(callbackfd);
+		callbackfd = -1;
+	}
+	pthread_mutex_unlock(&socketLock);
+	return lease;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_lock
+// Description  : Take the connection for a sequence of send/recv calls
+//
+// Inputs       : none
+// Outputs      : none
+void hdd_client_lock(void) {
+	pthread_mutex_lock(&socketLock);
+}
 
-			// DO WE NEED TO CHECK THAT OP TYPE MATCHES INITIAL OP TYPE? 
-			int r = read(socketfd, &value, sizeof(value)); // Receive data
-			if (r != sizeof(value)){
-				int total = r;
-				while(total!= sizeof(value)){
-					int w = read(socketfd, &value + total, sizeof(value) - total);
-					total = total + w; 
-				}  
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_unlock
+// Description  : Release the connection, every sent request must have had
+//                its response received
+//
+// Inputs       : none
+// Outputs      : none
+void hdd_client_unlock(void) {
+	pthread_mutex_unlock(&socketLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_exchange
+// Description  : This the client operation that sends a request to the CRUD
+//                server, the caller must hold socketLock.   It will:
+//
+//                1) if INIT make a connection to each replica
+//                2) send any request to the replicas, returning results
+//                3) if CLOSE, will close the connections
+//
+// Inputs       : cmd - the request opcode for the command
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response structure encoded as needed
+HddBitResp hdd_client_exchange(HddBitCmd cmd, void *buf) {
+	HddBitResp fail = formatResponse(0,0,0,1,0);
+	int flag = getFlag(cmd); 
+	int op = getOpCode(cmd);
+	HddBitResp response = 0; 
+	HddClientSent *rec;
+	HddRequest req;
+	int i;
+
+	if (flag == HDD_INIT){
+		for (i = 0; i < replicaCount; i++){ // a remount after an unclean shutdown, start over
+			dropReplica(i, NULL);
+		}
+		closeCallback();
+		leaseMs = 0;
+		protocolVersion = HDD_PROTOCOL_V1;
+		if (op != HDD_DEVICE){
+			return fail;
+		}
+
+		// Every replica must come up speaking the primary's protocol, the
+		// others are left out if they cannot
+		response = initReplica(0, cmd);
+		if (getR(response) != 0){
+			dropReplica(0, NULL);
+			return formatResponse(HDD_DEVICE, 0, HDD_INIT, 1, 0);
+		}
+		protocolVersion = replicas[0].protocol;
+		if (protocolVersion == HDD_PROTOCOL_V2){
+			leaseMs = getBlockSize(response); // the lease term rides in the size field
+		}
+		for (i = 1; i < replicaCount; i++){
+			if (getR(initReplica(i, cmd)) != 0 || replicas[i].protocol != protocolVersion){
+				logMessage(LOG_WARNING_LEVEL, "HDD_CLIENT : replica %d did not come up with the primary's protocol, left out", i);
+				dropReplica(i, NULL);
 			}
-			response = ntohll64(value); // Convert returned value to host byte order
-			return response; 
 		}
+		return formatResponse(HDD_DEVICE, 0, HDD_INIT, 0, 0);
+	}
 
-		return fail; // if the op is not delete, read, create or overwrite
+	if (flag == HDD_FORMAT || flag == HDD_SAVE_AND_CLOSE){
+		if (op != HDD_DEVICE){
+			return fail; 
+		}
 	}
+	else if (flag != HDD_NULL_FLAG && flag != HDD_META_BLOCK){
+		return fail; // unknown flag, the server would drop the connection
+	}
+
+	// Send the request (and bytes of block) to the replicas, receive the response (and bytes of block)
+	commandToRequest(cmd, &req);
+	if ((rec = submitSent(&req, buf)) == NULL){
+		logMessage(LOG_ERROR_LEVEL, "HDD_CLIENT : failed sending request [%s]", strerror(errno));
+		return fail;
+	}
+	waitSent(rec);
+	takeSent(rec, &req);
+	response = formatResponse(req.op, req.length, req.flags, req.result, (uint32_t)req.blockID);
 
+	// Close the connections (on save and close request), every earlier
+	// response has been received with this one
+	if (flag == HDD_SAVE_AND_CLOSE){
+		for (i = 0; i < replicaCount; i++){
+			dropReplica(i, NULL);
+		}
+		protocolVersion = HDD_PROTOCOL_V1;
+		closeCallback();
+		leaseMs = 0;
+	}
 
-    return fail; 
-}
\ No newline at end of file
+	return response; // return response from server in host byte order
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_operation
+// Description  : Sends a request to the server and waits for its response.
+//                Block requests from concurrent threads go through the I/O
+//                scheduler, device requests are exchanged directly
+//
+// Inputs       : cmd - the request opcode for the command
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response structure encoded as needed
+HddBitResp hdd_client_operation(HddBitCmd cmd, void *buf) {
+	double made = (traceFile != NULL) ? clientNow() : 0;
+	HddRequest sent, resp;
+	HddBitResp response;
+	HddSchedReq r;
+
+	if (getFlag(cmd) != HDD_NULL_FLAG && getFlag(cmd) != HDD_META_BLOCK){
+		response = hdd_client_device(cmd, buf);
+	}
+	else{
+		memset(&r, 0x0, sizeof(r));
+		commandToRequest(cmd, &r.req);
+		r.buf = buf;
+		hdd_client_schedule(&r);
+		response = formatResponse(r.req.op, r.req.length, r.req.flags, r.req.result, (uint32_t)r.req.blockID);
+	}
+	if (made > 0){
+		commandToRequest(cmd, &sent);
+		commandToRequest(response, &resp);
+		resp.result = getR(response);
+		traceRequest(&sent, &resp, buf, made);
+	}
+	return response;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_trace
+// Description  : Start recording every request made to the server, with its
+//                response and timing, in a wire trace (see hdd_trace.h), or
+//                stop recording. Recording stops at exit if it was not
+//                stopped before
+//
+// Inputs       : spec - "<file>" or "<file>,hash" to also hash the payloads,
+//                       NULL to stop
+// Outputs      : 0 if successful, -1 if failure
+int hdd_client_trace(char *spec) {
+	HddWireHeader hdr = { HDD_WIRE_MAGIC, HDD_WIRE_VERSION, 0, 0 };
+	static int registered = 0;
+	char path[1024], *comma;
+	FILE *file;
+
+	pthread_mutex_lock(&traceLock);
+	if (traceFile != NULL){
+		fclose(traceFile);
+		logMessage(LOG_INFO_LEVEL, "HDD_CLIENT : recorded %lu requests in the wire trace", (unsigned long)traceRecords);
+		traceFile = NULL;
+	}
+	pthread_mutex_unlock(&traceLock);
+	if (spec == NULL){
+		return 0;
+	}
+
+	strncpy(path, spec, sizeof(path) - 1);
+	path[sizeof(path) - 1] = '\0';
+	hdr.flags = 0;
+	if ((comma = strchr(path, ',')) != NULL){
+		if (strcmp(comma + 1, "hash") != 0){
+			logMessage(LOG_ERROR_LEVEL, "HDD_CLIENT : bad wire trace option [%s]", comma + 1);
+			return -1;
+		}
+		*comma = '\0';
+		hdr.flags = HDD_WIRE_HASHED;
+	}
+	if ((file = fopen(path, "wb")) == NULL || fwrite(&hdr, sizeof(hdr), 1, file) != 1){
+		logMessage(LOG_ERROR_LEVEL, "HDD_CLIENT : failed creating wire trace [%s]", path);
+		if (file != NULL){
+			fclose(file);
+		}
+		return -1;
+	}
+	pthread_mutex_lock(&traceLock);
+	traceHash = (hdr.flags & HDD_WIRE_HASHED) ? 1 : 0;
+	traceStart = clientNow();
+	traceRecords = 0;
+	traceFile = file;
+	pthread_mutex_unlock(&traceLock);
+	if (!registered){
+		atexit(traceStop);
+		registered = 1;
+	}
+	return 0;
+}
@@ -0,0 +1,243 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_coro_bench.cpp
+//  Description   : This is the benchmark driver for the C++ coroutine
+//                  interface (hdd_file.hpp). One thread runs a task per file
+//                  writer and many reader tasks per file against a live HDD
+//                  server, checks the data read back and reports the rate and
+//                  the heap allocations made per operation.
+//
+
+//
+
+// Include Files
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <unistd.h>
+#include <time.h>
+
+// Project Includes
+#include <hdd_file.hpp>
+extern "C" {
+#include <cmpsc311_log.h>
+}
+
+// Defines
+#define HDD_CORO_ARGUMENTS "hvf:c:n:"
+#define HDD_CORO_SLICE 256 // bytes per read
+#define USAGE \
+	"USAGE: hdd_coro_bench [-h] [-v] [-f <files>] [-c <readers>] [-n <reads>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -f - number of files (default 256)\n" \
+	"    -c - concurrent reader tasks per file (default 16)\n" \
+	"    -n - reads per reader task (default 8)\n" \
+	"\n" \
+
+//
+// Global Data
+static size_t allocations = 0; // calls to operator new
+
+void *operator new(size_t size) {
+	void *p;
+
+	allocations++;
+	if ( (p = malloc(size ? size : 1)) == nullptr ) {
+		throw std::bad_alloc();
+	}
+	return( p );
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_now_us
+// Description  : Get a monotonic timestamp in microseconds
+//
+// Inputs       : none
+// Outputs      : the timestamp
+
+static double bench_now_us( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return( (double)ts.tv_sec * 1000000.0 + (double)ts.tv_nsec / 1000.0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : slice_byte
+// Description  : The expected content of a file
+//
+// Inputs       : file - the file number
+//                pos - the position in the file
+// Outputs      : the byte
+
+static std::byte slice_byte( int file, uint32_t pos ) {
+	return( static_cast<std::byte>('a' + (file + pos / HDD_CORO_SLICE) % 26) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : create_file
+// Description  : Task opening file "n" and writing its content
+//
+// Inputs       : loop - the event loop
+//                files - where the open file is kept
+//                n - the file number
+//                size - the file size
+//                failed - incremented on failure
+// Outputs      : none
+
+static hdd::Task create_file( hdd::EventLoop &loop, std::vector<hdd::HddFile> &files, int n, uint32_t size, int &failed ) {
+	char name[MAX_FILENAME_LENGTH];
+	std::vector<std::byte> data(size);
+	uint32_t i;
+
+	snprintf( name, MAX_FILENAME_LENGTH, "coro-%d.txt", n );
+	hdd::HddFile f = co_await hdd::HddFile::open(loop, name);
+	for (i=0; i<size; i++) {
+		data[i] = slice_byte(n, i);
+	}
+	if ( !f || (co_await f.write(data, 0) != (int32_t)size) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_CORO_BENCH : creating [%s] failed.", name );
+		failed++;
+	}
+	files[n] = std::move(f);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_slices
+// Description  : Task reading slices of a file and checking them
+//
+// Inputs       : f - the open file
+//                n - the file number
+//                reader - the reader number, picks the first slice
+//                reads - the number of reads
+//                slices - the slices in the file
+//                failed - incremented on failure
+// Outputs      : none
+
+static hdd::Task read_slices( hdd::HddFile &f, int n, int reader, int reads, int slices, int &failed ) {
+	std::byte buf[HDD_CORO_SLICE];
+	uint32_t off;
+	int r;
+
+	for (r=0; r<reads; r++) {
+		off = (uint32_t)((reader + r) % slices) * HDD_CORO_SLICE;
+		if ( (co_await f.read(buf, off) != HDD_CORO_SLICE) || (buf[0] != slice_byte(n, off)) ||
+			 (buf[HDD_CORO_SLICE-1] != slice_byte(n, off)) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_CORO_BENCH : bad read of file %d at %u.", n, off );
+			failed++;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the coroutine benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+	// Local variables
+	int ch, i, c, nfiles = 256, readers = 16, reads = 8, failed = 0;
+	int slices = 16;
+	double start, elapsed;
+	size_t before, ops;
+
+	// Process the command line parameters
+	initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	while ((ch = getopt(argc, argv, HDD_CORO_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			enableLogLevels( LOG_INFO_LEVEL );
+			break;
+
+		case 'f': // Number of files
+			if ( (sscanf( optarg, "%d", &nfiles ) != 1) || (nfiles < 1) || (nfiles > MAX_HDD_FILEDESCR) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad file count [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'c': // Readers per file
+			if ( (sscanf( optarg, "%d", &readers ) != 1) || (readers < 1) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad reader count [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'n': // Reads per reader
+			if ( (sscanf( optarg, "%d", &reads ) != 1) || (reads < 1) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad read count [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	if ( hdd_format() || hdd_mount() ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_CORO_BENCH : format or mount failed." );
+		return( -1 );
+	}
+
+	{
+		hdd::EventLoop loop(1024);
+		std::vector<hdd::HddFile> files(nfiles);
+
+		// Create the files, one task each
+		start = bench_now_us();
+		for (i=0; i<nfiles; i++) {
+			loop.spawn(create_file(loop, files, i, slices * HDD_CORO_SLICE, failed));
+		}
+		loop.run();
+		elapsed = bench_now_us() - start;
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_CORO_BENCH create: %d files in %.0f us", nfiles, elapsed );
+
+		// Read them back with every reader in flight at once
+		before = allocations;
+		start = bench_now_us();
+		for (i=0; i<nfiles; i++) {
+			for (c=0; c<readers; c++) {
+				loop.spawn(read_slices(files[i], i, c, reads, slices, failed));
+			}
+		}
+		loop.run();
+		elapsed = bench_now_us() - start;
+		ops = (size_t)nfiles * readers * reads;
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_CORO_BENCH read: %d tasks, %zu ops in %.0f us, %.0f ops/s",
+				nfiles * readers, ops, elapsed, ops / (elapsed / 1000000.0) );
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_CORO_BENCH read: %zu allocations (%d task frames), %.3f per op beyond the frames",
+				allocations - before, nfiles * readers,
+				(double)(allocations - before - (size_t)nfiles * readers) / ops );
+	}
+
+	if ( hdd_unmount() || failed ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_CORO_BENCH : %d operations failed.", failed );
+		return( -1 );
+	}
+	return( 0 );
+}
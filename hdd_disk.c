@@ -0,0 +1,369 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_disk.c
+//  Description   : This is the mechanical disk model of the block server.
+//                  It keeps the head's track and the spindle's angle (from
+//                  the model clock) and charges each transfer for
+//
+//                    seek     - track to track time plus the rest of the
+//                               full stroke time scaled by the square root
+//                               of the distance
+//                    rotation - until the first byte comes under the head
+//                    transfer - the bytes at the media rate (trackBytes per
+//                               revolution) plus a track switch per track
+//                               boundary crossed
+//
+//                  on top of a fixed controller overhead, after any
+//                  earlier request has finished (one actuator, FIFO).
+//                  With stall= a random share of the requests is also
+//                  charged a fixed stall.
+//
+
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+// Project Include Files
+#include <hdd_driver.h>
+#include <hdd_disk.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define HDD_DISK_BUCKET_MS 0.1 // service time histogram resolution
+#define HDD_DISK_BUCKETS 2000  // histogram range (200 ms), longer ones count in the last
+
+//
+// Global Data
+HddDiskModel disk = {
+	.rpm = 7200,
+	.trackBytes = 1024 * 1024,
+	.tracks = 200000,
+	.seekTrackMs = 0.8,
+	.seekFullMs = 16.0,
+	.overheadMs = 0.1,
+	.sleep = 1,
+};
+int             diskEnabled = 0;
+pthread_mutex_t diskLock = PTHREAD_MUTEX_INITIALIZER;
+struct timespec diskEpoch;          // model time 0
+uint64_t        diskNext = 0;       // address of the next block placed
+uint64_t        diskHead = 0;       // track under the head
+double          diskBusy = 0;       // when the last request completes (ms)
+FILE           *diskLog = NULL;     // per request service times
+
+// Service time statistics
+uint64_t diskRequests = 0;
+double   diskQueue = 0, diskSeek = 0, diskRotation = 0, diskTransfer = 0, diskService = 0, diskMax = 0;
+uint64_t diskHistogram[HDD_DISK_BUCKETS];
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disk_now
+// Description  : Get the model clock
+//
+// Inputs       : none
+// Outputs      : milliseconds since the model was enabled
+
+double disk_now( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return( (ts.tv_sec - diskEpoch.tv_sec) * 1000.0 + (ts.tv_nsec - diskEpoch.tv_nsec) / 1000000.0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_disk_configure
+// Description  : Enable the model with the given parameters
+//
+// Inputs       : spec - "default" or a comma separated list of key=value
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_disk_configure( char *spec ) {
+	char *copy, *item, *save, *value;
+	double rate = 0, number;
+	int ret = 0;
+
+	if ( (copy = strdup(spec)) == NULL ) {
+		return( -1 );
+	}
+	for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		if (strcmp(item, "default") == 0) {
+			continue;
+		}
+		if ( ((value = strchr(item, '=')) == NULL) ) {
+			ret = -1;
+			break;
+		}
+		*value++ = '\0';
+		if (strcmp(item, "seek") == 0) {
+			ret = ( (sscanf(value, "%lf:%lf", &disk.seekTrackMs, &disk.seekFullMs) == 2) &&
+					(disk.seekTrackMs >= 0) && (disk.seekFullMs >= disk.seekTrackMs) ) ? 0 : -1;
+		} else if (strcmp(item, "stall") == 0) {
+			ret = ( (sscanf(value, "%lf:%lf", &disk.stallPct, &disk.stallMs) == 2) &&
+					(disk.stallPct >= 0) && (disk.stallPct <= 100) && (disk.stallMs >= 0) ) ? 0 : -1;
+		} else if ( (sscanf(value, "%lf", &number) != 1) || (number < 0) ) {
+			ret = -1;
+		} else if ( (strcmp(item, "rpm") == 0) && (number >= 1) ) {
+			disk.rpm = number;
+		} else if ( (strcmp(item, "track") == 0) && (number >= 1) ) {
+			disk.trackBytes = number * 1024;
+		} else if ( (strcmp(item, "rate") == 0) && (number > 0) ) {
+			rate = number;
+		} else if ( (strcmp(item, "tracks") == 0) && (number >= 1) ) {
+			disk.tracks = number;
+		} else if (strcmp(item, "overhead") == 0) {
+			disk.overheadMs = number;
+		} else if (strcmp(item, "sleep") == 0) {
+			disk.sleep = (number != 0);
+		} else {
+			ret = -1;
+		}
+		if (ret) {
+			break;
+		}
+	}
+	if (ret) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_DISK : bad model parameter [%s] in [%s]", item, spec );
+		free( copy );
+		return( -1 );
+	}
+	free( copy );
+
+	// A media rate sets the track size, a revolution carries one track
+	if (rate > 0) {
+		disk.trackBytes = (uint64_t)(rate * 1000000.0 * 60.0 / disk.rpm);
+	}
+	disk.trackBytes = (disk.trackBytes + HDD_DISK_SECTOR - 1) / HDD_DISK_SECTOR * HDD_DISK_SECTOR;
+
+	clock_gettime(CLOCK_MONOTONIC, &diskEpoch);
+	diskEnabled = 1;
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_DISK : %u rpm, %llu tracks of %llu KiB (%.1f MB/s), seek %.2f-%.2f ms, overhead %.2f ms%s",
+			disk.rpm, (unsigned long long)disk.tracks, (unsigned long long)disk.trackBytes / 1024,
+			disk.trackBytes * disk.rpm / 60.0 / 1000000.0, disk.seekTrackMs, disk.seekFullMs, disk.overheadMs,
+			disk.sleep ? "" : ", not sleeping" );
+	if (disk.stallPct > 0) {
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_DISK : %.2f%% of requests stall for %.1f ms", disk.stallPct, disk.stallMs );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_disk_enabled
+// Description  : Check whether the model is on
+//
+// Inputs       : none
+// Outputs      : 1 if enabled, 0 if not
+
+int hdd_disk_enabled( void ) {
+	return( diskEnabled );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_disk_open_log
+// Description  : Start the per request service time log
+//
+// Inputs       : path - the log file
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_disk_open_log( char *path ) {
+	if ( (diskLog = fopen(path, "w")) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_DISK : cannot write [%s] [%s]", path, strerror(errno) );
+		return( -1 );
+	}
+	fprintf( diskLog, "# start_ms op block offset length track queue_ms seek_ms rotation_ms transfer_ms service_ms\n" );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_disk_place
+// Description  : Place a new block after the last one, the first track is
+//                kept for the meta block; the disk wraps around when full
+//
+// Inputs       : size - bytes in the block
+// Outputs      : the disk address of the block
+
+uint64_t hdd_disk_place( uint64_t size ) {
+	uint64_t addr, capacity = disk.trackBytes * disk.tracks;
+
+	pthread_mutex_lock(&diskLock);
+	if ( (diskNext < disk.trackBytes) || (diskNext + size > capacity) ) {
+		diskNext = disk.trackBytes;
+	}
+	addr = diskNext;
+	diskNext += (size + HDD_DISK_SECTOR - 1) / HDD_DISK_SECTOR * HDD_DISK_SECTOR;
+	pthread_mutex_unlock(&diskLock);
+	return( addr );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_disk_reset
+// Description  : Start placing blocks from the beginning again
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_disk_reset( void ) {
+	pthread_mutex_lock(&diskLock);
+	diskNext = 0;
+	pthread_mutex_unlock(&diskLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_disk_access
+// Description  : Charge a transfer: it starts when the disk is free, seeks
+//                to the track, waits for the sector and reads or writes
+//
+// Inputs       : op - the HDD_OP_TYPES of the request
+//                blockID - the block (for the log)
+//                addr - the block's disk address
+//                offset - first byte transferred within the block
+//                length - bytes transferred
+// Outputs      : the completion time (ms on the model clock), 0 if the
+//                model is off
+
+double hdd_disk_access( int op, uint64_t blockID, uint64_t addr, uint64_t offset, uint64_t length ) {
+	static const char *names[] = { "CREATE", "READ", "OVERWRITE", "DELETE" };
+	double now, start, seek, rotation, transfer, period, angle, service;
+	uint64_t track, distance, first;
+	int bucket;
+
+	if ( !diskEnabled ) {
+		return( 0 );
+	}
+	period = 60000.0 / disk.rpm;
+	addr += offset;
+	track = (addr / disk.trackBytes) % disk.tracks;
+	first = addr % disk.trackBytes;
+
+	pthread_mutex_lock(&diskLock);
+	now = disk_now();
+	start = ( disk.sleep && (diskBusy > now) ) ? diskBusy : now; // without sleeping nothing ever waits for the disk
+
+	// Seek, then wait for the first sector to come around
+	distance = (track > diskHead) ? track - diskHead : diskHead - track;
+	seek = 0;
+	if (distance > 0) {
+		seek = disk.seekTrackMs;
+		if (disk.tracks > 2) {
+			seek += (disk.seekFullMs - disk.seekTrackMs) * sqrt((double)(distance - 1) / (disk.tracks - 2));
+		}
+	}
+	angle = fmod((start + disk.overheadMs + seek) / period, 1.0);
+	rotation = fmod((double)first / disk.trackBytes - angle + 1.0, 1.0) * period;
+
+	// Stream the bytes, switching track at each boundary
+	transfer = (double)length / disk.trackBytes * period;
+	if (length > 0) {
+		transfer += (double)((first + length - 1) / disk.trackBytes) * disk.seekTrackMs;
+		diskHead = ((addr + length - 1) / disk.trackBytes) % disk.tracks;
+	} else {
+		diskHead = track;
+	}
+	service = disk.overheadMs + seek + rotation + transfer;
+	if ( (disk.stallPct > 0) && (random() % 1000000 < disk.stallPct * 10000) ) {
+		service += disk.stallMs;
+	}
+	diskBusy = start + service;
+
+	// Account for it
+	diskRequests++;
+	diskQueue += start - now;
+	diskSeek += seek;
+	diskRotation += rotation;
+	diskTransfer += transfer;
+	diskService += service;
+	diskMax = (service > diskMax) ? service : diskMax;
+	bucket = (int)(service / HDD_DISK_BUCKET_MS);
+	diskHistogram[(bucket < HDD_DISK_BUCKETS) ? bucket : HDD_DISK_BUCKETS - 1]++;
+	if (diskLog != NULL) {
+		fprintf( diskLog, "%.3f %s %llu %llu %llu %llu %.3f %.3f %.3f %.3f %.3f\n", start,
+				 names[op & 0x3], (unsigned long long)blockID, (unsigned long long)offset, (unsigned long long)length,
+				 (unsigned long long)track, start - now, seek, rotation, transfer, service );
+	}
+	pthread_mutex_unlock(&diskLock);
+	return( start + service );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_disk_wait
+// Description  : Hold the caller until a modeled request completes
+//
+// Inputs       : done - the completion time from hdd_disk_access
+// Outputs      : none
+
+void hdd_disk_wait( double done ) {
+	struct timespec ts;
+	double ns;
+
+	if ( !diskEnabled || !disk.sleep || (done <= 0) ) {
+		return;
+	}
+	ns = diskEpoch.tv_nsec + done * 1000000.0;
+	ts.tv_sec = diskEpoch.tv_sec + (time_t)(ns / 1000000000.0);
+	ts.tv_nsec = (long)fmod(ns, 1000000000.0);
+	while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disk_percentile
+// Description  : Get a service time percentile from the histogram
+//
+// Inputs       : p - the percentile (0-1)
+// Outputs      : the upper edge of its bucket in ms
+
+double disk_percentile( double p ) {
+	uint64_t seen = 0, want = (uint64_t)ceil(p * diskRequests);
+	int b;
+
+	for (b=0; b<HDD_DISK_BUCKETS; b++) {
+		seen += diskHistogram[b];
+		if ( (seen >= want) && (seen > 0) ) {
+			break;
+		}
+	}
+	return( (b + 1) * HDD_DISK_BUCKET_MS );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_disk_report
+// Description  : Log what the requests cost and close the service time log
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_disk_report( void ) {
+	if ( !diskEnabled ) {
+		return;
+	}
+	pthread_mutex_lock(&diskLock);
+	if (diskRequests > 0) {
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_DISK : %llu requests, mean service %.3f ms (seek %.3f, rotation %.3f, transfer %.3f), "
+				"mean queue %.3f ms, p50 %.1f ms, p99 %.1f ms, max %.3f ms", (unsigned long long)diskRequests,
+				diskService / diskRequests, diskSeek / diskRequests, diskRotation / diskRequests,
+				diskTransfer / diskRequests, diskQueue / diskRequests, disk_percentile(0.5), disk_percentile(0.99), diskMax );
+	}
+	if (diskLog != NULL) {
+		fclose(diskLog);
+		diskLog = NULL;
+	}
+	pthread_mutex_unlock(&diskLock);
+}
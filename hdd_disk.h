@@ -0,0 +1,69 @@
+#ifndef HDD_DISK_INCLUDED
+#define HDD_DISK_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_disk.h
+//  Description    : This is the header file for the mechanical disk model of
+//                   the block server. Blocks are placed on tracks as they
+//                   are created, and each transfer is charged the seek of
+//                   the head to its track, the rotation until its first
+//                   byte passes under the head and the media transfer time.
+//                   Requests are served one at a time in arrival order.
+//                   Optionally a random few stall for much longer, the
+//                   retries and recalibrations behind a real disk's tail.
+//
+
+//
+
+// Include files
+#include <stdint.h>
+
+// Defines
+#define HDD_DISK_SECTOR 512 // placement granularity in bytes
+
+// The disk model parameters
+typedef struct {
+	uint32_t rpm;         // spindle speed
+	uint64_t trackBytes;  // bytes per track, with rpm this sets the transfer rate
+	uint64_t tracks;      // tracks across the stroke
+	double   seekTrackMs; // seek to the next track (also charged per track switch)
+	double   seekFullMs;  // seek across the whole stroke
+	double   overheadMs;  // controller time per request
+	double   stallPct;    // percent of requests that stall (a retry or recalibration)
+	double   stallMs;     // time a stall adds to the request
+	int      sleep;       // 1 to hold each response until its modeled completion,
+	                      // 0 to only log (requests then never queue)
+} HddDiskModel;
+
+//
+// Functional Prototypes
+
+int hdd_disk_configure( char *spec );
+	// Enable the model, spec is "default" or a comma separated list of
+	// rpm=, track=<KiB>, rate=<MB/s>, tracks=, seek=<track ms>:<full ms>,
+	// overhead=<ms>, stall=<percent>:<ms>, sleep=0|1
+
+int hdd_disk_enabled( void );
+	// 1 if the model is enabled
+
+int hdd_disk_open_log( char *path );
+	// Write a line per modeled request to path
+
+uint64_t hdd_disk_place( uint64_t size );
+	// Disk address of a new block of size bytes
+
+void hdd_disk_reset( void );
+	// Forget the placement of every block (format)
+
+double hdd_disk_access( int op, uint64_t blockID, uint64_t addr, uint64_t offset, uint64_t length );
+	// Charge a transfer of length bytes at addr + offset, returns when it
+	// completes (ms on the model clock)
+
+void hdd_disk_wait( double done );
+	// Sleep until a completion returned by hdd_disk_access (if sleeping is on)
+
+void hdd_disk_report( void );
+	// Log the service time summary and close the log
+
+#endif
@@ -12,6 +12,10 @@
 // Includes
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Defines
 #define HDD_MAX_BLOCK_SIZE 0xfffff
 #define HDD_NO_BLOCK 0
@@ -75,4 +79,8 @@ int g_extract_file_from_hdd(char *ex_file);
 int g_simulate_HDD( char *wload );
 
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
\ No newline at end of file
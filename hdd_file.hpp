@@ -0,0 +1,300 @@
+#ifndef HDD_FILE_HPP_INCLUDED
+#define HDD_FILE_HPP_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_file.hpp
+//  Description    : This is the header-only C++20 interface to the HDD
+//                   storage system. Files are move-only RAII handles whose
+//                   reads and writes are awaitables; an EventLoop runs the
+//                   coroutines on one thread over the asynchronous ring
+//                   (hdd_async.h). Each awaitable lives in the awaiting
+//                   coroutine's frame and is queued intrusively, so an
+//                   operation costs no heap allocation.
+//
+//                   hdd::EventLoop loop(1024);
+//                   loop.spawn([](hdd::EventLoop &loop) -> hdd::Task {
+//                       hdd::HddFile f = co_await hdd::HddFile::open(loop, "a.txt");
+//                       int32_t n = co_await f.read(std::span(buf), 0);
+//                   }(loop));
+//                   loop.run();
+//
+
+//
+
+// Include files
+#include <coroutine>
+#include <span>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+
+// Project include files
+#include <hdd_file_io.h>
+#include <hdd_async.h>
+
+namespace hdd {
+
+class EventLoop;
+class HddFile;
+
+//
+// Tasks
+
+// A detached coroutine started with EventLoop::spawn, its frame is freed when it returns
+class Task {
+public:
+	struct promise_type {
+		EventLoop *loop = nullptr; // set by spawn, told when the task finishes
+
+		Task get_return_object() noexcept { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+		~promise_type();
+	};
+
+	Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+	~Task() { if (handle) handle.destroy(); } // never spawned
+
+private:
+	friend class EventLoop;
+	explicit Task(std::coroutine_handle<promise_type> h) noexcept : handle(h) {}
+	std::coroutine_handle<promise_type> handle;
+};
+
+//
+// Operations
+
+// An operation awaiting a ring slot or a completion, it lives in the awaiting coroutine's frame.
+// Without a loop it is complete at once with result -1
+struct IoOp {
+	EventLoop               *loop;          // the loop running the request, nullptr if there is none
+	HddAsyncSqe              sqe{};         // the request, copied to the ring
+	std::coroutine_handle<>  waiter;        // resumed with the completion
+	IoOp                    *next = nullptr; // link in the loop's backlog while the ring is full
+	int32_t                  result = -1;   // the completion result
+
+	explicit IoOp(EventLoop &l) noexcept : loop(&l) {}
+	IoOp() noexcept : loop(nullptr) {}
+	IoOp(const IoOp &) = delete;
+	IoOp &operator=(const IoOp &) = delete;
+
+	bool await_ready() const noexcept { return loop == nullptr; }
+	void await_suspend(std::coroutine_handle<> h) noexcept;
+};
+
+// READ, WRITE and FLUSH, co_await gives the request result
+struct ResultOp : IoOp {
+	ResultOp(EventLoop &l, const HddAsyncSqe &request) noexcept : IoOp(l) { sqe = request; }
+	ResultOp() noexcept = default; // fails at once, for a file that is not open
+	int32_t await_resume() const noexcept { return result; }
+};
+
+// OPEN, co_await gives the file (not open if it failed)
+struct OpenOp : IoOp {
+	char path[MAX_FILENAME_LENGTH]; // the ring keeps a pointer until the request completes
+
+	OpenOp(EventLoop &l, const char *name) noexcept : IoOp(l) {
+		strncpy(path, name, MAX_FILENAME_LENGTH - 1);
+		path[MAX_FILENAME_LENGTH - 1] = '\0';
+		sqe.op = HDD_ASYNC_OPEN;
+	}
+	void await_suspend(std::coroutine_handle<> h) noexcept {
+		sqe.path = path; // the frame address is final once suspended
+		IoOp::await_suspend(h);
+	}
+	HddFile await_resume() noexcept;
+};
+
+//
+// Event loop
+
+// Runs coroutines on the calling thread, submitting their operations to one ring
+class EventLoop {
+public:
+	explicit EventLoop(uint32_t entries = 256) {
+		if (hdd_async_init(&ring, entries)) {
+			throw std::runtime_error("hdd_async_init failed");
+		}
+	}
+	~EventLoop() { hdd_async_exit(&ring); }
+	EventLoop(const EventLoop &) = delete;
+	EventLoop &operator=(const EventLoop &) = delete;
+
+	// Start a task, it runs until its first co_await
+	void spawn(Task task) {
+		std::coroutine_handle<Task::promise_type> h = std::exchange(task.handle, nullptr);
+		h.promise().loop = this;
+		live++;
+		h.resume();
+	}
+
+	// Run until every spawned task has returned
+	void run() {
+		HddAsyncCqe *cqe;
+
+		while (live > 0) {
+			fill();
+			if (inflight == 0) {
+				break; // every task waits on something other than the ring
+			}
+			hdd_async_submit(&ring);
+			if (hdd_async_wait_cqe(&ring, &cqe)) {
+				break;
+			}
+			do {
+				IoOp *op = reinterpret_cast<IoOp *>(static_cast<uintptr_t>(cqe->userData));
+				op->result = cqe->result;
+				hdd_async_cqe_seen(&ring, cqe);
+				inflight--;
+				op->waiter.resume(); // may queue more operations
+			} while (hdd_async_peek_cqe(&ring, &cqe) == 0);
+		}
+	}
+
+	// Number of tasks that have not returned
+	size_t tasks() const noexcept { return live; }
+
+private:
+	friend struct IoOp;
+	friend struct Task::promise_type;
+
+	// Queue an operation, behind the backlog if there is one
+	void submit(IoOp *op) noexcept {
+		op->next = nullptr;
+		if ( (backlogHead == nullptr) && post(op) ) {
+			return;
+		}
+		if (backlogTail) {
+			backlogTail->next = op;
+		} else {
+			backlogHead = op;
+		}
+		backlogTail = op;
+	}
+
+	// Copy an operation to a free ring slot, false if the ring is full
+	bool post(IoOp *op) noexcept {
+		HddAsyncSqe *sqe = hdd_async_get_sqe(&ring);
+		if (sqe == nullptr) {
+			return false;
+		}
+		*sqe = op->sqe;
+		sqe->userData = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(op));
+		inflight++;
+		return true;
+	}
+
+	// Move the backlog to the ring, in order, while there is room
+	void fill() noexcept {
+		while ( backlogHead && post(backlogHead) ) {
+			backlogHead = backlogHead->next;
+		}
+		if (backlogHead == nullptr) {
+			backlogTail = nullptr;
+		}
+	}
+
+	HddAsyncRing  ring;
+	IoOp         *backlogHead = nullptr; // operations waiting for a ring slot
+	IoOp         *backlogTail = nullptr;
+	size_t        inflight = 0;          // operations on the ring
+	size_t        live = 0;              // tasks not yet returned
+};
+
+inline Task::promise_type::~promise_type() {
+	if (loop) {
+		loop->live--;
+	}
+}
+
+inline void IoOp::await_suspend(std::coroutine_handle<> h) noexcept {
+	waiter = h;
+	loop->submit(this);
+}
+
+//
+// Files
+
+// An open file, closed when the handle is destroyed
+class HddFile {
+public:
+	HddFile() noexcept = default;
+	HddFile(EventLoop &l, int16_t handle) noexcept : loop(&l), fd(handle) {}
+	HddFile(HddFile &&other) noexcept : loop(other.loop), fd(std::exchange(other.fd, -1)) {}
+	HddFile &operator=(HddFile &&other) noexcept {
+		if (this != &other) {
+			close();
+			loop = other.loop;
+			fd = std::exchange(other.fd, -1);
+		}
+		return *this;
+	}
+	HddFile(const HddFile &) = delete;
+	HddFile &operator=(const HddFile &) = delete;
+	~HddFile() { close(); }
+
+	// Open (creating if needed) the file "name"
+	static OpenOp open(EventLoop &loop, const char *name) noexcept { return OpenOp(loop, name); }
+
+	// Read into "buf" from "offset", gives the bytes read or -1 (also if not open)
+	ResultOp read(std::span<std::byte> buf, uint32_t offset) noexcept {
+		HddAsyncSqe request{};
+		if (!is_open()) {
+			return ResultOp();
+		}
+		hdd_async_prep_read(&request, fd, buf.data(), static_cast<int32_t>(buf.size()), offset, 0);
+		return ResultOp(*loop, request);
+	}
+
+	// Write "buf" at "offset" (at most the file size), gives the bytes written or -1 (also if not open)
+	ResultOp write(std::span<const std::byte> buf, uint32_t offset) noexcept {
+		HddAsyncSqe request{};
+		if (!is_open()) {
+			return ResultOp();
+		}
+		hdd_async_prep_write(&request, fd, const_cast<std::byte *>(buf.data()), static_cast<int32_t>(buf.size()), offset, 0);
+		return ResultOp(*loop, request);
+	}
+
+	// Save the directory entry, gives 0 or -1 (also if not open)
+	ResultOp flush() noexcept {
+		HddAsyncSqe request{};
+		if (!is_open()) {
+			return ResultOp();
+		}
+		hdd_async_prep_flush(&request, fd, 0);
+		return ResultOp(*loop, request);
+	}
+
+	// Close now; operations on the file must have completed
+	void close() noexcept {
+		if (fd >= 0) {
+			hdd_close(fd);
+			fd = -1;
+		}
+	}
+
+	bool is_open() const noexcept { return fd >= 0; }
+	explicit operator bool() const noexcept { return fd >= 0; }
+	int16_t native_handle() const noexcept { return fd; }
+
+private:
+	EventLoop *loop = nullptr; // the loop running the file's operations
+	int16_t    fd = -1;        // the hdd_file_io handle, -1 if not open
+};
+
+inline HddFile OpenOp::await_resume() noexcept {
+	return (result < 0) ? HddFile() : HddFile(*loop, static_cast<int16_t>(result));
+}
+
+} // namespace hdd
+
+#endif
@@ -10,6 +10,9 @@
 // Includes
 #include <malloc.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 // Project Includes
 #include <hdd_file_io.h>
@@ -17,10 +20,16 @@
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 #include <hdd_network.h>
+#include <hdd_cache.h>
+#include <hdd_stripe.h>
+#include <hdd_async.h>
 
 // Defines
 #define CIO_UNIT_TEST_MAX_WRITE_SIZE 1024
 #define HDD_IO_UNIT_TEST_ITERATIONS 10240
+#define HDD_IO_UNIT_TEST_JOURNAL_KB 16
+#define HDD_IO_UNIT_TEST_PACK 1024 // packed file size of the packing test
+#define HDD_IO_UNIT_TEST_PACK_FILES 64
 
 
 // Type for UNIT test interface
@@ -40,17 +49,245 @@ char *cio_utest_buffer = NULL;  // Unit test buffer
 //
 // ----------------------- Implementation ---------------------------
 
-// Global Structure for Files 
-struct Files{
-	int open; //set to 1 if open 0 if closed
-	char name[128]; //file name
-	int16_t fileHandle; // stores the integer file handle 
-	HddBlockID blockID; // stores the block ID 
-	uint32_t seekLocation; // store the current seek position 
-	int exist; //1 if yes 0 if no
-	int32_t blockSize; 
-}file[1024]; // assume maximum number of file instances is 1024 
-
+// The file table is split in two. Inodes are the entries of the namespace
+// and are kept as a struct of arrays in chunks allocated as it grows, so an
+// inode never moves once created. Handles are the open instances of an
+// inode, so the same file can be open under several handles each with its
+// own seek position. Names live once in an append-only arena and the inodes
+// in memory are found through an open-addressed index on (directory, name).
+#define HDD_INODE_CHUNK_SHIFT 16
+#define HDD_INODE_CHUNK (1 << HDD_INODE_CHUNK_SHIFT) // inodes per chunk
+#define HDD_INODE_CHUNKS 256 // chunk directory size, keeps the arena under 4GB
+#define HDD_MAX_FILES (HDD_INODE_CHUNKS * HDD_INODE_CHUNK)
+#define HDD_NO_INODE 0xffffffff // inode of a closed handle
+#define HDD_FILE_LOCK_STRIPES 4096 // inode locks, inodes with equal low bits share one
+#define HDD_NAME_ARENA_MIN (64 * 1024)
+#define HDD_NAME_INDEX_MIN 1024
+
+// The hot fields of an inode, what every read and write looks at
+typedef struct {
+	HddBlockID blockID; // stores the block ID, 0 if the file is empty
+	int32_t blockSize; // file size
+} HddInode;
+
+typedef struct {
+	HddInode inode[HDD_INODE_CHUNK];
+	uint32_t hash[HDD_INODE_CHUNK]; // hash of (directory, name)
+	uint32_t name[HDD_INODE_CHUNK]; // offset of the name in the arena
+	uint32_t dir[HDD_INODE_CHUNK]; // directory holding the entry
+	uint32_t gen[HDD_INODE_CHUNK]; // mount session the file's block was last written in
+	uint32_t offset[HDD_INODE_CHUNK]; // packed files: where the file starts in its container, inline files: their data slot
+	uint8_t type[HDD_INODE_CHUNK]; // HDD_INODE_FILE, HDD_INODE_DIR, HDD_INODE_STRIPED, HDD_INODE_PACKED or HDD_INODE_INLINE
+	uint8_t dirty[HDD_INODE_CHUNK]; // 1 if changed since its leaf was written
+} HddInodeChunk;
+
+// An open handle
+typedef struct {
+	uint32_t ino; // the inode, HDD_NO_INODE if the handle is closed
+	uint32_t seekLocation; // store the current seek position
+} HddHandle;
+
+#define INODE_CHUNK(ino) (inodeChunk[(ino) >> HDD_INODE_CHUNK_SHIFT])
+#define INODE_SLOT(ino) ((ino) & (HDD_INODE_CHUNK - 1))
+#define INODE(ino) (INODE_CHUNK(ino)->inode[INODE_SLOT(ino)])
+#define INODE_HASH(ino) (INODE_CHUNK(ino)->hash[INODE_SLOT(ino)])
+#define INODE_NAME(ino) (nameArena + INODE_CHUNK(ino)->name[INODE_SLOT(ino)])
+#define INODE_DIR(ino) (INODE_CHUNK(ino)->dir[INODE_SLOT(ino)])
+#define INODE_TYPE(ino) (INODE_CHUNK(ino)->type[INODE_SLOT(ino)])
+#define INODE_DIRTY(ino) (INODE_CHUNK(ino)->dirty[INODE_SLOT(ino)])
+#define INODE_GEN(ino) (INODE_CHUNK(ino)->gen[INODE_SLOT(ino)])
+#define INODE_OFFSET(ino) (INODE_CHUNK(ino)->offset[INODE_SLOT(ino)])
+#define INODE_INLINE(ino) ((INODE_TYPE(ino) == HDD_INODE_INLINE) ? (uint32_t)INODE(ino).blockSize : 0) // bytes of data in its entry
+
+HddInodeChunk *inodeChunk[HDD_INODE_CHUNKS]; // allocated on first use, kept across mounts
+uint32_t inodeCount = 0; // inodes in memory (every entry once every leaf is read)
+char *nameArena = NULL; // NUL terminated names
+uint32_t nameArenaUsed = 0, nameArenaSize = 0;
+uint32_t *nameIndex = NULL; // inode + 1 in each used slot, 0 if empty
+uint32_t nameIndexSize = 0; // a power of two
+
+// Files of at most inlineMax bytes keep their data in their directory entry,
+// after the name in its leaf record and in its journal records, so they are
+// read and written without a block operation. In memory the data of each is
+// in a slot of chunks that never move, the slot is the inode's offset
+#define HDD_INLINE_MAX 1024 // largest inlineMax, keeps a record well under a node
+#define INLINE_DATA(slot) (inlineChunk[(slot) >> HDD_INODE_CHUNK_SHIFT][(slot) & (HDD_INODE_CHUNK - 1)])
+
+uint32_t inlineMax = 0; // files up to this size are inline, 0 for none
+char **inlineChunk[HDD_INODE_CHUNKS]; // allocated on first use, kept across mounts
+uint32_t inlineSlots = 0; // slots handed out, from 0
+uint32_t *inlineSpare = NULL; // released slots to hand out again
+uint32_t inlineSpareCount = 0, inlineSpareSize = 0;
+pthread_mutex_t inlineLock = PTHREAD_MUTEX_INITIALIZER; // guards the slots handed out
+
+HddHandle handle[MAX_HDD_FILEDESCR];
+int16_t handleFree[MAX_HDD_FILEDESCR]; // closed handles to hand out again
+int handleFreeCount = 0;
+int handleNext = 0; // handles from here up have never been used
+
+// The metablock only holds this superblock. The namespace is a B-tree of
+// fixed size node blocks keyed by (directory ID, name): leaves hold the
+// entries, interior nodes separator keys and the blocks of their children.
+// Nodes are read on first use and stay cached, so a lookup costs at most one
+// block read per level, and none once its path is cached.
+#define HDD_SUPERBLOCK_MAGIC 0x48444453 // "HDDS"
+#define HDD_SUPERBLOCK_VERSION 7
+#define HDD_BTREE_NODE_SIZE 16384 // bytes of a node block
+#define HDD_BTREE_MAX_DEPTH 16
+#define HDD_BTREE_NONE 0xffffffff // node not cached
+
+struct Superblock{
+	uint32_t magic; // HDD_SUPERBLOCK_MAGIC
+	uint32_t version; // HDD_SUPERBLOCK_VERSION
+	uint32_t fileCount; // entries, files and directories
+	uint32_t nextDir; // next directory ID to hand out
+	HddBlockID rootBlock; // block of the root node, 0 if never written
+	uint32_t height; // levels of the tree
+	uint32_t session; // mounts so far, the generation of blocks written in this one
+	uint32_t mounted; // 1 from mount to unmount, still 1 at mount if a client died
+	uint64_t fsid; // random at format and after an unclean unmount, client caches are for one fsid
+	HddBlockID journalBlock; // block of the journal, 0 if the file system has none
+	uint32_t journalSize; // bytes of the journal block
+	uint32_t journalEpoch; // records of other epochs in the journal are obsolete
+}superblock;
+
+// Changes to entries between directory saves are appended to the journal
+// block, so making them durable costs one small write instead of every
+// changed node and the superblock. A record is the state of one entry after
+// a change (replaying it creates or updates the entry), records are written
+// in groups by whichever thread commits first while the others wait for it.
+// When the journal is full the directory is saved with the next epoch and
+// the journal starts over. Mount replays the records of the current epoch
+// up to the first torn one
+#define HDD_JOURNAL_GROWTH 4096 // bytes the pending records grow by
+
+typedef struct {
+	uint32_t epoch; // superblock.journalEpoch when written
+	uint32_t seq; // records before it in the epoch
+	uint32_t check; // FNV-1a of the record (check 0) and its name
+	uint32_t dir; // directory holding the entry
+	uint8_t type; // HDD_INODE_FILE, HDD_INODE_DIR, HDD_INODE_STRIPED, HDD_INODE_PACKED or HDD_INODE_INLINE
+	uint8_t nameLength; // the name follows, then blockSize bytes of data if inline
+	HddBlockID blockID;
+	int32_t blockSize;
+	uint32_t generation;
+	uint32_t offset; // packed files: where the file starts in its container
+} __attribute__((packed)) HddJournalRecord;
+
+uint32_t journalKB = 0; // journal given to a file system formatted or mounted without one, 0 for none
+pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER; // guards the pending records and the commit state
+pthread_cond_t journalCommitted = PTHREAD_COND_INITIALIZER; // broadcast when a group is written
+char *journalPending = NULL, *journalSpare = NULL; // records logged since the last group was taken, and the buffer of the group being written
+uint32_t journalPendingBytes = 0, journalPendingSize = 0, journalSpareSize = 0;
+char *journalImage = NULL; // the journal block as written
+uint32_t journalTail = 0; // bytes of the current epoch in the journal
+uint32_t journalSeq = 0; // records of the current epoch
+uint64_t journalLogged = 0, journalDone = 0; // records logged, and of those written (or saved in the directory)
+int journalWriting = 0; // 1 while a thread writes a group
+int journalFailed = 0; // 1 once a group could not be written, changes are then saved at unmount only
+uint64_t journalGroups = 0, journalRecords = 0, journalCompactions = 0, journalBytes = 0;
+
+// A node block is this header followed by count records, each followed by
+// nameLength bytes of name (and the data of an inline file). Leaf records
+// are entries, interior records are separator keys with the child holding
+// the keys from there up
+typedef struct {
+	uint16_t leaf; // 1 for a leaf
+	uint16_t count; // records
+	HddBlockID child; // interior nodes: the leftmost child
+} __attribute__((packed)) HddBtreeHeader;
+
+typedef struct {
+	uint32_t dir; // directory holding the entry
+	uint8_t type; // HDD_INODE_FILE, HDD_INODE_DIR, HDD_INODE_STRIPED, HDD_INODE_PACKED or HDD_INODE_INLINE
+	uint8_t nameLength;
+	HddBlockID blockID;
+	int32_t blockSize;
+	uint32_t generation; // mount session the block was last written in
+	uint32_t offset; // packed files: where the file starts in its container
+} __attribute__((packed)) HddBtreeEntry;
+
+typedef struct {
+	uint32_t dir;
+	uint8_t nameLength;
+	HddBlockID child;
+} __attribute__((packed)) HddBtreeKey;
+
+// A cached node
+typedef struct {
+	HddBlockID block; // 0 until first written
+	uint8_t leaf; // 1 for a leaf
+	uint8_t dirty; // 1 if the block is out of date
+	uint32_t count; // entries or separator keys
+	uint32_t capacity; // allocated records
+	uint32_t bytes; // size of the records once written
+	uint32_t *ino; // leaves: the inode of each entry
+	uint32_t *keyDir, *keyName; // interior: separator keys, name as an arena offset
+	HddBlockID *childBlock; // interior: count + 1 children
+	uint32_t *childNode; // interior: cached node of each child, HDD_BTREE_NONE if not read
+} HddBtreeNode;
+
+// A path from the root to a position in a leaf
+typedef struct {
+	int depth; // levels on the path, the leaf is node[depth - 1]
+	uint32_t node[HDD_BTREE_MAX_DEPTH];
+	uint32_t index[HDD_BTREE_MAX_DEPTH]; // child taken, or position in the leaf
+} HddBtreeCursor;
+
+HddBtreeNode **btNode = NULL; // the cached nodes
+uint32_t btNodeCount = 0, btNodeSize = 0;
+uint32_t btRoot = HDD_BTREE_NONE;
+pthread_mutex_t dirLock = PTHREAD_MUTEX_INITIALIZER; // serializes namespace changes (open, close, mkdir...)
+
+pthread_rwlock_t fileLock[HDD_FILE_LOCK_STRIPES]; // serializes positional writers against readers of an inode
+pthread_once_t fileLockOnce = PTHREAD_ONCE_INIT;
+
+HDD_MOUNT_MODE mountMode = HDD_MOUNT_EAGER;
+
+// Files of at most packMax bytes are packed into shared container blocks,
+// so reading the small files of a directory costs one block read. Bytes are
+// only added to the container opened in this mount, whose image is kept in
+// memory: a file in it is rewritten in place when it stays within its size
+// or ends at the tail, any other write appends its new contents and leaves
+// the old ones dead. Closed containers never change, so the files of one
+// share its generation. A compactor thread moves the files of closed
+// containers mostly dead into the open one, in directory order, and
+// deletes them once the moves are durable
+#define HDD_PACK_BLOCK_SIZE (64 * 1024) // bytes of a container
+#define HDD_PACK_MAX_FILE (HDD_PACK_BLOCK_SIZE / 4) // largest packMax
+#define HDD_PACK_COMPACT_LIVE 50 // containers at most this percent live are compacted
+#define HDD_PACK_COMPACT_BATCH 16 // containers read and emptied by one pass
+
+// A container the compactor knows of
+typedef struct {
+	HddBlockID block;
+	uint32_t live; // bytes of files in it when last scanned
+	uint8_t scanned; // 1 if it existed when the scan started
+} HddPackContainer;
+
+// A packed file seen by a scan
+typedef struct {
+	HddBlockID block; // its container
+	uint32_t ino;
+	int32_t size;
+} HddPackRef;
+
+uint32_t packMax = 0; // files up to this size are packed, 0 for none
+pthread_mutex_t packLock = PTHREAD_MUTEX_INITIALIZER; // guards the open container, the known containers and the compactor state
+pthread_mutex_t packCompactLock = PTHREAD_MUTEX_INITIALIZER; // one compactor pass at a time
+pthread_cond_t packWake = PTHREAD_COND_INITIALIZER; // signalled when the compactor has work or must stop
+char packImage[HDD_PACK_BLOCK_SIZE]; // the open container as written
+HddBlockID packOpen = 0; // the open container, 0 if none
+uint32_t packTail = 0; // bytes of it used
+HddPackContainer *packTable = NULL; // containers created in this mount or seen by a scan
+uint32_t packTableCount = 0, packTableSize = 0;
+uint64_t packDead = 0; // bytes left dead since the compactor last ran
+pthread_t packThread;
+int packRunning = 0, packStop = 0, packKick = 0; // compactor started, told to stop, told to run
+pthread_mutex_t packReadLock = PTHREAD_MUTEX_INITIALIZER; // guards the last container read
+char packReadImage[HDD_PACK_BLOCK_SIZE]; // the last closed container read without the block cache
+HddBlockID packReadBlock = 0; // its block, 0 if none
+uint64_t packContainers = 0, packReads = 0, packMoved = 0, packFreed = 0, packReclaimed = 0;
 
 // ----------------------- HELPER FUNCTIONS ----------------------- 
 
@@ -175,455 +412,2632 @@ int32_t getBlockID(HddBitResp response){
 	return blockID;
 }
 
-int initialize = 0; // 0 if block has not been initialized 
-int metablockSize = 0; 
+// Hash a directory entry (FNV-1a over the directory ID and the name)
+uint32_t entryHash(uint32_t dir, char *name){
+	uint32_t hash = 2166136261u;
+	int k;
+	for (k = 0; k < 4; k++){
+		hash = hash ^ ((dir >> (8 * k)) & 0xff);
+		hash = hash * 16777619u;
+	}
+	while (*name != '\0'){
+		hash = hash ^ (uint8_t) *name;
+		hash = hash * 16777619u;
+		name++;
+	}
+	return hash;
+}
 
+// Get the first name index slot of a hash
+uint32_t hashIndexSlot(uint32_t hash){
+	return (uint32_t)((uint64_t)(hash * 2654435761u) * nameIndexSize >> 32);
+}
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : hdd_format
-// Description  : ????
-//
-// Inputs       : ????
-// Outputs      : ????
-//
-uint16_t hdd_format(void) {
-	if ( initialize == 0 ){ // if the block has not yet been initialized 
-		HddBitCmd initc = set_hdd_initialize_command();
-		HddBitResp initr = hdd_client_operation(initc, NULL);
-		int res = getResult(initr);
+// Order two keys by directory, then by name
+int keyCompare(uint32_t dirA, char *nameA, uint32_t dirB, char *nameB){
+	if (dirA != dirB){
+		return (dirA < dirB) ? -1 : 1;
+	}
+	return strcmp(nameA, nameB);
+}
 
-		if (res == 1){ // if hdd_client_operation failed, return failure
+// Get the directory of key i of a node
+uint32_t nodeKeyDir(HddBtreeNode *node, uint32_t i){
+	return node->leaf ? INODE_DIR(node->ino[i]) : node->keyDir[i];
+}
+
+// Get the name of key i of a node
+char *nodeKeyName(HddBtreeNode *node, uint32_t i){
+	return node->leaf ? INODE_NAME(node->ino[i]) : nameArena + node->keyName[i];
+}
+
+// Get the bytes record i of a node takes in its block
+uint32_t nodeRecordSize(HddBtreeNode *node, uint32_t i){
+	if (node->leaf){
+		return sizeof(HddBtreeEntry) + strlen(INODE_NAME(node->ino[i])) + INODE_INLINE(node->ino[i]);
+	}
+	return sizeof(HddBtreeKey) + strlen(nameArena + node->keyName[i]);
+}
+
+// Drop every cached node
+void resetBtree(){
+	uint32_t n;
+	for (n = 0; n < btNodeCount; n++){
+		free(btNode[n]->ino);
+		free(btNode[n]->keyDir);
+		free(btNode[n]->keyName);
+		free(btNode[n]->childBlock);
+		free(btNode[n]->childNode);
+		free(btNode[n]);
+	}
+	btNodeCount = 0;
+	btRoot = HDD_BTREE_NONE;
+}
+
+// Close every handle and forget every inode and node, the chunks, arena and
+// index are kept for the next mount
+void resetDirectory(){
+	int k; 
+	for (k = 0; k < MAX_HDD_FILEDESCR; k++){
+		handle[k].ino = HDD_NO_INODE;
+		handle[k].seekLocation = 0;
+	}
+	handleFreeCount = 0;
+	handleNext = 0;
+	inodeCount = 0;
+	for (k = 0; k < (int)inlineSlots; k++){
+		free(INLINE_DATA(k));
+	}
+	inlineSlots = 0;
+	inlineSpareCount = 0;
+	nameArenaUsed = 0;
+	if (nameIndex != NULL){
+		memset(nameIndex, 0x0, nameIndexSize * sizeof(uint32_t));
+	}
+	resetBtree();
+}
+
+// Put an inode in the name index
+void indexInode(uint32_t ino){
+	uint32_t slot = hashIndexSlot(INODE_HASH(ino));
+	while (nameIndex[slot] != 0){
+		slot = (slot + 1) & (nameIndexSize - 1);
+	}
+	nameIndex[slot] = ino + 1;
+}
+
+// Double the name index and put every inode back in it
+int growNameIndex(){
+	uint32_t size = (nameIndexSize == 0) ? HDD_NAME_INDEX_MIN : nameIndexSize * 2;
+	uint32_t *index = calloc(size, sizeof(uint32_t));
+	uint32_t ino;
+	if (index == NULL){
+		return -1;
+	}
+	free(nameIndex);
+	nameIndex = index;
+	nameIndexSize = size;
+	for (ino = 0; ino < inodeCount; ino++){
+		indexInode(ino);
+	}
+	return 0;
+}
+
+// Look up an entry among the inodes in memory, returns the inode or HDD_NO_INODE
+uint32_t findInode(uint32_t dir, char *name, uint32_t hash){
+	uint32_t slot, ino;
+	if (nameIndexSize == 0){
+		return HDD_NO_INODE;
+	}
+	for (slot = hashIndexSlot(hash); nameIndex[slot] != 0; slot = (slot + 1) & (nameIndexSize - 1)){
+		ino = nameIndex[slot] - 1;
+		if (INODE_HASH(ino) == hash && INODE_DIR(ino) == dir && strcmp(INODE_NAME(ino), name) == 0){
+			return ino;
+		}
+	}
+	return HDD_NO_INODE;
+}
+
+// Copy a name into the arena, returns its offset or -1 if out of memory
+int64_t addName(char *name, uint32_t length){
+	uint32_t size, offset;
+	char *arena;
+
+	if (nameArenaUsed + length + 1 > nameArenaSize){
+		for (size = (nameArenaSize == 0) ? HDD_NAME_ARENA_MIN : nameArenaSize; nameArenaUsed + length + 1 > size; size = size * 2);
+		if ((arena = realloc(nameArena, size)) == NULL){
 			return -1;
 		}
+		nameArena = arena;
+		nameArenaSize = size;
+	}
+	offset = nameArenaUsed;
+	memcpy(nameArena + offset, name, length);
+	nameArena[offset + length] = '\0';
+	nameArenaUsed = nameArenaUsed + length + 1;
+	return offset;
+}
+
+// Add an inode for an entry that is not in memory, returns the inode or HDD_NO_INODE
+uint32_t addInode(uint32_t dir, char *name, uint32_t length, uint8_t type, HddBlockID blockID, int32_t blockSize){
+	uint32_t ino = inodeCount;
+	int64_t offset;
+
+	if (ino == HDD_MAX_FILES){
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO : more than %d files", HDD_MAX_FILES);
+		return HDD_NO_INODE;
+	}
+	if (INODE_CHUNK(ino) == NULL && (INODE_CHUNK(ino) = malloc(sizeof(HddInodeChunk))) == NULL){
+		return HDD_NO_INODE;
+	}
+	if ((inodeCount + 1) * 2 > nameIndexSize && growNameIndex() == -1){ // keep the index at most half full
+		return HDD_NO_INODE;
+	}
+	if ((offset = addName(name, length)) == -1){
+		return HDD_NO_INODE;
+	}
+
+	INODE_CHUNK(ino)->name[INODE_SLOT(ino)] = offset;
+	INODE(ino).blockID = blockID;
+	INODE(ino).blockSize = blockSize;
+	INODE_HASH(ino) = entryHash(dir, INODE_NAME(ino));
+	INODE_DIR(ino) = dir;
+	INODE_TYPE(ino) = type;
+	INODE_DIRTY(ino) = 0;
+	INODE_GEN(ino) = 0;
+	INODE_OFFSET(ino) = 0;
+	inodeCount++;
+	indexInode(ino);
+	return ino;
+}
+
+// Hand out an inline data slot, returns it or HDD_NO_INODE
+uint32_t inlineAlloc(){
+	uint32_t slot = HDD_NO_INODE;
+
+	pthread_mutex_lock(&inlineLock);
+	if (inlineSpareCount > 0){
+		slot = inlineSpare[--inlineSpareCount];
+	}
+	else if (inlineSlots < HDD_MAX_FILES){
+		if (inlineChunk[inlineSlots >> HDD_INODE_CHUNK_SHIFT] != NULL ||
+			(inlineChunk[inlineSlots >> HDD_INODE_CHUNK_SHIFT] = calloc(HDD_INODE_CHUNK, sizeof(char *))) != NULL){
+			slot = inlineSlots++;
+		}
+	}
+	if (slot != HDD_NO_INODE){
+		INLINE_DATA(slot) = NULL;
+	}
+	pthread_mutex_unlock(&inlineLock);
+	return slot;
+}
+
+// Free the data of an inline slot and take the slot back
+void inlineRelease(uint32_t slot){
+	uint32_t *spare;
+
+	pthread_mutex_lock(&inlineLock);
+	free(INLINE_DATA(slot));
+	INLINE_DATA(slot) = NULL;
+	if (inlineSpareCount == inlineSpareSize){
+		if ((spare = realloc(inlineSpare, (inlineSpareSize + HDD_NAME_INDEX_MIN) * sizeof(uint32_t))) == NULL){
+			pthread_mutex_unlock(&inlineLock);
+			return; // the slot is not handed out again
+		}
+		inlineSpare = spare;
+		inlineSpareSize += HDD_NAME_INDEX_MIN;
+	}
+	inlineSpare[inlineSpareCount++] = slot;
+	pthread_mutex_unlock(&inlineLock);
+}
+
+// Write count bytes at loc of an inode's inline data, sized to newSize.
+// Unless it had a slot already (allocated) one is handed out and becomes
+// the inode's offset. Returns 0 if successful, -1 if failure
+int inlineCopy(uint32_t ino, int allocated, void *data, uint32_t loc, int32_t count, int32_t newSize){
+	uint32_t slot = allocated ? INODE_OFFSET(ino) : inlineAlloc();
+	char *buf;
+
+	if (slot == HDD_NO_INODE){
+		return -1;
+	}
+	if ((buf = realloc(INLINE_DATA(slot), (newSize > 0) ? newSize : 1)) == NULL){
+		if (allocated == 0){
+			inlineRelease(slot);
+		}
+		return -1;
+	}
+	INLINE_DATA(slot) = buf;
+	memcpy(buf + loc, data, count);
+	INODE_OFFSET(ino) = slot;
+	return 0;
+}
+
+// Hand out a handle on an inode, returns the handle or -1 if all are in use
+int16_t newHandle(uint32_t ino){
+	int16_t fh;
+	if (handleFreeCount > 0){
+		fh = handleFree[--handleFreeCount];
+	}
+	else if (handleNext < MAX_HDD_FILEDESCR){
+		fh = handleNext++;
+	}
+	else{
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO : more than %d open handles", MAX_HDD_FILEDESCR);
+		return -1;
+	}
+	handle[fh].ino = ino;
+	handle[fh].seekLocation = 0;
+	return fh;
+}
+
+// Check that fh is an open handle
+int isOpenHandle(int16_t fh){
+	return (fh >= 0 && fh < MAX_HDD_FILEDESCR && handle[fh].ino != HDD_NO_INODE);
+}
+
+// Initialize the inode locks (run once)
+void initFileLocks(){
+	int k;
+	for (k = 0; k < HDD_FILE_LOCK_STRIPES; k++){
+		pthread_rwlock_init(&fileLock[k], NULL);
+	}
+}
+
+// Get the lock of an inode
+pthread_rwlock_t *inodeLock(uint32_t ino){
+	pthread_once(&fileLockOnce, initFileLocks);
+	return &fileLock[ino & (HDD_FILE_LOCK_STRIPES - 1)];
+}
+
+// Get the lock of the inode a handle is open on
+pthread_rwlock_t *handleLock(int16_t fh){
+	return inodeLock(handle[fh].ino);
+}
+
+// Lock the inode of a handle for positional I/O, shared for readers and exclusive
+// for writers. Without wait, returns -1 instead of blocking when the inode is busy.
+// hdd_close holds the lock while it clears the handle, so once the lock is held
+// the handle cannot move to another inode and unlockFile finds the same lock
+int lockFile(int16_t fh, int exclusive, int wait){
+	pthread_rwlock_t *lock;
+	int err;
+
+	pthread_once(&fileLockOnce, initFileLocks);
+	while (1){
+		lock = handleLock(fh);
+		if (exclusive == 1){
+			err = wait ? pthread_rwlock_wrlock(lock) : pthread_rwlock_trywrlock(lock);
+		}
 		else{
-			initialize = 1; 
+			err = wait ? pthread_rwlock_rdlock(lock) : pthread_rwlock_tryrdlock(lock);
+		}
+		if (err){
+			return -1;
 		}
+		if (lock == handleLock(fh)){
+			return 0;
+		}
+		pthread_rwlock_unlock(lock); // the handle was closed or reopened while we waited
 	}
+}
 
-	 // if the block has been initialized 
-		HddBitCmd command = set_command_format(); // setup command to format device
-		HddBitResp response = hdd_client_operation(command, NULL);
-		int result = getResult(response); 
-		if (result == 1){
-			return -1; // hdd data lane failed 
+// Release an inode locked with lockFile
+void unlockFile(int16_t fh){
+	pthread_rwlock_unlock(handleLock(fh));
+}
+
+// Get the block of an open handle's file, the caller holds the entry lock.
+// Returns the file's HDD_INODE_ type, -1 if the handle is not open
+int hdd_entry_get(int16_t fh, HddBlockID *blockID, int32_t *blockSize){
+	uint32_t ino = handle[fh].ino;
+	if (ino == HDD_NO_INODE){
+		return -1;
+	}
+	*blockID = INODE(ino).blockID;
+	*blockSize = INODE(ino).blockSize;
+	return INODE_TYPE(ino);
+}
+
+// Bytes of a journal record with its name and inline data
+uint32_t journalRecordSize(HddJournalRecord *rec){
+	return sizeof(HddJournalRecord) + rec->nameLength + ((rec->type == HDD_INODE_INLINE) ? (uint32_t)rec->blockSize : 0);
+}
+
+// FNV-1a of a journal record, its name and inline data, computed with check 0
+uint32_t journalCheck(HddJournalRecord *rec){
+	uint8_t *p = (uint8_t *)rec;
+	uint32_t hash = 2166136261u, check = rec->check, i, size = journalRecordSize(rec);
+	rec->check = 0;
+	for (i = 0; i < size; i++){
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+	rec->check = check;
+	return hash;
+}
+
+// Log the current state of an entry, it is written by the next group commit.
+// Nothing to do if the file system has no journal
+void journalLog(uint32_t ino){
+	HddJournalRecord rec;
+	uint32_t size;
+	char *grown;
+
+	if (superblock.journalBlock == 0){
+		return;
+	}
+	memset(&rec, 0x0, sizeof(rec));
+	rec.dir = INODE_DIR(ino);
+	rec.type = INODE_TYPE(ino);
+	rec.nameLength = strlen(INODE_NAME(ino));
+	rec.blockID = INODE(ino).blockID;
+	rec.blockSize = INODE(ino).blockSize;
+	rec.generation = INODE_GEN(ino);
+	rec.offset = (rec.type == HDD_INODE_PACKED) ? INODE_OFFSET(ino) : 0;
+	size = journalRecordSize(&rec);
+
+	pthread_mutex_lock(&journalLock);
+	if (journalPendingBytes + size > journalPendingSize){
+		if ((grown = realloc(journalPending, journalPendingSize + HDD_JOURNAL_GROWTH)) == NULL){ // a record is under HDD_JOURNAL_GROWTH
+			logMessage(LOG_ERROR_LEVEL, "HDD_IO : failed growing the journal records, changes are saved at unmount only");
+			journalFailed = 1;
+			pthread_mutex_unlock(&journalLock);
+			return;
 		}
-		else {
+		journalPending = grown;
+		journalPendingSize += HDD_JOURNAL_GROWTH;
+	}
+	memcpy(journalPending + journalPendingBytes, &rec, sizeof(rec));
+	memcpy(journalPending + journalPendingBytes + sizeof(rec), INODE_NAME(ino), rec.nameLength);
+	if (rec.type == HDD_INODE_INLINE){
+		memcpy(journalPending + journalPendingBytes + sizeof(rec) + rec.nameLength, INLINE_DATA(INODE_OFFSET(ino)), rec.blockSize);
+	}
+	journalPendingBytes += size;
+	journalLogged++;
+	pthread_mutex_unlock(&journalLock);
+}
 
-			// create the meta block and default global structure to it 
-			int l; 
-			for (l = 0; l < 1024; l++){
-				file[l].fileHandle = 0;
-				file[l].open = 0;
-				file[l].exist = 0;
-				file[l].name[0] = '\0'; 
-				file[l].seekLocation = 0;
-				file[l].blockSize = 0; //new for assign4
-			}
+// Replace the block of an inode, the caller holds its lock exclusively
+void entrySet(uint32_t ino, HddBlockID blockID, int32_t blockSize){
+	INODE(ino).blockID = blockID;
+	INODE(ino).blockSize = blockSize;
+	INODE_GEN(ino) = superblock.session;
+	INODE_DIRTY(ino) = 1;
+	journalLog(ino);
+}
 
-			int *data = file;
-			uint32_t blockSize = sizeof(file); 
-			
-			HddBitCmd command2 = set_metablock_command(HDD_BLOCK_CREATE, blockSize);
-			HddBitResp response2 = hdd_client_operation(command2, data);
-			int result2 = getResult(response2);
+// Replace the block of an open handle's file, the caller holds the entry lock exclusively
+void hdd_entry_set(int16_t fh, HddBlockID blockID, int32_t blockSize){
+	uint32_t ino = handle[fh].ino;
+	if (ino != HDD_NO_INODE){
+		entrySet(ino, blockID, blockSize);
+	}
+}
 
-			if (result2 == 1){
-				return -1;
+// Turn an open handle's file into a striped file whose stripe map is
+// blockID, the caller holds the entry lock exclusively
+void setStriped(int16_t fh, HddBlockID blockID, int32_t blockSize){
+	INODE_TYPE(handle[fh].ino) = HDD_INODE_STRIPED; // before it is logged
+	hdd_entry_set(fh, blockID, blockSize);
+}
+
+// Note that an open handle's file is being written in this mount, so copies
+// of its block cached before are told apart. Returns the generation the
+// block had, the caller holds the entry lock exclusively
+uint32_t hdd_entry_touch(int16_t fh){
+	uint32_t ino = handle[fh].ino, gen;
+	if (ino == HDD_NO_INODE){
+		return 0;
+	}
+	gen = INODE_GEN(ino);
+	if (gen != superblock.session){
+		INODE_GEN(ino) = superblock.session;
+		INODE_DIRTY(ino) = 1; // the leaf records the generation
+	}
+	return gen;
+}
+
+// Make room for count records in a node
+int reserveNode(HddBtreeNode *node, uint32_t count){
+	uint32_t capacity = node->capacity ? node->capacity : 64;
+	void *p;
+
+	if (count <= node->capacity){
+		return 0;
+	}
+	while (capacity < count){
+		capacity = capacity * 2;
+	}
+	if (node->leaf){
+		if ((p = realloc(node->ino, capacity * sizeof(uint32_t))) == NULL){
+			return -1;
+		}
+		node->ino = p;
+	}
+	else{
+		if ((p = realloc(node->keyDir, capacity * sizeof(uint32_t))) == NULL){
+			return -1;
+		}
+		node->keyDir = p;
+		if ((p = realloc(node->keyName, capacity * sizeof(uint32_t))) == NULL){
+			return -1;
+		}
+		node->keyName = p;
+		if ((p = realloc(node->childBlock, (capacity + 1) * sizeof(HddBlockID))) == NULL){
+			return -1;
+		}
+		node->childBlock = p;
+		if ((p = realloc(node->childNode, (capacity + 1) * sizeof(uint32_t))) == NULL){
+			return -1;
+		}
+		node->childNode = p;
+	}
+	node->capacity = capacity;
+	return 0;
+}
+
+// Add an empty node to the cache, returns its number or HDD_BTREE_NONE
+uint32_t newNode(int leaf){
+	HddBtreeNode **nodes, *node;
+	uint32_t size;
+
+	if (btNodeCount == btNodeSize){
+		size = btNodeSize ? btNodeSize * 2 : 256;
+		if ((nodes = realloc(btNode, size * sizeof(HddBtreeNode *))) == NULL){
+			return HDD_BTREE_NONE;
+		}
+		btNode = nodes;
+		btNodeSize = size;
+	}
+	if ((node = calloc(1, sizeof(HddBtreeNode))) == NULL){
+		return HDD_BTREE_NONE;
+	}
+	node->leaf = leaf;
+	node->bytes = sizeof(HddBtreeHeader);
+	if (reserveNode(node, 1) == -1){
+		free(node);
+		return HDD_BTREE_NONE;
+	}
+	if (leaf == 0){
+		node->childBlock[0] = 0;
+		node->childNode[0] = HDD_BTREE_NONE;
+	}
+	btNode[btNodeCount] = node;
+	return btNodeCount++;
+}
+
+// Read a node block into the cache, adding the entries of a leaf to the
+// inode table. Returns the node number or HDD_BTREE_NONE
+uint32_t loadNode(HddBlockID block){
+	char buf[HDD_BTREE_NODE_SIZE], name[MAX_FILENAME_LENGTH], *pos = buf, *end = buf + HDD_BTREE_NODE_SIZE;
+	HddBtreeHeader hdr;
+	HddBtreeEntry ent;
+	HddBtreeKey key;
+	HddBtreeNode *node;
+	uint32_t n, i, length;
+	int64_t offset;
+	char *data = NULL;
+
+	HddBitCmd command = set_block_read(block, HDD_BTREE_NODE_SIZE);
+	HddBitResp response = hdd_client_operation(command, buf);
+	if (getResult(response) == 1){
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO : failed reading directory node [block %u]", block);
+		return HDD_BTREE_NONE;
+	}
+	memcpy(&hdr, pos, sizeof(hdr));
+	pos = pos + sizeof(hdr);
+	if ((n = newNode(hdr.leaf)) == HDD_BTREE_NONE || reserveNode(btNode[n], hdr.count) == -1){
+		return HDD_BTREE_NONE;
+	}
+	node = btNode[n];
+	node->block = block;
+	if (node->leaf == 0){
+		node->childBlock[0] = hdr.child;
+	}
+
+	for (i = 0; i < hdr.count; i++){
+		if (node->leaf){
+			if (pos + sizeof(ent) > end){
+				break;
 			}
-			else{ // successfully created metablock 
-				metablockSize = blockSize; // update gloabl variable with metablock size
-				return 0; 
+			memcpy(&ent, pos, sizeof(ent));
+			pos = pos + sizeof(ent);
+			length = ent.nameLength;
+		}
+		else{
+			if (pos + sizeof(key) > end){
+				break;
 			}
+			memcpy(&key, pos, sizeof(key));
+			pos = pos + sizeof(key);
+			length = key.nameLength;
 		}
-		
-	return -1;
+		if (length >= MAX_FILENAME_LENGTH || pos + length > end){
+			break;
+		}
+		memcpy(name, pos, length);
+		name[length] = '\0';
+		pos = pos + length;
+		if (node->leaf && ent.type == HDD_INODE_INLINE){
+			if (ent.blockSize < 0 || ent.blockSize > HDD_INLINE_MAX || pos + ent.blockSize > end){
+				break;
+			}
+			data = pos;
+			pos = pos + ent.blockSize;
+		}
+
+		if (node->leaf){
+			if ((node->ino[i] = addInode(ent.dir, name, length, ent.type, ent.blockID, ent.blockSize)) == HDD_NO_INODE){
+				return HDD_BTREE_NONE;
+			}
+			INODE_GEN(node->ino[i]) = ent.generation;
+			INODE_OFFSET(node->ino[i]) = ent.offset;
+			if (ent.type == HDD_INODE_INLINE && inlineCopy(node->ino[i], 0, data, 0, ent.blockSize, ent.blockSize) == -1){
+				return HDD_BTREE_NONE;
+			}
+		}
+		else{
+			if ((offset = addName(name, length)) == -1){
+				return HDD_BTREE_NONE;
+			}
+			node->keyDir[i] = key.dir;
+			node->keyName[i] = offset;
+			node->childBlock[i + 1] = key.child;
+		}
+		node->bytes = pos - buf;
+	}
+	if (i < hdr.count){
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO : directory node [block %u] is corrupt", block);
+		return HDD_BTREE_NONE;
+	}
+	node->count = hdr.count;
+	if (node->leaf == 0){
+		for (i = 0; i <= node->count; i++){
+			node->childNode[i] = HDD_BTREE_NONE;
+		}
+	}
+	return n;
 }
 
+// Get child i of an interior node, reading it on first use
+uint32_t nodeChild(uint32_t n, uint32_t i){
+	uint32_t child;
+	if (btNode[n]->childNode[i] == HDD_BTREE_NONE){
+		if ((child = loadNode(btNode[n]->childBlock[i])) == HDD_BTREE_NONE){
+			return HDD_BTREE_NONE;
+		}
+		btNode[n]->childNode[i] = child; // btNode may have moved while loading
+	}
+	return btNode[n]->childNode[i];
+}
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : hdd_mount 
-// Description  : ????
-//
-// Inputs       : ????
-// Outputs      : ????
-//
-uint16_t hdd_mount(void) {
-	if ( initialize == 0 ){ // if the block has not yet been initialized 
-		HddBitCmd initc = set_hdd_initialize_command();
-		HddBitResp initr = hdd_client_operation(initc, NULL);
-		int res = getResult(initr);
+// Read every node below n (eager mount)
+int loadSubtree(uint32_t n){
+	uint32_t i, child;
+	if (btNode[n]->leaf){
+		return 0;
+	}
+	for (i = 0; i <= btNode[n]->count; i++){
+		if ((child = nodeChild(n, i)) == HDD_BTREE_NONE || loadSubtree(child) == -1){
+			return -1;
+		}
+	}
+	return 0;
+}
 
-		if (res == 1){ // if hdd_client_operation failed, return failure
+// Position a cursor at the first entry not below (dir, name), or above it
+// when strict. The position may be past the end of its leaf
+int btreeSeek(HddBtreeCursor *c, uint32_t dir, char *name, int strict){
+	uint32_t n = btRoot, lo, hi, mid;
+	HddBtreeNode *node;
+	int cmp;
+
+	for (c->depth = 0; c->depth < HDD_BTREE_MAX_DEPTH; c->depth++){
+		node = btNode[n];
+		lo = 0;
+		hi = node->count;
+		while (lo < hi){ // leaves: first key >= (or >) the target, interior: first separator > the target
+			mid = (lo + hi) / 2;
+			cmp = keyCompare(nodeKeyDir(node, mid), nodeKeyName(node, mid), dir, name);
+			if (cmp < 0 || (cmp == 0 && (strict || node->leaf == 0))){
+				lo = mid + 1;
+			}
+			else{
+				hi = mid;
+			}
+		}
+		c->node[c->depth] = n;
+		c->index[c->depth] = lo;
+		if (node->leaf){
+			c->depth++;
+			return 0;
+		}
+		if ((n = nodeChild(n, lo)) == HDD_BTREE_NONE){
 			return -1;
 		}
-		else{
-			initialize = 1; 
+	}
+	return -1;
+}
+
+// Move a cursor past the end of its leaf to the start of the next non-empty
+// leaf. Returns 0 if positioned, 1 at the end of the tree, -1 if failure
+int btreeNextLeaf(HddBtreeCursor *c){
+	int d, leaf = c->depth - 1;
+	uint32_t n;
+
+	while (c->index[leaf] >= btNode[c->node[leaf]]->count){
+		for (d = leaf - 1; d >= 0 && c->index[d] >= btNode[c->node[d]]->count; d--); // last child at this level
+		if (d < 0){
+			return 1;
+		}
+		c->index[d]++;
+		for (; d < leaf; d++){
+			if ((n = nodeChild(c->node[d], c->index[d])) == HDD_BTREE_NONE){
+				return -1;
+			}
+			c->node[d + 1] = n;
+			c->index[d + 1] = 0;
 		}
 	}
+	return 0;
+}
+
+// Split node level d of a cursor's path in two, putting the separator in
+// its parent (which may split in turn). The root splits into a new root
+int btreeSplit(HddBtreeCursor *c, int d){
+	uint32_t n = c->node[d], r, p, i, m, half, size, sepDir, sepName;
+	HddBtreeNode *node, *right, *parent;
 
-	// device has been initialized 
+	if ((r = newNode(btNode[n]->leaf)) == HDD_BTREE_NONE){
+		return -1;
+	}
+	node = btNode[n];
+	right = btNode[r];
+	if (reserveNode(right, node->count) == -1){
+		return -1;
+	}
 
+	// Split at half the bytes, keeping at least one key on each side
+	half = (node->bytes - sizeof(HddBtreeHeader)) / 2;
+	for (m = 0, size = 0; m < node->count - 2 && size + nodeRecordSize(node, m) <= half; m++){
+		size = size + nodeRecordSize(node, m);
+	}
+	if (m == 0){
+		m = 1;
+	}
 
+	if (node->leaf){
+		// Entries m.. move right, the first of them is the separator
+		sepDir = INODE_DIR(node->ino[m]);
+		sepName = INODE_CHUNK(node->ino[m])->name[INODE_SLOT(node->ino[m])];
+		right->count = node->count - m;
+		memcpy(right->ino, node->ino + m, right->count * sizeof(uint32_t));
+		node->count = m;
+	}
+	else{
+		// Key m moves up, keys above it and their children move right
+		sepDir = node->keyDir[m];
+		sepName = node->keyName[m];
+		right->count = node->count - m - 1;
+		memcpy(right->keyDir, node->keyDir + m + 1, right->count * sizeof(uint32_t));
+		memcpy(right->keyName, node->keyName + m + 1, right->count * sizeof(uint32_t));
+		memcpy(right->childBlock, node->childBlock + m + 1, (right->count + 1) * sizeof(HddBlockID));
+		memcpy(right->childNode, node->childNode + m + 1, (right->count + 1) * sizeof(uint32_t));
+		node->count = m;
+	}
+	node->bytes = right->bytes = sizeof(HddBtreeHeader);
+	for (i = 0; i < node->count; i++){
+		node->bytes = node->bytes + nodeRecordSize(node, i);
+	}
+	for (i = 0; i < right->count; i++){
+		right->bytes = right->bytes + nodeRecordSize(right, i);
+	}
+	node->dirty = right->dirty = 1;
 
-	// Read from the metablock to populate struct with previously saved values 
-		
-		int blockSize = sizeof(file); // new for assign4
-		//int blockSize = hdd_read_block_size(0, HDD_META_BLOCK); // get size of metablock 
-		int *data = (int*) malloc(blockSize); // size of data buffer is blockSize for metablock 
-
-		// use hdd data lane to fill data buffer with metablock data 
-		HddBitCmd command = set_metablock_command(HDD_BLOCK_READ, blockSize);
-		HddBitResp response = hdd_client_operation(command, data);
-		int result = getResult(response);
-		if(result == 1){
-			free(data); // free memory 
-			return -1; // failure
+	if (d == 0){
+		// A new root above the two halves
+		if ((p = newNode(0)) == HDD_BTREE_NONE){
+			return -1;
 		}
-		else{
-			memcpy(file, data, blockSize); // copy memory from data read to global structure
-			free(data); 
-			return 0; 
+		parent = btNode[p];
+		parent->childBlock[0] = btNode[n]->block;
+		parent->childNode[0] = n;
+		parent->count = 0;
+		i = 0;
+		btRoot = p;
+		superblock.height++;
+	}
+	else{
+		p = c->node[d - 1];
+		i = c->index[d - 1]; // the split node is child i
+		parent = btNode[p];
+		if (reserveNode(parent, parent->count + 1) == -1){
+			return -1;
 		}
-			
+		memmove(parent->keyDir + i + 1, parent->keyDir + i, (parent->count - i) * sizeof(uint32_t));
+		memmove(parent->keyName + i + 1, parent->keyName + i, (parent->count - i) * sizeof(uint32_t));
+		memmove(parent->childBlock + i + 2, parent->childBlock + i + 1, (parent->count - i) * sizeof(HddBlockID));
+		memmove(parent->childNode + i + 2, parent->childNode + i + 1, (parent->count - i) * sizeof(uint32_t));
+	}
+	parent->keyDir[i] = sepDir;
+	parent->keyName[i] = sepName;
+	parent->childBlock[i + 1] = 0;
+	parent->childNode[i + 1] = r;
+	parent->count++;
+	parent->bytes = parent->bytes + nodeRecordSize(parent, i);
+	parent->dirty = 1;
+
+	if (d > 0 && parent->bytes > HDD_BTREE_NODE_SIZE){
+		return btreeSplit(c, d - 1);
+	}
+	return 0;
+}
+
+// Insert an inode at a cursor's position (from btreeSeek of its key)
+int btreeInsert(HddBtreeCursor *c, uint32_t ino){
+	int leaf = c->depth - 1;
+	uint32_t i = c->index[leaf];
+	HddBtreeNode *node = btNode[c->node[leaf]];
+
+	if (reserveNode(node, node->count + 1) == -1){
+		return -1;
+	}
+	memmove(node->ino + i + 1, node->ino + i, (node->count - i) * sizeof(uint32_t));
+	node->ino[i] = ino;
+	node->count++;
+	node->bytes = node->bytes + nodeRecordSize(node, i);
+	node->dirty = 1;
+	if (node->bytes > HDD_BTREE_NODE_SIZE){
+		return btreeSplit(c, leaf);
+	}
+	return 0;
+}
+
+// Find an entry, from the inodes in memory or else by walking the tree.
+// Returns 0 with the inode, 1 if there is no such entry (the cursor is then
+// where it would be inserted), -1 if failure
+int lookupEntry(uint32_t dir, char *name, uint32_t *ino, HddBtreeCursor *c){
+	HddBtreeNode *leaf;
+
+	if ((*ino = findInode(dir, name, entryHash(dir, name))) != HDD_NO_INODE){
+		return 0;
+	}
+	if (btreeSeek(c, dir, name, 0) == -1){
+		return -1;
+	}
+	leaf = btNode[c->node[c->depth - 1]];
+	if (c->index[c->depth - 1] < leaf->count){
+		*ino = leaf->ino[c->index[c->depth - 1]];
+		if (INODE_DIR(*ino) == dir && strcmp(INODE_NAME(*ino), name) == 0){
+			return 0; // the leaf was just read
+		}
+	}
+	*ino = HDD_NO_INODE;
+	return 1;
+}
+
+// Add a new entry at a cursor from lookupEntry, returns the inode or HDD_NO_INODE
+uint32_t createEntry(HddBtreeCursor *c, uint32_t dir, char *name, uint8_t type, HddBlockID blockID){
+	uint32_t ino = addInode(dir, name, strlen(name), type, blockID, 0);
+	if (ino == HDD_NO_INODE || btreeInsert(c, ino) == -1){
+		return HDD_NO_INODE;
+	}
+	superblock.fileCount++;
+	return ino;
+}
+
+// Account for an entry's inline data changing from before bytes in its
+// leaf, splitting the leaf once it outgrows its block. The caller holds
+// dirLock (or is mounting). Returns 0 if successful, -1 if failure
+int entryResize(uint32_t ino, uint32_t before){
+	uint32_t after = INODE_INLINE(ino);
+	HddBtreeCursor c;
+	HddBtreeNode *leaf;
+
+	if (after == before){
+		return 0;
+	}
+	if (btreeSeek(&c, INODE_DIR(ino), INODE_NAME(ino), 0) == -1){
+		return -1;
+	}
+	leaf = btNode[c.node[c.depth - 1]];
+	leaf->bytes = leaf->bytes + after - before;
+	leaf->dirty = 1;
+	return (leaf->bytes > HDD_BTREE_NODE_SIZE) ? btreeSplit(&c, c.depth - 1) : 0;
+}
+
+// Walk the directories of a path. With last set the final component is left
+// out and copied to last. Returns the directory ID reached, 0 if a component
+// is missing or not a directory
+uint32_t resolvePath(char *path, char *last){
+	char buf[MAX_FILENAME_LENGTH], *name, *next, *save;
+	uint32_t dir = HDD_ROOT_DIR, ino;
+	HddBtreeCursor c;
+
+	strncpy(buf, path, MAX_FILENAME_LENGTH - 1); // paths are truncated like they are stored
+	buf[MAX_FILENAME_LENGTH - 1] = '\0';
+	name = strtok_r(buf, "/", &save);
+	if (last != NULL){
+		if (name == NULL){
+			return 0; // no final component
+		}
+	}
+	while (name != NULL){
+		next = strtok_r(NULL, "/", &save);
+		if (next == NULL && last != NULL){
+			strcpy(last, name);
+			break;
+		}
+		if (lookupEntry(dir, name, &ino, &c) != 0 || INODE_TYPE(ino) != HDD_INODE_DIR){
+			return 0;
+		}
+		dir = INODE(ino).blockID;
+		name = next;
+	}
+	return dir;
+}
+
+// Write a node block, creating it the first time
+int writeNodeBlock(HddBtreeNode *node){
+	char buf[HDD_BTREE_NODE_SIZE], *pos = buf;
+	HddBtreeHeader hdr = { .leaf = node->leaf, .count = node->count, .child = 0 };
+	HddBtreeEntry ent;
+	HddBtreeKey key;
+	uint32_t i;
+	char *name;
+
+	if (node->bytes > HDD_BTREE_NODE_SIZE){ // a leaf whose split failed
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO : directory node of %u bytes does not fit its block", node->bytes);
+		return -1;
+	}
+	memset(buf, 0x0, HDD_BTREE_NODE_SIZE);
+	if (node->leaf == 0){
+		hdr.child = node->childBlock[0];
+	}
+	memcpy(pos, &hdr, sizeof(hdr));
+	pos = pos + sizeof(hdr);
+	for (i = 0; i < node->count; i++){
+		name = nodeKeyName(node, i);
+		if (node->leaf){
+			ent.dir = INODE_DIR(node->ino[i]);
+			ent.type = INODE_TYPE(node->ino[i]);
+			ent.nameLength = strlen(name);
+			ent.blockID = INODE(node->ino[i]).blockID;
+			ent.blockSize = INODE(node->ino[i]).blockSize;
+			ent.generation = INODE_GEN(node->ino[i]);
+			ent.offset = (ent.type == HDD_INODE_PACKED) ? INODE_OFFSET(node->ino[i]) : 0;
+			memcpy(pos, &ent, sizeof(ent));
+			pos = pos + sizeof(ent);
+			memcpy(pos, name, ent.nameLength);
+			pos = pos + ent.nameLength;
+			if (ent.type == HDD_INODE_INLINE){
+				memcpy(pos, INLINE_DATA(INODE_OFFSET(node->ino[i])), ent.blockSize);
+				pos = pos + ent.blockSize;
+			}
+		}
+		else{
+			key.dir = node->keyDir[i];
+			key.nameLength = strlen(name);
+			key.child = node->childBlock[i + 1];
+			memcpy(pos, &key, sizeof(key));
+			pos = pos + sizeof(key);
+			memcpy(pos, name, key.nameLength);
+			pos = pos + key.nameLength;
+		}
+	}
+
+	HddBitCmd command = (node->block == 0) ? set_block_create(0, HDD_BTREE_NODE_SIZE) : set_block_overwrite(node->block, HDD_BTREE_NODE_SIZE);
+	HddBitResp response = hdd_client_operation(command, buf);
+	if (getResult(response) == 1){
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO : failed writing directory node");
+		return -1;
+	}
+	if (node->block == 0){
+		node->block = getBlockID(response); // remember where it lives
+	}
+	node->dirty = 0;
+	return 0;
+}
+
+// Write the dirty nodes below and including n, children first so that
+// their parents record where new children were placed
+int saveSubtree(uint32_t n){
+	HddBtreeNode *node = btNode[n];
+	uint32_t i, child;
+
+	if (node->leaf == 0){
+		for (i = 0; i <= node->count; i++){
+			if ((child = node->childNode[i]) != HDD_BTREE_NONE){
+				if (saveSubtree(child) == -1){
+					return -1;
+				}
+				if (node->childBlock[i] != btNode[child]->block){
+					node->childBlock[i] = btNode[child]->block;
+					node->dirty = 1;
+				}
+			}
+		}
+	}
+	return (node->dirty == 1) ? writeNodeBlock(node) : 0;
+}
+
+// Write every changed node, then the superblock
+int saveDirectory(){
+	HddBtreeCursor c;
+	uint32_t ino;
+
+	for (ino = 0; ino < inodeCount; ino++){
+		if (INODE_DIRTY(ino) == 1){ // a file's block changed, rewrite its leaf
+			INODE_DIRTY(ino) = 0; // cleared first, a write racing with the save marks it again
+			if (btreeSeek(&c, INODE_DIR(ino), INODE_NAME(ino), 0) == -1){
+				return -1;
+			}
+			btNode[c.node[c.depth - 1]]->dirty = 1;
+		}
+	}
+	if (saveSubtree(btRoot) == -1){
+		return -1;
+	}
+	superblock.rootBlock = btNode[btRoot]->block;
+
+	HddBitCmd command = set_metablock_command(HDD_BLOCK_OVERWRITE, sizeof(superblock));
+	HddBitResp response = hdd_client_operation(command, &superblock);
+	return (getResult(response) == 1) ? -1 : 0;
+}
+
+// Save the directory with the next journal epoch, every record written so
+// far is then obsolete and the journal starts over. The caller is the only
+// thread writing the journal
+int journalCompact(){
+	int ret;
+
+	pthread_mutex_lock(&dirLock);
+	superblock.journalEpoch++;
+	if ((ret = saveDirectory()) == -1){
+		superblock.journalEpoch--;
+	}
+	pthread_mutex_unlock(&dirLock);
+	if (ret == 0){
+		journalTail = 0;
+		journalSeq = 0;
+		journalCompactions++;
+	}
+	return ret;
+}
+
+// Write a group of records at the journal's tail, compacting it first if
+// they do not fit. Returns 0 if successful, -1 if failure
+int journalWrite(char *group, uint32_t bytes){
+	HddJournalRecord *rec;
+	HddRequest req;
+	uint32_t pos;
+
+	if (journalTail + bytes > superblock.journalSize){
+		if (journalCompact() == -1){
+			return -1;
+		}
+		if (bytes > superblock.journalSize){
+			return 0; // the directory saved holds them
+		}
+	}
+	for (pos = 0; pos < bytes; pos += journalRecordSize(rec)){
+		rec = (HddJournalRecord *)(group + pos);
+		rec->epoch = superblock.journalEpoch;
+		rec->seq = journalSeq++;
+		rec->check = 0;
+		rec->check = journalCheck(rec);
+	}
+	memcpy(journalImage + journalTail, group, bytes);
+
+	// v2 writes just the group, v1 the whole block
+	memset(&req, 0x0, sizeof(req));
+	req.op = HDD_BLOCK_OVERWRITE;
+	req.flags = HDD_NULL_FLAG;
+	req.blockID = superblock.journalBlock;
+	if (hdd_client_protocol() == HDD_PROTOCOL_V2){
+		req.offset = journalTail;
+		req.length = bytes;
+	}
+	else{
+		req.length = superblock.journalSize;
+	}
+	if (hdd_client_request(&req, journalImage + req.offset) == -1){
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO : failed writing the journal");
+		return -1;
+	}
+	journalTail += bytes;
+	journalBytes += req.length;
+	return 0;
+}
+
+// Wait until every change logged so far is in the journal. The first thread
+// to get here writes all the pending records as one group, threads logging
+// meanwhile wait for it and then write theirs as the next group. Returns 0
+// if successful (or the file system has no journal), -1 if failure
+int journalCommit(){
+	uint64_t ticket, upto;
+	uint32_t bytes, size;
+	char *group;
+	int ret;
+
+	if (superblock.journalBlock == 0){
+		return 0;
+	}
+	pthread_mutex_lock(&journalLock);
+	ticket = journalLogged;
+	while (journalDone < ticket && journalFailed == 0){
+		if (journalWriting == 1){
+			pthread_cond_wait(&journalCommitted, &journalLock);
+			continue;
+		}
+
+		// lead a group of every pending record
+		group = journalPending;
+		size = journalPendingSize;
+		bytes = journalPendingBytes;
+		upto = journalLogged;
+		journalPending = journalSpare;
+		journalPendingSize = journalSpareSize;
+		journalPendingBytes = 0;
+		journalWriting = 1;
+		pthread_mutex_unlock(&journalLock);
+		if ((ret = journalWrite(group, bytes)) == -1){
+			ret = journalCompact(); // the directory saved holds the group instead
+		}
+		pthread_mutex_lock(&journalLock);
+		journalSpare = group;
+		journalSpareSize = size;
+		journalWriting = 0;
+		if (ret == -1){
+			logMessage(LOG_ERROR_LEVEL, "HDD_IO : failed saving journaled changes, they are saved at unmount only");
+			journalFailed = 1;
+		}
+		else{
+			journalGroups++;
+			journalRecords += upto - journalDone;
+			journalDone = upto;
+		}
+		pthread_cond_broadcast(&journalCommitted);
+	}
+	ret = (journalFailed == 1) ? -1 : 0;
+	pthread_mutex_unlock(&journalLock);
+	return ret;
+}
+
+// Apply a journal record to the directory
+int journalApply(HddJournalRecord *rec){
+	char name[MAX_FILENAME_LENGTH];
+	HddBtreeCursor c;
+	uint32_t ino, before;
+	int found, inlined;
+
+	if (rec->nameLength >= MAX_FILENAME_LENGTH){
+		return -1;
+	}
+	memcpy(name, (char *)rec + sizeof(HddJournalRecord), rec->nameLength);
+	name[rec->nameLength] = '\0';
+	if ((found = lookupEntry(rec->dir, name, &ino, &c)) == -1){
+		return -1;
+	}
+	if (found == 1 && (ino = createEntry(&c, rec->dir, name, (rec->type == HDD_INODE_INLINE) ? HDD_INODE_FILE : rec->type, rec->blockID)) == HDD_NO_INODE){
+		return -1;
+	}
+	before = INODE_INLINE(ino);
+	inlined = (INODE_TYPE(ino) == HDD_INODE_INLINE);
+	if (rec->type == HDD_INODE_INLINE){
+		if (inlineCopy(ino, inlined, (char *)rec + sizeof(HddJournalRecord) + rec->nameLength, 0, rec->blockSize, rec->blockSize) == -1){
+			return -1;
+		}
+	}
+	else {
+		if (inlined){
+			inlineRelease(INODE_OFFSET(ino));
+		}
+		INODE_OFFSET(ino) = rec->offset;
+	}
+	INODE(ino).blockID = rec->blockID;
+	INODE(ino).blockSize = rec->blockSize;
+	INODE_TYPE(ino) = rec->type;
+	INODE_GEN(ino) = rec->generation;
+	INODE_DIRTY(ino) = 1;
+	if (entryResize(ino, before) == -1){
+		return -1;
+	}
+	if (rec->type == HDD_INODE_DIR && rec->blockID >= superblock.nextDir){
+		superblock.nextDir = rec->blockID + 1;
+	}
+	return 0;
+}
+
+// Read the journal and apply the records of the current epoch, up to the
+// first one out of sequence or torn. Returns the records applied, -1 if failure
+int journalReplay(){
+	HddJournalRecord *rec;
+	HddRequest req;
+	uint32_t pos = 0, seq = 0;
+	char *image;
+
+	if ((image = realloc(journalImage, superblock.journalSize)) == NULL){
+		return -1;
+	}
+	journalImage = image;
+	memset(&req, 0x0, sizeof(req));
+	req.op = HDD_BLOCK_READ;
+	req.flags = HDD_NULL_FLAG;
+	req.blockID = superblock.journalBlock;
+	req.length = superblock.journalSize;
+	if (hdd_client_request(&req, journalImage) == -1){
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO : failed reading the journal");
+		return -1;
+	}
+	while (pos + sizeof(HddJournalRecord) <= superblock.journalSize){
+		rec = (HddJournalRecord *)(journalImage + pos);
+		if (rec->epoch != superblock.journalEpoch || rec->seq != seq ||
+			(rec->type == HDD_INODE_INLINE && (rec->blockSize < 0 || rec->blockSize > HDD_INLINE_MAX)) ||
+			pos + journalRecordSize(rec) > superblock.journalSize || journalCheck(rec) != rec->check){
+			break;
+		}
+		if (journalApply(rec) == -1){
+			return -1;
+		}
+		pos += journalRecordSize(rec);
+		seq++;
+	}
+	return seq;
+}
+
+// Create an empty journal block of journalKB for the superblock
+int journalCreate(){
+	uint32_t size = journalKB * 1024;
+	HddRequest req;
+	char *image;
+
+	if (size > (uint32_t)hdd_client_max_block_size()){
+		size = hdd_client_max_block_size();
+	}
+	if ((image = calloc(1, size)) == NULL){
+		return -1;
+	}
+	memset(&req, 0x0, sizeof(req));
+	req.op = HDD_BLOCK_CREATE;
+	req.flags = HDD_NULL_FLAG;
+	req.length = size;
+	if (hdd_client_request(&req, image) == -1){
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO : failed creating the journal");
+		free(image);
+		return -1;
+	}
+	free(journalImage);
+	journalImage = image;
+	superblock.journalBlock = req.blockID;
+	superblock.journalSize = size;
+	superblock.journalEpoch = 1; // the zeroed block holds no record of it
+	return 0;
+}
+
+// Forget the records of a journal the directory was just saved over, and
+// start the counters over
+void journalReset(){
+	pthread_mutex_lock(&journalLock);
+	journalGroups = journalRecords = journalCompactions = journalBytes = 0;
+	journalPendingBytes = 0;
+	journalDone = journalLogged;
+	journalFailed = 0;
+	journalTail = 0;
+	journalSeq = 0;
+	pthread_mutex_unlock(&journalLock);
+}
+
+// Log the journal's counters
+void journalReport(){
+	if (superblock.journalBlock == 0){
+		return;
+	}
+	logMessage(LOG_INFO_LEVEL, "HDD_IO : journal wrote %lu records in %lu groups (%.2f per group, %lu bytes), compacted %lu times",
+			   (unsigned long)journalRecords, (unsigned long)journalGroups,
+			   (journalGroups == 0) ? 0.0 : (double)journalRecords / journalGroups,
+			   (unsigned long)journalBytes, (unsigned long)journalCompactions);
+}
+
+// A new file system ID, never 0
+uint64_t newFsid(){
+	struct timespec ts;
+	uint64_t id;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	id = ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^ ((uint64_t)getpid() << 40);
+	id = (id ^ (id >> 31)) * 0x9e3779b97f4a7c15ULL;
+	return (id == 0) ? 1 : id;
+}
+
+// Write a range of the open container, and its image, the caller holds packLock
+int packStore(uint32_t off, void *data, uint32_t len){
+	if (hdd_client_protocol() == HDD_PROTOCOL_V2){ // just the range
+		if (hdd_cache_write(packOpen, superblock.session, superblock.session, data, off, len) == -1){
+			return -1;
+		}
+		memcpy(packImage + off, data, len);
+		return 0;
+	}
+	memcpy(packImage + off, data, len);
+	HddBitResp response = hdd_client_operation(set_block_overwrite(packOpen, HDD_PACK_BLOCK_SIZE), packImage);
+	if (getResult(response) == 1){
+		hdd_cache_invalidate(packOpen);
+		return -1;
+	}
+	hdd_cache_update(packOpen, superblock.session, superblock.session, packImage, 0, HDD_PACK_BLOCK_SIZE);
+	return 0;
+}
+
+// Add a container to the ones the compactor knows of, the caller holds packLock
+int packTrack(HddBlockID block, uint8_t scanned){
+	HddPackContainer *table;
+	uint32_t size;
+
+	if (packTableCount == packTableSize){
+		size = (packTableSize == 0) ? 64 : packTableSize * 2;
+		if ((table = realloc(packTable, size * sizeof(HddPackContainer))) == NULL){
+			return -1;
+		}
+		packTable = table;
+		packTableSize = size;
+	}
+	packTable[packTableCount].block = block;
+	packTable[packTableCount].live = 0;
+	packTable[packTableCount].scanned = scanned;
+	packTableCount++;
+	return 0;
+}
+
+// Append bytes to the open container, opening a new one holding them when
+// they do not fit. Returns 0 with where they were put, -1 if failure
+int packAppend(void *data, uint32_t len, HddBlockID *block, uint32_t *off){
+	int ret = 0;
+
+	pthread_mutex_lock(&packLock);
+	if (packOpen != 0 && packTail + len <= HDD_PACK_BLOCK_SIZE){
+		if ((ret = packStore(packTail, data, len)) == 0){
+			*block = packOpen;
+			*off = packTail;
+			packTail += len;
+		}
+		pthread_mutex_unlock(&packLock);
+		return ret;
+	}
+
+	memset(packImage, 0x0, HDD_PACK_BLOCK_SIZE);
+	memcpy(packImage, data, len);
+	packOpen = 0; // the image is no longer the last one's
+	packTail = 0;
+	HddRequest req = { .op = HDD_BLOCK_CREATE, .flags = HDD_NULL_FLAG, .length = HDD_PACK_BLOCK_SIZE };
+	if (hdd_client_request(&req, packImage) == -1 || packTrack(req.blockID, 0) == -1){
+		pthread_mutex_unlock(&packLock);
+		return -1;
+	}
+	hdd_cache_insert(req.blockID, superblock.session, req.version, packImage, HDD_PACK_BLOCK_SIZE);
+	packOpen = req.blockID;
+	packTail = len;
+	packContainers++;
+	*block = packOpen;
+	*off = 0;
+	pthread_mutex_unlock(&packLock);
+	return 0;
+}
+
+// Read bytes of a container: the open one from its image, closed ones
+// through the block cache, or else whole so the next small file read from
+// it costs nothing (just the range on v2 unless whole). Returns 0 if
+// successful, -1 if failure
+int packRead(HddBlockID block, uint32_t gen, void *buf, uint32_t off, uint32_t len, int whole){
+	pthread_mutex_lock(&packLock);
+	if (block == packOpen){
+		memcpy(buf, packImage + off, len);
+		pthread_mutex_unlock(&packLock);
+		return 0;
+	}
+	pthread_mutex_unlock(&packLock);
+	if (hdd_cache_fits(HDD_PACK_BLOCK_SIZE)){
+		return hdd_cache_fetch(block, HDD_PACK_BLOCK_SIZE, gen, buf, off, len);
+	}
+
+	pthread_mutex_lock(&packReadLock);
+	if (block != packReadBlock && whole == 0 && hdd_client_protocol() == HDD_PROTOCOL_V2){
+		pthread_mutex_unlock(&packReadLock);
+		HddRequest req = { .op = HDD_BLOCK_READ, .flags = HDD_NULL_FLAG, .blockID = block, .offset = off, .length = len };
+		return hdd_client_request(&req, buf);
+	}
+	if (block != packReadBlock){
+		HddRequest req = { .op = HDD_BLOCK_READ, .flags = HDD_NULL_FLAG, .blockID = block, .length = HDD_PACK_BLOCK_SIZE };
+		packReadBlock = 0;
+		if (hdd_client_request(&req, packReadImage) == -1){
+			pthread_mutex_unlock(&packReadLock);
+			return -1;
+		}
+		packReadBlock = block;
+		packReads++;
+	}
+	memcpy(buf, packReadImage + off, len);
+	pthread_mutex_unlock(&packReadLock);
+	return 0;
+}
+
+// Note bytes of a container are no longer used, waking the compactor once
+// they add up to a container
+void packRelease(uint32_t bytes){
+	pthread_mutex_lock(&packLock);
+	packDead += bytes;
+	if (packDead >= HDD_PACK_BLOCK_SIZE){
+		pthread_cond_signal(&packWake);
+	}
+	pthread_mutex_unlock(&packLock);
+}
+
+// Make a file inline with newSize bytes, count of them data at loc and the
+// rest what it held inline before. Done under dirLock so that a save sees
+// the data and its size together. The caller holds the entry lock
+// exclusively and releases where the file was if it was not inline.
+// Returns 0 if successful, -1 if failure
+int inlineSet(uint32_t ino, void *data, uint32_t loc, int32_t count, int32_t newSize){
+	uint32_t before;
+	int ret = -1;
+
+	pthread_mutex_lock(&dirLock);
+	before = INODE_INLINE(ino);
+	if (inlineCopy(ino, INODE_TYPE(ino) == HDD_INODE_INLINE, data, loc, count, newSize) == 0){
+		INODE_TYPE(ino) = HDD_INODE_INLINE;
+		INODE(ino).blockID = 0;
+		INODE(ino).blockSize = newSize;
+		ret = entryResize(ino, before);
+	}
+	pthread_mutex_unlock(&dirLock);
+	if (ret == 0){
+		entrySet(ino, 0, newSize);
+	}
+	return ret;
+}
+
+// Put the whole new contents of a file where their size says: inline in
+// its entry, packed, in stripes or in a block of its own. The caller holds
+// the entry lock exclusively and releases where the file was unless it was
+// inline. Returns 0 if successful, -1 if failure (the file is unchanged)
+int placeFile(uint32_t ino, char *newData, int32_t newSize){
+	HddBlockID moved = HDD_NO_BLOCK;
+	uint32_t to = 0, slot, before;
+	uint8_t type;
+	int ret;
+
+	if (newSize <= (int32_t)inlineMax){
+		return inlineSet(ino, newData, 0, newSize, newSize);
+	}
+	if (newSize <= (int32_t)packMax){
+		ret = packAppend(newData, newSize, &moved, &to);
+		type = HDD_INODE_PACKED;
+	}
+	else if (hdd_stripe_fits(newSize)){
+		ret = (hdd_stripe_write(&moved, newData, 0, newSize) == -1) ? -1 : 0;
+		type = HDD_INODE_STRIPED;
+	}
+	else{
+		HddRequest req = { .op = HDD_BLOCK_CREATE, .flags = HDD_NULL_FLAG, .length = newSize };
+		if ((ret = hdd_client_request(&req, newData)) != -1){
+			hdd_cache_insert(req.blockID, superblock.session, req.version, newData, newSize);
+			moved = req.blockID;
+		}
+		type = HDD_INODE_FILE;
+	}
+	if (ret == -1){
+		return -1;
+	}
+
+	// the type is set before it is logged, inline data leaves its leaf record
+	ret = 0;
+	if (INODE_TYPE(ino) == HDD_INODE_INLINE){
+		pthread_mutex_lock(&dirLock);
+		before = INODE_INLINE(ino);
+		slot = INODE_OFFSET(ino);
+		INODE_TYPE(ino) = type;
+		INODE_OFFSET(ino) = to;
+		ret = entryResize(ino, before);
+		pthread_mutex_unlock(&dirLock);
+		inlineRelease(slot);
+	}
+	else{
+		INODE_TYPE(ino) = type;
+		INODE_OFFSET(ino) = to;
+	}
+	entrySet(ino, moved, newSize);
+	return ret;
+}
+
+// Write to a file kept inline in its entry, or empty and small enough to
+// be, without a block operation. Once it grows past inlineMax it moves out,
+// packed or to blocks of its own. The caller holds the entry lock
+// exclusively. Returns 0 if successful, -1 if failure
+int inlineWrite(int16_t fh, int32_t size, void *data, int32_t count, uint32_t loc){
+	uint32_t ino = handle[fh].ino;
+	int32_t newSize = (loc + count > size) ? loc + count : size;
+	char *newData;
+	int ret;
+
+	if (newSize <= (int32_t)inlineMax){
+		return inlineSet(ino, data, loc, count, newSize);
+	}
+	if ((newData = malloc(newSize)) == NULL){
+		return -1;
+	}
+	if (size > 0){
+		memcpy(newData, INLINE_DATA(INODE_OFFSET(ino)), size);
+	}
+	memcpy(newData + loc, data, count);
+	ret = placeFile(ino, newData, newSize);
+	free(newData);
+	return ret;
+}
+
+// Write to a file that is packed, or empty and packed by this write. It is
+// rewritten in place when it is in the open container and either stays
+// within its size or ends at the tail, else its new contents are appended
+// to the open container, or put in a block (or stripes) of its own once
+// past packMax (or inline if it fits again). The caller holds the entry lock exclusively and gives the
+// generation the file had. Returns 0 if successful, -1 if failure
+int packWrite(int16_t fh, HddBlockID block, int32_t size, uint32_t gen, void *data, int32_t count, uint32_t loc){
+	uint32_t ino = handle[fh].ino, off = INODE_OFFSET(ino);
+	int32_t newSize = (loc + count > size) ? loc + count : size;
+	char *newData;
+	int ret;
+
+	INODE_GEN(ino) = gen; // the generation of its container until it moves
+	pthread_mutex_lock(&packLock);
+	if (block != 0 && block == packOpen && newSize <= (int32_t)packMax &&
+		(newSize == size || (off + size == packTail && off + newSize <= HDD_PACK_BLOCK_SIZE))){
+		if ((ret = packStore(off + loc, data, count)) == 0 && newSize > size){
+			packTail = off + newSize;
+		}
+		pthread_mutex_unlock(&packLock);
+		if (ret == 0 && newSize > size){
+			entrySet(ino, block, newSize);
+		}
+		return ret;
+	}
+	pthread_mutex_unlock(&packLock);
+
+	// gather the whole new contents
+	if ((newData = malloc(newSize)) == NULL){
+		return -1;
+	}
+	if (block != 0 && size > 0 && packRead(block, gen, newData, off, size, 0) == -1){
+		free(newData);
+		return -1;
+	}
+	memcpy(newData + loc, data, count);
+	ret = placeFile(ino, newData, newSize);
+	free(newData);
+	if (ret == -1){
+		return -1; // the file is still where it was
+	}
+	if (block != 0){
+		packRelease(size);
+	}
+	return 0;
+}
+
+// Compare containers by block
+int packCompareBlock(const void *a, const void *b){
+	HddBlockID x = ((const HddPackContainer *)a)->block, y = ((const HddPackContainer *)b)->block;
+	return (x > y) - (x < y);
+}
+
+// Compare scanned files by container
+int packCompareRef(const void *a, const void *b){
+	HddBlockID x = ((const HddPackRef *)a)->block, y = ((const HddPackRef *)b)->block;
+	return (x > y) - (x < y);
+}
+
+// Move a packed file out of a container about to be deleted into the open
+// one, image holding the container. Skipped if the file left it since the
+// scan. Returns 0 if successful (or skipped), -1 if failure
+int packMove(uint32_t ino, HddBlockID block, char *image){
+	uint32_t to;
+	int32_t size;
+	HddBlockID moved;
+	int ret = 0;
+
+	pthread_rwlock_wrlock(inodeLock(ino));
+	if (INODE_TYPE(ino) == HDD_INODE_PACKED && INODE(ino).blockID == block){
+		size = INODE(ino).blockSize;
+		if ((ret = packAppend(image + INODE_OFFSET(ino), size, &moved, &to)) == 0){
+			INODE_OFFSET(ino) = to;
+			entrySet(ino, moved, size);
+			packMoved++;
+		}
+	}
+	pthread_rwlock_unlock(inodeLock(ino));
+	return ret;
+}
+
+int packCompactPass(int live);
+
+// Compact up to HDD_PACK_COMPACT_BATCH closed containers at most live
+// percent used: the directory is scanned for the bytes of each, the
+// survivors in them are moved to the open container in directory order,
+// and once the moves are durable the containers are deleted. Returns the
+// containers left to compact, -1 if failure
+int packCompact(int live){
+	int ret;
+
+	pthread_mutex_lock(&packCompactLock);
+	ret = packCompactPass(live);
+	pthread_mutex_unlock(&packCompactLock);
+	return ret;
+}
+
+// A compactor pass, the caller holds packCompactLock
+int packCompactPass(int live){
+	HddBlockID open, victim[HDD_PACK_COMPACT_BATCH];
+	HddPackRef *refs = NULL, *sorted = NULL, *grown;
+	uint32_t refCount = 0, refSize = 0, i, k, v, victims = 0, left = 0, ino, bytes;
+	int failed[HDD_PACK_COMPACT_BATCH], end, ret = -1;
+	HddPackContainer key, *found;
+	HddBtreeCursor c;
+	HddBtreeNode *leaf;
+	char *images = NULL;
+
+	// Every packed file, in directory order. Files only ever move into the
+	// open container, so the bytes seen in the closed ones can only drop
+	pthread_mutex_lock(&packLock);
+	open = packOpen;
+	for (i = 0; i < packTableCount; i++){
+		packTable[i].scanned = 1;
+		packTable[i].live = 0;
+	}
+	pthread_mutex_unlock(&packLock);
+	pthread_mutex_lock(&dirLock);
+	if (btreeSeek(&c, 0, "", 0) == -1){
+		pthread_mutex_unlock(&dirLock);
+		return -1;
+	}
+	while ((end = btreeNextLeaf(&c)) == 0){
+		leaf = btNode[c.node[c.depth - 1]];
+		ino = leaf->ino[c.index[c.depth - 1]++];
+		if (INODE_TYPE(ino) != HDD_INODE_PACKED){
+			continue;
+		}
+		if (refCount == refSize){
+			refSize = (refSize == 0) ? 1024 : refSize * 2;
+			if ((grown = realloc(refs, refSize * sizeof(HddPackRef))) == NULL){
+				end = -1;
+				break;
+			}
+			refs = grown;
+		}
+		refs[refCount].block = INODE(ino).blockID;
+		refs[refCount].ino = ino;
+		refs[refCount].size = INODE(ino).blockSize;
+		refCount++;
+	}
+	pthread_mutex_unlock(&dirLock);
+	if (end == -1 || (refCount > 0 && (sorted = malloc(refCount * sizeof(HddPackRef))) == NULL)){
+		goto done;
+	}
+
+	// The bytes of each container, those of earlier mounts are learnt here
+	if (refCount > 0){
+		memcpy(sorted, refs, refCount * sizeof(HddPackRef));
+		qsort(sorted, refCount, sizeof(HddPackRef), packCompareRef);
+	}
+	pthread_mutex_lock(&packLock);
+	qsort(packTable, packTableCount, sizeof(HddPackContainer), packCompareBlock);
+	for (i = 0, k = packTableCount; i < refCount; i = v){
+		for (v = i, bytes = 0; v < refCount && sorted[v].block == sorted[i].block; v++){
+			bytes += sorted[v].size;
+		}
+		key.block = sorted[i].block;
+		if ((found = bsearch(&key, packTable, k, sizeof(HddPackContainer), packCompareBlock)) == NULL){
+			if (packTrack(key.block, 1) == -1){
+				pthread_mutex_unlock(&packLock);
+				goto done;
+			}
+			found = &packTable[packTableCount - 1];
+		}
+		found->live = bytes;
+	}
+	for (i = 0; i < packTableCount; i++){
+		if (packTable[i].scanned == 1 && packTable[i].block != open &&
+			(uint64_t)packTable[i].live * 100 <= (uint64_t)HDD_PACK_BLOCK_SIZE * live){
+			if (victims < HDD_PACK_COMPACT_BATCH){
+				victim[victims++] = packTable[i].block;
+			}
+			else{
+				left++;
+			}
+		}
+	}
+	pthread_mutex_unlock(&packLock);
+	if (victims == 0){
+		ret = 0;
+		goto done;
+	}
+
+	// Read the containers, then move their files
+	if ((images = malloc((size_t)victims * HDD_PACK_BLOCK_SIZE)) == NULL){
+		goto done;
+	}
+	for (v = 0; v < victims; v++){
+		HddRequest req = { .op = HDD_BLOCK_READ, .flags = HDD_NULL_FLAG, .blockID = victim[v], .length = HDD_PACK_BLOCK_SIZE };
+		failed[v] = (hdd_client_request(&req, images + (size_t)v * HDD_PACK_BLOCK_SIZE) == -1);
+	}
+	for (i = 0; i < refCount; i++){
+		for (v = 0; v < victims && victim[v] != refs[i].block; v++);
+		if (v < victims && failed[v] == 0 && packMove(refs[i].ino, victim[v], images + (size_t)v * HDD_PACK_BLOCK_SIZE) == -1){
+			failed[v] = 1;
+		}
+	}
+
+	// The moves have to be durable before the containers go
+	if (superblock.journalBlock != 0){
+		ret = journalCommit();
+	}
+	else{
+		pthread_mutex_lock(&dirLock);
+		ret = saveDirectory();
+		pthread_mutex_unlock(&dirLock);
+	}
+	for (v = 0; ret == 0 && v < victims; v++){
+		if (failed[v] == 1){
+			continue;
+		}
+		hdd_cache_invalidate(victim[v]); // its ID can be handed out again
+		pthread_mutex_lock(&packReadLock);
+		if (packReadBlock == victim[v]){
+			packReadBlock = 0;
+		}
+		pthread_mutex_unlock(&packReadLock);
+		if (getResult(hdd_client_operation(set_delete_block_command(victim[v]), NULL)) == 1){
+			logMessage(LOG_WARNING_LEVEL, "HDD_IO : failed deleting packed container %u", victim[v]);
+			continue;
+		}
+		pthread_mutex_lock(&packLock);
+		for (i = 0; i < packTableCount && packTable[i].block != victim[v]; i++);
+		if (i < packTableCount){
+			packReclaimed += HDD_PACK_BLOCK_SIZE - packTable[i].live;
+			packTable[i] = packTable[--packTableCount]; // the next scan sorts the table again
+		}
+		packFreed++;
+		pthread_mutex_unlock(&packLock);
+	}
+	ret = (ret == 0) ? (int)left : -1;
+
+done:
+	free(refs);
+	free(sorted);
+	free(images);
+	return ret;
+}
+
+// The compactor thread, runs a pass when kicked or once a container's
+// worth of bytes is dead, and passes again while containers are left
+void *packCompactor(void *arg){
+	int left;
+
+	pthread_mutex_lock(&packLock);
+	while (packStop == 0){
+		if (packKick == 0 && packDead < HDD_PACK_BLOCK_SIZE){
+			pthread_cond_wait(&packWake, &packLock);
+			continue;
+		}
+		packKick = 0;
+		packDead = 0;
+		pthread_mutex_unlock(&packLock);
+		left = packCompact(HDD_PACK_COMPACT_LIVE);
+		pthread_mutex_lock(&packLock);
+		if (left > 0){
+			packKick = 1;
+		}
+	}
+	pthread_mutex_unlock(&packLock);
+	return NULL;
+}
+
+// Stop the compactor thread if it runs
+void packHalt(){
+	if (packRunning == 0){
+		return;
+	}
+	pthread_mutex_lock(&packLock);
+	packStop = 1;
+	pthread_cond_signal(&packWake);
+	pthread_mutex_unlock(&packLock);
+	pthread_join(packThread, NULL);
+	packRunning = 0;
+}
+
+// Forget the open and known containers of the last mount, and start the
+// counters over
+void packReset(){
+	packHalt();
+	pthread_mutex_lock(&packLock);
+	packOpen = 0;
+	packTail = 0;
+	packTableCount = 0;
+	packDead = 0;
+	packContainers = packReads = packMoved = packFreed = packReclaimed = 0;
+	pthread_mutex_unlock(&packLock);
+	packReadBlock = 0;
+}
+
+// Start the compactor thread with a pass over what earlier mounts left
+void packStart(){
+	if (packMax == 0){
+		return;
+	}
+	packStop = 0;
+	packKick = 1;
+	if (pthread_create(&packThread, NULL, packCompactor, NULL) != 0){
+		logMessage(LOG_WARNING_LEVEL, "HDD_IO : failed starting the packed container compactor");
+		return;
+	}
+	packRunning = 1;
+}
+
+// Log the packing counters
+void packReport(){
+	if (packContainers == 0 && packFreed == 0){
+		return;
+	}
+	logMessage(LOG_INFO_LEVEL, "HDD_IO : packed files into %lu containers (%lu read whole), compacted %lu moving %lu files and reclaiming %lu bytes",
+			   (unsigned long)packContainers, (unsigned long)packReads, (unsigned long)packFreed,
+			   (unsigned long)packMoved, (unsigned long)packReclaimed);
+}
+
+int initialize = 0; // 0 if block has not been initialized 
+int metablockSize = 0; 
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_format
+// Description  : Formats the device and writes an empty superblock to the
+//                metablock (the directory B-tree is written on first unmount)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+//
+uint16_t hdd_format(void) {
+	if ( initialize == 0 ){ // if the block has not yet been initialized 
+		HddBitCmd initc = set_hdd_initialize_command();
+		HddBitResp initr = hdd_client_operation(initc, NULL);
+		int res = getResult(initr);
+
+		if (res == 1){ // if hdd_client_operation failed, return failure
+			return -1;
+		}
+		else{
+			initialize = 1; 
+		}
+	}
+
+	 // if the block has been initialized 
+		HddBitCmd command = set_command_format(); // setup command to format device
+		HddBitResp response = hdd_client_operation(command, NULL);
+		int result = getResult(response); 
+		if (result == 1){
+			return -1; // hdd data lane failed 
+		}
+		else {
+
+			// create the meta block and default global structure to it 
+			resetDirectory();
+			packReset();
+			hdd_cache_reset(); // block IDs start over
+			memset(&superblock, 0x0, sizeof(superblock));
+			superblock.magic = HDD_SUPERBLOCK_MAGIC;
+			superblock.version = HDD_SUPERBLOCK_VERSION;
+			superblock.nextDir = HDD_ROOT_DIR + 1;
+			superblock.height = 1;
+			superblock.fsid = newFsid();
+			if ((btRoot = newNode(1)) == HDD_BTREE_NONE){ // an empty leaf, written on unmount
+				return -1;
+			}
+			btNode[btRoot]->dirty = 1;
+			journalReset();
+			if (journalKB > 0 && journalCreate() == -1){
+				return -1;
+			}
+
+			uint32_t blockSize = sizeof(superblock); 
+			
+			HddBitCmd command2 = set_metablock_command(HDD_BLOCK_CREATE, blockSize);
+			HddBitResp response2 = hdd_client_operation(command2, &superblock);
+			int result2 = getResult(response2);
+
+			if (result2 == 1 || hdd_stripe_format() == -1){
+				return -1;
+			}
+			else{ // successfully created metablock 
+				metablockSize = blockSize; // update gloabl variable with metablock size
+				return 0; 
+			}
+		}
+		
 	return -1;
 }
 
-
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_mount 
+// Description  : Reads the superblock from the metablock and starts a new
+//                session in it, then reads the root node of the directory
+//                B-tree. In eager mode loadSubtree reads every node below it
+//                as well, in lazy mode a node is read when a lookup first
+//                reaches it
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+//
+uint16_t hdd_mount(void) {
+	if ( initialize == 0 ){ // if the block has not yet been initialized 
+		HddBitCmd initc = set_hdd_initialize_command();
+		HddBitResp initr = hdd_client_operation(initc, NULL);
+		int res = getResult(initr);
+
+		if (res == 1){ // if hdd_client_operation failed, return failure
+			return -1;
+		}
+		else{
+			initialize = 1; 
+		}
+	}
+
+	// device has been initialized, read the superblock
+	packReset(); // the compactor of a mount never unmounted is stopped first
+	int blockSize = sizeof(superblock);
+	HddBitCmd command = set_metablock_command(HDD_BLOCK_READ, blockSize);
+	HddBitResp response = hdd_client_operation(command, &superblock);
+	int result = getResult(response);
+	if(result == 1){
+		return -1; // failure
+	}
+	if (superblock.magic != HDD_SUPERBLOCK_MAGIC || superblock.version != HDD_SUPERBLOCK_VERSION ||
+		superblock.height == 0 || superblock.height > HDD_BTREE_MAX_DEPTH){
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO : metablock is not a version %d superblock, reformat the device", HDD_SUPERBLOCK_VERSION);
+		return -1;
+	}
+	metablockSize = blockSize;
+
+	// A new session, recorded before anything is written. If the last one
+	// never unmounted its writes may not be in the directory, so caches
+	// saved before cannot be checked and the file system gets a new ID
+	if (superblock.mounted == 1){
+		logMessage(LOG_WARNING_LEVEL, "HDD_IO : the file system was not unmounted, client caches of it are dropped");
+		superblock.fsid = newFsid();
+	}
+	superblock.session++;
+	superblock.mounted = 1;
+	journalReset();
+	if (superblock.journalBlock == 0 && journalKB > 0 && journalCreate() == -1){
+		return -1;
+	}
+	command = set_metablock_command(HDD_BLOCK_OVERWRITE, blockSize);
+	if (getResult(hdd_client_operation(command, &superblock)) == 1){
+		return -1;
+	}
+	hdd_cache_mount(superblock.fsid);
+	hdd_cache_coherence(); // other clients may mount it too
+
+	// Nothing is cached yet, read the root node
+	resetDirectory();
+	btRoot = (superblock.rootBlock == 0) ? newNode(1) : loadNode(superblock.rootBlock);
+	if (btRoot == HDD_BTREE_NONE){
+		return -1;
+	}
+	if (mountMode == HDD_MOUNT_EAGER && loadSubtree(btRoot) == -1){
+		return -1;
+	}
+
+	// Changes journaled since the directory was last saved, saved now with
+	// the next epoch so that the journal starts empty
+	if (superblock.journalBlock != 0){
+		int replayed = journalReplay();
+		if (replayed > 0){
+			logMessage(LOG_WARNING_LEVEL, "HDD_IO : replayed %d journaled directory changes", replayed);
+		}
+		if (replayed == -1 || journalCompact() == -1){
+			return -1;
+		}
+	}
+
+	if (hdd_stripe_init() == -1){ // striped files need their servers
+		return -1;
+	}
+	packStart();
+	return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_unmount
+// Description  : Writes back the changed directory B-tree nodes and the
+//                superblock, then saves and closes the device and saves the
+//                block cache
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+//
+uint16_t hdd_unmount(void) {
+	uint32_t blockSize = sizeof(superblock); 
+
+	// containers left without a file go, the rest wait for the next mount
+	packHalt();
+	if (packMax > 0){
+		packCompact(0);
+	}
+	superblock.mounted = 0;
+	superblock.journalEpoch++; // the directory saved holds every journaled change
+	if (saveDirectory() == -1){ // save the changed nodes and current superblock
+		superblock.mounted = 1;
+		superblock.journalEpoch--;
+		return -1; // failure from hdd data lane
+	}
+	else{
+		metablockSize = blockSize; 
+		journalReport();
+		journalReset();
+		packReport();
+		// send save and close request 
+		HddBitCmd command2 = set_command_save_and_close();
+		HddBitResp response2 = hdd_client_operation(command2, NULL);
+		int result2 = getResult(response2);
+		if (result2 == 1){
+			return -1; // failure from hdd data lane
+		}
+		else{
+			// the connection is closed, the next mount has to initialize again
+			initialize = 0;
+			resetDirectory();
+			hdd_cache_report();
+			hdd_cache_save(); // the blocks stay cached, the next mount checks they are of this file system
+			hdd_stripe_report();
+
+			return (hdd_stripe_close() == -1) ? -1 : 0; // successfully sent save and close request
+		}
+	}
+
+	return -1; 
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_set_mount_mode
+// Description  : Select whether hdd_mount reads the whole directory or only
+//                the superblock
+//
+// Inputs       : mode - HDD_MOUNT_EAGER or HDD_MOUNT_LAZY
+// Outputs      : none
+//
+void hdd_set_mount_mode(HDD_MOUNT_MODE mode) {
+	mountMode = mode;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_set_journal
+// Description  : Set the size of the journal that hdd_format, or hdd_mount
+//                of a file system without one, gives the file system. A
+//                file system keeps its journal once it has one
+//
+// Inputs       : kb - the journal size in KiB, 0 for none
+// Outputs      : none
+//
+void hdd_set_journal(uint32_t kb) {
+	journalKB = kb;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_journal_commit
+// Description  : Wait until every entry change logged so far is in the
+//                journal, as hdd_pwrite does after changing an entry
+//
+// Inputs       : none
+// Outputs      : 0 if successful (or there is no journal), -1 if failure
+//
+int hdd_journal_commit(void) {
+	return journalCommit();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_journal_stats
+// Description  : Get the counters of the journal since it was last mounted
+//
+// Inputs       : records - set to the records written
+//                groups - set to the group commits that wrote them
+//                compactions - set to the directory saves that emptied it
+// Outputs      : none
+//
+void hdd_journal_stats(uint64_t *records, uint64_t *groups, uint64_t *compactions) {
+	pthread_mutex_lock(&journalLock);
+	*records = journalRecords;
+	*groups = journalGroups;
+	*compactions = journalCompactions;
+	pthread_mutex_unlock(&journalLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_set_pack
+// Description  : Set the size up to which files are packed into shared
+//                container blocks, taking effect at the next mount for the
+//                compactor. Files packed before stay readable without it
+//
+// Inputs       : bytes - the largest file packed, 0 for none
+// Outputs      : none
+//
+void hdd_set_pack(uint32_t bytes) {
+	packMax = (bytes > HDD_PACK_MAX_FILE) ? HDD_PACK_MAX_FILE : bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pack_fits
+// Description  : Tell whether a file of the given size is packed
+//
+// Inputs       : size - the file size
+// Outputs      : 1 if it is packed, 0 if not
+//
+int hdd_pack_fits(uint32_t size) {
+	return (size > 0 && size <= packMax);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : hdd_unmount
-// Description  : ????
+// Function     : hdd_set_inline
+// Description  : Set the largest file kept inline in its directory entry,
+//                read and written with the directory and journal and never
+//                with a block operation of their own. Files growing past it
+//                move out, packed or to blocks of their own
 //
-// Inputs       : ????
-// Outputs      : ????
+// Inputs       : bytes - the largest inline file, 0 for none
+// Outputs      : none
 //
-uint16_t hdd_unmount(void) {
-	int *data = file; // data buffer points to global array 
+void hdd_set_inline(uint32_t bytes) {
+	inlineMax = (bytes > HDD_INLINE_MAX) ? HDD_INLINE_MAX : bytes;
+}
 
-	uint32_t blockSize = sizeof(file); 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_inline_fits
+// Description  : Tell whether a file of the given size is kept inline
+//
+// Inputs       : size - the file size
+// Outputs      : 1 if it is inline, 0 if not
+//
+int hdd_inline_fits(uint32_t size) {
+	return (size > 0 && size <= inlineMax);
+}
 
-	HddBitCmd command = set_metablock_command(HDD_BLOCK_OVERWRITE, blockSize); // save current state of struct
-	HddBitResp response = hdd_client_operation(command, data);
-	int result = getResult(response);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pack_compact
+// Description  : Run a compactor pass now, moving the files of closed
+//                containers at most half used and deleting them
+//
+// Inputs       : none
+// Outputs      : the containers left for another pass, -1 if failure
+//
+int hdd_pack_compact(void) {
+	return packCompact(HDD_PACK_COMPACT_LIVE);
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pack_stats
+// Description  : Get the packing counters since the file system was mounted
+//
+// Inputs       : containers - set to the containers opened
+//                reads - set to the containers read whole (without the cache)
+//                freed - set to the containers compacted and deleted
+//                moved - set to the files the compactor moved
+// Outputs      : none
+//
+void hdd_pack_stats(uint64_t *containers, uint64_t *reads, uint64_t *freed, uint64_t *moved) {
+	pthread_mutex_lock(&packLock);
+	*containers = packContainers;
+	*reads = packReads;
+	*freed = packFreed;
+	*moved = packMoved;
+	pthread_mutex_unlock(&packLock);
+}
 
-	if (result == -1){
-		return -1; // failure from hdd data lane
-	}
-	else{
-		metablockSize = blockSize; 
-		// send save and close request 
-		HddBitCmd command2 = set_command_save_and_close();
-		HddBitResp response2 = hdd_client_operation(command2, NULL);
-		int result2 = getResult(response2);
-		if (result2 == -1){
-			return -1; // failure from hdd data lane
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_open
+// Description  : Opens a new handle on the file, creating its entry if the
+//                name is new. The directories on the path must exist, and a
+//                file may be open under several handles at once
+//
+// Inputs       : path - the file path, components separated by "/"
+// Outputs      : the file handle, -1 if failure
+//
+int16_t hdd_open(char *path) {
+	char name[MAX_FILENAME_LENGTH];
+	HddBtreeCursor c;
+	uint32_t dir, ino;
+	int16_t fh = -1;
+	int found = 0;
+
+	pthread_mutex_lock(&dirLock);
+	if ((dir = resolvePath(path, name)) != 0 && (found = lookupEntry(dir, name, &ino, &c)) != -1){
+		if (found == 1 && (ino = createEntry(&c, dir, name, HDD_INODE_FILE, 0)) != HDD_NO_INODE){ // new file
+			journalLog(ino);
 		}
-		else{
-			// create the meta block and default global structure to it 
-			int k; 
-			for (k = 0; k < 1024; k++){
-				file[k].fileHandle = 0;
-				file[k].open = 0;
-				file[k].exist = 0;
-				file[k].name[0] = '\0'; 
-				file[k].seekLocation = 0;
-				file[k].blockSize = 0; 
-			}
-
-
-			return 0; // successfully sent save and close request
+		if (ino != HDD_NO_INODE && INODE_TYPE(ino) != HDD_INODE_DIR){
+			fh = newHandle(ino);
 		}
 	}
+	pthread_mutex_unlock(&dirLock);
+	if (found == 1){
+		journalCommit(); // a failure leaves the entry to be saved at unmount
+	}
+	return fh;
+}
 
-	return -1; 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_mkdir
+// Description  : Creates a directory, the directories above it must exist
+//
+// Inputs       : path - the directory path, components separated by "/"
+// Outputs      : 0 if successful, -1 if failure (or the name exists)
+//
+int16_t hdd_mkdir(char *path) {
+	char name[MAX_FILENAME_LENGTH];
+	HddBtreeCursor c;
+	uint32_t dir, ino;
+	int16_t ret = -1;
+
+	pthread_mutex_lock(&dirLock);
+	if ((dir = resolvePath(path, name)) != 0 && lookupEntry(dir, name, &ino, &c) == 1 &&
+		(ino = createEntry(&c, dir, name, HDD_INODE_DIR, superblock.nextDir)) != HDD_NO_INODE){
+		superblock.nextDir++;
+		journalLog(ino);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&dirLock);
+	if (ret == 0){
+		journalCommit();
+	}
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : hdd_open
-// Description  : ????
+// Function     : hdd_opendir
+// Description  : Starts listing a directory, optionally only the names that
+//                start with a prefix
 //
-// Inputs       : ????
-// Outputs      : ????
+// Inputs       : path - the directory path, "" or "/" for the root
+//                prefix - the names to list, NULL for every name
+//                dir - the listing to set up
+// Outputs      : 0 if successful, -1 if the directory does not exist
 //
-int16_t hdd_open(char *path) {
+int16_t hdd_opendir(char *path, char *prefix, HddDir *dir) {
+	pthread_mutex_lock(&dirLock);
+	dir->dir = resolvePath(path, NULL);
+	pthread_mutex_unlock(&dirLock);
+
+	strncpy(dir->prefix, (prefix == NULL) ? "" : prefix, MAX_FILENAME_LENGTH - 1);
+	dir->prefix[MAX_FILENAME_LENGTH - 1] = '\0';
+	dir->last[0] = '\0';
+	dir->started = 0;
+	dir->node = HDD_BTREE_NONE;
+	return (dir->dir == 0) ? -1 : 0;
+}
 
-	// loop through files in structure 
-	int i; 
-	for( i = 0; i <1024; i++){
-		int x = strcmp((char*)file[i].name, path);
-		if(x == 0){ // if there is already a designated file handle for that path 
-			file[i].open = 1;
-			return i;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_readdir
+// Description  : Gets the next entry of a listing, in name order. Resumes
+//                from the leaf position of the previous entry when the tree
+//                has not moved it, else by a lookup of the previous name
+//
+// Inputs       : dir - the listing from hdd_opendir
+//                entry - the entry to fill
+// Outputs      : 1 with an entry, 0 at the end of the listing, -1 if failure
+//
+int16_t hdd_readdir(HddDir *dir, HddDirEntry *entry) {
+	HddBtreeCursor c;
+	HddBtreeNode *leaf = NULL;
+	uint32_t index = 0, ino;
+	int16_t ret = -1;
+	int end;
+
+	pthread_mutex_lock(&dirLock);
+	if (dir->started && dir->node < btNodeCount && btNode[dir->node]->leaf && dir->index + 1 < btNode[dir->node]->count){
+		ino = btNode[dir->node]->ino[dir->index];
+		if (INODE_DIR(ino) == dir->dir && strcmp(INODE_NAME(ino), dir->last) == 0){
+			leaf = btNode[dir->node]; // the next entry is in the same leaf
+			index = dir->index + 1;
 		}
 	}
-
-	int j; 
-	for(j = 0; j<1024; j++){
-		int y= strcmp("\0", (char*)file[j].name);
-		if(y == 0){
-			file[j].open = 1; // initialize open to 1 (1 = open, 0 = closed)
-			//int size = sizeof(path); 
-			strcpy(file[j].name, path); // copy path to file name variable 
-			file[j].blockID = 0;
-			file[j].fileHandle = j;
-			file[j].seekLocation = 0;
-			file[j].exist = 1; 
-			file[j].blockSize = 0; // initialize blockSize to zero
-			return j; 
+	if (leaf == NULL){
+		if (btreeSeek(&c, dir->dir, dir->started ? dir->last : dir->prefix, dir->started) == -1 ||
+			(end = btreeNextLeaf(&c)) == -1){
+			pthread_mutex_unlock(&dirLock);
+			return -1;
 		}
+		if (end == 0){
+			dir->node = c.node[c.depth - 1];
+			leaf = btNode[dir->node];
+			index = c.index[c.depth - 1];
+		}
+	}
 
+	ret = 0;
+	if (leaf != NULL){
+		ino = leaf->ino[index];
+		if (INODE_DIR(ino) == dir->dir && strncmp(INODE_NAME(ino), dir->prefix, strlen(dir->prefix)) == 0){
+			strcpy(entry->name, INODE_NAME(ino));
+			entry->isDir = (INODE_TYPE(ino) == HDD_INODE_DIR);
+			entry->size = entry->isDir ? 0 : INODE(ino).blockSize;
+			strcpy(dir->last, entry->name);
+			dir->index = index;
+			dir->started = 1;
+			ret = 1;
+		}
 	}
-	return -1;
+	pthread_mutex_unlock(&dirLock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : hdd_close
-// Description  : ????
+// Description  : Closes a handle, the file stays in the directory
 //
-// Inputs       : ????
-// Outputs      : ????
+// Inputs       : fh - the file handle
+// Outputs      : 0 if successful, -1 if the handle was not open
 //
 int16_t hdd_close(int16_t fh) {
-	if (file[fh].open == 1){  
-		file[fh].open = 0; // set file to closed (open = 1, closed = 0)
-		file[fh].seekLocation = 0; 
-		return 0;
-	}
-	
-	else{ //the file was already closed 
+	int16_t ret = -1;
+	pthread_rwlock_t *lock;
+
+	if (fh < 0 || fh >= MAX_HDD_FILEDESCR){
 		return -1;
 	}
-
-
+	// Take the inode lock before dirLock (the file lock is always taken first) so no
+	// I/O is between lockFile and unlockFile on the handle while it is cleared
+	lockFile(fh, 1, 1);
+	lock = handleLock(fh);
+	pthread_mutex_lock(&dirLock);
+	if (isOpenHandle(fh)){  
+		handle[fh].ino = HDD_NO_INODE; // set the handle to closed
+		handle[fh].seekLocation = 0; 
+		handleFree[handleFreeCount++] = fh;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&dirLock);
+	pthread_rwlock_unlock(lock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : hdd_read
-// Description  : ????
+// Function     : hdd_pread
+// Description  : Reads up to "count" bytes at position "loc" of the file
+//                without using or changing the handle's seek position. Safe
+//                to call concurrently with other positional calls on the
+//                same handle
 //
-// Inputs       : ????
-// Outputs      : ????
+// Inputs       : fh - the file handle
+//                data - the buffer to read into
+//                count - the number of bytes to read
+//                loc - the position in the file to read from
+// Outputs      : the number of bytes read (short at end of file), -1 if failure
 //
-int32_t hdd_read(int16_t fh, void * data, int32_t count) {
+int32_t hdd_pread(int16_t fh, void *data, int32_t count, uint32_t loc) {
+	if (fh < 0 || fh >= MAX_HDD_FILEDESCR){
+		return -1;
+	}
+	lockFile(fh, 0, 1);
+	int32_t blockSize;
+	HddBlockID blockID;
+	int type = hdd_entry_get(fh, &blockID, &blockSize);
+
+	if (type == -1 || (blockID == 0 && type != HDD_INODE_INLINE) || loc > blockSize){ // file is closed, block does not exist or past the end
+		unlockFile(fh);
+		return -1; // failure 
+	}
+
+	// an inline file is read out of its entry, without the server
+	if (type == HDD_INODE_INLINE){
+		if (blockSize < loc + count){
+			count = blockSize - loc;
+		}
+		memcpy(data, INLINE_DATA(INODE_OFFSET(handle[fh].ino)) + loc, count);
+		unlockFile(fh);
+		return count;
+	}
+
+	// a striped file is read from all of its servers at once
+	if (type == HDD_INODE_STRIPED){
+		if (blockSize < loc + count){
+			count = blockSize - loc;
+		}
+		int ret = hdd_stripe_read(blockID, data, loc, count);
+		unlockFile(fh);
+		return (ret == -1) ? -1 : count;
+	}
+
+	// a packed file is read out of its container
+	if (type == HDD_INODE_PACKED){
+		if (blockSize < loc + count){
+			count = blockSize - loc;
+		}
+		uint32_t ino = handle[fh].ino;
+		int ret = (count == 0) ? 0 : packRead(blockID, INODE_GEN(ino), data, INODE_OFFSET(ino) + loc, count, 1);
+		unlockFile(fh);
+		return (ret == -1) ? -1 : count;
+	}
 
-	int32_t blockSize = file[fh].blockSize; //new for assign 4
-	//blockSize = hdd_read_block_size(file[fh].blockID, HDD_NULL_FLAG); // get blockSize for fh 
+	// a cached block is read without the server, a miss caches the whole block
+	if (hdd_cache_fits(blockSize)){
+		if (blockSize < loc + count){
+			count = blockSize - loc;
+		}
+		int ret = hdd_cache_fetch(blockID, blockSize, INODE_GEN(handle[fh].ino), data, loc, count); // while locked, so no writer can slip in
+		unlockFile(fh);
+		return (ret == -1) ? -1 : count;
+	}
+
+	// v2 reads just the range asked for, straight into the caller's buffer
+	if (hdd_client_protocol() == HDD_PROTOCOL_V2){
+		if (blockSize < loc + count){
+			count = blockSize - loc;
+		}
+		HddRequest req = { .op = HDD_BLOCK_READ, .flags = HDD_NULL_FLAG, .blockID = blockID, .offset = loc, .length = count };
+		int ret = (count == 0) ? 0 : hdd_client_request(&req, data);
+		unlockFile(fh);
+		return (ret == -1) ? -1 : count;
+	}
 
 	//Create pointer to populate with current data in the block 
 	char *oldData;  
 	oldData =  (char*) malloc(blockSize); //allocate size of oldData to be blockSize
-	HddBitCmd command = set_block_read(file[fh].blockID, blockSize); 
+	HddBitCmd command = set_block_read(blockID, blockSize); 
 	HddBitResp response = hdd_client_operation(command, oldData); // store data from read in the oldData buffer
+	unlockFile(fh);
 			
-	int result = getResult(response);
-	if (result == 1 || file[fh].blockID == 0 || file[fh].open == 0){ //if hdd_client_operation failed, or block does not exist or file is closed 
+	if (getResult(response) == 1){ //if hdd_client_operation failed
+		free(oldData);
 		return -1; // failure 
 	}	
-	
-		
-	else{	
-		int condition = count + file[fh].seekLocation; 
-
-		// if count + seek position is greater than block size, read bytes from seek to blocksize 
-		if (blockSize < condition){
-			int copySize = blockSize - file[fh].seekLocation; // amount of data that is read
-			memcpy(data, oldData + file[fh].seekLocation, copySize); // copy current data read to data buffer
-			
-			free(oldData); // free mem in oldData pointer to prevent mem leak 
-
-			// update global data structure 
-			file[fh].seekLocation = blockSize; 
-				 
-			return copySize;
-		}
 
-		//else, read bytes from seek to seek+count 
-		else{ 
-			memcpy(data, oldData + file[fh].seekLocation, count); // copy current data read to data buffer
-			
-			free(oldData); // free mem in oldData pointer to prevent mem leak 
-
-			// update global data structure 
-			file[fh].seekLocation = file[fh].seekLocation + count;
-
-			return count; 
-		}
+	// if count + seek position is greater than block size, read bytes from loc to blocksize 
+	if (blockSize < loc + count){
+		count = blockSize - loc; // amount of data that is read
 	}
-	return -1;
+	memcpy(data, oldData + loc, count); // copy current data read to data buffer
+	free(oldData); // free mem in oldData pointer to prevent mem leak 
+
+	return count;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : hdd_write
-// Description  : ????
+// Function     : hdd_pwrite
+// Description  : Writes "count" bytes at position "loc" of the file without
+//                using or changing the handle's seek position, growing the
+//                file when the write runs past its end. Safe to call
+//                concurrently with other positional calls on the same handle
 //
-// Inputs       : ????
-// Outputs      : ????
+// Inputs       : fh - the file handle
+//                data - the buffer to write from
+//                count - the number of bytes to write
+//                loc - the position in the file to write at (at most the file size)
+// Outputs      : the number of bytes written, -1 if failure
 //
-int32_t hdd_write(int16_t fh, void *data, int32_t count) {
-	if (file[fh].seekLocation + count > HDD_MAX_BLOCK_SIZE || file[fh].open == 0){ // if the size to write exceeds Max or file is closed
+int32_t hdd_pwrite(int16_t fh, void *data, int32_t count, uint32_t loc) {
+	if (fh < 0 || fh >= MAX_HDD_FILEDESCR){
+		return -1;
+	}
+	lockFile(fh, 1, 1);
+	int32_t blockSize;
+	HddBlockID blockID;
+	int type = hdd_entry_get(fh, &blockID, &blockSize);
+	int64_t limit = (type == HDD_INODE_STRIPED || hdd_stripe_fits((uint64_t)loc + count)) ? HDD_STRIPE_MAX_FILE : hdd_client_max_block_size();
+	if (type == -1 || (int64_t)loc + count > limit || loc > blockSize){ // if the file is closed, the size to write exceeds Max or write leaves a hole
+		unlockFile(fh);
 		return -1; // return failure 
 	}
+	uint32_t generation = hdd_entry_touch(fh); // the block's generation before this write
+	int32_t newSize = (loc + count > blockSize) ? loc + count : blockSize;
+
+	// a striped file is written to all of its servers at once
+	if (type == HDD_INODE_STRIPED){
+		int ret = hdd_stripe_write(&blockID, data, loc, count);
+		if (blockID != HDD_NO_BLOCK){
+			hdd_entry_set(fh, blockID, (ret == -1) ? blockSize : newSize); // the map may have moved
+		}
+		unlockFile(fh);
+		journalCommit();
+		return (ret == -1) ? -1 : count;
+	}
 
-	// if block ID in global structure equals zero
-	// the block has not yet been created and seek position = 0 
-	if (file[fh].blockID == 0){
-		HddBitCmd command = set_block_create(file[fh].blockID, count); // use helper function 
-		HddBitResp response = hdd_client_operation(command, data); 
-		int result = getResult(response); // use helper function 
-		if (result == 1 ){ // failure response from hdd_client_operation
+	// tiny files are kept in their entry, and leave it once they grow
+	if (type == HDD_INODE_INLINE || (blockID == 0 && newSize > 0 && newSize <= (int32_t)inlineMax)){
+		int ret = inlineWrite(fh, blockSize, data, count, loc);
+		unlockFile(fh);
+		journalCommit();
+		return (ret == -1) ? -1 : count;
+	}
+
+	// small files are packed into a shared container, and leave it once they grow
+	if (type == HDD_INODE_PACKED || (blockID == 0 && newSize > 0 && newSize <= (int32_t)packMax)){
+		int ret = packWrite(fh, blockID, blockSize, generation, data, count, loc);
+		unlockFile(fh);
+		journalCommit();
+		return (ret == -1) ? -1 : count;
+	}
+
+	// a file growing large enough is striped, its block becomes the first stripes
+	if (hdd_stripe_fits(newSize)){
+		HddBlockID map = HDD_NO_BLOCK;
+		char *newData = malloc(newSize);
+		if (newData == NULL){
+			unlockFile(fh);
 			return -1;
 		}
-		else{ // hdd_client_operation passed 
-			file[fh].blockID = getBlockID(response); // store block ID in global struct
-			file[fh].seekLocation = count; // the seek position of the file becomes the count 
-			file[fh].blockSize = count; // new for assign 4
-
-			return count;
+		if (blockID != 0 && (loc > 0 || loc + count < blockSize) && hdd_cache_read(blockID, blockSize, generation, newData, 0, blockSize) == 0){
+			HddRequest req = { .op = HDD_BLOCK_READ, .flags = HDD_NULL_FLAG, .blockID = blockID, .length = blockSize };
+			if (hdd_client_request(&req, newData) == -1){
+				free(newData);
+				unlockFile(fh);
+				return -1;
+			}
 		}
-		
+		memcpy(newData + loc, data, count);
+		int ret = hdd_stripe_write(&map, newData, 0, newSize);
+		free(newData);
+		if (ret == -1){
+			unlockFile(fh); // the old block is untouched
+			return -1;
+		}
+		if (blockID != 0){
+			hdd_cache_invalidate(blockID);
+			HddBitResp delresponse = hdd_client_operation(set_delete_block_command(blockID), NULL);
+			if (getResult(delresponse) == 1){
+				logMessage(LOG_WARNING_LEVEL, "HDD_IO : failed deleting block %u of a file now striped", blockID);
+			}
+		}
+		setStriped(fh, map, newSize);
+		unlockFile(fh);
+		journalCommit();
+		return count;
 	}
 
-	//if blockID exists 
-	else{
-		int32_t blockSize = file[fh].blockSize; // new for assign 4
-		
-		int condition = file[fh].seekLocation + count; // total bytes of data to be written
+	// if block ID in global structure equals zero
+	// the block has not yet been created and the file is empty
+	if (blockID == 0){
+		HddRequest req = { .op = HDD_BLOCK_CREATE, .flags = HDD_NULL_FLAG, .length = count };
+		if (hdd_client_request(&req, data) == -1){ // failure response from the server
+			unlockFile(fh);
+			return -1;
+		}
 
-		if ( blockSize < condition){ 
-		// the block size is less than the the size of data
+		hdd_entry_set(fh, req.blockID, count); // store block ID and size in the inode
+		hdd_cache_insert(req.blockID, superblock.session, req.version, data, count);
+		unlockFile(fh);
+		journalCommit();
+		return count;
+	}
 
-			char *oldData; //pointer for old data in block 
-			oldData =  (char*) malloc(blockSize); //allocate size of oldData to be blockSize
+	// the block exists, merge the new data into its current contents 
+	int32_t condition = loc + count; // end of the data to be written
 
-			HddBitCmd command = set_block_read(file[fh].blockID, blockSize);
-			HddBitResp response = hdd_client_operation(command, oldData); // point to memory location of oldData 
-			
-			int result = getResult(response);
-			if (result == 1){
-				return -1; // failure response from hdd_client_operation 
-			}	
-			
-			else{
-				// create data buffer with old data at seek point and appended new 
-				// data (from input buffer)
-				char *newData;
-				newData = (char*) malloc(condition ); 
-				memcpy(newData, oldData, file[fh].seekLocation); // append old data to seek
-				memcpy(newData + file[fh].seekLocation , data, count); // append new data 
-				free(oldData); // free memory used no longer to prevent memory leak 
-			
-				// delete old block
-				HddBitCmd delcommand = set_delete_block_command(file[fh].blockID); 
-				HddBitCmd delresponse = hdd_client_operation(delcommand, NULL);
-				int del = getResult(delresponse);
-
-				if (del == 1){
-					return -1; // failure response from deleting block using hdd client operation 
-				} 
-				
-				else{
-					HddBitCmd command = set_block_create(0, condition); // set blockID to zero 
-					HddBitResp response = hdd_client_operation(command, newData); 
-					int result = getResult(response);
-
-					if (result == 1){ // failure response from hdd_client_operation
-						return -1;
-					}
-
-					else{ // hdd_client_operation passed 
-						free(newData); // free mem no longer used to prevent memory leak 
-						file[fh].blockID = getBlockID(response); // store block ID 		
-						file[fh].blockSize = condition; // assign4 update global block size
-						file[fh].seekLocation = condition; // new block size
-
-						return count; 
-					}
-				};
-			}
+	// v2 overwrites just the range written when the block does not grow
+	if (hdd_client_protocol() == HDD_PROTOCOL_V2 && condition <= blockSize){
+		int ret = (count == 0) ? 0 : hdd_cache_write(blockID, generation, superblock.session, data, loc, count);
+		unlockFile(fh);
+		return (ret == -1) ? -1 : count;
+	}
+	// read the old block straight into a buffer big enough for the result
+	char *newData;
+	newData = (char*) malloc(newSize);
+	if ((loc > 0 || condition < blockSize) && hdd_cache_read(blockID, blockSize, generation, newData, 0, blockSize) == 0){ // nothing to keep if the write covers the whole block 
+		HddBitCmd command = set_block_read(blockID, blockSize);
+		HddBitResp response = hdd_client_operation(command, newData);
+		if (getResult(response) == 1){
+			free(newData);
+			unlockFile(fh);
+			return -1; // failure response from hdd_client_operation 
 		}
-		
-		else{ // the block size can fit the the data to be appended 
-			char *oldData; //pointer for old data in block 
-			oldData =  (char*) malloc(blockSize); //allocate size of oldData to be blockSize
+	}
+	memcpy(newData + loc, data, count); // write count data at loc
+
+	if (newSize == blockSize){ 
+		// the block size can fit the the data, overwrite block with new data
+		HddBitCmd command = set_block_overwrite(blockID, blockSize);
+		HddBitResp response = hdd_client_operation(command, newData);
+		if (getResult(response) == 1){
+			hdd_cache_invalidate(blockID);
+		}
+		else{
+			hdd_cache_update(blockID, generation, superblock.session, newData, 0, blockSize);
+		}
+		free(newData); // free mem no longer used
+		unlockFile(fh);
+		return (getResult(response) == 1) ? -1 : count;
+	}
 
-			HddBitCmd command = set_block_read(file[fh].blockID, blockSize);
-			HddBitResp response = hdd_client_operation(command, oldData); // point to memory location of oldData 
-			
-			int result = getResult(response);
-			if (result == 1){
-				free(oldData);
-				return -1; // failure response from hdd_client_operation 
-			}	
-			
-			else{
-				if(condition == blockSize){ // when the block size = seek position + count 
-				
-					char *newData;
-					newData = (char*) malloc(blockSize);
-					memcpy(newData, oldData, file[fh].seekLocation); // write old data up to seek location 
-					memcpy(newData+file[fh].seekLocation, data, count); // write count data up to blockSize
-					
-					free(oldData); // free mem no longer used to prevent memory leak 
-
-					// overwrite block with new data
-					HddBitCmd command = set_block_overwrite(file[fh].blockID, blockSize);
-					HddBitResp response = hdd_client_operation(command, newData);
-					int result = getResult(response);
-
-					if (result == 1){
-						free(newData);
-						return -1; // failure from hdd_client_operation
-					}
-					
-					else {
-						free(newData); // free mem no longer used;
-						file[fh].seekLocation = condition;
-
-						return count; 
-					}	
-				}
-				
-				else{ //block size > seek position + count
-					char *newData;
-					newData = (char*) malloc(blockSize);
-					memcpy(newData, oldData, file[fh].seekLocation); // write old data up to seek location
-					memcpy(newData + file[fh].seekLocation, data, count); // write count data up to seekLocation + count
-
-					int leftoverPos = blockSize - file[fh].seekLocation - count; // amount of old data after the overwritten
-					memcpy(newData + file[fh].seekLocation + count, oldData + file[fh].seekLocation + count, leftoverPos);
-					
-					free (oldData); // free memory 
-
-					// overwrite block with new data
-					HddBitCmd command = set_block_overwrite(file[fh].blockID, blockSize);
-					HddBitResp response = hdd_client_operation(command, newData);
-					int result = getResult(response);
-
-					if (result == 1){
-						free(newData);
-						return -1;
-					}
-					
-					else {
-						free(newData); // free mem no longer used
-						file[fh].seekLocation = condition;
-
-						return count; 
-					}						
-				}
+	// the block size is less than the the size of data, replace the block
+	hdd_cache_invalidate(blockID); // its ID can be handed out again
+	HddBitCmd delcommand = set_delete_block_command(blockID); 
+	HddBitResp delresponse = hdd_client_operation(delcommand, NULL);
+	if (getResult(delresponse) == 1){
+		free(newData);
+		unlockFile(fh);
+		return -1; // failure response from deleting block using hdd client operation 
+	} 
+
+	HddRequest req = { .op = HDD_BLOCK_CREATE, .flags = HDD_NULL_FLAG, .length = newSize };
+	if (hdd_client_request(&req, newData) == -1){ // failure response from the server
+		free(newData);
+		hdd_entry_set(fh, 0, 0); // the old block is gone
+		unlockFile(fh);
+		journalCommit();
+		return -1;
+	}
 
-			}
+	hdd_cache_insert(req.blockID, superblock.session, req.version, newData, newSize);
+	free(newData); // free mem no longer used to prevent memory leak 
+	hdd_entry_set(fh, req.blockID, newSize); // store block ID and size in the inode
+	unlockFile(fh);
+	journalCommit(); // a failure leaves the entry to be saved at unmount
+	return count; 
+}
 
-		} 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_read
+// Description  : Reads "count" bytes from the seek position and advances it
+//
+// Inputs       : fh - the file handle
+//                data - the buffer to read into
+//                count - the number of bytes to read
+// Outputs      : the number of bytes read, -1 if failure
+//
+int32_t hdd_read(int16_t fh, void * data, int32_t count) {
+	if (fh < 0 || fh >= MAX_HDD_FILEDESCR){
+		return -1;
 	}
-	return -1;
+	int32_t bytes = hdd_pread(fh, data, count, handle[fh].seekLocation);
+	if (bytes != -1){
+		handle[fh].seekLocation = handle[fh].seekLocation + bytes; // update the handle 
+	}
+	return bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_write
+// Description  : Writes "count" bytes at the seek position and advances it
+//
+// Inputs       : fh - the file handle
+//                data - the buffer to write from
+//                count - the number of bytes to write
+// Outputs      : the number of bytes written, -1 if failure
+//
+int32_t hdd_write(int16_t fh, void *data, int32_t count) {
+	if (fh < 0 || fh >= MAX_HDD_FILEDESCR){
+		return -1;
+	}
+	int32_t bytes = hdd_pwrite(fh, data, count, handle[fh].seekLocation);
+	if (bytes != -1){
+		handle[fh].seekLocation = handle[fh].seekLocation + bytes;
+	}
+	return bytes;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -635,15 +3049,12 @@ int32_t hdd_write(int16_t fh, void *data, int32_t count) {
 // Outputs      : ????
 //
 int32_t hdd_seek(int16_t fh, uint32_t loc) {
-	int32_t blockSize;
-	blockSize = file[fh].blockSize; // get blockSize for fh 
-
-	if(blockSize < loc || loc < 0 || file[fh].open == 0){ // if the seeking is out of range with the file 
+	if (isOpenHandle(fh) == 0 || INODE(handle[fh].ino).blockSize < loc){ // if the file is closed or the seeking is out of range with the file 
 		return -1;
 	}
 	
 	else{
-		file[fh].seekLocation = loc; 
+		handle[fh].seekLocation = loc; 
 		
 		return 0;
 	}
@@ -654,6 +3065,73 @@ int32_t hdd_seek(int16_t fh, uint32_t loc) {
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_fsync
+// Description  : Makes the file's directory entry durable without unmounting.
+//                With a journal that is a group commit of the changes logged
+//                so far, else the changed directory nodes and the superblock
+//                are written. Every changed node is written, a leaf alone
+//                could disagree with interior nodes that have since split
+//
+// Inputs       : fh - the file handle
+// Outputs      : 0 if successful, -1 if failure
+//
+int16_t hdd_fsync(int16_t fh) {
+	int16_t ret = -1;
+
+	if (superblock.journalBlock != 0){
+		return isOpenHandle(fh) ? journalCommit() : -1;
+	}
+	pthread_mutex_lock(&dirLock);
+	if (isOpenHandle(fh)){
+		ret = saveDirectory();
+	}
+	pthread_mutex_unlock(&dirLock);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : packTestCheck
+// Description  : Check the files of the packing (or inline) test, byte pos
+//                of file i in version v is (i * 31 + pos * 7 + v * 101)
+//
+// Inputs       : dir - the directory of the files
+//                size - the size of each file
+//                version - the version of each file
+// Outputs      : 0 if every file matches, -1 if not
+//
+int packTestCheck(char *dir, int32_t *size, uint8_t *version) {
+	char path[MAX_FILENAME_LENGTH], buf[HDD_IO_UNIT_TEST_PACK * 8];
+	HddBlockID blockID;
+	int32_t i, pos, blockSize;
+	int16_t fh;
+	int type;
+
+	for (i = 0; i < HDD_IO_UNIT_TEST_PACK_FILES; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", dir, i);
+		if (((fh = hdd_open(path)) == -1) || (hdd_pread(fh, buf, sizeof(buf), 0) != size[i])) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : packed file %s is not %d bytes.", path, size[i]);
+			return(-1);
+		}
+		lockFile(fh, 0, 1);
+		type = hdd_entry_get(fh, &blockID, &blockSize);
+		unlockFile(fh);
+		if (hdd_close(fh) || ((type == HDD_INODE_INLINE) != hdd_inline_fits(size[i]))) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : file %s of %d bytes is %sinline.", path, size[i], (type == HDD_INODE_INLINE) ? "" : "not ");
+			return(-1);
+		}
+		for (pos = 0; pos < size[i]; pos++) {
+			if (buf[pos] != (char)(i * 31 + pos * 7 + version[i] * 101)) {
+				logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : packed file %s differs at %d.", path, pos);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : hddIOUnitTest
@@ -811,15 +3289,157 @@ int hddIOUnitTest(void) {
 		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure close close.", fh);
 		return(-1);
 	}
-	free(cio_utest_buffer);
-	free(tbuf);
-
-	// Format and mount the file system
 	if (hdd_unmount()) {
 		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure on unmount operation.");
 		return(-1);
 	}
 
+	// Crash with a journal: changes committed to it but never saved in the
+	// directory have to be there after the next mount, an async write that
+	// grew a file is committed before it completes
+	HddAsyncRing ring;
+	HddAsyncSqe *sqe;
+	HddAsyncCqe *cqe;
+	int32_t result = -1;
+	uint32_t kb = journalKB;
+	hdd_set_journal(HDD_IO_UNIT_TEST_JOURNAL_KB);
+	for (i = 0; i < CIO_UNIT_TEST_MAX_WRITE_SIZE; i++) {
+		cio_utest_buffer[i] = (char)getRandomValue(0, 0xff);
+	}
+	if (hdd_format() || hdd_mount() || hdd_mkdir("journaled") || ((fh = hdd_open("journaled/file")) == -1) ||
+		(hdd_write(fh, cio_utest_buffer, CIO_UNIT_TEST_MAX_WRITE_SIZE) != CIO_UNIT_TEST_MAX_WRITE_SIZE) || hdd_fsync(fh)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure writing a journaled file.");
+		return(-1);
+	}
+	if (((fh = hdd_open("journaled/async")) == -1) || hdd_async_init(&ring, 4)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure opening a journaled async file.");
+		return(-1);
+	}
+	if ((sqe = hdd_async_get_sqe(&ring)) != NULL) {
+		hdd_async_prep_write(sqe, fh, cio_utest_buffer, CIO_UNIT_TEST_MAX_WRITE_SIZE, 0, 0);
+		hdd_async_submit(&ring);
+		if (hdd_async_wait_cqe(&ring, &cqe) == 0) {
+			result = cqe->result;
+			hdd_async_cqe_seen(&ring, cqe);
+		}
+	}
+	if (hdd_async_exit(&ring) || (result != CIO_UNIT_TEST_MAX_WRITE_SIZE)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure writing a journaled async file [%d].", result);
+		return(-1);
+	}
+	if (hdd_mount() || ((fh = hdd_open("journaled/file")) == -1) ||
+		(hdd_read(fh, tbuf, HDD_MAX_BLOCK_SIZE) != CIO_UNIT_TEST_MAX_WRITE_SIZE) ||
+		memcmp(tbuf, cio_utest_buffer, CIO_UNIT_TEST_MAX_WRITE_SIZE) || hdd_close(fh)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : journaled file lost in a crash.");
+		return(-1);
+	}
+	if (((fh = hdd_open("journaled/async")) == -1) || (hdd_pread(fh, tbuf, HDD_MAX_BLOCK_SIZE, 0) != CIO_UNIT_TEST_MAX_WRITE_SIZE) ||
+		memcmp(tbuf, cio_utest_buffer, CIO_UNIT_TEST_MAX_WRITE_SIZE) || hdd_close(fh) || hdd_unmount()) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : journaled async write lost in a crash.");
+		return(-1);
+	}
+	hdd_set_journal(kb);
+	logMessage(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : journal replayed after a crash.");
+
+	// Packed files written in two parts, rewritten larger in the next mount
+	// (some past the packed size) and compacted keep their contents
+	int32_t packSize[HDD_IO_UNIT_TEST_PACK_FILES], pos, half;
+	uint8_t packVersion[HDD_IO_UNIT_TEST_PACK_FILES];
+	uint64_t containers, reads, freed, moved;
+	uint32_t pack = packMax;
+	char path[MAX_FILENAME_LENGTH];
+	hdd_set_pack(HDD_IO_UNIT_TEST_PACK);
+	if (hdd_format() || hdd_mount() || hdd_mkdir("packed")) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure on format or mount operation.");
+		return(-1);
+	}
+	for (i = 0; i < HDD_IO_UNIT_TEST_PACK_FILES * 2; i++) {
+		int32_t f = i % HDD_IO_UNIT_TEST_PACK_FILES;
+		if (i == HDD_IO_UNIT_TEST_PACK_FILES) {
+			if (packTestCheck("packed", packSize, packVersion) || hdd_unmount() || hdd_mount()) {
+				logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : packed/f0 to packed/f%d (offsets 0 to %d) not intact across a remount.",
+						   HDD_IO_UNIT_TEST_PACK_FILES - 1, HDD_IO_UNIT_TEST_PACK - 1);
+				return(-1);
+			}
+		}
+		packVersion[f] = i / HDD_IO_UNIT_TEST_PACK_FILES;
+		packSize[f] = (i < HDD_IO_UNIT_TEST_PACK_FILES) ? 1 + (f * 37) % 900 : (f == 0) ? HDD_IO_UNIT_TEST_PACK * 4 : packSize[f] + 200;
+		if ((i >= HDD_IO_UNIT_TEST_PACK_FILES) && (f % 2 == 1)) {
+			packVersion[f] = 0; // odd files stay as they are
+			packSize[f] = 1 + (f * 37) % 900;
+			continue;
+		}
+		for (pos = 0; pos < packSize[f]; pos++) {
+			cio_utest_buffer[pos] = (char)(f * 31 + pos * 7 + packVersion[f] * 101);
+		}
+		half = packSize[f] / 2;
+		snprintf(path, sizeof(path), "packed/f%d", f);
+		if (((fh = hdd_open(path)) == -1) || (hdd_pwrite(fh, cio_utest_buffer, half, 0) != half) ||
+			(hdd_pwrite(fh, cio_utest_buffer + half, packSize[f] - half, half) != packSize[f] - half) || hdd_close(fh)) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : failed writing packed file %s.", path);
+			return(-1);
+		}
+	}
+	if (packTestCheck("packed", packSize, packVersion) || (hdd_pack_compact() == -1) || packTestCheck("packed", packSize, packVersion)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : packed/f0 to packed/f%d (offsets 0 to %d) not intact around compaction.",
+				   HDD_IO_UNIT_TEST_PACK_FILES - 1, HDD_IO_UNIT_TEST_PACK * 4 - 1);
+		return(-1);
+	}
+	hdd_pack_stats(&containers, &reads, &freed, &moved);
+	if ((freed == 0) || hdd_unmount() || hdd_mount() || packTestCheck("packed", packSize, packVersion) || hdd_unmount()) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : packed files lost or not compacted.");
+		return(-1);
+	}
+	hdd_set_pack(pack);
+	logMessage(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : packed files compacted (%lu containers freed, %lu files moved).",
+			   (unsigned long)freed, (unsigned long)moved);
+
+	// Inline files written in two parts come back from the journal after a
+	// crash, and from their leaves (split as they filled) after a remount.
+	// Rewritten larger some move out to blocks of their own
+	uint32_t inlined = inlineMax;
+	hdd_set_inline(HDD_IO_UNIT_TEST_PACK);
+	hdd_set_journal(HDD_IO_UNIT_TEST_JOURNAL_KB);
+	if (hdd_format() || hdd_mount() || hdd_mkdir("inline")) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure on format or mount operation.");
+		return(-1);
+	}
+	for (i = 0; i < HDD_IO_UNIT_TEST_PACK_FILES * 2; i++) {
+		int32_t f = i % HDD_IO_UNIT_TEST_PACK_FILES;
+		if ((i == HDD_IO_UNIT_TEST_PACK_FILES) && (hdd_mount() || packTestCheck("inline", packSize, packVersion))) { // mounted again without an unmount
+			logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : inline/f0 to inline/f%d (offsets 0 to %d) not replayed after a crash.",
+					   HDD_IO_UNIT_TEST_PACK_FILES - 1, HDD_IO_UNIT_TEST_PACK - 1);
+			return(-1);
+		}
+		packVersion[f] = i / HDD_IO_UNIT_TEST_PACK_FILES;
+		packSize[f] = (i < HDD_IO_UNIT_TEST_PACK_FILES) ? 2 + (f * 37) % 900 : packSize[f] + 300; // halves are not empty
+		if ((i >= HDD_IO_UNIT_TEST_PACK_FILES) && (f % 2 == 1)) {
+			packVersion[f] = 0; // odd files stay as they are
+			packSize[f] = 2 + (f * 37) % 900;
+			continue;
+		}
+		for (pos = 0; pos < packSize[f]; pos++) {
+			cio_utest_buffer[pos] = (char)(f * 31 + pos * 7 + packVersion[f] * 101);
+		}
+		half = packSize[f] / 2;
+		snprintf(path, sizeof(path), "inline/f%d", f);
+		if (((fh = hdd_open(path)) == -1) || (hdd_pwrite(fh, cio_utest_buffer, half, 0) != half) ||
+			(hdd_pwrite(fh, cio_utest_buffer + half, packSize[f] - half, half) != packSize[f] - half) || hdd_close(fh)) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : failed writing inline file %s.", path);
+			return(-1);
+		}
+	}
+	if (packTestCheck("inline", packSize, packVersion) || hdd_unmount() || hdd_mount() ||
+		packTestCheck("inline", packSize, packVersion) || hdd_unmount()) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : inline files lost.");
+		return(-1);
+	}
+	hdd_set_inline(inlined);
+	hdd_set_journal(kb);
+	logMessage(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : inline files kept in their entries.");
+	free(cio_utest_buffer);
+	free(tbuf);
+
 	// Return successfully
 	return(0);
 }
@@ -16,10 +16,43 @@
 // Project include files
 #include <hdd_driver.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Defines
-#define MAX_HDD_FILEDESCR 1024
+#define MAX_HDD_FILEDESCR 32767 // open handles, the most an int16_t handle can name
 #define MAX_FILENAME_LENGTH 128
-
+#define HDD_ROOT_DIR 1 // directory ID of "/"
+
+// Inode types
+#define HDD_INODE_FILE 0
+#define HDD_INODE_DIR 1 // the inode's blockID holds the directory ID
+#define HDD_INODE_STRIPED 2 // a file whose blockID holds its stripe map
+#define HDD_INODE_PACKED 3 // a small file stored at offset in the container blockID
+#define HDD_INODE_INLINE 4 // a tiny file stored in its entry, offset is its inline data slot
+
+// A directory entry returned by hdd_readdir
+typedef struct {
+	char name[MAX_FILENAME_LENGTH]; // name within its directory
+	uint8_t isDir; // 1 for a directory
+	int32_t size; // file size, 0 for a directory
+} HddDirEntry;
+
+// A directory listing in progress, set up by hdd_opendir
+typedef struct {
+	uint32_t dir; // ID of the directory listed
+	char prefix[MAX_FILENAME_LENGTH]; // only names starting with this are listed
+	char last[MAX_FILENAME_LENGTH]; // the name listed last
+	int started; // 0 until the first entry is listed
+	uint32_t node, index; // where the last entry was, to resume without a lookup
+} HddDir;
+
+// Mount modes
+typedef enum {
+	HDD_MOUNT_EAGER = 0, // Read every node of the directory B-tree when mounting
+	HDD_MOUNT_LAZY  = 1, // Read the root node only, the nodes below as lookups reach them
+} HDD_MOUNT_MODE;
 
 // Management operations
 
@@ -32,15 +65,57 @@ uint16_t hdd_mount(void);
 uint16_t hdd_unmount(void);
 	// This function unmounts the current crud file system and saves the file allocation table.
 
+void hdd_set_mount_mode(HDD_MOUNT_MODE mode);
+	// Select how much of the directory hdd_mount reads up front (default eager)
+
+void hdd_set_journal(uint32_t kb);
+	// Journal directory changes in a block of kb KiB (0 none, the default), given
+	// to a file system by hdd_format or by hdd_mount if it has none
+
+int hdd_journal_commit(void);
+	// Group commit the entry changes logged so far to the journal (0 if none)
+
+void hdd_journal_stats(uint64_t *records, uint64_t *groups, uint64_t *compactions);
+	// Counters of the journal since the last mount
+
+void hdd_set_pack(uint32_t bytes);
+	// Pack files of at most bytes (0 none, the default, at most 16 KiB) into
+	// shared container blocks, compacted by a thread while mounted
+
+int hdd_pack_fits(uint32_t size);
+	// 1 if a file of size bytes is packed
+
+void hdd_set_inline(uint32_t bytes);
+	// Keep files of at most bytes (0 none, the default, at most 1 KiB) inline
+	// in their directory entries, read and written without block operations
+
+int hdd_inline_fits(uint32_t size);
+	// 1 if a file of size bytes is kept inline
+
+int hdd_pack_compact(void);
+	// Compact the containers mostly dead now, returns the ones left or -1
+
+void hdd_pack_stats(uint64_t *containers, uint64_t *reads, uint64_t *freed, uint64_t *moved);
+	// Counters of packing since the last mount
+
 //
 // Interface functions
 
 int16_t hdd_open(char *path);
-	// This function opens the file and returns a file handle
+	// This function opens the file and returns a new file handle, a file may be open under several
 
 int16_t hdd_close(int16_t fd);
 	// This function closes the file
 
+int16_t hdd_mkdir(char *path);
+	// Create a directory, the directories above it must exist
+
+int16_t hdd_opendir(char *path, char *prefix, HddDir *dir);
+	// Start listing a directory, only names starting with prefix unless it is NULL
+
+int16_t hdd_readdir(HddDir *dir, HddDirEntry *entry);
+	// Get the next entry in name order, returns 1 with an entry, 0 at the end, -1 if failure
+
 int32_t hdd_read(int16_t fd, void *buf, int32_t count);
 	// Reads "count" bytes from the file handle "fh" into the buffer  "buf"
 
@@ -50,12 +125,63 @@ int32_t hdd_write(int16_t fd, void *buf, int32_t count);
 int32_t hdd_seek(int16_t fd, uint32_t loc);
 	// Seek to specific point in the file
 
+int32_t hdd_pread(int16_t fd, void *buf, int32_t count, uint32_t offset);
+	// Reads "count" bytes at "offset" without touching the seek position
+
+int32_t hdd_pwrite(int16_t fd, void *buf, int32_t count, uint32_t offset);
+	// Writes "count" bytes at "offset" without touching the seek position
+
+int16_t hdd_fsync(int16_t fd);
+	// Makes the file's directory entry durable, a journal group commit or the changed directory nodes
+
+//
+// Block-level helpers, shared with the asynchronous interface (hdd_async.c)
+
+HddBitCmd set_block_create(int32_t blockID, int32_t count);
+	// Command to create a block of "count" bytes
+
+HddBitCmd set_block_read(int32_t blockID, int32_t blockSize);
+	// Command to read a whole block
+
+HddBitCmd set_block_overwrite(int32_t blockID, int32_t blockSize);
+	// Command to overwrite a whole block
+
+HddBitCmd set_delete_block_command(uint64_t blockID);
+	// Command to delete a block
+
+int32_t getResult(HddBitResp response);
+	// Result bit of a response (0 success, 1 failure)
+
+int32_t getBlockID(HddBitResp response);
+	// Block ID of a response
+
+int lockFile(int16_t fh, int exclusive, int wait);
+	// Lock an entry for I/O (shared or exclusive), returns -1 if busy and not waiting
+
+void unlockFile(int16_t fh);
+	// Release an entry locked with lockFile
+
+int hdd_entry_get(int16_t fh, HddBlockID *blockID, int32_t *blockSize);
+	// Get the entry's block, returns its HDD_INODE_ type (a striped file's
+	// block is its stripe map, a packed file's its container and an inline
+	// file has none) or -1 if the file is not open (caller holds the entry lock)
+
+void hdd_entry_set(int16_t fh, HddBlockID blockID, int32_t blockSize);
+	// Replace the entry's block (caller holds the entry lock exclusively)
+
+uint32_t hdd_entry_touch(int16_t fh);
+	// Note the entry's block is written in this mount, returns the generation it had
+
 //
 // Unit testing for the module
 
 int hddIOUnitTest(void);
 	// Perform a test of the CRUD IO implementation
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
 
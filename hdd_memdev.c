@@ -0,0 +1,297 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_memdev.c
+//  Description   : This is an in-process block device with the semantics of
+//                  hdd_blockd. It provides the client interface of
+//                  hdd_network.h in place of hdd_client.c, so programs
+//                  linked with it run the filesystem without a server or a
+//                  socket (the microbenchmarks measure the client this way).
+//                  The store lives until the process exits, SAVE_AND_CLOSE
+//                  keeps it and FORMAT empties it.
+//
+
+//
+
+// Include Files
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+// Project Include Files
+#include <hdd_driver.h>
+#include <hdd_network.h>
+
+// Defines
+#define HDD_MEMDEV_FIRST_BLOCK 4096 // ID of the first block created, as hdd_blockd
+
+// A stored block
+typedef struct {
+	char     *data; // the contents
+	uint64_t  size; // bytes in the block
+	uint8_t   used; // 1 if the block exists
+} HddMemdevBlock;
+
+//
+// Global Data
+HddMemdevBlock  *memBlocks = NULL;  // blocks by ID - HDD_MEMDEV_FIRST_BLOCK
+uint64_t         memSlots = 0;      // allocated entries in memBlocks
+uint64_t         memNext = 0;       // index of the next block created
+HddMemdevBlock   memMeta;           // the meta block
+pthread_mutex_t  memLock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : memdev_find
+// Description  : Find a stored block, the caller holds memLock
+//
+// Inputs       : req - the request naming the block
+// Outputs      : the block, NULL if it does not exist
+
+HddMemdevBlock *memdev_find( HddRequest *req ) {
+	uint64_t idx;
+
+	if (req->flags == HDD_META_BLOCK) {
+		return( memMeta.used ? &memMeta : NULL );
+	}
+	if (req->blockID < HDD_MEMDEV_FIRST_BLOCK) {
+		return( NULL );
+	}
+	idx = req->blockID - HDD_MEMDEV_FIRST_BLOCK;
+	return( ((idx < memNext) && memBlocks[idx].used) ? &memBlocks[idx] : NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : memdev_store
+// Description  : Copy a payload into a block, replacing its contents
+//
+// Inputs       : blk - the block
+//                buf - the payload
+//                size - bytes in the payload
+// Outputs      : 0 if successful, -1 if failure
+
+int memdev_store( HddMemdevBlock *blk, void *buf, uint64_t size ) {
+	char *data = malloc(size ? size : 1);
+
+	if (data == NULL) {
+		return( -1 );
+	}
+	memcpy(data, buf, size);
+	free(blk->data);
+	blk->data = data;
+	blk->size = size;
+	blk->used = 1;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : memdev_execute
+// Description  : Run a request against the store as hdd_blockd would,
+//                filling in the response fields
+//
+// Inputs       : req - the request, becomes the response
+//                buf - the CREATE/OVERWRITE payload or the READ destination
+// Outputs      : none
+
+void memdev_execute( HddRequest *req, void *buf ) {
+	HddMemdevBlock *blk, *grown;
+	uint64_t i;
+
+	req->result = 1;
+	req->version = 0; // no versions, there is one client
+	pthread_mutex_lock(&memLock);
+	switch (req->flags) {
+	case HDD_INIT:
+	case HDD_SAVE_AND_CLOSE:
+		req->result = 0;
+		break;
+
+	case HDD_FORMAT:
+		for (i=0; i<memNext; i++) {
+			free(memBlocks[i].data);
+		}
+		free(memMeta.data);
+		memset(&memMeta, 0x0, sizeof(memMeta));
+		memNext = 0;
+		req->result = 0;
+		break;
+
+	case HDD_NULL_FLAG:
+	case HDD_META_BLOCK:
+		if (req->op == HDD_BLOCK_CREATE) {
+			if (req->flags == HDD_META_BLOCK) {
+				blk = &memMeta;
+				req->blockID = 0;
+			} else {
+				if (memNext == memSlots) {
+					memSlots = memSlots ? memSlots * 2 : 1024;
+					if ( (grown = realloc(memBlocks, memSlots * sizeof(HddMemdevBlock))) == NULL ) {
+						memSlots = memNext;
+						break;
+					}
+					memBlocks = grown;
+				}
+				blk = &memBlocks[memNext];
+				memset(blk, 0x0, sizeof(HddMemdevBlock));
+				req->blockID = HDD_MEMDEV_FIRST_BLOCK + memNext;
+			}
+			if (memdev_store(blk, buf, req->length) == 0) {
+				memNext += (req->flags == HDD_NULL_FLAG);
+				req->result = 0;
+			}
+			break;
+		}
+		if ( (blk = memdev_find(req)) == NULL ) {
+			break;
+		}
+		if (req->op == HDD_BLOCK_DELETE) {
+			free(blk->data);
+			memset(blk, 0x0, sizeof(HddMemdevBlock));
+			req->result = 0;
+		} else if ( (req->op == HDD_BLOCK_OVERWRITE) && (req->flags == HDD_META_BLOCK) && (req->offset == 0) ) {
+			req->result = (memdev_store(blk, buf, req->length) == 0) ? 0 : 1; // replaced whole
+		} else if ( (req->offset > blk->size) || (req->length > blk->size - req->offset) ) {
+			// out of the block
+		} else if (req->op == HDD_BLOCK_OVERWRITE) {
+			memcpy(blk->data + req->offset, buf, req->length);
+			req->result = 0;
+		} else if (req->op == HDD_BLOCK_READ) {
+			memcpy(buf, blk->data + req->offset, req->length);
+			req->result = 0;
+		}
+		break;
+
+	default:
+		break;
+	}
+	pthread_mutex_unlock(&memLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_operation
+// Description  : Run a v1 command against the in-process store
+//
+// Inputs       : cmd - the request opcode for the command
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response structure encoded as needed
+
+HddBitResp hdd_client_operation(HddBitCmd cmd, void *buf) {
+	HddRequest req;
+
+	memset(&req, 0x0, sizeof(req));
+	req.op = getOpCode(cmd);
+	req.flags = getFlag(cmd);
+	req.blockID = (uint32_t)getID(cmd);
+	req.length = getBlockSize(cmd);
+	memdev_execute(&req, buf);
+	return( formatResponse(req.op, req.length, req.flags, req.result, (uint32_t)req.blockID) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_request
+// Description  : Run a v2 request against the in-process store
+//
+// Inputs       : req - the request, the response fields are filled in
+//                buf - the bytes to be read/written (READ/CREATE/OVERWRITE)
+// Outputs      : 0 if the store succeeded, -1 if failure
+
+int hdd_client_request(HddRequest *req, void *buf) {
+	memdev_execute(req, buf);
+	return( (req->result == 0) ? 0 : -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_protocol
+// Description  : The protocol the in-process store speaks, always v2
+//
+// Inputs       : none
+// Outputs      : HDD_PROTOCOL_V2
+
+int hdd_client_protocol(void) {
+	return( HDD_PROTOCOL_V2 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_max_block_size
+// Description  : The largest block the in-process store holds
+//
+// Inputs       : none
+// Outputs      : the size in bytes
+
+int32_t hdd_client_max_block_size(void) {
+	return( HDD_V2_MAX_BLOCK_SIZE );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_coherence
+// Description  : The in-process store has a single client, there is
+//                nothing to invalidate
+//
+// Inputs       : invalidate - unused
+// Outputs      : 0, no lease
+
+uint32_t hdd_client_coherence(void (*invalidate)(HddBlockID blockID, uint32_t version)) {
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_lock
+// Description  : Take the connection for pipelining, the in-process store
+//                runs each request as it is sent so there is none to take
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_client_lock(void) {
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_unlock
+// Description  : Release the connection taken with hdd_client_lock
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_client_unlock(void) {
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_send_request
+// Description  : Send a pipelined request, it runs against the store at
+//                once, in send order like hdd_blockd runs them
+//
+// Inputs       : req - the request, the response fields are filled in
+//                buf - the bytes to be read/written (READ/CREATE/OVERWRITE)
+// Outputs      : 0, the request was sent
+
+int hdd_client_send_request(HddRequest *req, void *buf) {
+	memdev_execute(req, buf);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_recv_request
+// Description  : Receive the response to the oldest request sent, which
+//                hdd_client_send_request already filled in
+//
+// Inputs       : req - the request
+//                buf - unused, a read was copied out when it was sent
+// Outputs      : 0 if the store succeeded, -1 if failure
+
+int hdd_client_recv_request(HddRequest *req, void *buf) {
+	return( (req->result == 0) ? 0 : -1 );
+}
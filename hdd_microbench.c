@@ -0,0 +1,720 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_microbench.c
+//  Description   : These are the microbenchmarks of the core primitives:
+//                  command encoding, byte order, the hashtable (the open
+//                  addressing table and libcrud's chained table side by
+//                  side), and the filesystem calls run against the in-process device
+//                  (hdd_memdev.c). Each benchmark reports the median
+//                  ns/op over several timed runs and the heap allocations
+//                  per op, counted by wrapping malloc at link time.
+//
+
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// Project Includes
+#include <hdd_driver.h>
+#include <hdd_network.h>
+#include <hdd_file_io.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+#include <cmpsc311_hashtable.h>
+
+// Defines
+#define MICRO_ARGUMENTS "hvr:t:"
+#define MICRO_DEFAULT_RUNS 5    // timed runs, the median is reported
+#define MICRO_DEFAULT_MS 100    // target length of a timed run
+#define MICRO_CMDS 4096         // precomputed commands decoded in a loop
+#define MICRO_HT_MAX_BITS 15    // widest table the libcrud table accepts, both start there
+#define USAGE \
+	"USAGE: hdd_microbench [-h] [-v] [-r <runs>] [-t <ms>] [filter ...]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -r - timed runs per benchmark, the median is reported (default 5)\n" \
+	"    -t - target milliseconds per timed run (default 100)\n" \
+	"\n" \
+	"    filter - run only the benchmarks whose name contains one of these\n" \
+	"\n" \
+
+// A benchmark body: runs about "iters" operations, returns how many it ran
+typedef uint64_t (*MicroFn)( void *ctx, uint64_t iters );
+
+// A hashtable implementation
+typedef struct {
+	char  *name;
+	int    (*init)( HTable *ht, uint16_t bits );
+	int    (*cleanup)( HTable *ht );
+	int    (*insert)( HTable *ht, HtIndexValue idx, void *blk );
+	void * (*find)( HTable *ht, HtIndexValue idx );
+	void * (*delete)( HTable *ht, HtIndexValue idx );
+	int    (*iterInit)( HTable *ht, HtIterator *it );
+	void * (*iterate)( HtIterator *it );
+} MicroHtApi;
+
+// The hashtable benchmarks' state
+typedef struct {
+	MicroHtApi   *api;   // the implementation measured
+	uint32_t      size;  // elements in the table
+	HtIndexValue *keys;  // the keys, in insertion order
+	uint32_t     *order; // a shuffled order of the keys to look them up in
+	HTable        table; // the table, filled for find and iterate
+} MicroTable;
+
+// The filesystem benchmarks' state
+typedef struct {
+	uint32_t   count;  // files created (hdd_open) or bytes per op (read, write)
+	char     **names;  // the file names (hdd_open)
+	int16_t    fh;     // the file (read, write)
+	char      *buf;    // the transfer buffer
+} MicroFiles;
+
+//
+// Global Data
+int      runs = MICRO_DEFAULT_RUNS;
+double   targetNs = MICRO_DEFAULT_MS * 1000000.0;
+char   **filters = NULL;
+int      nfilters = 0;
+uint64_t microAllocs = 0;              // allocations while counting
+int      microCounting = 0;            // 1 while the clock runs
+double   microStart = 0, microNs = 0;  // clock of the current run
+volatile uint64_t microSink;           // results the compiler must not drop
+HddBitCmd microCmds[MICRO_CMDS];
+
+//
+// Functional Prototypes
+
+void *__real_malloc( size_t size );
+void *__real_calloc( size_t nmemb, size_t size );
+void *__real_realloc( void *ptr, size_t size );
+int micro_run( char *name, MicroFn fn, void *ctx );
+int micro_primitives( void );
+int micro_hashtable( void );
+int micro_files( void );
+
+// libcrud's hashtable, renamed when it is extracted from the library (Makefile)
+int crud_initHashTable( HTable *ht, uint16_t bits );
+int crud_cleanupHashTable( HTable *ht );
+int crud_insertValueInHashTable( HTable *ht, HtIndexValue idx, void *blk );
+void * crud_findValueInHashTable( HTable *ht, HtIndexValue idx );
+void * crud_deleteValueFromHashTable( HTable *ht, HtIndexValue idx );
+int crud_initHashTableIterator( HTable *ht, HtIterator *it );
+void * crud_iterateHashTable( HtIterator *it );
+
+// The hashtable implementations measured
+MicroHtApi microTables[] = {
+	{ "ht", initHashTable, cleanupHashTable, insertValueInHashTable, findValueInHashTable,
+	  deleteValueFromHashTable, initHashTableIterator, iterateHashTable },
+	{ "crud_ht", crud_initHashTable, crud_cleanupHashTable, crud_insertValueInHashTable, crud_findValueInHashTable,
+	  crud_deleteValueFromHashTable, crud_initHashTableIterator, crud_iterateHashTable },
+};
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : __wrap_malloc, __wrap_calloc, __wrap_realloc
+// Description  : Count the heap allocations of the code under test, the
+//                link line routes malloc/calloc/realloc here (--wrap)
+//
+// Inputs       : as malloc, calloc and realloc
+// Outputs      : as malloc, calloc and realloc
+
+void *__wrap_malloc( size_t size ) {
+	microAllocs += microCounting;
+	return( __real_malloc(size) );
+}
+
+void *__wrap_calloc( size_t nmemb, size_t size ) {
+	microAllocs += microCounting;
+	return( __real_calloc(nmemb, size) );
+}
+
+void *__wrap_realloc( void *ptr, size_t size ) {
+	microAllocs += microCounting;
+	return( __real_realloc(ptr, size) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : micro_now_ns
+// Description  : Get a monotonic timestamp in nanoseconds
+//
+// Inputs       : none
+// Outputs      : the timestamp
+
+double micro_now_ns( void ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return( (double)ts.tv_sec * 1000000000.0 + (double)ts.tv_nsec );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : micro_stop, micro_start
+// Description  : Stop and restart the clock and the allocation count around
+//                a benchmark's setup, which is not part of the operation
+//
+// Inputs       : none
+// Outputs      : none
+
+void micro_stop( void ) {
+	microNs += micro_now_ns() - microStart;
+	microCounting = 0;
+}
+
+void micro_start( void ) {
+	microCounting = 1;
+	microStart = micro_now_ns();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : micro_compare
+// Description  : Order doubles for qsort
+//
+// Inputs       : a, b - the values
+// Outputs      : -1, 0 or 1
+
+int micro_compare( const void *a, const void *b ) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return( (x < y) ? -1 : (x > y) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : micro_selected
+// Description  : Check a benchmark name against the command line filters
+//
+// Inputs       : name - the benchmark name
+// Outputs      : 1 if it should run, 0 if not
+
+int micro_selected( char *name ) {
+	int i;
+
+	for (i=0; i<nfilters; i++) {
+		if (strstr(name, filters[i]) != NULL) {
+			return( 1 );
+		}
+	}
+	return( nfilters == 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : micro_run
+// Description  : Time a benchmark: grow the iteration count until a run
+//                takes a tenth of the target (this also warms the caches),
+//                size the runs to the target, then report the median, the
+//                fastest run and the allocations per op
+//
+// Inputs       : name - the benchmark name
+//                fn - the benchmark body
+//                ctx - its state
+// Outputs      : 0 if successful, -1 if failure
+
+int micro_run( char *name, MicroFn fn, void *ctx ) {
+	double sample[runs], median;
+	uint64_t iters = 1, ops, allocs = 0, total = 0;
+	int r;
+
+	if ( !micro_selected(name) ) {
+		return( 0 );
+	}
+
+	// Calibrate
+	while (1) {
+		microNs = 0;
+		micro_start();
+		ops = fn(ctx, iters);
+		micro_stop();
+		if ( (ops == 0) || (microNs >= targetNs / 10) || (iters >= (1ULL << 40)) ) {
+			break;
+		}
+		iters *= 2;
+	}
+	if (ops == 0) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_MICRO : %s failed", name );
+		return( -1 );
+	}
+	iters = (uint64_t)(ops * (targetNs / (microNs > 1 ? microNs : 1)));
+	iters = (iters > 0) ? iters : 1;
+
+	// The timed runs
+	for (r=0; r<runs; r++) {
+		microNs = 0;
+		microAllocs = 0;
+		micro_start();
+		ops = fn(ctx, iters);
+		micro_stop();
+		if (ops == 0) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_MICRO : %s failed", name );
+			return( -1 );
+		}
+		sample[r] = microNs / ops;
+		allocs += microAllocs;
+		total += ops;
+	}
+	qsort(sample, runs, sizeof(double), micro_compare);
+	median = (runs % 2) ? sample[runs/2] : (sample[runs/2-1] + sample[runs/2]) / 2;
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_MICRO %-28s %12.2f %12.2f %8.1f%% %12.3f", name,
+			median, sample[0], 100.0 * (sample[runs-1] - sample[0]) / median, (double)allocs / total );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the microbenchmarks
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+	// Local variables
+	int ch, ms;
+
+	// Process the command line parameters
+	initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	while ((ch = getopt(argc, argv, MICRO_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			enableLogLevels( LOG_INFO_LEVEL );
+			break;
+
+		case 'r': // Set the timed runs
+			if ( (sscanf( optarg, "%d", &runs ) != 1) || (runs < 1) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad run count [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 't': // Set the run length
+			if ( (sscanf( optarg, "%d", &ms ) != 1) || (ms < 1) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad run length [%s]", optarg );
+				return( -1 );
+			}
+			targetNs = ms * 1000000.0;
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+	filters = &argv[optind];
+	nfilters = argc - optind;
+
+	logMessage( LOG_OUTPUT_LEVEL, "HDD_MICRO %-28s %12s %12s %9s %12s", "benchmark", "ns/op", "min ns/op", "spread", "allocs/op" );
+	if ( micro_primitives() || micro_hashtable() || micro_files() ) {
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : micro_* (primitives)
+// Description  : The command encoding and byte order benchmarks, each op
+//                encodes or decodes one command
+//
+// Inputs       : ctx - unused
+//                iters - operations to run
+// Outputs      : operations run
+
+uint64_t micro_set_block_read( void *ctx, uint64_t iters ) {
+	uint64_t i, acc = 0;
+
+	for (i=0; i<iters; i++) {
+		acc ^= set_block_read((int32_t)(i & 0xffffff), (int32_t)(i & 0xfffff));
+	}
+	microSink = acc;
+	return( iters );
+}
+
+uint64_t micro_getResult( void *ctx, uint64_t iters ) {
+	uint64_t i, acc = 0;
+
+	for (i=0; i<iters; i++) {
+		acc += getResult(microCmds[i & (MICRO_CMDS - 1)]);
+	}
+	microSink = acc;
+	return( iters );
+}
+
+uint64_t micro_getBlockSize( void *ctx, uint64_t iters ) {
+	uint64_t i, acc = 0;
+
+	for (i=0; i<iters; i++) {
+		acc += getBlockSize(microCmds[i & (MICRO_CMDS - 1)]);
+	}
+	microSink = acc;
+	return( iters );
+}
+
+uint64_t micro_htonll64( void *ctx, uint64_t iters ) {
+	uint64_t i, acc = 0;
+
+	for (i=0; i<iters; i++) {
+		acc += htonll64(microCmds[i & (MICRO_CMDS - 1)]);
+	}
+	microSink = acc;
+	return( iters );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : micro_primitives
+// Description  : Run the command encoding and byte order benchmarks
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int micro_primitives( void ) {
+	uint64_t x = 88172645463325252ULL;
+	int i;
+
+	// Commands with varied fields, decoded from memory so nothing folds away
+	for (i=0; i<MICRO_CMDS; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		microCmds[i] = x;
+	}
+	if ( micro_run("cmd/set_block_read", micro_set_block_read, NULL) ||
+		 micro_run("cmd/getResult", micro_getResult, NULL) ||
+		 micro_run("cmd/getBlockSize", micro_getBlockSize, NULL) ||
+		 micro_run("util/htonll64", micro_htonll64, NULL) ) {
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : micro_ht_* (hashtable)
+// Description  : The hashtable benchmarks, each op inserts, finds, deletes
+//                or visits one element of a table of the given size
+//
+// Inputs       : ctx - the MicroTable
+//                iters - operations to run (rounded to whole tables for
+//                        insert and delete)
+// Outputs      : operations run, 0 if failure
+
+// Build a table of all the keys, the clock is stopped
+int micro_ht_fill( MicroTable *mt, HTable *table ) {
+	uint32_t bits = 1, i;
+
+	while ( ((1U << bits) < mt->size) && (bits < MICRO_HT_MAX_BITS) ) {
+		bits++;
+	}
+	if (mt->api->init(table, bits)) {
+		return( -1 );
+	}
+	for (i=0; i<mt->size; i++) {
+		if (mt->api->insert(table, mt->keys[i], &mt->keys[i])) {
+			return( -1 );
+		}
+	}
+	return( 0 );
+}
+
+// Empty and free a table, the clock is stopped (cleanupHashTable frees the
+// values still in the table, which here point into the key array)
+void micro_ht_free( MicroTable *mt, HTable *table ) {
+	uint32_t i;
+
+	for (i=0; i<mt->size; i++) {
+		mt->api->delete(table, mt->keys[i]);
+	}
+	mt->api->cleanup(table);
+}
+
+uint64_t micro_ht_insert( void *ctx, uint64_t iters ) {
+	MicroTable *mt = ctx;
+	uint32_t bits = 1, i;
+	uint64_t ops = 0;
+	HTable table;
+
+	while ( ((1U << bits) < mt->size) && (bits < MICRO_HT_MAX_BITS) ) {
+		bits++;
+	}
+	do {
+		micro_stop();
+		if (mt->api->init(&table, bits)) {
+			return( 0 );
+		}
+		micro_start();
+		for (i=0; i<mt->size; i++) {
+			if (mt->api->insert(&table, mt->keys[i], &mt->keys[i])) {
+				return( 0 );
+			}
+		}
+		micro_stop();
+		micro_ht_free(mt, &table);
+		micro_start();
+		ops += mt->size;
+	} while (ops < iters);
+	return( ops );
+}
+
+uint64_t micro_ht_find( void *ctx, uint64_t iters ) {
+	MicroTable *mt = ctx;
+	uint64_t i, found = 0;
+
+	for (i=0; i<iters; i++) {
+		found += (mt->api->find(&mt->table, mt->keys[mt->order[i % mt->size]]) != NULL);
+	}
+	microSink = found;
+	return( (found == iters) ? iters : 0 );
+}
+
+uint64_t micro_ht_delete( void *ctx, uint64_t iters ) {
+	MicroTable *mt = ctx;
+	uint64_t ops = 0;
+	HTable table;
+	uint32_t i;
+
+	do {
+		micro_stop();
+		if (micro_ht_fill(mt, &table)) {
+			return( 0 );
+		}
+		micro_start();
+		for (i=0; i<mt->size; i++) {
+			if (mt->api->delete(&table, mt->keys[mt->order[i]]) == NULL) {
+				return( 0 );
+			}
+		}
+		micro_stop();
+		mt->api->cleanup(&table);
+		micro_start();
+		ops += mt->size;
+	} while (ops < iters);
+	return( ops );
+}
+
+uint64_t micro_ht_iterate( void *ctx, uint64_t iters ) {
+	MicroTable *mt = ctx;
+	uint64_t ops = 0, acc = 0;
+	HtIterator it;
+	void *value;
+
+	do {
+		mt->api->iterInit(&mt->table, &it);
+		while ( (value = mt->api->iterate(&it)) != NULL ) {
+			acc += (uintptr_t)value;
+			ops++;
+		}
+	} while (ops < iters);
+	microSink = acc;
+	return( ops );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : micro_hashtable
+// Description  : Run the hashtable benchmarks at 1K, 64K and 1M elements for
+//                each implementation (tables start 2^15 wide, so the larger
+//                ones chain in libcrud's table and grow in the other)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int micro_hashtable( void ) {
+	uint32_t sizes[] = { 1 << 10, 1 << 16, 1 << 20 };
+	char name[64];
+	uint32_t i, j, t;
+	MicroTable mt;
+	int s, a;
+
+	for (s=0; s<(int)(sizeof(sizes)/sizeof(uint32_t)); s++) {
+		mt.size = sizes[s];
+		mt.keys = malloc(mt.size * sizeof(HtIndexValue));
+		mt.order = malloc(mt.size * sizeof(uint32_t));
+		if ( (mt.keys == NULL) || (mt.order == NULL) ) {
+			return( -1 );
+		}
+
+		// Distinct scattered keys, looked up in a fixed shuffled order
+		for (i=0; i<mt.size; i++) {
+			mt.keys[i] = (HtIndexValue)(i + 1) * 0x9e3779b97f4a7c15ULL;
+			mt.order[i] = i;
+		}
+		for (i=mt.size-1; i>0; i--) {
+			j = (uint32_t)(((uint64_t)(mt.keys[i] >> 32) * (i + 1)) >> 32);
+			t = mt.order[i];
+			mt.order[i] = mt.order[j];
+			mt.order[j] = t;
+		}
+
+		for (a=0; a<(int)(sizeof(microTables)/sizeof(MicroHtApi)); a++) {
+			mt.api = &microTables[a];
+			if (micro_ht_fill(&mt, &mt.table)) {
+				return( -1 );
+			}
+			snprintf( name, sizeof(name), "%s/insert/%u", mt.api->name, mt.size );
+			if (micro_run(name, micro_ht_insert, &mt)) {
+				return( -1 );
+			}
+			snprintf( name, sizeof(name), "%s/find/%u", mt.api->name, mt.size );
+			if (micro_run(name, micro_ht_find, &mt)) {
+				return( -1 );
+			}
+			snprintf( name, sizeof(name), "%s/delete/%u", mt.api->name, mt.size );
+			if (micro_run(name, micro_ht_delete, &mt)) {
+				return( -1 );
+			}
+			snprintf( name, sizeof(name), "%s/iterate/%u", mt.api->name, mt.size );
+			if (micro_run(name, micro_ht_iterate, &mt)) {
+				return( -1 );
+			}
+			micro_ht_free(&mt, &mt.table);
+		}
+		free(mt.keys);
+		free(mt.order);
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : micro_open, micro_read, micro_write
+// Description  : The filesystem benchmarks: an open (and close) of an
+//                existing file by name, and a read or write of "count"
+//                bytes at the start of a file of that size
+//
+// Inputs       : ctx - the MicroFiles
+//                iters - operations to run
+// Outputs      : operations run, 0 if failure
+
+uint64_t micro_open( void *ctx, uint64_t iters ) {
+	MicroFiles *mf = ctx;
+	uint64_t i;
+	int16_t fh;
+
+	for (i=0; i<iters; i++) {
+		if ( ((fh = hdd_open(mf->names[(i * 7919) % mf->count])) == -1) || hdd_close(fh) ) {
+			return( 0 );
+		}
+	}
+	return( iters );
+}
+
+uint64_t micro_read( void *ctx, uint64_t iters ) {
+	MicroFiles *mf = ctx;
+	uint64_t i;
+
+	for (i=0; i<iters; i++) {
+		if ( hdd_seek(mf->fh, 0) || (hdd_read(mf->fh, mf->buf, mf->count) != mf->count) ) {
+			return( 0 );
+		}
+	}
+	return( iters );
+}
+
+uint64_t micro_write( void *ctx, uint64_t iters ) {
+	MicroFiles *mf = ctx;
+	uint64_t i;
+
+	for (i=0; i<iters; i++) {
+		if ( hdd_seek(mf->fh, 0) || (hdd_write(mf->fh, mf->buf, mf->count) != mf->count) ) {
+			return( 0 );
+		}
+	}
+	return( iters );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : micro_files
+// Description  : Run the filesystem benchmarks on a fresh in-process
+//                filesystem: opens in directories of 1K and 100K files,
+//                reads and writes of 64 bytes, 4 KiB and 64 KiB
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int micro_files( void ) {
+	uint32_t counts[] = { 1000, 100000 }, sizes[] = { 64, 4096, 65536 };
+	char name[64], fname[MAX_FILENAME_LENGTH];
+	MicroFiles mf;
+	uint32_t i;
+	int c, s;
+
+	if ( hdd_format() || hdd_mount() ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_MICRO : format or mount failed." );
+		return( -1 );
+	}
+
+	// Opens by name
+	for (c=0; c<(int)(sizeof(counts)/sizeof(uint32_t)); c++) {
+		snprintf( name, sizeof(name), "hdd_open/%u", counts[c] );
+		if ( !micro_selected(name) ) {
+			continue;
+		}
+		snprintf( fname, MAX_FILENAME_LENGTH, "open%u", counts[c] );
+		if ( hdd_mkdir(fname) ) {
+			return( -1 );
+		}
+		mf.count = counts[c];
+		mf.names = malloc(mf.count * sizeof(char *));
+		for (i=0; i<mf.count; i++) {
+			snprintf( fname, MAX_FILENAME_LENGTH, "open%u/file-%06u", counts[c], i );
+			mf.names[i] = strdup(fname);
+			if ( (mf.fh = hdd_open(fname)) == -1 || hdd_close(mf.fh) ) {
+				return( -1 );
+			}
+		}
+		if (micro_run(name, micro_open, &mf)) {
+			return( -1 );
+		}
+		for (i=0; i<mf.count; i++) {
+			free(mf.names[i]);
+		}
+		free(mf.names);
+	}
+
+	// Reads and writes
+	for (s=0; s<(int)(sizeof(sizes)/sizeof(uint32_t)); s++) {
+		mf.count = sizes[s];
+		mf.buf = malloc(mf.count);
+		memset(mf.buf, 'a' + s, mf.count);
+		snprintf( fname, MAX_FILENAME_LENGTH, "io-%u", sizes[s] );
+		if ( ((mf.fh = hdd_open(fname)) == -1) || (hdd_write(mf.fh, mf.buf, mf.count) != mf.count) ) {
+			return( -1 );
+		}
+		snprintf( name, sizeof(name), "hdd_read/%u", sizes[s] );
+		if (micro_run(name, micro_read, &mf)) {
+			return( -1 );
+		}
+		snprintf( name, sizeof(name), "hdd_write/%u", sizes[s] );
+		if (micro_run(name, micro_write, &mf)) {
+			return( -1 );
+		}
+		hdd_close(mf.fh);
+		free(mf.buf);
+	}
+
+	if ( hdd_unmount() ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_MICRO : unmount failed." );
+		return( -1 );
+	}
+	return( 0 );
+}
@@ -8,21 +8,160 @@
 
 
 // Include Files
+#include <stdint.h>
 
 // Project Include Files
 #include <hdd_driver.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Defines
 #define HDD_MAX_BACKLOG 5
 #define HDD_NET_HEADER_SIZE sizeof(HddBitResp)
 #define HDD_DEFAULT_IP "127.0.0.1"
 #define HDD_DEFAULT_PORT 19876
+#define HDD_MAX_REPLICAS 8        // servers a client mirrors its writes to
+#define HDD_HEDGE_PERCENTILE 95   // default percentile of read latency a read is hedged after
+
+// Protocol versions, v2 is offered in the INIT of every connection and used
+// only if the server accepts it
+#define HDD_PROTOCOL_V1 1
+#define HDD_PROTOCOL_V2 2
+#define HDD_V2_HELLO 0x48444432         // block ID of the INIT offering v2 ("HDD2")
+#define HDD_V2_ACCEPT 0x48443241        // block ID of the INIT response accepting it ("HD2A")
+#define HDD_V2_CALLBACK 0x48444342      // block ID of the INIT opening an invalidation channel ("HDCB")
+#define HDD_V2_MAGIC 0x48324844         // first word of every v2 header ("H2HD")
+#define HDD_V2_HEADER_SIZE 40           // bytes in a v2 header on the wire
+#define HDD_V2_MAX_BLOCK_SIZE 0x3ffffff // largest v2 block, what the HddBitCmd size field can carry
+
+/*
+ Protocol v2 header (network byte order), followed by "length" bytes of
+ payload for CREATE/OVERWRITE requests and successful READ responses
+
+  Bytes   Description
+  -----   -------------------------------------------------------------
+    0-3 - Magic - HDD_V2_MAGIC
+      4 - Op - HDD_OP_TYPES
+      5 - Flags - HDD_FLAG_TYPES
+      6 - Result - 0 success, 1 failure (responses)
+      7 - Reserved (0)
+   8-11 - Tag - chosen by the client, echoed in the response
+  12-15 - Version - in a response, the block's version after the request
+          (every write gives the block a new one). In a READ or OVERWRITE
+          request, the version of the client's cached copy or 0: a READ
+          of the version the block still has answers with length 0 and no
+          payload, an OVERWRITE of a block at another version answers
+          with version 0 (the copy missed a write)
+  16-23 - Block - the block ID (the new block in a CREATE response)
+  24-31 - Offset - first byte of the block transferred (READ, OVERWRITE)
+  32-39 - Length - bytes transferred, the block size for CREATE
+
+ The INIT response accepting v2 carries the server's lease term in ms in
+ its size field: a client may use a cached copy for that long after the
+ server last confirmed it. A client caching blocks opens a second
+ connection whose INIT names HDD_V2_CALLBACK; the server then only writes
+ to it, a v2 header (op OVERWRITE or DELETE, block, new version, length 0)
+ for each write by any client, or flags FORMAT when the store is emptied.
+*/
+
+// A v2 request or response in host byte order
+typedef struct {
+	uint8_t  op;      // HDD_OP_TYPES
+	uint8_t  flags;   // HDD_FLAG_TYPES
+	uint8_t  result;  // 0 success, 1 failure
+	uint32_t tag;     // echoed in the response
+	uint32_t version; // the block's version, see above
+	uint64_t blockID; // the block
+	uint64_t offset;  // first byte transferred
+	uint64_t length;  // bytes transferred
+} HddRequest;
 
 //
 // Functional Prototypes
 HddBitResp hdd_client_operation(HddBitCmd cmd, void *buf);
     // This is the implementation of the client operation (hdd_client.c)
 
+int hdd_client_send(HddBitCmd cmd, void *buf);
+    // Send a request without waiting for its response (pipelining)
+
+HddBitResp hdd_client_recv(HddBitCmd cmd, void *buf);
+    // Receive the response to the oldest request sent with hdd_client_send
+
+void hdd_client_lock(void);
+    // Take the connections for a run of hdd_client_send/hdd_client_recv calls
+
+void hdd_client_unlock(void);
+    // Release the connections taken with hdd_client_lock
+
+int hdd_client_request(HddRequest *req, void *buf);
+    // Exchange a request, filling in the response fields, returns 0 if the server succeeded
+    // (needs v2 unless the request is whole-block, offset 0)
+
+int hdd_client_send_request(HddRequest *req, void *buf);
+    // Send a request without waiting for its response (caller holds the connection)
+
+int hdd_client_recv_request(HddRequest *req, void *buf);
+    // Receive the response to the oldest request sent, returns 0 if the server succeeded
+
+int hdd_client_protocol(void);
+    // Protocol version negotiated for the current connection
+
+void hdd_client_set_protocol(int version);
+    // Highest protocol version to offer on the next connection (default v2)
+
+int32_t hdd_client_max_block_size(void);
+    // Largest block the current connection can carry
+
+int hdd_client_set_replicas(char *spec);
+    // Mirror writes to the servers in spec too, a comma separated list of
+    // [<ip>:]<port>, reads are spread across all of them (before INIT)
+
+void hdd_client_set_hedge(double percentile);
+    // Send a second copy of a read to another replica once it waited longer
+    // than this percentile of recent reads, 0 never (default 95)
+
+void hdd_client_hedges(uint64_t *reads, uint64_t *hedged, uint64_t *won);
+    // Reads sent, second copies sent and second copies answered first
+
+void hdd_client_report(void);
+    // Log the reads each replica served and the hedge timeout
+
+int hdd_client_trace(char *spec);
+    // Record every request and its response in a wire trace (hdd_trace.h),
+    // spec is <file> or <file>,hash to hash payloads too, NULL to stop
+
+uint32_t hdd_client_coherence(void (*invalidate)(HddBlockID blockID, uint32_t version));
+    // Open the invalidation channel, invalidate is called for every block
+    // written since (HDD_NO_BLOCK after a format), returns the lease term
+    // in ms, 0 if the server grants none
+
+void hdd_v2_encode(HddRequest *req, uint8_t *hdr);
+    // Write the v2 header for a request (hdd_protocol.c)
+
+int hdd_v2_decode(uint8_t *hdr, HddRequest *req);
+    // Read a v2 header, returns -1 if the magic is wrong (hdd_protocol.c)
+
+int32_t getID(HddBitCmd command);
+int getOpCode(uint64_t command);
+int32_t getBlockSize(uint64_t command);
+int getFlag(HddBitCmd command);
+int getR(HddBitCmd command);
+    // Fields of a v1 command or response (hdd_protocol.c)
+
+HddBitResp formatResponse(uint64_t op, uint64_t blockSize, uint64_t flags, uint64_t r, uint64_t blockID);
+    // Pack the fields of a v1 command or response (hdd_protocol.c)
+
+int connectServer(char *ip, unsigned short port);
+    // Open a connection to a server, returns the socket or -1 (hdd_protocol.c)
+
+int sendParts(int fd, void *hdr, int32_t hlen, void *buf, int32_t blen);
+    // Write a header then a payload to a connection, returns 0 if successful (hdd_protocol.c)
+
+int recvAll(int fd, void *buf, int32_t len);
+    // Read exactly len bytes from a connection, returns 0 if successful (hdd_protocol.c)
+
 int hdd_server( void );
     // This is the implementation of the server application (hdd_server.c)
 
@@ -32,4 +171,8 @@ extern int            hdd_network_shutdown; // Flag indicating shutdown
 extern unsigned char *hdd_network_address;  // Address of HDD server 
 extern unsigned short hdd_network_port;     // Port of HDD server
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
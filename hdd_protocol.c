@@ -0,0 +1,222 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_protocol.c
+//  Description   : This is the wire encoding of the v2 protocol header and
+//                  the HddBitCmd fields, shared by the client, the server
+//                  and the in-process device, and the socket helpers of the
+//                  client's connections.
+//
+
+//
+
+// Include Files
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Project Include Files
+#include <hdd_network.h>
+#include <cmpsc311_util.h>
+#include <cmpsc311_log.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_v2_encode
+// Description  : Write the v2 header of a request or response
+//
+// Inputs       : req - the request in host byte order
+//                hdr - the HDD_V2_HEADER_SIZE byte header to fill
+// Outputs      : none
+
+void hdd_v2_encode(HddRequest *req, uint8_t *hdr) {
+	uint32_t word;
+	uint64_t dword;
+
+	memset(hdr, 0, HDD_V2_HEADER_SIZE);
+	word = htonl(HDD_V2_MAGIC);
+	memcpy(hdr, &word, sizeof(word));
+	hdr[4] = req->op;
+	hdr[5] = req->flags;
+	hdr[6] = req->result;
+	word = htonl(req->tag);
+	memcpy(hdr + 8, &word, sizeof(word));
+	word = htonl(req->version);
+	memcpy(hdr + 12, &word, sizeof(word));
+	dword = htonll64(req->blockID);
+	memcpy(hdr + 16, &dword, sizeof(dword));
+	dword = htonll64(req->offset);
+	memcpy(hdr + 24, &dword, sizeof(dword));
+	dword = htonll64(req->length);
+	memcpy(hdr + 32, &dword, sizeof(dword));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_v2_decode
+// Description  : Read the v2 header of a request or response
+//
+// Inputs       : hdr - the HDD_V2_HEADER_SIZE byte header
+//                req - the request to fill in host byte order
+// Outputs      : 0 if successful, -1 if the header is not a v2 header
+
+int hdd_v2_decode(uint8_t *hdr, HddRequest *req) {
+	uint32_t word;
+	uint64_t dword;
+
+	memcpy(&word, hdr, sizeof(word));
+	if (ntohl(word) != HDD_V2_MAGIC) {
+		return( -1 );
+	}
+	req->op = hdr[4];
+	req->flags = hdr[5];
+	req->result = hdr[6];
+	memcpy(&word, hdr + 8, sizeof(word));
+	req->tag = ntohl(word);
+	memcpy(&word, hdr + 12, sizeof(word));
+	req->version = ntohl(word);
+	memcpy(&dword, hdr + 16, sizeof(dword));
+	req->blockID = ntohll64(dword);
+	memcpy(&dword, hdr + 24, sizeof(dword));
+	req->offset = ntohll64(dword);
+	memcpy(&dword, hdr + 32, sizeof(dword));
+	req->length = ntohll64(dword);
+	return( 0 );
+}
+
+// Get BlockID from HddBitCmd
+int32_t getID(HddBitCmd command){
+	int32_t blockID;
+	command = command << 32; // shift left 32 bits to remove flags, block size, and op
+	command = command >> 32; // shift right 32 bits to make command lsb
+	blockID = command; 
+	
+	return blockID;
+}
+
+// Get the operation code from HddBitCmd
+int getOpCode(uint64_t command){
+	int opCode; 
+	command = command >> 62;
+	opCode = command; 
+	return opCode; 
+}
+
+int32_t getBlockSize(uint64_t command){
+	int blockSize; 
+	command = command << 2; // remove op code
+	command = command >> 38; // reove flags, r, and block ID
+	blockSize = command; 
+	return blockSize; 
+}
+
+int getFlag(HddBitCmd command){
+	command = command << 28;
+	command = command >> 61;
+	return command; 
+}
+
+int getR(HddBitCmd command){
+	int result;
+
+	command = command << 31; // shift left 31 bits to remove flags, block size and op
+	command = command >> 63; // shift right 63 to make command lsb  
+	result = command; 
+	
+	return result; // value of either 0 on success or 1 on failure 
+}
+
+HddBitResp formatResponse(uint64_t op, uint64_t blockSize, uint64_t flags, uint64_t r, uint64_t blockID){
+	op = op << 62; 
+	blockSize = blockSize << 36;
+	flags = flags << 33; 
+	r = r << 32; 
+	HddBitResp response = op | blockSize | flags | r | blockID;
+	return response; 
+}
+
+// Connect a new socket to a server, returns it or -1 on failure
+int connectServer(char *ip, unsigned short port){
+	struct sockaddr_in caddr; 
+	int nodelay = 1;
+
+	caddr.sin_family = AF_INET;
+	caddr.sin_port = htons(port);
+	if ( inet_aton(ip, &caddr.sin_addr) == 0 ){
+		return -1;
+	}
+	int fd = socket(PF_INET, SOCK_STREAM, 0);
+	// Error on socket creation 
+	if (fd == -1){
+		logMessage(LOG_ERROR_LEVEL, "HDD_NET : error on socket creation [%s]", strerror(errno));
+		return -1;
+	}
+	// Error on socket connect
+	int connection = connect(fd, (const struct sockaddr *)&caddr, sizeof(struct sockaddr));
+	if (connection == -1){
+		logMessage(LOG_ERROR_LEVEL, "HDD_NET : error on socket connect to %s:%u [%s]", ip, port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	// Commands and payloads go out in separate writes, don't let Nagle hold them back
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	return fd; 
+
+}
+
+// Write exactly hlen bytes of hdr then blen bytes of buf to a server in as
+// few segments as possible, returns 0 on success, -1 on failure
+int sendParts(int fd, void *hdr, int32_t hlen, void *buf, int32_t blen){
+	struct iovec iov[2];
+	int i = 0, n = (blen > 0) ? 2 : 1;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hlen;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = blen;
+	while (i < n){
+		ssize_t w = writev(fd, &iov[i], n - i);
+		if (w <= 0){
+			if (w == -1 && errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		while (i < n && (size_t)w >= iov[i].iov_len){ // skip the parts fully written
+			w = w - iov[i].iov_len;
+			i++;
+		}
+		if (i < n){
+			iov[i].iov_base = (char *)iov[i].iov_base + w;
+			iov[i].iov_len = iov[i].iov_len - w;
+		}
+	}
+	return 0;
+}
+
+// Read exactly len bytes from a server, returns 0 on success, -1 on failure
+int recvAll(int fd, void *buf, int32_t len){
+	int32_t total = 0;
+	int quickack = 1;
+	while (total != len){
+		// ACK right away: with requests pipelined there is often no outgoing
+		// request to piggyback on, and the server's next response waits on it
+		setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+		int r = read(fd, (char *)buf + total, len - total);
+		if (r <= 0){
+			if (r == -1 && errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		total = total + r; 
+	}
+	return 0;
+}
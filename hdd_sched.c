@@ -0,0 +1,328 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_sched.c
+//  Description    : This is the implementation of the client I/O scheduler.
+//                   The queues are short (bounded by the requesting threads
+//                   or the async ring), so they are kept in arrival order
+//                   and scanned to pick the next request.
+//
+
+// Includes
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Project Includes
+#include <hdd_sched.h>
+#include <hdd_driver.h>
+#include <cmpsc311_log.h>
+
+//
+// Global Data
+int    schedPolicy = HDD_SCHED_DEADLINE;   // HDD_SCHED_POLICY_TYPES of every queue
+double schedExpireMs = HDD_SCHED_EXPIRE_MS; // deadline of a request after it is queued
+
+//
+// Helper functions
+
+// Current time on the monotonic clock in ms
+double schedNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return( (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0 );
+}
+
+// Is the request for the meta block?
+int schedIsMeta(HddSchedReq *r) {
+	return( r->req.flags == HDD_META_BLOCK );
+}
+
+// Position of a request in the sweep, new blocks are laid out after the others
+uint64_t schedKey(HddSchedReq *r) {
+	if (r->req.op == HDD_BLOCK_CREATE) {
+		return( UINT64_MAX );
+	}
+	return( (r->req.blockID << 32) | (r->req.offset & 0xffffffff) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : schedMerge
+// Description  : Merge a read into the queued read at index i, the queued
+//                one is replaced by a merged request covering [lo, hi)
+//
+// Inputs       : s - the queue
+//                i - index of the queued read
+//                r - the new read
+//                lo, hi - the range the merged read covers
+// Outputs      : 0 if successful, -1 if failure
+
+int schedMerge(HddSched *s, uint32_t i, HddSchedReq *r, uint64_t lo, uint64_t hi) {
+	HddSchedReq *m = s->queue[i];
+	char *buf;
+
+	if ( (buf = malloc(hi - lo)) == NULL ) {
+		return( -1 );
+	}
+	if (m->members == NULL) {
+		if ( (m = calloc(1, sizeof(HddSchedReq))) == NULL ) {
+			free(buf);
+			return( -1 );
+		}
+		m->req = s->queue[i]->req;
+		m->deadline = s->queue[i]->deadline;
+		m->members = s->queue[i];
+		s->queue[i] = m;
+	}
+	free(m->buf);
+	m->buf = buf;
+	m->req.offset = lo;
+	m->req.length = hi - lo;
+	if (r->deadline < m->deadline) {
+		m->deadline = r->deadline;
+	}
+	r->nextMember = m->members;
+	m->members = r;
+	s->merges++;
+	return( 0 );
+}
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_sched_configure
+// Description  : Set the dispatch policy of every queue
+//
+// Inputs       : spec - "fifo", "clook" or "deadline[:<ms>]"
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_sched_configure( char *spec ) {
+	double expire = HDD_SCHED_EXPIRE_MS;
+
+	if (strcmp(spec, "fifo") == 0) {
+		schedPolicy = HDD_SCHED_FIFO;
+	} else if (strcmp(spec, "clook") == 0) {
+		schedPolicy = HDD_SCHED_CLOOK;
+	} else if ( (strcmp(spec, "deadline") == 0) ||
+				((sscanf(spec, "deadline:%lf", &expire) == 1) && (expire >= 0)) ) {
+		schedPolicy = HDD_SCHED_DEADLINE;
+		schedExpireMs = expire;
+	} else {
+		logMessage(LOG_ERROR_LEVEL, "HDD_SCHED : bad scheduler [%s]", spec);
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_sched_add
+// Description  : Queue a request, merging a read into a queued read of the
+//                same block when the queue's merge mode allows it
+//
+// Inputs       : s - the queue
+//                r - the request, owned by the caller until it is done
+// Outputs      : 1 if merged, 0 if queued, -1 if failure
+
+int hdd_sched_add( HddSched *s, HddSchedReq *r ) {
+	HddSchedReq **grown, *q;
+	uint64_t lo, hi;
+	uint32_t i;
+
+	r->deadline = schedNow() + schedExpireMs;
+	r->done = 0;
+	r->members = NULL;
+	r->nextMember = NULL;
+
+	// Reads of the same block, a merge that fails just queues the read alone.
+	// A read revalidating a cached copy may come back without data, it is
+	// not merged
+	if ( (s->merge != HDD_SCHED_MERGE_NONE) && (r->req.op == HDD_BLOCK_READ) &&
+		 (r->req.flags == HDD_NULL_FLAG) && (r->req.length > 0) && (r->req.version == 0) ) {
+		for (i = 0; i < s->count; i++) {
+			q = s->queue[i];
+			if ( (q->req.op != HDD_BLOCK_READ) || (q->req.flags != HDD_NULL_FLAG) || (q->req.blockID != r->req.blockID) ||
+				 (q->req.version != 0) ) {
+				continue;
+			}
+			lo = (q->req.offset < r->req.offset) ? q->req.offset : r->req.offset;
+			hi = (q->req.offset + q->req.length > r->req.offset + r->req.length) ?
+					q->req.offset + q->req.length : r->req.offset + r->req.length;
+			if (s->merge == HDD_SCHED_MERGE_SAME) {
+				if ( (q->req.offset != r->req.offset) || (q->req.length != r->req.length) ) {
+					continue;
+				}
+			} else if ( (r->req.offset > q->req.offset + q->req.length) ||
+						(q->req.offset > r->req.offset + r->req.length) || (hi - lo > HDD_SCHED_MAX_MERGE) ) {
+				continue; // a gap between them, or too large
+			}
+			if (schedMerge(s, i, r, lo, hi) == 0) {
+				return( 1 );
+			}
+			break;
+		}
+	}
+
+	if (s->count == s->capacity) {
+		grown = realloc(s->queue, (s->capacity ? s->capacity * 2 : 64) * sizeof(HddSchedReq *));
+		if (grown == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_SCHED : failed growing the queue");
+			return( -1 );
+		}
+		s->queue = grown;
+		s->capacity = s->capacity ? s->capacity * 2 : 64;
+	}
+	s->queue[s->count++] = r;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_sched_peek
+// Description  : Pick the request to dispatch next: the oldest metadata
+//                request (unless HDD_SCHED_META_BATCH went ahead of waiting
+//                data), else the data request the policy selects
+//
+// Inputs       : s - the queue
+// Outputs      : the request, NULL if the queue is empty
+
+HddSchedReq *hdd_sched_peek( HddSched *s ) {
+	uint32_t i, meta = s->count, data = s->count, next = s->count, low = s->count;
+	uint64_t key, nextKey = 0, lowKey = 0;
+
+	for (i = 0; i < s->count; i++) {
+		if (schedIsMeta(s->queue[i])) {
+			meta = (meta == s->count) ? i : meta;
+			continue;
+		}
+		data = (data == s->count) ? i : data;
+
+		// C-LOOK, the nearest request at or after the head, else the lowest
+		key = schedKey(s->queue[i]);
+		if ( (key >= s->head) && ((next == s->count) || (key < nextKey)) ) {
+			next = i;
+			nextKey = key;
+		}
+		if ( (low == s->count) || (key < lowKey) ) {
+			low = i;
+			lowKey = key;
+		}
+	}
+
+	if ( (meta < s->count) && ((data == s->count) || (s->metaRun < HDD_SCHED_META_BATCH)) ) {
+		return( s->queue[meta] );
+	}
+	if (data == s->count) {
+		return( NULL );
+	}
+	if ( (schedPolicy == HDD_SCHED_FIFO) ||
+		 ((schedPolicy == HDD_SCHED_DEADLINE) && (s->queue[data]->deadline <= schedNow())) ) {
+		return( s->queue[data] );
+	}
+	return( s->queue[(next < s->count) ? next : low] );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_sched_take
+// Description  : Remove the request being dispatched and move the head
+//
+// Inputs       : s - the queue
+//                r - the request returned by hdd_sched_peek
+// Outputs      : none
+
+void hdd_sched_take( HddSched *s, HddSchedReq *r ) {
+	uint32_t i;
+
+	for (i = 0; (i < s->count) && (s->queue[i] != r); i++);
+	if (i == s->count) {
+		return;
+	}
+	memmove(&s->queue[i], &s->queue[i+1], (s->count - i - 1) * sizeof(HddSchedReq *));
+	s->count--;
+
+	if (schedIsMeta(r)) {
+		s->metaRun++;
+	} else {
+		s->metaRun = 0;
+		s->head = (r->req.op == HDD_BLOCK_CREATE) ? UINT64_MAX : schedKey(r) + r->req.length;
+	}
+	s->dispatched++;
+	if (r->deadline <= schedNow()) {
+		s->late++;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_sched_complete
+// Description  : Finish a dispatched request, a merged read copies each
+//                member's range, result and block version out of the merged
+//                transfer
+//
+// Inputs       : r - the request, its response fields are filled in
+// Outputs      : none
+
+void hdd_sched_complete( HddSchedReq *r ) {
+	HddSchedReq *m;
+
+	if (r->members == NULL) {
+		r->done = 1;
+		return;
+	}
+	for (m = r->members; m != NULL; m = m->nextMember) {
+		if (r->req.result == 0) {
+			memcpy(m->buf, (char *)r->buf + (m->req.offset - r->req.offset), m->req.length);
+		}
+		m->req.result = r->req.result;
+		m->req.version = r->req.version;
+		m->done = 1;
+	}
+	free(r->buf);
+	free(r);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_sched_resp_bytes
+// Description  : The payload bytes the response to a request carries
+//
+// Inputs       : r - the request
+// Outputs      : the bytes
+
+int32_t hdd_sched_resp_bytes( HddSchedReq *r ) {
+	if ( (r->req.op == HDD_BLOCK_READ) && ((r->req.flags == HDD_NULL_FLAG) || (r->req.flags == HDD_META_BLOCK)) ) {
+		return( (int32_t)r->req.length );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_sched_free
+// Description  : Free an empty queue
+//
+// Inputs       : s - the queue
+// Outputs      : none
+
+void hdd_sched_free( HddSched *s ) {
+	free(s->queue);
+	memset(s, 0x0, sizeof(HddSched));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_sched_report
+// Description  : Log the counters of a queue
+//
+// Inputs       : s - the queue
+//                name - who the queue belongs to
+// Outputs      : none
+
+void hdd_sched_report( HddSched *s, char *name ) {
+	logMessage(LOG_INFO_LEVEL, "HDD_SCHED : %s dispatched %lu requests, %lu reads merged, %lu past their deadline",
+			   name, (unsigned long)s->dispatched, (unsigned long)s->merges, (unsigned long)s->late);
+}
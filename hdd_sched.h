@@ -0,0 +1,108 @@
+#ifndef HDD_SCHED_INCLUDED
+#define HDD_SCHED_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_sched.h
+//  Description    : This is the header file for the client I/O scheduler.
+//                   Block requests waiting for the connection are queued
+//                   here and dispatched in elevator order (C-LOOK on block
+//                   ID and offset, the order hdd_blockd lays blocks out on
+//                   its disk), optionally with a deadline that bounds how
+//                   long a request can be passed over. Metadata block
+//                   requests have their own queue that goes first, and
+//                   reads of overlapping or adjacent ranges of the same
+//                   block are merged into one transfer.
+//
+
+//
+
+// Include files
+#include <stdint.h>
+
+// Project include files
+#include <hdd_network.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Defines
+#define HDD_SCHED_EXPIRE_MS 50        // default deadline, age at which a request jumps the elevator
+#define HDD_SCHED_META_BATCH 8        // metadata requests dispatched in a row while data waits
+#define HDD_SCHED_MAX_MERGE (1 << 20) // largest merged read in bytes
+#define HDD_SCHED_BATCH 32            // requests the client keeps in flight on its connections
+
+// These are the dispatch policies
+typedef enum {
+	HDD_SCHED_FIFO     = 0, // Arrival order
+	HDD_SCHED_CLOOK    = 1, // Ascending block/offset sweep, wrapping to the lowest
+	HDD_SCHED_DEADLINE = 2, // C-LOOK, but an overdue request goes first
+} HDD_SCHED_POLICY_TYPES;
+
+// These are the merge modes of a queue
+typedef enum {
+	HDD_SCHED_MERGE_NONE   = 0, // Never merge
+	HDD_SCHED_MERGE_SAME   = 1, // Merge reads of the same range only (v1 whole-block reads)
+	HDD_SCHED_MERGE_RANGES = 2, // Merge reads of overlapping or adjacent ranges (v2)
+} HDD_SCHED_MERGE_TYPES;
+
+// A queued block request
+typedef struct HddSchedReq {
+	HddRequest          req;        // the request, the response fields are filled in
+	void               *buf;        // the payload or the read destination
+	void               *owner;      // the submitter's context
+	double              deadline;   // ms on the monotonic clock it is due by
+	int                 done;       // 1 once the response is in req
+	struct HddSchedReq *members;    // the requests merged into this one, NULL if not merged
+	struct HddSchedReq *nextMember; // next request merged with this one
+} HddSchedReq;
+
+// A scheduler queue, a zeroed structure is an empty queue
+typedef struct {
+	int            merge;      // HDD_SCHED_MERGE_TYPES
+	uint64_t       head;       // position after the last data request dispatched
+	uint32_t       metaRun;    // metadata requests dispatched since the last data one
+	HddSchedReq  **queue;      // pending requests in arrival order
+	uint32_t       count;      // pending requests
+	uint32_t       capacity;   // allocated queue entries
+	uint64_t       dispatched; // requests taken for the connection
+	uint64_t       merges;     // requests merged into another
+	uint64_t       late;       // requests dispatched after their deadline
+} HddSched;
+
+//
+// Functional Prototypes
+
+int hdd_sched_configure( char *spec );
+	// Set the policy of every queue, spec is "fifo", "clook" or
+	// "deadline[:<ms>]", returns -1 if spec is bad
+
+int hdd_sched_add( HddSched *s, HddSchedReq *r );
+	// Queue a request, returns 1 if it was merged into a queued one,
+	// 0 if queued on its own, -1 if failure
+
+HddSchedReq *hdd_sched_peek( HddSched *s );
+	// The request the policy dispatches next, NULL if the queue is empty
+
+void hdd_sched_take( HddSched *s, HddSchedReq *r );
+	// Remove a request returned by hdd_sched_peek, it is being dispatched
+
+void hdd_sched_complete( HddSchedReq *r );
+	// Mark a dispatched request done once its response arrived, a merged
+	// request hands the result (and its data) to its members and is freed
+
+int32_t hdd_sched_resp_bytes( HddSchedReq *r );
+	// Payload bytes the response to a request carries
+
+void hdd_sched_free( HddSched *s );
+	// Free the queue, nothing may be pending
+
+void hdd_sched_report( HddSched *s, char *name );
+	// Log the queue's counters
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
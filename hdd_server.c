@@ -0,0 +1,787 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_server.c
+//  Description   : This is the server side of the CRUD communication
+//                  protocol, a block store kept in memory and saved to disk
+//                  on SAVE_AND_CLOSE. Each connection starts in v1 and is
+//                  switched to v2 when its INIT offers it. With -d, block
+//                  transfers are charged the service time of a mechanical
+//                  disk (hdd_disk.c) and responses held until it passes.
+//                  Every write gives its block a new version; clients that
+//                  cache blocks lease copies for -L ms and subscribe to an
+//                  invalidation channel that is sent each write as it
+//                  happens.
+//
+
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Project Include Files
+#include <hdd_driver.h>
+#include <hdd_network.h>
+#include <hdd_disk.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define HDD_SERVER_ARGUMENTS "hvp:s:1d:l:L:"
+#define HDD_SERVER_FIRST_BLOCK 4096           // ID of the first block created
+#define HDD_SERVER_SAVE_FILE "hdd_blockd.svd" // where SAVE_AND_CLOSE writes the store
+#define HDD_SERVER_SAVE_MAGIC 0x48444253      // first word of the save file ("HDBS")
+#define HDD_SERVER_LEASE_MS 1000              // default lease term granted to caching clients
+#define USAGE \
+	"USAGE: hdd_blockd [-h] [-v] [-1] [-p <port>] [-s <savefile>] [-d <model>] [-l <logfile>] [-L <ms>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -1 - refuse protocol v2 (behave like a legacy server)\n" \
+	"    -p - port number to listen on\n" \
+	"    -s - file the store is saved to and loaded from (default hdd_blockd.svd)\n" \
+	"    -d - model a mechanical disk, <model> is \"default\" or a comma separated\n" \
+	"         list of rpm=<7200>, track=<1024 KiB>, rate=<MB/s, sets the track size>,\n" \
+	"         tracks=<200000>, seek=<0.8>:<16.0 ms, track to track and full stroke>,\n" \
+	"         overhead=<0.1 ms>, stall=<0>:<ms, percent of requests stalling and\n" \
+	"         for how long> and sleep=<1, 0 to only log the service times>\n" \
+	"    -l - log the modeled service time of every request to <logfile>\n" \
+	"    -L - lease term in ms of the copies clients cache, the longest a client\n" \
+	"         may miss another's write; 0 grants no leases and sends no\n" \
+	"         invalidations (default 1000)\n" \
+	"\n" \
+
+// A stored block
+typedef struct {
+	char     *data; // the contents
+	uint64_t  size; // bytes in the block
+	uint8_t   used; // 1 if the block exists
+	uint64_t  addr; // disk address (disk model)
+	uint32_t  version; // changed by every write
+} HddServerBlock;
+
+// A client connection
+typedef struct HddServerConn {
+	int       fd;          // the socket
+	int       version;     // HDD_PROTOCOL_V1 or HDD_PROTOCOL_V2
+	char     *scratch;     // READ payload buffer, reused between requests
+	uint64_t  scratchSize; // bytes allocated for scratch
+	double    diskDone;    // when the disk model completes the request
+	int       callback;    // 1 if this is an invalidation channel
+	int       dropped;     // 1 once an invalidation could not be sent
+	struct HddServerConn *next; // next invalidation channel
+} HddServerConn;
+
+//
+// Global Data
+HddServerBlock  *blocks = NULL;     // blocks by ID - HDD_SERVER_FIRST_BLOCK
+uint64_t         blockSlots = 0;    // allocated entries in blocks
+uint64_t         nextBlock = 0;     // index of the next block created
+HddServerBlock   metaBlock;         // the meta block
+pthread_mutex_t  storeLock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t         storeVersion = 0;  // the last block version handed out
+int              maxVersion = HDD_PROTOCOL_V2;
+char            *saveFile = HDD_SERVER_SAVE_FILE;
+uint32_t         leaseMs = HDD_SERVER_LEASE_MS;
+HddServerConn   *callbacks = NULL;  // the invalidation channels
+pthread_mutex_t  callbackLock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Functional Prototypes
+
+int hdd_server_load( void );
+void *hdd_server_connection( void *arg );
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the HDD block server
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+	// Local variables
+	char *logFile = NULL;
+	int ch, ret;
+
+	// Process the command line parameters
+	initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	while ((ch = getopt(argc, argv, HDD_SERVER_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			enableLogLevels( LOG_INFO_LEVEL );
+			break;
+
+		case '1': // Legacy protocol only
+			maxVersion = HDD_PROTOCOL_V1;
+			break;
+
+		case 'p': // Get the port
+			hdd_network_port = (unsigned short)atoi(optarg);
+			break;
+
+		case 's': // Save file
+			saveFile = optarg;
+			break;
+
+		case 'd': // Disk model
+			if ( hdd_disk_configure(optarg) ) {
+				return( -1 );
+			}
+			break;
+
+		case 'l': // Service time log
+			logFile = optarg;
+			break;
+
+		case 'L': // Lease term
+			leaseMs = (uint32_t)atoi(optarg);
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	if ( (logFile != NULL) && (!hdd_disk_enabled() || hdd_disk_open_log(logFile)) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SERVER : the service time log needs the disk model (-d)" );
+		return( -1 );
+	}
+	if ( hdd_server_load() ) {
+		return( -1 );
+	}
+	ret = hdd_server();
+	hdd_disk_report();
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_shutdown
+// Description  : Signal handler, stop accepting connections
+//
+// Inputs       : sig - the signal
+// Outputs      : none
+
+void hdd_server_shutdown( int sig ) {
+	hdd_network_shutdown = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server
+// Description  : Accept connections, each is served by its own thread
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_server( void ) {
+	struct sockaddr_in saddr;
+	struct sigaction sa;
+	HddServerConn *conn;
+	pthread_t thread;
+	int sock, fd, on = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = hdd_server_shutdown; // no SA_RESTART, accept returns on the signal
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(hdd_network_port ? hdd_network_port : HDD_DEFAULT_PORT);
+	saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if ( ((sock = socket(PF_INET, SOCK_STREAM, 0)) == -1) ||
+		 (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) ||
+		 (bind(sock, (struct sockaddr *)&saddr, sizeof(saddr)) == -1) ||
+		 (listen(sock, HDD_MAX_BACKLOG) == -1) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SERVER : listen failed [%s]", strerror(errno) );
+		return( -1 );
+	}
+	logMessage( LOG_INFO_LEVEL, "HDD_SERVER : listening on port %d", ntohs(saddr.sin_port) );
+
+	while ( !hdd_network_shutdown ) {
+		if ( (fd = accept(sock, NULL, NULL)) == -1 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			logMessage( LOG_ERROR_LEVEL, "HDD_SERVER : accept failed [%s]", strerror(errno) );
+			break;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		conn = calloc(1, sizeof(HddServerConn));
+		conn->fd = fd;
+		conn->version = HDD_PROTOCOL_V1;
+		if ( pthread_create(&thread, NULL, hdd_server_connection, conn) != 0 ) {
+			close(fd);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	close(sock);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readAll
+// Description  : Read exactly len bytes from a connection
+//
+// Inputs       : fd - the socket
+//                buf - where to put the bytes
+//                len - bytes to read
+// Outputs      : 0 if successful, -1 if the connection failed or closed
+
+int readAll( int fd, void *buf, uint64_t len ) {
+	uint64_t total = 0;
+	ssize_t r;
+
+	while (total < len) {
+		if ( (r = read(fd, (char *)buf + total, len - total)) <= 0 ) {
+			if ( (r == -1) && (errno == EINTR) ) {
+				continue;
+			}
+			return( -1 );
+		}
+		total += r;
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeAll
+// Description  : Write a header and a payload to a connection
+//
+// Inputs       : fd - the socket
+//                hdr - the header
+//                hlen - bytes in the header
+//                buf - the payload (may be NULL)
+//                blen - bytes in the payload
+// Outputs      : 0 if successful, -1 if the connection failed
+
+int writeAll( int fd, void *hdr, uint64_t hlen, void *buf, uint64_t blen ) {
+	struct iovec iov[2];
+	int i = 0, n = (blen > 0) ? 2 : 1;
+	ssize_t w;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hlen;
+	iov[1].iov_base = buf;
+	iov[1].iov_len = blen;
+	while (i < n) {
+		if ( (w = writev(fd, &iov[i], n - i)) <= 0 ) {
+			if ( (w == -1) && (errno == EINTR) ) {
+				continue;
+			}
+			return( -1 );
+		}
+		while ( (i < n) && ((size_t)w >= iov[i].iov_len) ) {
+			w -= iov[i].iov_len;
+			i++;
+		}
+		if (i < n) {
+			iov[i].iov_base = (char *)iov[i].iov_base + w;
+			iov[i].iov_len -= w;
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_block
+// Description  : Find a stored block, the caller holds storeLock
+//
+// Inputs       : req - the request naming the block
+// Outputs      : the block, NULL if it does not exist
+
+HddServerBlock *find_block( HddRequest *req ) {
+	uint64_t idx;
+
+	if (req->flags == HDD_META_BLOCK) {
+		return( metaBlock.used ? &metaBlock : NULL );
+	}
+	if (req->blockID < HDD_SERVER_FIRST_BLOCK) {
+		return( NULL );
+	}
+	idx = req->blockID - HDD_SERVER_FIRST_BLOCK;
+	return( ((idx < nextBlock) && blocks[idx].used) ? &blocks[idx] : NULL );
+}
+
+// A version no block has had, 0 is never handed out
+uint32_t next_version( void ) {
+	if (++storeVersion == 0) {
+		storeVersion = 1;
+	}
+	return( storeVersion );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : new_block
+// Description  : Add a block to the store, the caller holds storeLock
+//
+// Inputs       : data - the contents, owned by the store from now on
+//                size - bytes in the block
+// Outputs      : the block ID, 0 if failure
+
+uint64_t new_block( char *data, uint64_t size ) {
+	HddServerBlock *grown;
+
+	if (nextBlock == blockSlots) {
+		blockSlots = blockSlots ? blockSlots * 2 : 1024;
+		if ( (grown = realloc(blocks, blockSlots * sizeof(HddServerBlock))) == NULL ) {
+			return( 0 );
+		}
+		blocks = grown;
+	}
+	blocks[nextBlock].data = data;
+	blocks[nextBlock].size = size;
+	blocks[nextBlock].used = 1;
+	blocks[nextBlock].addr = hdd_disk_place(size);
+	blocks[nextBlock].version = next_version();
+	return( HDD_SERVER_FIRST_BLOCK + nextBlock++ );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_format
+// Description  : Delete every block, the caller holds storeLock
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_server_format( void ) {
+	uint64_t i;
+
+	for (i=0; i<nextBlock; i++) {
+		free(blocks[i].data);
+	}
+	free(metaBlock.data);
+	memset(&metaBlock, 0, sizeof(metaBlock));
+	nextBlock = 0;
+	storeVersion = 0; // replicas formatted together hand out the same versions
+	hdd_disk_reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_save
+// Description  : Write the store to the save file, the caller holds storeLock
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_server_save( void ) {
+	uint64_t i, word[2];
+	FILE *fp;
+	int ret = 0;
+
+	if ( (fp = fopen(saveFile, "w")) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SERVER : cannot write [%s] [%s]", saveFile, strerror(errno) );
+		return( -1 );
+	}
+	word[0] = HDD_SERVER_SAVE_MAGIC;
+	word[1] = nextBlock;
+	ret |= (fwrite(word, sizeof(word), 1, fp) != 1);
+	word[0] = metaBlock.used | ((uint64_t)metaBlock.version << 32); // the version rides above the used flag
+	word[1] = metaBlock.size;
+	ret |= (fwrite(word, sizeof(word), 1, fp) != 1);
+	ret |= (metaBlock.size && (fwrite(metaBlock.data, metaBlock.size, 1, fp) != 1));
+	for (i=0; i<nextBlock; i++) {
+		word[0] = blocks[i].used | ((uint64_t)blocks[i].version << 32);
+		word[1] = blocks[i].used ? blocks[i].size : 0;
+		ret |= (fwrite(word, sizeof(word), 1, fp) != 1);
+		ret |= (word[1] && (fwrite(blocks[i].data, word[1], 1, fp) != 1));
+	}
+	ret |= (fclose(fp) != 0);
+	return( ret ? -1 : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_record
+// Description  : Read one block record of the save file
+//
+// Inputs       : fp - the save file
+//                blk - the block to fill
+// Outputs      : 0 if successful, -1 if failure
+
+int load_record( FILE *fp, HddServerBlock *blk ) {
+	uint64_t word[2];
+
+	if (fread(word, sizeof(word), 1, fp) != 1) {
+		return( -1 );
+	}
+	blk->used = word[0] & 0xff;
+	blk->version = word[0] >> 32;
+	blk->size = word[1];
+	if ( blk->used && ((int32_t)(blk->version - storeVersion) > 0) ) {
+		storeVersion = blk->version; // versions go on from the newest saved
+	}
+	blk->data = NULL;
+	if ( blk->size && (((blk->data = malloc(blk->size)) == NULL) || (fread(blk->data, blk->size, 1, fp) != 1)) ) {
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_load
+// Description  : Read the store from the save file if there is one
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_server_load( void ) {
+	uint64_t i, word[2];
+	FILE *fp;
+
+	if ( (fp = fopen(saveFile, "r")) == NULL ) {
+		return( 0 ); // a fresh store
+	}
+	if ( (fread(word, sizeof(word), 1, fp) != 1) || (word[0] != HDD_SERVER_SAVE_MAGIC) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SERVER : [%s] is not a save file", saveFile );
+		fclose(fp);
+		return( -1 );
+	}
+	blockSlots = (word[1] > 1024) ? word[1] : 1024;
+	blocks = calloc(blockSlots, sizeof(HddServerBlock));
+	nextBlock = word[1];
+	if (load_record(fp, &metaBlock)) {
+		fclose(fp);
+		return( -1 );
+	}
+	for (i=0; i<nextBlock; i++) {
+		if (load_record(fp, &blocks[i])) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_SERVER : [%s] is truncated", saveFile );
+			fclose(fp);
+			return( -1 );
+		}
+		blocks[i].addr = hdd_disk_place(blocks[i].size); // placement is not saved, lay the blocks out again
+	}
+	fclose(fp);
+	logMessage( LOG_INFO_LEVEL, "HDD_SERVER : loaded %llu blocks from [%s]", (unsigned long long)nextBlock, saveFile );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_invalidate
+// Description  : Send a change to every invalidation channel. A channel
+//                that cannot take the message right away is dropped rather
+//                than holding up the writer, its client falls back on the
+//                lease term
+//
+// Inputs       : changed - the block and its new version (or a FORMAT)
+// Outputs      : none
+
+void hdd_server_invalidate( HddRequest *changed ) {
+	uint8_t hdr[HDD_V2_HEADER_SIZE];
+	HddServerConn *c;
+
+	hdd_v2_encode(changed, hdr);
+	pthread_mutex_lock(&callbackLock);
+	for (c = callbacks; c != NULL; c = c->next) {
+		if ( !c->dropped && (send(c->fd, hdr, HDD_V2_HEADER_SIZE, MSG_DONTWAIT | MSG_NOSIGNAL) != HDD_V2_HEADER_SIZE) ) {
+			logMessage( LOG_WARNING_LEVEL, "HDD_SERVER : invalidation channel %d is not keeping up, dropped", c->fd );
+			c->dropped = 1;
+			shutdown(c->fd, SHUT_RDWR);
+		}
+	}
+	pthread_mutex_unlock(&callbackLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_callbacks
+// Description  : Keep an invalidation channel registered until its client
+//                closes it, nothing is read from it
+//
+// Inputs       : conn - the connection
+// Outputs      : none
+
+void hdd_server_callbacks( HddServerConn *conn ) {
+	HddServerConn **link;
+	char byte;
+
+	pthread_mutex_lock(&callbackLock);
+	conn->next = callbacks;
+	callbacks = conn;
+	pthread_mutex_unlock(&callbackLock);
+
+	while ( (read(conn->fd, &byte, 1) == -1) && (errno == EINTR) );
+
+	pthread_mutex_lock(&callbackLock);
+	for (link = &callbacks; *link != conn; link = &(*link)->next);
+	*link = conn->next;
+	pthread_mutex_unlock(&callbackLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_execute
+// Description  : Run a request against the store, filling in the response
+//                fields; a READ leaves its bytes in the connection's scratch.
+//                Writes are sent to the invalidation channels before the
+//                response goes out
+//
+// Inputs       : conn - the connection
+//                req - the request, becomes the response
+//                payload - the CREATE/OVERWRITE bytes, a CREATE keeps them
+// Outputs      : 1 if the store kept the payload, 0 if not
+
+int hdd_server_execute( HddServerConn *conn, HddRequest *req, char *payload ) {
+	HddServerBlock *blk;
+	HddRequest changed;
+	int kept = 0, current;
+
+	req->result = 1;
+	conn->diskDone = 0;
+	memset(&changed, 0, sizeof(changed));
+	pthread_mutex_lock(&storeLock);
+	switch (req->flags) {
+	case HDD_INIT:
+		req->result = 0;
+		break;
+
+	case HDD_FORMAT:
+		hdd_server_format();
+		req->result = 0;
+		changed.flags = HDD_FORMAT;
+		break;
+
+	case HDD_SAVE_AND_CLOSE:
+		req->result = (hdd_server_save() == 0) ? 0 : 1;
+		break;
+
+	case HDD_NULL_FLAG:
+	case HDD_META_BLOCK:
+		if (req->op == HDD_BLOCK_CREATE) {
+			if (req->flags == HDD_META_BLOCK) {
+				free(metaBlock.data);
+				metaBlock.data = payload;
+				metaBlock.size = req->length;
+				metaBlock.used = 1;
+				req->blockID = 0;
+			} else {
+				req->blockID = new_block(payload, req->length);
+			}
+			kept = (req->flags == HDD_META_BLOCK) || (req->blockID != 0);
+			req->result = kept ? 0 : 1;
+			if (kept) {
+				blk = (req->flags == HDD_META_BLOCK) ? &metaBlock : find_block(req);
+				if (req->flags == HDD_META_BLOCK) {
+					blk->version = next_version();
+				}
+				req->version = blk->version;
+				conn->diskDone = hdd_disk_access(req->op, req->blockID, blk->addr, 0, req->length);
+			}
+			break;
+		}
+		if ( (blk = find_block(req)) == NULL ) {
+			break;
+		}
+		current = (req->version == 0) || (req->version == blk->version); // the client's copy, if it has one
+		if (req->op == HDD_BLOCK_DELETE) {
+			free(blk->data);
+			memset(blk, 0, sizeof(HddServerBlock));
+			req->version = next_version();
+			req->result = 0;
+		} else if ( (req->op == HDD_BLOCK_OVERWRITE) && (req->flags == HDD_META_BLOCK) && (req->offset == 0) ) {
+			free(blk->data); // the meta block is replaced whole
+			blk->data = payload;
+			blk->size = req->length;
+			blk->version = next_version();
+			req->version = current ? blk->version : 0;
+			kept = 1;
+			req->result = 0;
+			conn->diskDone = hdd_disk_access(req->op, req->blockID, blk->addr, 0, req->length);
+		} else if ( (req->offset > blk->size) || (req->length > blk->size - req->offset) ) {
+			// out of the block
+		} else if (req->op == HDD_BLOCK_OVERWRITE) {
+			memcpy(blk->data + req->offset, payload, req->length);
+			blk->version = next_version();
+			req->version = current ? blk->version : 0;
+			req->result = 0;
+			conn->diskDone = hdd_disk_access(req->op, req->blockID, blk->addr, req->offset, req->length);
+		} else if ( (req->op == HDD_BLOCK_READ) && (req->version != 0) && current ) {
+			req->length = 0; // the client's copy is current, nothing to send
+			req->result = 0;
+		} else if (req->op == HDD_BLOCK_READ) {
+			if (conn->scratchSize < req->length) {
+				free(conn->scratch);
+				conn->scratch = malloc(req->length);
+				conn->scratchSize = (conn->scratch != NULL) ? req->length : 0;
+			}
+			if (conn->scratch != NULL) {
+				memcpy(conn->scratch, blk->data + req->offset, req->length);
+				req->version = blk->version;
+				req->result = 0;
+				conn->diskDone = hdd_disk_access(req->op, req->blockID, blk->addr, req->offset, req->length);
+			}
+		}
+		if ( (req->result == 0) && (req->flags == HDD_NULL_FLAG) &&
+			 ((req->op == HDD_BLOCK_OVERWRITE) || (req->op == HDD_BLOCK_DELETE)) ) {
+			changed.op = req->op;
+			changed.blockID = req->blockID;
+			changed.version = (req->op == HDD_BLOCK_DELETE) ? req->version : blk->version;
+		}
+		break;
+
+	default:
+		break;
+	}
+	pthread_mutex_unlock(&storeLock);
+	if ( (changed.op != 0) || (changed.flags != 0) ) {
+		hdd_server_invalidate(&changed);
+	}
+	return( kept );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_request
+// Description  : Read one request from a connection, run it and send the
+//                response in the connection's protocol
+//
+// Inputs       : conn - the connection
+// Outputs      : 0 to keep serving, -1 to close the connection
+
+int hdd_server_request( HddServerConn *conn ) {
+	uint8_t hdr[HDD_V2_HEADER_SIZE];
+	HddRequest req;
+	HddBitCmd cmd;
+	char *payload = NULL, *reply = NULL;
+	uint64_t replyLen = 0;
+	int offered = 0, subscribe = 0, hasPayload;
+
+	// Read the request, v1 commands are handled as whole-block v2 requests
+	memset(&req, 0, sizeof(req));
+	if (conn->version == HDD_PROTOCOL_V2) {
+		if ( readAll(conn->fd, hdr, HDD_V2_HEADER_SIZE) || hdd_v2_decode(hdr, &req) ) {
+			return( -1 );
+		}
+	} else {
+		if ( readAll(conn->fd, &cmd, sizeof(cmd)) ) {
+			return( -1 );
+		}
+		cmd = ntohll64(cmd);
+		req.op = cmd >> 62;
+		req.length = (cmd >> 36) & 0x3ffffff;
+		req.flags = (cmd >> 33) & 0x7;
+		req.blockID = cmd & 0xffffffff;
+		offered = (req.flags == HDD_INIT) && (req.blockID == HDD_V2_HELLO);
+		subscribe = (req.flags == HDD_INIT) && (req.blockID == HDD_V2_CALLBACK);
+	}
+	if (req.length > HDD_V2_MAX_BLOCK_SIZE) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_SERVER : request of %llu bytes refused", (unsigned long long)req.length );
+		return( -1 );
+	}
+	hasPayload = ((req.flags == HDD_NULL_FLAG) || (req.flags == HDD_META_BLOCK)) &&
+				 ((req.op == HDD_BLOCK_CREATE) || (req.op == HDD_BLOCK_OVERWRITE));
+	if ( hasPayload && (((payload = malloc(req.length ? req.length : 1)) == NULL) || readAll(conn->fd, payload, req.length)) ) {
+		free(payload);
+		return( -1 );
+	}
+
+	if ( hdd_server_execute(conn, &req, payload) == 0 ) {
+		free(payload);
+	}
+	hdd_disk_wait(conn->diskDone); // outside storeLock, later requests queue on the model instead
+	if ( (req.op == HDD_BLOCK_READ) && ((req.flags == HDD_NULL_FLAG) || (req.flags == HDD_META_BLOCK)) ) {
+		reply = conn->scratch;
+		replyLen = req.length;
+	}
+
+	// Send the response
+	if (conn->version == HDD_PROTOCOL_V2) {
+		hdd_v2_encode(&req, hdr);
+		if ( writeAll(conn->fd, hdr, HDD_V2_HEADER_SIZE, reply, (req.result == 0) ? replyLen : 0) ) {
+			return( -1 );
+		}
+	} else {
+		if ( offered && (maxVersion >= HDD_PROTOCOL_V2) ) {
+			req.blockID = HDD_V2_ACCEPT;
+			req.length = leaseMs;
+		}
+		if ( subscribe && ((maxVersion < HDD_PROTOCOL_V2) || (leaseMs == 0)) ) {
+			req.result = 1; // no leases, nothing to invalidate
+		}
+		cmd = htonll64( ((uint64_t)req.op << 62) | ((uint64_t)req.length << 36) | ((uint64_t)req.flags << 33) |
+						((uint64_t)req.result << 32) | (req.blockID & 0xffffffff) );
+		if ( (reply != NULL) && (req.result != 0) ) {
+			// v1 always sends the block, send zeros
+			if (conn->scratchSize < replyLen) {
+				free(conn->scratch);
+				if ( (conn->scratch = malloc(replyLen)) == NULL ) {
+					conn->scratchSize = 0;
+					return( -1 );
+				}
+				conn->scratchSize = replyLen;
+			}
+			memset(conn->scratch, 0, replyLen);
+			reply = conn->scratch;
+		}
+		if ( writeAll(conn->fd, &cmd, sizeof(cmd), reply, replyLen) ) {
+			return( -1 );
+		}
+		if (req.blockID == HDD_V2_ACCEPT) {
+			conn->version = HDD_PROTOCOL_V2;
+		}
+		conn->callback = subscribe && (req.result == 0);
+	}
+	return( (req.flags == HDD_SAVE_AND_CLOSE) ? -1 : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_connection
+// Description  : Serve one connection until it closes
+//
+// Inputs       : arg - the connection
+// Outputs      : NULL
+
+void *hdd_server_connection( void *arg ) {
+	HddServerConn *conn = arg;
+
+	logMessage( LOG_INFO_LEVEL, "HDD_SERVER : connection %d opened", conn->fd );
+	while ( hdd_server_request(conn) == 0 ) {
+		if (conn->callback) {
+			hdd_server_callbacks(conn);
+			break;
+		}
+	}
+	logMessage( LOG_INFO_LEVEL, "HDD_SERVER : connection %d closed (v%d)", conn->fd, conn->version );
+	close(conn->fd);
+	free(conn->scratch);
+	free(conn);
+	return( NULL );
+}
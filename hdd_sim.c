@@ -8,6 +8,7 @@
 
 // Include Files
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
@@ -18,48 +19,118 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <time.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HDD_SIM_X86
+#include <immintrin.h>
+#endif
 
 // Project Includes
 #include <hdd_driver.h>
 #include <hdd_network.h>
 #include <hdd_file_io.h>
+#include <hdd_cache.h>
+#include <hdd_stripe.h>
+#include <hdd_trace.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 #include <cmpsc311_hashtable.h>
 
 // Defines
 #define HDD_SIM_MAX_OPEN_FILES 128
-#define HDD_ARGUMENTS "hvul:x:a:p:"
+#define HDD_SIM_MAX_FIELD 128       // longest file name or command of a workload line
+#define HDD_SIM_MIN_TEXT 1024       // smallest transfer buffer
+#define HDD_SIM_MAX_PAYLOADS 16     // payload files a workload refers to
+#define HDD_ARGUMENTS "hvutl:c:x:a:p:m:R:H:S:E:J:k:i:T:"
 #define USAGE \
-	"USAGE: hdd [-h] [-v] [-l <logfile>] [-c <sz>] [-x <file>] [-a <ip addr>] [-p <port>] <workload-file>\n" \
+	"USAGE: hdd [-h] [-v] [-t] [-l <logfile>] [-c <cache>] [-x <file>] [-a <ip addr>] [-p <port>] [-m <mode>]\n" \
+	"           [-R <replicas>] [-H <percentile>] [-S <servers>] [-E <layout>] [-J <KiB>]\n" \
+	"           [-k <bytes>] [-i <bytes>] [-T <trace>] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -u - run the unit tests instead of the simulator\n" \
 	"    -v - verbose output\n" \
+	"    -t - report the throughput of sequential and random reads and writes\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
+	"    -c - client block cache, \"default\" or a comma separated list of\n" \
+	"         ram=<KiB>, file=<path>, size=<MiB>, slot=<KiB>, admit=<n>,\n" \
+	"         direct=0|1 (a file tier is only used with file=)\n" \
 	"    -x - extract a file <file> from the hdd filesystem\n" \
 	"    -a - IP address of server to connect to.\n" \
 	"    -p - port number of server to connect to.\n" \
+	"    -m - mount mode, eager (read the whole directory) or lazy (read the root\n" \
+	"         of the directory B-tree, the nodes below as lookups reach them)\n" \
+	"    -R - more servers holding copies of the store, a comma separated list\n" \
+	"         of [<ip>:]<port>: writes go to every server, reads to the least busy\n" \
+	"    -H - hedge a read on a second server once it waited longer than this\n" \
+	"         percentile of recent reads, 0 to never hedge (default 95)\n" \
+	"    -S - stripe large files across these servers, a comma separated list\n" \
+	"         of [<ip>:]<port> (the IP defaults to the one of -a)\n" \
+	"    -E - stripe layout, \"default\" or a comma separated list of parity=<m>\n" \
+	"         (Reed-Solomon parity units per stripe), unit=<KiB>, min=<KiB>\n" \
+	"         (the size from which a file is striped)\n" \
+	"    -J - journal directory changes in a block of <KiB> (0 none, the default),\n" \
+	"         given to a file system formatted or mounted without one\n" \
+	"    -k - pack files of at most <bytes> (0 none, the default, at most 16384)\n" \
+	"         into shared container blocks\n" \
+	"    -i - keep files of at most <bytes> (0 none, the default, at most 1024)\n" \
+	"         inline in their directory entries\n" \
+	"    -T - record every request to the server in the wire trace <trace>,\n" \
+	"         <trace>,hash to hash the payloads too (replay with hdd_bench)\n" \
 	"\n" \
-	"    <workload-file> - file contain the workload to simulate\n" \
+	"    <workload-file> - file contain the workload to simulate, lines of\n" \
+	"         <file> <command> <len> <off> followed by the data of a write as\n" \
+	"         :<text> (a * is a newline), <<payload file>[+<offset>] or =zero|pos\n" \
+	"         (a pattern of the position in the file), READ checks against a\n" \
+	"         payload or a pattern too\n" \
 	"\n" \
 
 // This is the file table
 typedef struct {
 	char     *filename;  // This is the filename for the test file
 	int16_t   fhandle;   // This is a file handle for the opened file
+	uint32_t  position;  // The seek position in the file
+	uint32_t  end;       // Where its last read or write ended
 } HddSimulationTable;
 
+// A payload file of the workload, mapped the first time it is used
+typedef struct {
+	char     *path;      // The path in the workload
+	char     *map;       // Its contents
+	size_t    size;      // Bytes of contents
+} HddSimulationPayload;
+
+// Transfers counted for the throughput report
+typedef struct {
+	uint64_t  ops;       // Reads or writes
+	uint64_t  bytes;     // Bytes transferred
+	uint64_t  ns;        // Time spent in them
+} HddSimulationTransfers;
+
 //
 // Global Data
 int verbose;
+int throughput = 0;                                   // 1 to report the throughput
+HddSimulationPayload payloads[HDD_SIM_MAX_PAYLOADS];  // payload files
+int payloadCount = 0;
+HddSimulationTransfers transfers[2][2];              // [read, write][sequential, random]
 
 //
 // Functional Prototypes
 
 int simulate_HDD( char *wload );
 int extract_file_from_hdd(char *ex_file);
+int flush_pending_seek( HddSimulationTable *ftable, int *pending, int32_t off, int32_t expected );
+void simSetCopy( void );
+int simParseLine( char **pos, char *end, char *fname, char *command, int32_t *len, int32_t *off, char *kind, char **data, size_t *dataLen );
+char *simGetData( char kind, char *data, size_t dataLen, int32_t len, uint32_t pos, char **buf, size_t *size );
+char *simGrow( char **buf, size_t *size, size_t need );
+void simCount( int write, HddSimulationTable *file, uint32_t pos, int32_t len, struct timespec *start );
+void simReport( void );
+void simUnmap( char *map, size_t size, int fd );
 
 //
 // Functions
@@ -76,8 +147,9 @@ int extract_file_from_hdd(char *ex_file);
 int main( int argc, char *argv[] ) {
 	// Local variables
 	int ch, verbose = 0, unit_tests = 0, log_initialized = 0, extract_file = 0;
-	uint32_t cache_size = 1024; // Defaults to 1024 cache lines
+	unsigned journal, pack, inlined;
 	char *ex_file = NULL;
+	double hedge;
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, HDD_ARGUMENTS)) != -1) {
@@ -95,6 +167,10 @@ int main( int argc, char *argv[] ) {
 			unit_tests = 1;
 			break;
 
+		case 't': // Throughput report
+			throughput = 1;
+			break;
+
 		case 'l': // Set the log filename
 			initializeLogWithFilename( optarg );
 			log_initialized = 1;
@@ -105,9 +181,8 @@ int main( int argc, char *argv[] ) {
 			extract_file = 1;
 			break;
 
-		case 'c': // Set cache line size
-			if ( sscanf( optarg, "%u", &cache_size ) != 1 ) {
-			    logMessage( LOG_ERROR_LEVEL, "Bad  cache size [%s]", argv[optind] );
+		case 'c': // Set up the block cache
+			if ( hdd_cache_configure( optarg ) != 0 ) {
                 return(-1);
 			}
 			break;
@@ -127,6 +202,73 @@ int main( int argc, char *argv[] ) {
 			}
             break;
 
+		case 'm': // Set the mount mode
+			if (strcmp(optarg, "eager") == 0) {
+				hdd_set_mount_mode(HDD_MOUNT_EAGER);
+			} else if (strcmp(optarg, "lazy") == 0) {
+				hdd_set_mount_mode(HDD_MOUNT_LAZY);
+			} else {
+				logMessage( LOG_ERROR_LEVEL, "Bad mount mode [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'R': // Add replicas
+			if ( hdd_client_set_replicas(optarg) ) {
+				return(-1);
+			}
+			break;
+
+		case 'H': // Set the hedging percentile
+			if ( (sscanf(optarg, "%lf", &hedge) != 1) || (hedge < 0) || (hedge >= 100) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad hedging percentile [%s]", optarg );
+				return(-1);
+			}
+			hdd_client_set_hedge(hedge);
+			break;
+
+		case 'S': // Set the stripe servers
+			if ( hdd_stripe_set_servers(optarg) ) {
+				return(-1);
+			}
+			break;
+
+		case 'E': // Set the stripe layout
+			if ( hdd_stripe_configure(optarg) ) {
+				return(-1);
+			}
+			break;
+
+		case 'J': // Set the journal size
+			if ( sscanf(optarg, "%u", &journal) != 1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad journal size [%s]", optarg );
+				return(-1);
+			}
+			hdd_set_journal(journal);
+			break;
+
+		case 'k': // Set the packed file size
+			if ( sscanf(optarg, "%u", &pack) != 1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad packed file size [%s]", optarg );
+				return(-1);
+			}
+			hdd_set_pack(pack);
+			break;
+
+		case 'i': // Set the inline file size
+			if ( sscanf(optarg, "%u", &inlined) != 1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad inline file size [%s]", optarg );
+				return(-1);
+			}
+			hdd_set_inline(inlined);
+			break;
+
+		case 'T': // Record a wire trace
+			if ( hdd_client_trace(optarg) ) {
+				return(-1);
+			}
+			break;
+
 		default:  // Default (unknown)
 			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
 			return( -1 );
@@ -146,7 +288,7 @@ int main( int argc, char *argv[] ) {
 
 		// Enable verbose, run the tests and check the results
 		enableLogLevels( LOG_INFO_LEVEL );
-		if ( b64UnitTest() || hddIOUnitTest() ) {
+		if ( b64UnitTest() || hashTableUnitTest() || hddCacheUnitTest() || hddStripeUnitTest() || hddIOUnitTest() ) {
 			logMessage( LOG_ERROR_LEVEL, "HDD unit tests failed.\n\n" );
 		} else {
 			logMessage( LOG_INFO_LEVEL, "HDD unit tests completed successfully.\n\n" );
@@ -196,237 +338,640 @@ int main( int argc, char *argv[] ) {
 int simulate_HDD( char *wload ) {
 
 	// Local variables
-	char line[2048], fname[128], command[128], text[2048], *sep, *rbuf;
-	FILE *fhandle = NULL;
-	int32_t err=0, len, off, fields, linecount;
+	char fname[HDD_SIM_MAX_FIELD], command[HDD_SIM_MAX_FIELD], *text = NULL, *rbuf = NULL, *ebuf = NULL, *map, *pos, *end;
+	char kind, *data, *wbuf, *expect;
+	struct timespec start;
+	struct stat st;
+	int fd;
+	size_t textSize = 0, rbufSize = 0, ebufSize = 0, dataLen;
+	int32_t err=0, len, off, linecount;
+	uint32_t at;
 	HddSimulationTable ftable[HDD_SIM_MAX_OPEN_FILES];
 	int idx, i;
+	int pendingSeek = -1;               // file table index of a SEEK not yet applied
+	int32_t pendingOff = 0, pendingLen = 0; // its offset and expected result
+	int ret = -1;
 
 	// Setup the file table
 	memset(ftable, 0x0, sizeof(HddSimulationTable)*HDD_SIM_MAX_OPEN_FILES);
 
-	// Open the workload file
+	// Map the workload file, it is parsed in place
 	linecount = 0;
-	if ( (fhandle=fopen(wload, "r")) == NULL ) {
+	if ( ((fd=open(wload, O_RDONLY)) == -1) || fstat(fd, &st) ) {
 		logMessage( LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.\n",
 			wload, strerror(errno) );
+		if (fd != -1) {
+			close( fd );
+		}
+		return( -1 );
+	}
+	map = NULL;
+	if ( (st.st_size > 0) && ((map=mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure mapping the workload file [%s], error: %s.\n",
+			wload, strerror(errno) );
+		close( fd );
 		return( -1 );
 	}
+	if (map != NULL) {
+		madvise( map, st.st_size, MADV_SEQUENTIAL );
+	}
+	pos = map;
+	end = map + st.st_size;
+	simSetCopy();
 
 	// While file not done
-	while (!feof(fhandle)) {
-
-		// Get the line and bail out on fail
-		if (fgets(line, 2048, fhandle) != NULL) {
-
-			// Parse out the string
-			linecount ++;
-			fields = sscanf(line, "%s %s %d %d", fname, command, &len, &off);
-			sep = strchr(line, ':');
-			if ( (fields != 4) || (sep == NULL) ) {
-				logMessage( LOG_ERROR_LEVEL, "HDD un-parsable workload string, aborting [%s], line %d",
-						line, linecount );
-				fclose( fhandle );
-				return( -1 );
+	while (pos < end) {
+
+		// Parse out the line, bail out on fail
+		linecount ++;
+		if (simParseLine(&pos, end, fname, command, &len, &off, &kind, &data, &dataLen)) {
+			logMessage( LOG_ERROR_LEVEL, "HDD un-parsable workload string, aborting, line %d", linecount );
+			goto cleanup;
+		}
+
+		// Just log the contents
+		logMessage(LOG_INFO_LEVEL, "File [%s], command [%s], len=%d, offset=%d",
+				fname, command, len, off);
+
+		// Now process the commands
+		if (strncmp(command, "FORMAT", 6) == 0) {
+
+			// Log the command executed
+			logMessage(LOG_INFO_LEVEL, "HDD_SIM : Formatting HDD filesystem");
+			if (flush_pending_seek(ftable, &pendingSeek, pendingOff, pendingLen)) {
+				goto cleanup;
 			}
 
-			// Just log the contents
-			logMessage(LOG_INFO_LEVEL, "File [%s], command [%s], len=%d, offset=%d",
-					fname, command, len, off);
+			// Now perform the format
+			if (hdd_format() != len) {
+				// Failed, error out
+				logMessage(LOG_ERROR_LEVEL, "Formatting failed, aborting simulation.");
+				goto cleanup;
+			}
 
-			// Now process the commands
-			if (strncmp(command, "FORMAT", 6) == 0) {
+		} else if (strncmp(command, "MOUNT", 5) == 0) {
 
-				// Log the command executed
-				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Formatting HDD filesystem");
+			// Log the command executed
+			logMessage(LOG_INFO_LEVEL, "HDD_SIM : Mounting HDD filesystem");
+			if (flush_pending_seek(ftable, &pendingSeek, pendingOff, pendingLen)) {
+				goto cleanup;
+			}
 
-				// Now perform the format
-				if (hdd_format() != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Formatting failed, aborting simulation.");
-					return(-1);
+			// Now perform the filesystem mount
+			if (hdd_mount() != len) {
+				// Failed, error out
+				logMessage(LOG_ERROR_LEVEL, "Mount failed, aborting simulation.");
+				goto cleanup;
+			}
+
+		} else if (strncmp(command, "UNMOUNT", 5) == 0) {
+
+			// Log the command executed
+			logMessage(LOG_INFO_LEVEL, "HDD_SIM : Un-mounting HDD filesystem");
+			if (flush_pending_seek(ftable, &pendingSeek, pendingOff, pendingLen)) {
+				goto cleanup;
+			}
+
+			// Finished, close all of the files
+			for (idx=0; idx<HDD_SIM_MAX_OPEN_FILES; idx++) {
+
+				// If file in use, close if
+				if (ftable[idx].filename != NULL) {
+					// Log the file close
+					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Closing file [%s]", ftable[idx].filename);
+					if (hdd_close(ftable[idx].fhandle) == -1) {
+						// Failed, error out
+						logMessage(LOG_ERROR_LEVEL, "Close file [%s] failed, aborting simulation.", ftable[idx].filename);
+						goto cleanup;
+					}
+					free(ftable[idx].filename);
+					ftable[idx].filename = NULL;
 				}
 
-			} else if (strncmp(command, "MOUNT", 5) == 0) {
+			}
 
-				// Log the command executed
-				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Mounting HDD filesystem");
+			// Now perform the filesystem unmount
+			if (hdd_unmount() != len) {
+				// Failed, error out
+				logMessage(LOG_ERROR_LEVEL, "Mount failed, aborting simulation.");
+				goto cleanup;
+			}
+
+
+		} else {
+
+			//
+			// File operations
+
+			// Now walk the the table looking for the file
+			idx = -1;
+			i = 0;
+			while ( (i < HDD_SIM_MAX_OPEN_FILES) && (idx == -1) ) {
+				if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,fname) == 0) ) {
+					idx = i;
+				}
+				i++;
+			}
 
-				// Now perform the filesystem mount
-				if (hdd_mount() != len) {
+			// File is not found, open the file
+			if (idx == -1) {
+
+				// Log message, find unused index and save filename for later use
+				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Opening file [%s]", fname);
+				idx = 0;
+				while ((ftable[idx].filename != NULL) && (idx < HDD_SIM_MAX_OPEN_FILES)) {
+					idx++;
+				}
+				CMPSC_ASSERT1(idx<HDD_SIM_MAX_OPEN_FILES, "Too many open files on HDD sim [%d]", idx);
+				ftable[idx].filename = strdup(fname);
+				ftable[idx].position = ftable[idx].end = 0;
+
+				// Now perform the open
+				ftable[idx].fhandle = hdd_open(ftable[idx].filename);
+				if (ftable[idx].fhandle == -1) {
 					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Mount failed, aborting simulation.");
-					return(-1);
+					logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", fname);
+					goto cleanup;
 				}
 
-			} else if (strncmp(command, "UNMOUNT", 5) == 0) {
+			}
+
+			// A SEEK is held back so that a READ of the same file right after it
+			// can be replayed as a single positional read, apply it otherwise
+			if ( (pendingSeek != -1) && ((pendingSeek != idx) || (strncmp(command, "READ", 4) != 0)) ) {
+				if (flush_pending_seek(ftable, &pendingSeek, pendingOff, pendingLen)) {
+					goto cleanup;
+				}
+			}
+
+			// Now execute the specific command
+			if (strncmp(command, "WRITEAT", 7) == 0) {
 
 				// Log the command executed
-				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Un-mounting HDD filesystem");
-
-				// Finished, close all of the files
-				for (idx=0; idx<HDD_SIM_MAX_OPEN_FILES; idx++) {
-
-					// If file in use, close if
-					if (ftable[idx].filename != NULL) {
-						// Log the file close
-						logMessage(LOG_INFO_LEVEL, "HDD_SIM : Closing file [%s]", ftable[idx].filename);
-						if (hdd_close(ftable[idx].fhandle) == -1) {
-							// Failed, error out
-							logMessage(LOG_ERROR_LEVEL, "Close file [%s] failed, aborting simulation.", ftable[idx].filename);
-							return(-1);
-						}
-						free(ftable[idx].filename);
-						ftable[idx].filename = NULL;
-					}
+				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Writing %d bytes at position %d from file [%s]", len, off, fname);
 
+				// Get the data, then perform the seek
+				if ( (wbuf = simGetData(kind, data, dataLen, len, off, &text, &textSize)) == NULL ) {
+					logMessage(LOG_ERROR_LEVEL, "Bad workload data on line %d, aborting simulation.", linecount);
+					goto cleanup;
+				}
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				if (hdd_seek(ftable[idx].fhandle, off)) {
+					// Failed, error out
+					logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", fname, off);
+					goto cleanup;
 				}
 
-				// Now perform the filesystem unmount
-				if (hdd_unmount() != len) {
+				// Now perform the write
+				if (hdd_write(ftable[idx].fhandle, wbuf, len) != len) {
 					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Mount failed, aborting simulation.");
-					return(-1);
+					logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", fname, len);
+					goto cleanup;
 				}
+				simCount(1, &ftable[idx], off, len, &start);
 
+			} else if (strncmp(command, "WRITE", 5) == 0) {
 
-			} else {
+				// Now get the data, terminating the lines
+				if ( (wbuf = simGetData(kind, data, dataLen, len, ftable[idx].position, &text, &textSize)) == NULL ) {
+					logMessage(LOG_ERROR_LEVEL, "Bad workload data on line %d, aborting simulation.", linecount);
+					goto cleanup;
+				}
 
-				//
-				// File operations
+				// Log the command executed
+				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Writing %d bytes to file [%s]", len, fname);
 
-				// Now walk the the table looking for the file
-				idx = -1;
-				i = 0;
-				while ( (i < HDD_SIM_MAX_OPEN_FILES) && (idx == -1) ) {
-					if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,fname) == 0) ) {
-						idx = i;
-					}
-					i++;
+				// Now perform the write
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				if (hdd_write(ftable[idx].fhandle, wbuf, len) != len) {
+					// Failed, error out
+					logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", fname, len);
+					goto cleanup;
 				}
+				simCount(1, &ftable[idx], ftable[idx].position, len, &start);
 
-				// File is not found, open the file
-				if (idx == -1) {
+			} else if (strncmp(command, "SEEK", 4) == 0) {
 
-					// Log message, find unused index and save filename for later use
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Opening file [%s]", fname);
-					idx = 0;
-					while ((ftable[idx].filename != NULL) && (idx < HDD_SIM_MAX_OPEN_FILES)) {
-						idx++;
-					}
-					CMPSC_ASSERT1(idx<HDD_SIM_MAX_OPEN_FILES, "Too many open files on HDD sim [%d]", idx);
-					ftable[idx].filename = strdup(fname);
+				// Log the command executed
+				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Seeking to position %d in file [%s]", off, fname);
 
-					// Now perform the open
-					ftable[idx].fhandle = hdd_open(ftable[idx].filename);
-					if (ftable[idx].fhandle == -1) {
+				// Hold the seek until we know whether a READ follows
+				pendingSeek = idx;
+				pendingOff = off;
+				pendingLen = len;
+				ftable[idx].position = off;
+
+			} else if (strncmp(command, "READ", 4) == 0) {
+
+				// Log the command executed
+				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Reading %d bytes from file [%s]", len, fname);
+
+				// Now perform the read, fused with the preceding seek if there is one
+				if ( (len < 0) || (simGrow(&rbuf, &rbufSize, len) == NULL) ) {
+					logMessage(LOG_ERROR_LEVEL, "Bad read length %d on line %d, aborting simulation.", len, linecount);
+					goto cleanup;
+				}
+				at = ftable[idx].position;
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				if (pendingSeek == idx) {
+					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Fused seek to position %d with read", pendingOff);
+					pendingSeek = -1;
+					if ( (hdd_pread(ftable[idx].fhandle, rbuf, len, pendingOff) != len) ||
+						 hdd_seek(ftable[idx].fhandle, pendingOff+len) ) {
 						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", fname);
-						return(-1);
+						logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d at position %d failed, aborting simulation.", fname, len, pendingOff);
+						goto cleanup;
 					}
+				} else if (hdd_read(ftable[idx].fhandle, rbuf, len) != len) {
+					// Failed, error out
+					logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", fname, off);
+					goto cleanup;
+				}
+				simCount(0, &ftable[idx], at, len, &start);
 
+				// Check the bytes read against a payload or pattern
+				if (kind != ':') {
+					if ( (expect = simGetData(kind, data, dataLen, len, at, &ebuf, &ebufSize)) == NULL ) {
+						logMessage(LOG_ERROR_LEVEL, "Bad workload data on line %d, aborting simulation.", linecount);
+						goto cleanup;
+					}
+					if (memcmp(rbuf, expect, len) != 0) {
+						logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d at position %u returned the wrong data, aborting simulation.",
+								fname, len, at);
+						goto cleanup;
+					}
 				}
 
-				// Now execute the specific command
-				if (strncmp(command, "WRITEAT", 7) == 0) {
+			} else {
 
-					// Log the command executed
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Writing %d bytes at position %d from file [%s]", len, off, fname);
+				// Bomb out, don't understand the command
+				CMPSC_ASSERT1(0, "HDD_SIM : Failed, unknown command [%s]", command);
 
-					// First perform the seek
-					if (hdd_seek(ftable[idx].fhandle, off)) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", fname, off);
-						return(-1);
-					}
+			}
+		}
 
-					// Now see if we need more data to fill, terminate the lines
-					CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-					CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-					strncpy(text, sep+1, len);
-					text[len] = 0x0;
-					for (i=0; i<strlen(text); i++) {
-						if (text[i] == '*') {
-							text[i] = '\n';
-						}
-					}
+		// Check for the virtual level failing
+		if ( err ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD system failed, aborting [%d]", err );
+			goto cleanup;
+		}
+	}
 
-					// Now perform the write
-					if (hdd_write(ftable[idx].fhandle, text, len) != len) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", fname, len);
-						return(-1);
-					}
+	// The workload ran through
+	if (throughput) {
+		simReport();
+	}
+	ret = 0;
 
-				} else if (strncmp(command, "WRITE", 5) == 0) {
-
-					// Now see if we need more data to fill, terminate the lines
-					CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-					CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-					strncpy(text, sep+1, len);
-					text[len] = 0x0;
-					for (i=0; i<strlen(text); i++) {
-						if (text[i] == '*') {
-							text[i] = '\n';
-						}
-					}
+	// Release the buffers, the payload files and the workload, on failure too
+cleanup:
+	for (idx=0; idx<HDD_SIM_MAX_OPEN_FILES; idx++) {
+		free( ftable[idx].filename );
+	}
+	free( text );
+	free( rbuf );
+	free( ebuf );
+	for (i=0; i<payloadCount; i++) {
+		if (payloads[i].map != NULL) {
+			munmap( payloads[i].map, payloads[i].size );
+		}
+		free( payloads[i].path );
+	}
+	payloadCount = 0;
+	simUnmap( map, st.st_size, fd );
+	return( ret );
+}
 
-					// Log the command executed
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Writing %d bytes to file [%s]", len, fname);
+//
+// Workload parsing, the workload is mapped and scanned in place: lines and
+// the data separator are found with memchr (vectorized in libc), numbers
+// are converted directly and write data is copied with its '*' turned into
+// newlines 16 or 32 bytes at a time
 
-					// Now perform the write
-					if (hdd_write(ftable[idx].fhandle, text, len) != len) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", fname, len);
-						return(-1);
-					}
+// Copy n bytes of write data, turning '*' into '\n'
+void simCopyScalar( char *dst, const char *src, size_t n ) {
+	size_t i;
 
-				} else if (strncmp(command, "SEEK", 4) == 0) {
+	for (i=0; i<n; i++) {
+		dst[i] = (src[i] == '*') ? '\n' : src[i];
+	}
+}
 
-					// Log the command executed
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Seeking to position %d in file [%s]", off, fname);
+#ifdef HDD_SIM_X86
+// The same 16 bytes at a time, the '*' bytes are selected with a compare
+__attribute__((target("sse2")))
+void simCopySse2( char *dst, const char *src, size_t n ) {
+	__m128i star = _mm_set1_epi8('*'), nl = _mm_set1_epi8('\n'), s, m;
+	size_t i;
+
+	for (i=0; i+16<=n; i+=16) {
+		s = _mm_loadu_si128((__m128i *)(src + i));
+		m = _mm_cmpeq_epi8(s, star);
+		s = _mm_or_si128(_mm_andnot_si128(m, s), _mm_and_si128(m, nl));
+		_mm_storeu_si128((__m128i *)(dst + i), s);
+	}
+	simCopyScalar(dst + i, src + i, n - i);
+}
 
-					// Now perform the seek
-					if (hdd_seek(ftable[idx].fhandle, off) != len) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", fname, off);
-						return(-1);
-					}
+// And 32 bytes at a time
+__attribute__((target("avx2")))
+void simCopyAvx2( char *dst, const char *src, size_t n ) {
+	__m256i star = _mm256_set1_epi8('*'), nl = _mm256_set1_epi8('\n'), s;
+	size_t i;
 
-				} else if (strncmp(command, "READ", 4) == 0) {
+	for (i=0; i+32<=n; i+=32) {
+		s = _mm256_loadu_si256((__m256i *)(src + i));
+		s = _mm256_blendv_epi8(s, nl, _mm256_cmpeq_epi8(s, star));
+		_mm256_storeu_si256((__m256i *)(dst + i), s);
+	}
+	simCopyScalar(dst + i, src + i, n - i);
+}
+#endif
+
+void (*simCopy)( char *dst, const char *src, size_t n ) = simCopyScalar;
+
+// Pick the widest copy the CPU has
+void simSetCopy( void ) {
+#ifdef HDD_SIM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		simCopy = simCopyAvx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		simCopy = simCopySse2;
+	}
+#endif
+}
 
-					// Log the command executed
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Reading %d bytes from file [%s]", len, fname);
+// Blanks between the fields of a line
+#define simBlank(c) (((c) == ' ') || ((c) == '\t') || ((c) == '\r'))
 
-					// Now perform the read
-					rbuf = malloc(len);
-					if (hdd_read(ftable[idx].fhandle, rbuf, len) != len) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", fname, off);
-						return(-1);
-					}
-					free(rbuf);
-					rbuf = NULL;
+// Copy the next field of the line into buf (of HDD_SIM_MAX_FIELD bytes)
+int simParseField( char **p, char *eol, char *buf ) {
+	char *s = *p, *f;
 
-				} else {
+	while ( (s < eol) && simBlank(*s) ) {
+		s++;
+	}
+	for (f=s; (f < eol) && !simBlank(*f); f++);
+	if ( (f == s) || (f - s >= HDD_SIM_MAX_FIELD) ) {
+		return( -1 );
+	}
+	memcpy( buf, s, f - s );
+	buf[f - s] = 0x0;
+	*p = f;
+	return( 0 );
+}
 
-					// Bomb out, don't understand the command
-					CMPSC_ASSERT1(0, "HDD_SIM : Failed, unknown command [%s]", command);
+// Convert the next field of the line, a decimal number
+int simParseInt( char **p, char *eol, int32_t *v ) {
+	char *s = *p;
+	int64_t n = 0;
+	int neg = 0;
 
-				}
-			}
+	while ( (s < eol) && simBlank(*s) ) {
+		s++;
+	}
+	if ( (s < eol) && ((*s == '-') || (*s == '+')) ) {
+		neg = (*s++ == '-');
+	}
+	if ( (s == eol) || (*s < '0') || (*s > '9') ) {
+		return( -1 );
+	}
+	for ( ; (s < eol) && (*s >= '0') && (*s <= '9'); s++) {
+		n = n * 10 + (*s - '0');
+		if (n > INT32_MAX) {
+			return( -1 );
+		}
+	}
+	*v = (int32_t)(neg ? -n : n);
+	*p = s;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simParseLine
+// Description  : Parse the next line of the mapped workload, "<file>
+//                <command> <len> <off> :<data>", of any length
+//
+// Inputs       : pos - the start of the line, moved past it
+//                end - the end of the workload
+//                fname, command - filled with the first two fields
+//                len, off - the numbers
+//                kind - the character the data follows, ':' for text, '<'
+//                       for a payload file or '=' for a fill pattern
+//                data, dataLen - the data after it (to the newline)
+// Outputs      : 0 if successful, -1 if the line is un-parsable
+
+int simParseLine( char **pos, char *end, char *fname, char *command, int32_t *len, int32_t *off, char *kind, char **data, size_t *dataLen ) {
+	char *p = *pos, *eol;
+
+	// Find the end of the line, the last may lack a newline
+	if ( (eol = memchr(p, '\n', end - p)) == NULL ) {
+		eol = end;
+	}
+	*pos = (eol < end) ? eol + 1 : end;
+
+	// Then the fields and the data
+	if ( simParseField(&p, eol, fname) || simParseField(&p, eol, command) ||
+		 simParseInt(&p, eol, len) || simParseInt(&p, eol, off) ) {
+		return( -1 );
+	}
+	while ( (p < eol) && simBlank(*p) ) {
+		p++;
+	}
+	if ( (p == eol) || ((*p != ':') && (*p != '<') && (*p != '=')) ) {
+		return( -1 );
+	}
+	*kind = *p;
+	*data = p + 1;
+	*dataLen = eol - *data;
+	return( 0 );
+}
 
-			// Check for the virtual level failing
-			if ( err ) {
-				logMessage( LOG_ERROR_LEVEL, "HDD system failed, aborting [%d]", err );
-				fclose( fhandle );
-				return( -1 );
+// Grow a transfer buffer to at least need bytes, NULL if out of memory
+char *simGrow( char **buf, size_t *size, size_t need ) {
+	size_t grown;
+	char *more;
+
+	if (need > *size) {
+		for (grown=(*size ? *size : HDD_SIM_MIN_TEXT); grown<need; grown*=2);
+		if ( (more = realloc(*buf, grown)) == NULL ) {
+			return( NULL );
+		}
+		*buf = more;
+		*size = grown;
+	}
+	return( *buf );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simPayload
+// Description  : Get a range of a payload file, "<path>[+<offset>]", the
+//                file is mapped the first time and kept for the workload
+//
+// Inputs       : spec, specLen - the reference in the line
+//                len - the bytes wanted
+// Outputs      : the bytes, NULL if the file cannot be read or is too short
+
+char *simPayload( char *spec, size_t specLen, int32_t len ) {
+	char path[PATH_MAX], *plus;
+	HddSimulationPayload *pl;
+	uint64_t offset = 0;
+	struct stat st;
+	int i, fd;
+
+	while ( (specLen > 0) && simBlank(spec[specLen-1]) ) {
+		specLen--;
+	}
+	if ( (specLen == 0) || (specLen >= PATH_MAX) ) {
+		return( NULL );
+	}
+	memcpy( path, spec, specLen );
+	path[specLen] = 0x0;
+	if ( ((plus = strrchr(path, '+')) != NULL) && (plus[1] != 0x0) && (strspn(plus+1, "0123456789") == strlen(plus+1)) ) {
+		offset = strtoull(plus+1, NULL, 10);
+		*plus = 0x0;
+	}
+
+	// Find the file, or map it
+	for (i=0; (i < payloadCount) && strcmp(payloads[i].path, path); i++);
+	if (i == payloadCount) {
+		if (payloadCount == HDD_SIM_MAX_PAYLOADS) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_SIM : more than %d payload files", HDD_SIM_MAX_PAYLOADS);
+			return( NULL );
+		}
+		if ( ((fd = open(path, O_RDONLY)) == -1) || fstat(fd, &st) ) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_SIM : cannot open payload [%s], error: %s", path, strerror(errno));
+			return( NULL );
+		}
+		pl = &payloads[payloadCount];
+		pl->size = st.st_size;
+		pl->map = NULL;
+		if ( (pl->size > 0) && ((pl->map = mmap(NULL, pl->size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) ) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_SIM : cannot map payload [%s], error: %s", path, strerror(errno));
+			close(fd);
+			return( NULL );
+		}
+		close(fd);
+		pl->path = strdup(path);
+		payloadCount++;
+	}
+	pl = &payloads[i];
+	if (offset + len > pl->size) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_SIM : payload [%s] has no %d bytes at %lu", path, len, (unsigned long)offset);
+		return( NULL );
+	}
+	return( pl->map + offset );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simGetData
+// Description  : Get the bytes of a transfer: the line's text with its
+//                newlines (':'), a range of a payload file ('<') or a fill
+//                pattern ('=' zero or pos)
+//
+// Inputs       : kind, data, dataLen - the line's data
+//                len - the bytes of the transfer
+//                pos - the position in the file it starts at
+//                buf, size - a buffer the bytes may be put in, grown as
+//                            needed and kept for the next transfer
+// Outputs      : the bytes, NULL if the line's data is bad
+
+char *simGetData( char kind, char *data, size_t dataLen, int32_t len, uint32_t pos, char **buf, size_t *size ) {
+
+	if (len < 0) {
+		return( NULL );
+	}
+	if (kind == '<') {
+		return( simPayload(data, dataLen, len) );
+	}
+	if (simGrow(buf, size, (size_t)len + 1) == NULL) {
+		return( NULL );
+	}
+	if (kind == ':') {
+		if ((size_t)len > dataLen) {
+			return( NULL );
+		}
+		simCopy(*buf, data, len);
+	} else if ( (dataLen >= 4) && (strncmp(data, "zero", 4) == 0) ) {
+		memset(*buf, 0x0, len);
+	} else if ( (dataLen >= 3) && (strncmp(data, "pos", 3) == 0) ) {
+		hdd_fill_pos((uint8_t *)*buf, pos, len);
+	} else {
+		return( NULL );
+	}
+	(*buf)[len] = 0x0;
+	return( *buf );
+}
+
+// Count a transfer of len bytes at pos started at start, it is sequential
+// if it starts where the last one on the file ended
+void simCount( int write, HddSimulationTable *file, uint32_t pos, int32_t len, struct timespec *start ) {
+	HddSimulationTransfers *t = &transfers[write][pos != file->end];
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t->ops++;
+	t->bytes += len;
+	t->ns += (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+	file->position = file->end = pos + len;
+}
+
+// Log the throughput of each kind of transfer
+void simReport( void ) {
+	char *ops[2] = { "reads", "writes" }, *kinds[2] = { "sequential", "random" };
+	HddSimulationTransfers *t;
+	int w, k;
+
+	for (w=0; w<2; w++) {
+		for (k=0; k<2; k++) {
+			t = &transfers[w][k];
+			if (t->ops > 0) {
+				logMessage(LOG_OUTPUT_LEVEL, "HDD_SIM : %lu %s %s of %.1f KB average, %.1f MB in %.3f s, %.1f MB/s",
+						(unsigned long)t->ops, kinds[k], ops[w], t->bytes / 1000.0 / t->ops, t->bytes / 1000000.0,
+						t->ns / 1e9, (t->ns > 0) ? t->bytes * 1000.0 / t->ns : 0.0);
 			}
 		}
 	}
+}
+
+// Release the mapped workload
+void simUnmap( char *map, size_t size, int fd ) {
+	if (map != NULL) {
+		munmap( map, size );
+	}
+	close( fd );
+}
 
-	// Close the workload file, successfully
-	fclose( fhandle );
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_pending_seek
+// Description  : Apply a SEEK that was held back for fusing with a READ
+//
+// Inputs       : ftable - the simulation file table
+//                pending - the table index of the held SEEK (-1 if none),
+//                          reset to -1
+//                off - the position to seek to
+//                expected - the expected result of the seek
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_pending_seek( HddSimulationTable *ftable, int *pending, int32_t off, int32_t expected ) {
+	int idx = *pending;
+
+	if (idx == -1) {
+		return( 0 );
+	}
+	*pending = -1;
+
+	// Now perform the seek
+	if (hdd_seek(ftable[idx].fhandle, off) != expected) {
+		// Failed, error out
+		logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", ftable[idx].filename, off);
+		return( -1 );
+	}
 	return( 0 );
 }
 
@@ -443,15 +988,16 @@ int extract_file_from_hdd(char *ex_file) {
 	// Local variables
 	int16_t fd;
 	int32_t len;
-	char buf[HDD_MAX_BLOCK_SIZE];
+	char *buf = NULL;
     int fhandle, flags;
     mode_t mode;
-	// Open the file, read from it, close it
-	if ( (hdd_mount()) || ((fd = hdd_open(ex_file)) == -1) ||
-		 ((len = hdd_read(fd, buf, HDD_MAX_BLOCK_SIZE)) == -1) ||
-		 (hdd_close(fd) == -1)	) {
+
+	// Open the file on the hdd (the chunk read at a time depends on the protocol)
+	if ( (hdd_mount()) || ((buf = malloc(hdd_client_max_block_size())) == NULL) ||
+		 ((fd = hdd_open(ex_file)) == -1) ) {
 		// Error out
 		logMessage(LOG_INFO_LEVEL, "HDD : extraction failed on hdd interface [%s].", ex_file);
+		free(buf);
 		return(-1);
 	}
 
@@ -461,15 +1007,26 @@ int extract_file_from_hdd(char *ex_file) {
     fhandle = open(ex_file, flags, mode);
     if ( fhandle == -1 ) {
         fprintf( stderr, "HDD: extraction open() failed, error=%s\n", strerror(errno) );
+        hdd_close(fd);
+        hdd_unmount();
+        free(buf);
         return( -1 );
     }
 
-    // Now write the read bytes to the file, then close
-    if (write(fhandle, buf, len) != len) {
-        fprintf( stderr, "HDD: extraction write() failed, error=%s\n", strerror(errno) );
-        return( -1 );
+    // Copy the file a chunk at a time (a striped file spans many blocks), then close
+    while ( (len = hdd_read(fd, buf, hdd_client_max_block_size())) > 0 ) {
+        if (write(fhandle, buf, len) != len) {
+            fprintf( stderr, "HDD: extraction write() failed, error=%s\n", strerror(errno) );
+            break;
+        }
     }
     close( fhandle );
+    free(buf);
+    if ( (hdd_close(fd) == -1) || (hdd_unmount() != 0) || (len != 0) ) {
+		logMessage(LOG_INFO_LEVEL, "HDD : extraction failed on hdd interface [%s].", ex_file);
+        unlink(ex_file);
+        return( -1 );
+    }
 
     // Return successfully
 	return( 0 );
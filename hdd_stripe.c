@@ -0,0 +1,1551 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_stripe.c
+//  Description    : This is the implementation of striped files. Every stripe
+//                   server has a connection and a thread of its own: a
+//                   transfer is a batch of unit requests, each thread
+//                   pipelines its server's share on its connection and the
+//                   caller waits for all of them. One transfer runs at a
+//                   time. Unit j of stripe s is on server (s + j) % n, so the
+//                   parity units rotate across the servers.
+//
+
+// Includes
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HDD_STRIPE_X86
+#include <immintrin.h>
+#endif
+
+// Project Includes
+#include <hdd_stripe.h>
+#include <hdd_network.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define HDD_STRIPE_MAGIC 0x48445354        // first word of a stripe map ("HDST")
+#define HDD_STRIPE_GROUP_BYTES (64 << 20)  // unit bytes of the stripes moved in one batch
+#define HDD_STRIPE_MAP_MIN 16              // stripes a new map has room for
+#define HDD_STRIPE_GF_POLY 0x11d           // x^8 + x^4 + x^3 + x^2 + 1
+#define HDD_STRIPE_CODE_CHUNK 4096         // bytes of every unit coded at a time, so they stay in L1
+
+// A stripe map block is this header followed by "capacity" records of
+// servers + 1 words: a mask of the stripe's stale units (they missed a write
+// while their server was down), then the block of each unit (0 if the unit
+// was never written, it reads as zeros)
+typedef struct {
+	uint32_t magic;    // HDD_STRIPE_MAGIC
+	uint32_t servers;  // units in a stripe
+	uint32_t parity;   // parity units in a stripe
+	uint32_t unit;     // bytes in a unit
+	uint32_t stripes;  // stripes in use
+	uint32_t capacity; // stripes the block has room for
+} HddStripeHeader;
+
+// A stripe map in memory
+typedef struct {
+	HddBlockID  block;     // the map block on the directory server, 0 until written
+	uint32_t    stripes;   // stripes in use
+	uint32_t    capacity;  // records allocated
+	uint32_t    room;      // records the map block has room for
+	uint32_t   *records;   // the records, as in the block
+	int         dirty;     // 1 if the records changed since the block was written
+} HddStripeMap;
+
+// A unit request of the current batch
+typedef struct {
+	HddRequest  req;     // the request, the response fields once answered
+	void       *buf;     // payload to write or buffer to read into
+	int         server;  // server it goes to
+	uint32_t    stripe;  // stripe and unit it is for
+	int         unit;
+	int         ok;      // 1 if the server succeeded
+} HddStripeIo;
+
+// A stripe server
+typedef struct {
+	char           *address;  // its IP, NULL for the directory server's
+	unsigned short  port;     // its port
+	int             fd;       // the connection, -1 if closed
+	int             down;     // 1 if it failed or could not be reached
+	uint32_t        tag;      // tag of the next request
+	pthread_t       thread;   // runs its share of each batch
+	uint32_t       *io;       // indexes of its requests in the batch
+	uint32_t        count;    // requests in io
+	uint32_t        capacity; // entries allocated for io
+	uint64_t        requests; // requests answered
+	uint64_t        bytes;    // payload bytes moved
+} HddStripeServer;
+
+#define MAP_WORDS (stripeServers + 1) // words in a map record
+#define MAP_STALE(mp, s) ((mp)->records[(uint64_t)(s) * MAP_WORDS])
+#define MAP_UNIT(mp, s, j) ((mp)->records[(uint64_t)(s) * MAP_WORDS + 1 + (j)])
+#define UNIT_SERVER(s, j) (((s) + (j)) % stripeServers)
+
+//
+// Global Data
+HddStripeServer stripeServer[HDD_STRIPE_MAX_SERVERS];
+int stripeServers = 0;                    // n, servers configured
+int stripeParity = 0;                     // m, parity units per stripe
+uint32_t stripeUnit = HDD_STRIPE_UNIT_KB * 1024; // bytes in a unit
+uint64_t stripeMin = HDD_STRIPE_MIN_KB * 1024;   // files this large are striped
+int stripeConnected = 0;                  // 1 from init to close
+pthread_mutex_t stripeLock = PTHREAD_MUTEX_INITIALIZER; // one transfer at a time
+HddStripeMap **stripeMaps = NULL;         // the maps read or written since mounting
+uint32_t stripeMapCount = 0, stripeMapSize = 0;
+HddStripeIo *batch = NULL;                // the requests of the current batch
+uint32_t batchCount = 0, batchSize = 0;
+uint8_t *stripeScratch = NULL;            // units being rebuilt, merged or coded
+uint64_t stripeScratchSize = 0;
+uint64_t stripeDegraded = 0;              // stripes read or merged with units missing
+uint64_t stripeRebuilt = 0;               // units rebuilt from parity
+pthread_mutex_t workLock = PTHREAD_MUTEX_INITIALIZER; // hands batches to the server threads
+pthread_cond_t workStart = PTHREAD_COND_INITIALIZER;  // broadcast when a batch is ready
+pthread_cond_t workDone = PTHREAD_COND_INITIALIZER;   // signalled when the last thread is done
+uint64_t workBatch = 0;                   // batches handed out
+int workPending = 0;                      // threads still running the batch
+int workStop = 0;                         // 1 to stop the threads
+
+// GF(2^8) arithmetic
+uint8_t gfExp[512], gfLog[256];           // powers of the generator and their logs
+uint8_t gfMulTable[256][256];             // every product
+pthread_once_t gfOnce = PTHREAD_ONCE_INIT;
+void (*gfRegion)(uint8_t *dst, uint8_t *src, uint8_t c, uint32_t len, int add) = NULL;
+char *gfKernel = "none";                  // name of the kernel in gfRegion
+
+//
+// GF(2^8) kernels
+
+// dst = c * src over len bytes, or dst ^= c * src with add
+void gfRegionScalar(uint8_t *dst, uint8_t *src, uint8_t c, uint32_t len, int add) {
+	uint8_t *row = gfMulTable[c];
+	uint32_t i;
+
+	if (add) {
+		for (i = 0; i < len; i++) {
+			dst[i] ^= row[src[i]];
+		}
+	} else {
+		for (i = 0; i < len; i++) {
+			dst[i] = row[src[i]];
+		}
+	}
+}
+
+#ifdef HDD_STRIPE_X86
+// The product of a byte is the product of its low nibble xor that of its
+// high nibble, each looked up in a 16 entry table with a byte shuffle
+__attribute__((target("ssse3")))
+void gfRegionSsse3(uint8_t *dst, uint8_t *src, uint8_t c, uint32_t len, int add) {
+	uint8_t lo[16], hi[16];
+	uint32_t i;
+
+	for (i = 0; i < 16; i++) {
+		lo[i] = gfMulTable[c][i];
+		hi[i] = gfMulTable[c][i << 4];
+	}
+	__m128i tlo = _mm_loadu_si128((__m128i *)lo), thi = _mm_loadu_si128((__m128i *)hi);
+	__m128i mask = _mm_set1_epi8(0x0f), s, p;
+	for (i = 0; i + 16 <= len; i += 16) {
+		s = _mm_loadu_si128((__m128i *)(src + i));
+		p = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(s, mask)),
+						  _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+		if (add) {
+			p = _mm_xor_si128(p, _mm_loadu_si128((__m128i *)(dst + i)));
+		}
+		_mm_storeu_si128((__m128i *)(dst + i), p);
+	}
+	gfRegionScalar(dst + i, src + i, c, len - i, add);
+}
+
+// The same 32 bytes at a time, the tables repeated in both lanes
+__attribute__((target("avx2")))
+void gfRegionAvx2(uint8_t *dst, uint8_t *src, uint8_t c, uint32_t len, int add) {
+	uint8_t lo[16], hi[16];
+	uint32_t i;
+
+	for (i = 0; i < 16; i++) {
+		lo[i] = gfMulTable[c][i];
+		hi[i] = gfMulTable[c][i << 4];
+	}
+	__m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)lo));
+	__m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)hi));
+	__m256i mask = _mm256_set1_epi8(0x0f), s, p;
+	for (i = 0; i + 32 <= len; i += 32) {
+		s = _mm256_loadu_si256((__m256i *)(src + i));
+		p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask)),
+							 _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+		if (add) {
+			p = _mm256_xor_si256(p, _mm256_loadu_si256((__m256i *)(dst + i)));
+		}
+		_mm256_storeu_si256((__m256i *)(dst + i), p);
+	}
+	gfRegionScalar(dst + i, src + i, c, len - i, add);
+}
+#endif
+
+// Build the log, power and product tables and pick a kernel (run once)
+void gfSetup(void) {
+	uint32_t i, j, x = 1;
+
+	for (i = 0; i < 255; i++) {
+		gfExp[i] = gfExp[i + 255] = (uint8_t)x;
+		gfLog[x] = (uint8_t)i;
+		x <<= 1;
+		if (x & 0x100) {
+			x ^= HDD_STRIPE_GF_POLY;
+		}
+	}
+	for (i = 1; i < 256; i++) {
+		for (j = 1; j < 256; j++) {
+			gfMulTable[i][j] = gfExp[gfLog[i] + gfLog[j]];
+		}
+	}
+	if (gfRegion == NULL) {
+		hdd_stripe_set_kernel("auto");
+	}
+}
+
+// Multiplicative inverse of a non-zero element
+uint8_t gfInv(uint8_t a) {
+	return( gfExp[255 - gfLog[a]] );
+}
+
+// Coefficient of data unit j in parity unit i. The parity rows form a Cauchy
+// matrix, so any k of the n units are independent and rebuild the stripe
+uint8_t gfCoefficient(int k, int i, int j) {
+	return( gfInv((uint8_t)((k + i) ^ j)) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gfDecode
+// Description  : Rebuild data units of a stripe from any k of its units by
+//                inverting the rows of the code matrix for the units held
+//
+// Inputs       : k - data units in the stripe
+//                have - the index of each unit held (k of them, data units
+//                       are 0 to k-1, parity units k and up)
+//                units - the units held
+//                wants - data units to rebuild
+//                want - their indexes
+//                out - where to write each
+//                len - bytes in a unit
+// Outputs      : 0 if successful, -1 if the units held are not independent
+
+int gfDecode(int k, int *have, uint8_t **units, int wants, int *want, uint8_t **out, uint32_t len) {
+	uint8_t a[HDD_STRIPE_MAX_SERVERS][HDD_STRIPE_MAX_SERVERS], inv[HDD_STRIPE_MAX_SERVERS][HDD_STRIPE_MAX_SERVERS];
+	uint8_t t, f;
+	uint32_t off, n;
+	int r, c, p, w;
+
+	pthread_once(&gfOnce, gfSetup);
+	for (r = 0; r < k; r++) {
+		for (c = 0; c < k; c++) {
+			a[r][c] = (have[r] < k) ? (have[r] == c) : gfCoefficient(k, have[r] - k, c);
+			inv[r][c] = (r == c);
+		}
+	}
+
+	// Gauss-Jordan elimination, in GF(2^8) subtraction is xor
+	for (c = 0; c < k; c++) {
+		for (p = c; (p < k) && (a[p][c] == 0); p++);
+		if (p == k) {
+			return( -1 );
+		}
+		for (r = 0; r < k; r++) {
+			t = a[c][r]; a[c][r] = a[p][r]; a[p][r] = t;
+			t = inv[c][r]; inv[c][r] = inv[p][r]; inv[p][r] = t;
+		}
+		f = gfInv(a[c][c]);
+		for (r = 0; r < k; r++) {
+			a[c][r] = gfMulTable[f][a[c][r]];
+			inv[c][r] = gfMulTable[f][inv[c][r]];
+		}
+		for (r = 0; r < k; r++) {
+			if ( (r == c) || ((f = a[r][c]) == 0) ) {
+				continue;
+			}
+			for (p = 0; p < k; p++) {
+				a[r][p] ^= gfMulTable[f][a[c][p]];
+				inv[r][p] ^= gfMulTable[f][inv[c][p]];
+			}
+		}
+	}
+
+	for (off = 0; off < len; off += HDD_STRIPE_CODE_CHUNK) {
+		n = (len - off < HDD_STRIPE_CODE_CHUNK) ? len - off : HDD_STRIPE_CODE_CHUNK;
+		for (w = 0; w < wants; w++) {
+			for (r = 0; r < k; r++) {
+				gfRegion(out[w] + off, units[r] + off, inv[want[w]][r], n, r > 0);
+			}
+		}
+	}
+	return( 0 );
+}
+
+//
+// Server connections
+
+// Close a server's connection and leave it down
+void stripeDown(HddStripeServer *srv, char *why) {
+	if (srv->fd != -1) {
+		close(srv->fd);
+		srv->fd = -1;
+	}
+	if (!srv->down) {
+		logMessage(LOG_WARNING_LEVEL, "HDD_STRIPE : server %d is down [%s]", (int)(srv - stripeServer), why);
+	}
+	srv->down = 1;
+}
+
+// Connect to a server and switch the connection to v2, returns 0 if
+// successful, the server is left down if not
+int stripeConnect(HddStripeServer *srv) {
+	char *ip = (srv->address != NULL) ? srv->address : ((hdd_network_address != NULL) ? (char *)hdd_network_address : HDD_DEFAULT_IP);
+	uint64_t value;
+
+	srv->down = 0;
+	srv->tag = 0;
+	if ( (srv->fd = connectServer(ip, srv->port)) == -1 ) {
+		stripeDown(srv, "cannot connect");
+		return( -1 );
+	}
+	value = htonll64(formatResponse(HDD_DEVICE, 0, HDD_INIT, 0, HDD_V2_HELLO));
+	if ( sendParts(srv->fd, &value, sizeof(value), NULL, 0) || recvAll(srv->fd, &value, sizeof(value)) ) {
+		stripeDown(srv, "INIT failed");
+		return( -1 );
+	}
+	value = ntohll64(value);
+	if ( (getR(value) != 0) || (getID(value) != HDD_V2_ACCEPT) ) {
+		stripeDown(srv, "no protocol v2");
+		return( -1 );
+	}
+	return( 0 );
+}
+
+// Send a server its share of the batch, then receive the responses in order
+void stripeServe(HddStripeServer *srv) {
+	uint8_t hdr[HDD_V2_HEADER_SIZE];
+	HddRequest resp;
+	HddStripeIo *io;
+	uint32_t sent, i;
+	int32_t blen;
+
+	for (i = 0; i < srv->count; i++) {
+		batch[srv->io[i]].ok = 0;
+	}
+	if (srv->fd == -1) {
+		return;
+	}
+	for (sent = 0; sent < srv->count; sent++) {
+		io = &batch[srv->io[sent]];
+		io->req.tag = srv->tag + sent;
+		blen = ( (io->req.op == HDD_BLOCK_CREATE) || (io->req.op == HDD_BLOCK_OVERWRITE) ) && (io->req.flags == HDD_NULL_FLAG) ?
+				(int32_t)io->req.length : 0;
+		hdd_v2_encode(&io->req, hdr);
+		if (sendParts(srv->fd, hdr, HDD_V2_HEADER_SIZE, io->buf, blen)) {
+			break;
+		}
+		srv->bytes += blen;
+	}
+	for (i = 0; i < sent; i++) {
+		io = &batch[srv->io[i]];
+		if ( recvAll(srv->fd, hdr, HDD_V2_HEADER_SIZE) || hdd_v2_decode(hdr, &resp) || (resp.tag != io->req.tag) ) {
+			break;
+		}
+		if ( (resp.result == 0) && (io->req.op == HDD_BLOCK_READ) ) {
+			if ( (resp.length != io->req.length) || recvAll(srv->fd, io->buf, (int32_t)resp.length) ) {
+				break;
+			}
+			srv->bytes += resp.length;
+		}
+		io->req.result = resp.result;
+		io->req.blockID = resp.blockID;
+		io->req.version = resp.version;
+		io->ok = (resp.result == 0);
+		srv->requests++;
+	}
+	srv->tag += sent;
+	if ( (sent < srv->count) || (i < sent) ) {
+		stripeDown(srv, "connection lost");
+	}
+}
+
+// Run each batch handed out on a server's connection
+void *stripeWorker(void *arg) {
+	HddStripeServer *srv = arg;
+	uint64_t seen = 0;
+
+	pthread_mutex_lock(&workLock);
+	while (1) {
+		while ( (workBatch == seen) && !workStop ) {
+			pthread_cond_wait(&workStart, &workLock);
+		}
+		if (workStop) {
+			break;
+		}
+		seen = workBatch;
+		pthread_mutex_unlock(&workLock);
+		stripeServe(srv);
+		pthread_mutex_lock(&workLock);
+		if (--workPending == 0) {
+			pthread_cond_signal(&workDone);
+		}
+	}
+	pthread_mutex_unlock(&workLock);
+	return( NULL );
+}
+
+// Add a request to the batch, returns its index or -1 on failure
+int64_t stripeAdd(uint32_t s, int j, uint8_t op, HddBlockID block, uint64_t offset, uint64_t length, void *buf) {
+	HddStripeIo *grown, *io;
+
+	if (batchCount == batchSize) {
+		if ( (grown = realloc(batch, (batchSize ? batchSize * 2 : 256) * sizeof(HddStripeIo))) == NULL ) {
+			return( -1 );
+		}
+		batch = grown;
+		batchSize = batchSize ? batchSize * 2 : 256;
+	}
+	io = &batch[batchCount];
+	memset(io, 0x0, sizeof(HddStripeIo));
+	io->req.op = op;
+	io->req.flags = HDD_NULL_FLAG;
+	io->req.blockID = block;
+	io->req.offset = offset;
+	io->req.length = length;
+	io->buf = buf;
+	io->server = UNIT_SERVER(s, j);
+	io->stripe = s;
+	io->unit = j;
+	return( batchCount++ );
+}
+
+// Run the batch on every server at once, returns the requests that failed
+int stripeRun(void) {
+	HddStripeServer *srv;
+	uint32_t i, *grown;
+	int failed = 0;
+
+	for (i = 0; i < (uint32_t)stripeServers; i++) {
+		stripeServer[i].count = 0;
+	}
+	for (i = 0; i < batchCount; i++) {
+		srv = &stripeServer[batch[i].server];
+		if (srv->count == srv->capacity) {
+			if ( (grown = realloc(srv->io, (srv->capacity ? srv->capacity * 2 : 64) * sizeof(uint32_t))) == NULL ) {
+				return( batchCount );
+			}
+			srv->io = grown;
+			srv->capacity = srv->capacity ? srv->capacity * 2 : 64;
+		}
+		srv->io[srv->count++] = i;
+	}
+
+	pthread_mutex_lock(&workLock);
+	workPending = stripeServers;
+	workBatch++;
+	pthread_cond_broadcast(&workStart);
+	while (workPending > 0) {
+		pthread_cond_wait(&workDone, &workLock);
+	}
+	pthread_mutex_unlock(&workLock);
+
+	for (i = 0; i < batchCount; i++) {
+		failed += !batch[i].ok;
+	}
+	return( failed );
+}
+
+// Send a device request (FORMAT, SAVE_AND_CLOSE) to every server that is up,
+// returns the number that failed
+int stripeDevice(int flag) {
+	int64_t i;
+	int j;
+
+	batchCount = 0;
+	for (j = 0; j < stripeServers; j++) {
+		if (!stripeServer[j].down) {
+			if ( (i = stripeAdd(j, 0, HDD_DEVICE, 0, 0, 0, NULL)) == -1 ) {
+				return( stripeServers );
+			}
+			batch[i].req.flags = flag;
+			batch[i].server = j;
+		}
+	}
+	return( stripeRun() );
+}
+
+// Start the server threads
+int stripeStart(void) {
+	int i;
+
+	workStop = 0;
+	workBatch = 0; // the threads start having seen none
+	for (i = 0; i < stripeServers; i++) {
+		if (pthread_create(&stripeServer[i].thread, NULL, stripeWorker, &stripeServer[i])) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : failed starting the thread of server %d", i);
+			pthread_mutex_lock(&workLock);
+			workStop = 1;
+			pthread_cond_broadcast(&workStart);
+			pthread_mutex_unlock(&workLock);
+			while (--i >= 0) {
+				pthread_join(stripeServer[i].thread, NULL);
+			}
+			return( -1 );
+		}
+	}
+	return( 0 );
+}
+
+// Stop the server threads and close the connections
+void stripeStop(void) {
+	int i;
+
+	pthread_mutex_lock(&workLock);
+	workStop = 1;
+	pthread_cond_broadcast(&workStart);
+	pthread_mutex_unlock(&workLock);
+	for (i = 0; i < stripeServers; i++) {
+		pthread_join(stripeServer[i].thread, NULL);
+		if (stripeServer[i].fd != -1) {
+			close(stripeServer[i].fd);
+			stripeServer[i].fd = -1;
+		}
+	}
+	stripeConnected = 0;
+}
+
+//
+// Stripe maps
+
+// Drop the maps of the last mount
+void stripeForgetMaps(void) {
+	uint32_t i;
+
+	for (i = 0; i < stripeMapCount; i++) {
+		free(stripeMaps[i]->records);
+		free(stripeMaps[i]);
+	}
+	stripeMapCount = 0;
+}
+
+// Remember a map, returns -1 on failure
+int stripeKeepMap(HddStripeMap *mp) {
+	HddStripeMap **grown;
+
+	if (stripeMapCount == stripeMapSize) {
+		if ( (grown = realloc(stripeMaps, (stripeMapSize ? stripeMapSize * 2 : 16) * sizeof(HddStripeMap *))) == NULL ) {
+			return( -1 );
+		}
+		stripeMaps = grown;
+		stripeMapSize = stripeMapSize ? stripeMapSize * 2 : 16;
+	}
+	stripeMaps[stripeMapCount++] = mp;
+	return( 0 );
+}
+
+// Make room for a number of stripes in a map, new records are zero
+int stripeGrowMap(HddStripeMap *mp, uint64_t stripes) {
+	uint64_t capacity = mp->capacity ? mp->capacity : HDD_STRIPE_MAP_MIN;
+	uint32_t *grown;
+
+	if (stripes <= mp->capacity) {
+		return( 0 );
+	}
+	while (capacity < stripes) {
+		capacity *= 2;
+	}
+	if ( (grown = realloc(mp->records, capacity * MAP_WORDS * sizeof(uint32_t))) == NULL ) {
+		return( -1 );
+	}
+	memset(grown + (uint64_t)mp->capacity * MAP_WORDS, 0x0, (capacity - mp->capacity) * MAP_WORDS * sizeof(uint32_t));
+	mp->records = grown;
+	mp->capacity = capacity;
+	return( 0 );
+}
+
+// Get the map in a block, reading it on first use, returns NULL on failure
+HddStripeMap *stripeLoadMap(HddBlockID block) {
+	HddStripeHeader hdr;
+	HddStripeMap *mp;
+	HddRequest req;
+	uint32_t i;
+
+	for (i = 0; i < stripeMapCount; i++) {
+		if (stripeMaps[i]->block == block) {
+			return( stripeMaps[i] );
+		}
+	}
+
+	memset(&req, 0x0, sizeof(req));
+	req.op = HDD_BLOCK_READ;
+	req.blockID = block;
+	req.length = sizeof(hdr);
+	if (hdd_client_request(&req, &hdr)) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : failed reading the stripe map [block %u]", block);
+		return( NULL );
+	}
+	if ( (hdr.magic != HDD_STRIPE_MAGIC) || (hdr.stripes > hdr.capacity) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : block %u is not a stripe map", block);
+		return( NULL );
+	}
+	if ( (hdr.servers != (uint32_t)stripeServers) || (hdr.parity != (uint32_t)stripeParity) || (hdr.unit != stripeUnit) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : file striped over %u servers (%u parity) in %u byte units, not as set up",
+				   hdr.servers, hdr.parity, hdr.unit);
+		return( NULL );
+	}
+	if ( (mp = calloc(1, sizeof(HddStripeMap))) == NULL ) {
+		return( NULL );
+	}
+	mp->block = block;
+	if (stripeGrowMap(mp, hdr.capacity) == -1) {
+		free(mp);
+		return( NULL );
+	}
+	mp->stripes = hdr.stripes;
+	mp->room = hdr.capacity;
+	memset(&req, 0x0, sizeof(req)); // a version would ask for the records only if they changed
+	req.op = HDD_BLOCK_READ;
+	req.blockID = block;
+	req.offset = sizeof(hdr);
+	req.length = (uint64_t)hdr.capacity * MAP_WORDS * sizeof(uint32_t);
+	if ( (hdr.capacity > 0) && hdd_client_request(&req, mp->records) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : failed reading the stripe map [block %u]", block);
+		free(mp->records);
+		free(mp);
+		return( NULL );
+	}
+	if (stripeKeepMap(mp) == -1) {
+		free(mp->records);
+		free(mp);
+		return( NULL );
+	}
+	return( mp );
+}
+
+// Write a map to its block, a map that outgrew its block moves to a new one
+int stripeStoreMap(HddStripeMap *mp) {
+	uint64_t size = sizeof(HddStripeHeader) + (uint64_t)mp->capacity * MAP_WORDS * sizeof(uint32_t);
+	HddStripeHeader hdr = { HDD_STRIPE_MAGIC, stripeServers, stripeParity, stripeUnit, mp->stripes, mp->capacity };
+	HddBlockID old = mp->block;
+	HddRequest req;
+	char *buf;
+	int ret;
+
+	if ( (buf = malloc(size)) == NULL ) {
+		return( -1 );
+	}
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), mp->records, size - sizeof(hdr));
+	memset(&req, 0x0, sizeof(req));
+	req.op = ( (old != HDD_NO_BLOCK) && (mp->room == mp->capacity) ) ? HDD_BLOCK_OVERWRITE : HDD_BLOCK_CREATE;
+	req.blockID = (req.op == HDD_BLOCK_OVERWRITE) ? old : 0;
+	req.length = size;
+	ret = hdd_client_request(&req, buf);
+	free(buf);
+	if (ret) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : failed writing the stripe map");
+		return( -1 );
+	}
+	if (req.op == HDD_BLOCK_CREATE) {
+		mp->block = req.blockID;
+		mp->room = mp->capacity;
+		if (old != HDD_NO_BLOCK) {
+			memset(&req, 0x0, sizeof(req));
+			req.op = HDD_BLOCK_DELETE;
+			req.blockID = old;
+			hdd_client_request(&req, NULL); // a leftover block is only wasted space
+		}
+	}
+	mp->dirty = 0;
+	return( 0 );
+}
+
+// Units of a stripe that cannot be read: stale, or on a server that is down
+uint32_t stripeMissing(HddStripeMap *mp, uint64_t s) {
+	uint32_t mask = MAP_STALE(mp, s);
+	int j;
+
+	for (j = 0; j < stripeServers; j++) {
+		if ( (MAP_UNIT(mp, s, j) != HDD_NO_BLOCK) && stripeServer[UNIT_SERVER(s, j)].down ) {
+			mask |= 1u << j;
+		}
+	}
+	return( mask );
+}
+
+// Note that a unit missed a write or could not be read
+void stripeStale(HddStripeMap *mp, uint64_t s, int j) {
+	if ( !(MAP_STALE(mp, s) & (1u << j)) ) {
+		MAP_STALE(mp, s) |= 1u << j;
+		mp->dirty = 1;
+	}
+}
+
+// Grow the scratch buffer to hold at least size bytes
+int stripeReserve(uint64_t size) {
+	uint8_t *grown;
+
+	if (stripeScratchSize < size) {
+		if ( (grown = realloc(stripeScratch, size)) == NULL ) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : out of memory for %lu bytes of units", (unsigned long)size);
+			return( -1 );
+		}
+		stripeScratch = grown;
+		stripeScratchSize = size;
+	}
+	return( 0 );
+}
+
+// Stripes moved in one batch
+uint64_t stripeGroup(void) {
+	uint64_t group = HDD_STRIPE_GROUP_BYTES / ((uint64_t)stripeServers * stripeUnit);
+	return( (group > 0) ? group : 1 );
+}
+
+// The scratch unit j of stripe s of a group starting at stripe s0
+#define SCRATCH(s0, s, j) (stripeScratch + (((s) - (s0)) * stripeServers + (j)) * (uint64_t)stripeUnit)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripeGather
+// Description  : Read whole units of stripes into their scratch units,
+//                rebuilding the ones that are missing from any k others.
+//                A unit that fails to read is marked stale and the batch is
+//                planned again, up to the parity
+//
+// Inputs       : mp - the map
+//                s0, s1 - the stripes
+//                need - for each stripe, the units wanted
+// Outputs      : 0 if successful, -1 if failure
+
+int stripeGather(HddStripeMap *mp, uint64_t s0, uint64_t s1, uint32_t *need) {
+	int k = stripeServers - stripeParity, have[HDD_STRIPE_MAX_SERVERS], want[HDD_STRIPE_MAX_SERVERS];
+	uint8_t *units[HDD_STRIPE_MAX_SERVERS], *out[HDD_STRIPE_MAX_SERVERS];
+	uint32_t missing, read;
+	uint64_t s;
+	int attempt, j, held, wants;
+	uint32_t i;
+
+	for (attempt = 0; ; attempt++) {
+		batchCount = 0;
+		for (s = s0; s <= s1; s++) {
+			if (need[s - s0] == 0) {
+				continue;
+			}
+			missing = stripeMissing(mp, s);
+			read = (need[s - s0] & missing) ? ~missing : need[s - s0]; // k units that can be read
+			for (j = 0, held = 0; (j < stripeServers) && ((held < k) || !(need[s - s0] & missing)); j++) {
+				if ( !(read & (1u << j)) ) {
+					continue;
+				}
+				held++;
+				if (MAP_UNIT(mp, s, j) == HDD_NO_BLOCK) {
+					memset(SCRATCH(s0, s, j), 0x0, stripeUnit); // never written
+				} else if (stripeAdd(s, j, HDD_BLOCK_READ, MAP_UNIT(mp, s, j), 0, stripeUnit, SCRATCH(s0, s, j)) == -1) {
+					return( -1 );
+				}
+			}
+			if ( (need[s - s0] & missing) && (held < k) ) {
+				logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : stripe %lu lost more units than its parity", (unsigned long)s);
+				return( -1 );
+			}
+		}
+		if (stripeRun() == 0) {
+			break;
+		}
+		for (i = 0; i < batchCount; i++) {
+			if ( !batch[i].ok && !stripeServer[batch[i].server].down ) {
+				stripeStale(mp, batch[i].stripe, batch[i].unit);
+			}
+		}
+		if (attempt == stripeParity) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : failed reading stripe units");
+			return( -1 );
+		}
+	}
+
+	// Rebuild the missing units wanted from the first k units held
+	for (s = s0; s <= s1; s++) {
+		missing = stripeMissing(mp, s);
+		if ( (need[s - s0] & missing) == 0 ) {
+			continue;
+		}
+		for (j = 0, held = 0, wants = 0; j < stripeServers; j++) {
+			if ( !(missing & (1u << j)) && (held < k) ) {
+				have[held] = j;
+				units[held++] = SCRATCH(s0, s, j);
+			} else if ( (missing & need[s - s0] & (1u << j)) && (j < k) ) {
+				want[wants] = j;
+				out[wants++] = SCRATCH(s0, s, j);
+			}
+		}
+		if (gfDecode(k, have, units, wants, want, out, stripeUnit) == -1) {
+			return( -1 );
+		}
+		stripeDegraded++;
+		stripeRebuilt += wants;
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripeReadGroup
+// Description  : Read the part of a run of stripes a transfer covers. The
+//                units are read straight into the caller's buffer, a stripe
+//                with a unit missing is gathered whole and rebuilt instead
+//
+// Inputs       : mp - the map
+//                buf, off, len - the transfer
+//                s0, s1 - the stripes
+// Outputs      : 0 if successful, -1 if failure
+
+int stripeReadGroup(HddStripeMap *mp, uint8_t *buf, uint64_t off, uint32_t len, uint64_t s0, uint64_t s1) {
+	uint64_t sd = (uint64_t)(stripeServers - stripeParity) * stripeUnit, s, us, lo, hi;
+	uint32_t need[s1 - s0 + 1], degraded = 0, i;
+	int attempt, j, k = stripeServers - stripeParity;
+
+	for (attempt = 0; ; attempt++) {
+		batchCount = 0;
+		for (s = s0; s <= s1; s++) {
+			need[s - s0] = 0;
+			for (j = 0; j < k; j++) {
+				us = s * sd + (uint64_t)j * stripeUnit;
+				lo = (off > us) ? off : us;
+				hi = (off + len < us + stripeUnit) ? off + len : us + stripeUnit;
+				if (lo >= hi) {
+					continue;
+				}
+				if ( (s >= mp->stripes) || (MAP_UNIT(mp, s, j) == HDD_NO_BLOCK && !(MAP_STALE(mp, s) & (1u << j))) ) {
+					memset(buf + (lo - off), 0x0, hi - lo); // never written
+				} else if (stripeMissing(mp, s) & (1u << j)) {
+					need[s - s0] = 1;
+				} else if (stripeAdd(s, j, HDD_BLOCK_READ, MAP_UNIT(mp, s, j), lo - us, hi - lo, buf + (lo - off)) == -1) {
+					return( -1 );
+				}
+			}
+		}
+		if (stripeRun() == 0) {
+			break;
+		}
+		for (i = 0; i < batchCount; i++) {
+			if ( !batch[i].ok && !stripeServer[batch[i].server].down ) {
+				stripeStale(mp, batch[i].stripe, batch[i].unit);
+			}
+		}
+		if ( (stripeParity == 0) || (attempt == stripeParity) ) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : failed reading stripe units");
+			return( -1 );
+		}
+	}
+
+	// Stripes with a unit missing are read whole and rebuilt
+	for (s = s0; s <= s1; s++) {
+		if (need[s - s0]) {
+			degraded++;
+			need[s - s0] = 0;
+			for (j = 0; j < k; j++) {
+				us = s * sd + (uint64_t)j * stripeUnit;
+				if ( (off < us + stripeUnit) && (off + len > us) ) {
+					need[s - s0] |= 1u << j;
+				}
+			}
+		}
+	}
+	if (degraded == 0) {
+		return( 0 );
+	}
+	if (stripeParity == 0) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : a server holding the file is down");
+		return( -1 );
+	}
+	if ( (stripeReserve((s1 - s0 + 1) * stripeServers * (uint64_t)stripeUnit) == -1) || (stripeGather(mp, s0, s1, need) == -1) ) {
+		return( -1 );
+	}
+	for (s = s0; s <= s1; s++) {
+		for (j = 0; j < k; j++) {
+			if (need[s - s0] & (1u << j)) {
+				us = s * sd + (uint64_t)j * stripeUnit;
+				lo = (off > us) ? off : us;
+				hi = (off + len < us + stripeUnit) ? off + len : us + stripeUnit;
+				memcpy(buf + (lo - off), SCRATCH(s0, s, j) + (lo - us), hi - lo);
+			}
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripeWriteGroup
+// Description  : Write the part of a run of stripes a transfer covers.
+//                Without parity only the ranges written are sent. With
+//                parity every data unit not fully written is gathered (read
+//                or rebuilt) and merged so the parity can be computed, then
+//                the units written, the parity and any stale unit whose
+//                server is back are sent whole. A unit whose server is down
+//                or fails is marked stale, as long as each stripe keeps k
+//
+// Inputs       : mp - the map
+//                buf, off, len - the transfer
+//                s0, s1 - the stripes
+// Outputs      : 0 if successful, -1 if failure
+
+int stripeWriteGroup(HddStripeMap *mp, uint8_t *buf, uint64_t off, uint32_t len, uint64_t s0, uint64_t s1) {
+	int k = stripeServers - stripeParity, m = stripeParity, j;
+	uint64_t sd = (uint64_t)k * stripeUnit, s, us, lo, hi;
+	uint32_t need[s1 - s0 + 1], touched, full, i, lost;
+	uint8_t *data[HDD_STRIPE_MAX_SERVERS], *parity[HDD_STRIPE_MAX_SERVERS], *src;
+	HddBlockID block;
+
+	if (stripeReserve((s1 - s0 + 1) * stripeServers * (uint64_t)stripeUnit) == -1) {
+		return( -1 );
+	}
+
+	// With parity, gather the data units not fully written
+	for (s = s0; (s <= s1) && (m > 0); s++) {
+		need[s - s0] = 0;
+		for (j = 0; j < k; j++) {
+			us = s * sd + (uint64_t)j * stripeUnit;
+			if ( (off > us) || (off + len < us + stripeUnit) ) {
+				need[s - s0] |= 1u << j;
+			}
+		}
+	}
+	if ( (m > 0) && (stripeGather(mp, s0, s1, need) == -1) ) {
+		return( -1 );
+	}
+
+	// Merge the new bytes into the units and compute the parity
+	batchCount = 0;
+	for (s = s0; s <= s1; s++) {
+		touched = full = 0;
+		for (j = 0; j < k; j++) {
+			us = s * sd + (uint64_t)j * stripeUnit;
+			lo = (off > us) ? off : us;
+			hi = (off + len < us + stripeUnit) ? off + len : us + stripeUnit;
+			data[j] = SCRATCH(s0, s, j);
+			if (lo >= hi) {
+				continue;
+			}
+			touched |= 1u << j;
+			if (hi - lo == stripeUnit) {
+				full |= 1u << j;
+				data[j] = buf + (lo - off);
+			} else if ( (m > 0) || (MAP_UNIT(mp, s, j) == HDD_NO_BLOCK) ) {
+				if (m == 0) {
+					memset(data[j], 0x0, stripeUnit); // a new unit, zero around the write
+				}
+				memcpy(data[j] + (lo - us), buf + (lo - off), hi - lo);
+			}
+		}
+		for (j = 0; j < m; j++) {
+			parity[j] = SCRATCH(s0, s, k + j);
+		}
+		if (m > 0) {
+			hdd_stripe_encode(k, m, data, parity, stripeUnit);
+		}
+
+		// Send the units written, the parity and the stale units to heal
+		for (j = 0; j < stripeServers; j++) {
+			if ( !(touched & (1u << j)) && ((m == 0) || ((j < k) && !(MAP_STALE(mp, s) & (1u << j)))) ) {
+				continue;
+			}
+			if (stripeServer[UNIT_SERVER(s, j)].down) {
+				if (m == 0) {
+					logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : server %d holding the file is down", (int)UNIT_SERVER(s, j));
+					return( -1 );
+				}
+				stripeStale(mp, s, j);
+				continue;
+			}
+			block = MAP_UNIT(mp, s, j);
+			src = (j < k) ? data[j] : parity[j - k];
+			if ( (m == 0) && (block != HDD_NO_BLOCK) && !(full & (1u << j)) ) {
+				us = s * sd + (uint64_t)j * stripeUnit;
+				lo = (off > us) ? off : us;
+				hi = (off + len < us + stripeUnit) ? off + len : us + stripeUnit;
+				if (stripeAdd(s, j, HDD_BLOCK_OVERWRITE, block, lo - us, hi - lo, buf + (lo - off)) == -1) {
+					return( -1 );
+				}
+			} else if (stripeAdd(s, j, (block == HDD_NO_BLOCK) ? HDD_BLOCK_CREATE : HDD_BLOCK_OVERWRITE, block, 0, stripeUnit, src) == -1) {
+				return( -1 );
+			}
+		}
+	}
+	stripeRun();
+
+	// New units get their blocks, units that missed the write are stale
+	for (i = 0; i < batchCount; i++) {
+		s = batch[i].stripe;
+		j = batch[i].unit;
+		if (!batch[i].ok) {
+			if (m == 0) {
+				logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : failed writing stripe %lu unit %d", (unsigned long)s, j);
+				return( -1 );
+			}
+			stripeStale(mp, s, j);
+			continue;
+		}
+		if (batch[i].req.op == HDD_BLOCK_CREATE) {
+			MAP_UNIT(mp, s, j) = (HddBlockID)batch[i].req.blockID;
+			mp->dirty = 1;
+		}
+		if (MAP_STALE(mp, s) & (1u << j)) {
+			MAP_STALE(mp, s) &= ~(1u << j);
+			mp->dirty = 1;
+		}
+	}
+	for (s = s0; (s <= s1) && (m > 0); s++) {
+		for (lost = stripeMissing(mp, s), j = 0; lost; lost &= lost - 1) {
+			j++;
+		}
+		if (j > m) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : stripe %lu lost more units than its parity", (unsigned long)s);
+			return( -1 );
+		}
+	}
+	return( 0 );
+}
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_set_servers
+// Description  : Set the servers files are striped across, takes effect at
+//                the next format or mount
+//
+// Inputs       : spec - comma separated list of [<ip>:]<port>, the IP
+//                       defaults to the directory server's
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_stripe_set_servers( char *spec ) {
+	char *copy, *item, *save = NULL, *colon;
+	unsigned int port;
+	int n = 0;
+
+	if (stripeConnected) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : the stripe servers are in use");
+		return( -1 );
+	}
+	if ( (copy = strdup(spec)) == NULL ) {
+		return( -1 );
+	}
+	for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		colon = strrchr(item, ':');
+		if ( (n == HDD_STRIPE_MAX_SERVERS) || (sscanf(colon ? colon + 1 : item, "%u", &port) != 1) || (port == 0) || (port > 65535) ) {
+			logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : bad stripe server [%s] (at most %d servers)", item, HDD_STRIPE_MAX_SERVERS);
+			free(copy);
+			return( -1 );
+		}
+		free(stripeServer[n].address);
+		free(stripeServer[n].io);
+		memset(&stripeServer[n], 0x0, sizeof(HddStripeServer));
+		stripeServer[n].fd = -1;
+		stripeServer[n].port = port;
+		if (colon != NULL) {
+			*colon = '\0';
+			stripeServer[n].address = strdup(item);
+		}
+		n++;
+	}
+	free(copy);
+	stripeServers = n;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_configure
+// Description  : Set the stripe layout. Files keep the layout they were
+//                written with, a file is only readable under the same one
+//
+// Inputs       : spec - "default" or a comma separated list of parity=<m>,
+//                       unit=<KiB>, min=<KiB>
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_stripe_configure( char *spec ) {
+	char *copy, *item, *save, *value;
+	double number;
+	int ret = 0;
+
+	if ( (copy = strdup(spec)) == NULL ) {
+		return( -1 );
+	}
+	for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		if (strcmp(item, "default") == 0) {
+			continue;
+		}
+		if ( ((value = strchr(item, '=')) == NULL) ) {
+			ret = -1;
+			break;
+		}
+		*value++ = '\0';
+		if ( (sscanf(value, "%lf", &number) != 1) || (number < 0) ) {
+			ret = -1;
+		} else if ( (strcmp(item, "parity") == 0) && (number < HDD_STRIPE_MAX_SERVERS) ) {
+			stripeParity = (int)number;
+		} else if ( (strcmp(item, "unit") == 0) && (number >= 1) && (number * 1024 <= HDD_V2_MAX_BLOCK_SIZE) ) {
+			stripeUnit = (uint32_t)number * 1024;
+		} else if (strcmp(item, "min") == 0) {
+			stripeMin = (uint64_t)(number * 1024);
+		} else {
+			ret = -1;
+		}
+		if (ret == -1) {
+			break;
+		}
+	}
+	if (ret == -1) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_STRIPE : bad stripe parameter [%s] in [%s]", item, spec );
+	}
+	free(copy);
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_set_kernel
+// Description  : Select the GF(2^8) kernel the parity is computed with
+//
+// Inputs       : name - "auto" (the widest the CPU has), "scalar", "ssse3"
+//                       or "avx2"
+// Outputs      : 0 if successful, -1 if the CPU lacks it
+
+int hdd_stripe_set_kernel( char *name ) {
+	int ssse3 = 0, avx2 = 0;
+
+#ifdef HDD_STRIPE_X86
+	__builtin_cpu_init();
+	ssse3 = __builtin_cpu_supports("ssse3");
+	avx2 = __builtin_cpu_supports("avx2");
+#endif
+	if (strcmp(name, "auto") == 0) {
+		name = avx2 ? "avx2" : (ssse3 ? "ssse3" : "scalar");
+	}
+	if (strcmp(name, "scalar") == 0) {
+		gfRegion = gfRegionScalar;
+		gfKernel = "scalar";
+#ifdef HDD_STRIPE_X86
+	} else if ( (strcmp(name, "ssse3") == 0) && ssse3 ) {
+		gfRegion = gfRegionSsse3;
+		gfKernel = "ssse3";
+	} else if ( (strcmp(name, "avx2") == 0) && avx2 ) {
+		gfRegion = gfRegionAvx2;
+		gfKernel = "avx2";
+#endif
+	} else {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : no [%s] GF(2^8) kernel on this CPU", name);
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_kernel
+// Description  : Name the GF(2^8) kernel in use
+//
+// Inputs       : none
+// Outputs      : the name
+
+char *hdd_stripe_kernel( void ) {
+	pthread_once(&gfOnce, gfSetup);
+	return( gfKernel );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_fits
+// Description  : Should a file reaching a size be striped
+//
+// Inputs       : size - the file size
+// Outputs      : 1 if it is striped, 0 if not
+
+int hdd_stripe_fits( uint64_t size ) {
+	return( (stripeServers > 0) && (size >= stripeMin) && (size <= HDD_STRIPE_MAX_FILE) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_init
+// Description  : Connect to the stripe servers and start their threads, a
+//                server that cannot be reached is left down (its units are
+//                rebuilt from parity). Maps read before are dropped
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_stripe_init( void ) {
+	int i, down = 0;
+
+	if (stripeServers == 0) {
+		return( 0 );
+	}
+	pthread_mutex_lock(&stripeLock);
+	stripeForgetMaps();
+	if (stripeConnected) {
+		pthread_mutex_unlock(&stripeLock);
+		return( 0 );
+	}
+	if (stripeParity >= stripeServers) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : %d parity units leave no data unit on %d servers", stripeParity, stripeServers);
+		pthread_mutex_unlock(&stripeLock);
+		return( -1 );
+	}
+	if (hdd_client_protocol() != HDD_PROTOCOL_V2) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : striped files need protocol v2 on the directory server");
+		pthread_mutex_unlock(&stripeLock);
+		return( -1 );
+	}
+	pthread_once(&gfOnce, gfSetup);
+	signal(SIGPIPE, SIG_IGN); // a server going away fails its requests, not the client
+
+	for (i = 0; i < stripeServers; i++) {
+		down += (stripeConnect(&stripeServer[i]) == -1);
+	}
+	if (stripeStart() == -1) {
+		for (i = 0; i < stripeServers; i++) {
+			stripeDown(&stripeServer[i], "no thread");
+		}
+		pthread_mutex_unlock(&stripeLock);
+		return( -1 );
+	}
+	stripeConnected = 1;
+	stripeDegraded = stripeRebuilt = 0;
+	if (down > stripeParity) {
+		logMessage(LOG_WARNING_LEVEL, "HDD_STRIPE : %d of %d stripe servers are down, striped files cannot be read", down, stripeServers);
+	}
+	pthread_mutex_unlock(&stripeLock);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_format
+// Description  : Format every stripe server
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure (or a server is down)
+
+int hdd_stripe_format( void ) {
+	int i, ret = 0;
+
+	if (stripeServers == 0) {
+		return( 0 );
+	}
+	if (hdd_stripe_init() == -1) {
+		return( -1 );
+	}
+	pthread_mutex_lock(&stripeLock);
+	for (i = 0; i < stripeServers; i++) {
+		if (stripeServer[i].down && (stripeConnect(&stripeServer[i]) == -1)) { // a format needs them all
+			logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : cannot format, stripe server %d is down", i);
+			ret = -1;
+		}
+	}
+	if ( (ret == 0) && (stripeDevice(HDD_FORMAT) != 0) ) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : formatting the stripe servers failed");
+		ret = -1;
+	}
+	stripeForgetMaps();
+	pthread_mutex_unlock(&stripeLock);
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_close
+// Description  : Save and close every stripe server that is up
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_stripe_close( void ) {
+	int ret = 0;
+
+	if (!stripeConnected) {
+		return( 0 );
+	}
+	pthread_mutex_lock(&stripeLock);
+	if (stripeDevice(HDD_SAVE_AND_CLOSE) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : saving the stripe servers failed");
+		ret = -1;
+	}
+	stripeStop();
+	stripeForgetMaps();
+	pthread_mutex_unlock(&stripeLock);
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_read
+// Description  : Read a range of a striped file, the units of each batch of
+//                stripes are read from all the servers at once
+//
+// Inputs       : map - the file's stripe map
+//                buf - the buffer to read into
+//                off, len - the range
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_stripe_read( HddBlockID map, void *buf, uint64_t off, uint32_t len ) {
+	uint64_t sd = (uint64_t)(stripeServers - stripeParity) * stripeUnit, s, last, group;
+	HddStripeMap *mp;
+	int ret = 0;
+
+	if (len == 0) {
+		return( 0 );
+	}
+	pthread_mutex_lock(&stripeLock);
+	if (!stripeConnected) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : the file is striped, no stripe servers are set");
+		pthread_mutex_unlock(&stripeLock);
+		return( -1 );
+	}
+	if ( (mp = stripeLoadMap(map)) == NULL ) {
+		pthread_mutex_unlock(&stripeLock);
+		return( -1 );
+	}
+	group = stripeGroup();
+	last = (off + len - 1) / sd;
+	for (s = off / sd; (s <= last) && (ret == 0); s += group) {
+		ret = stripeReadGroup(mp, buf, off, len, s, (s + group - 1 < last) ? s + group - 1 : last);
+	}
+	if ( (ret == 0) && mp->dirty ) {
+		ret = stripeStoreMap(mp); // units found stale
+	}
+	pthread_mutex_unlock(&stripeLock);
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_write
+// Description  : Write a range of a striped file, adding stripes as it
+//                grows, then write its map if it changed
+//
+// Inputs       : map - the file's stripe map, HDD_NO_BLOCK for a new file,
+//                      updated if the map moved
+//                buf - the bytes to write
+//                off, len - the range
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_stripe_write( HddBlockID *map, void *buf, uint64_t off, uint32_t len ) {
+	uint64_t sd = (uint64_t)(stripeServers - stripeParity) * stripeUnit, s, last, group;
+	HddStripeMap *mp;
+	int ret = 0;
+
+	pthread_mutex_lock(&stripeLock);
+	if (!stripeConnected) {
+		logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : the file is striped, no stripe servers are set");
+		pthread_mutex_unlock(&stripeLock);
+		return( -1 );
+	}
+	group = stripeGroup();
+	if (*map == HDD_NO_BLOCK) {
+		if ( ((mp = calloc(1, sizeof(HddStripeMap))) == NULL) || (stripeKeepMap(mp) == -1) ) {
+			free(mp);
+			pthread_mutex_unlock(&stripeLock);
+			return( -1 );
+		}
+		mp->dirty = 1;
+	} else if ( (mp = stripeLoadMap(*map)) == NULL ) {
+		pthread_mutex_unlock(&stripeLock);
+		return( -1 );
+	}
+
+	last = (len > 0) ? (off + len - 1) / sd : 0;
+	if (stripeGrowMap(mp, last + 1) == -1) {
+		ret = -1;
+	} else if (last + 1 > mp->stripes) {
+		mp->stripes = last + 1;
+		mp->dirty = 1;
+	}
+	for (s = off / sd; (len > 0) && (s <= last) && (ret == 0); s += group) {
+		ret = stripeWriteGroup(mp, buf, off, len, s, (s + group - 1 < last) ? s + group - 1 : last);
+	}
+	if ( (ret == 0) && mp->dirty ) {
+		ret = stripeStoreMap(mp);
+	}
+	*map = mp->block;
+	pthread_mutex_unlock(&stripeLock);
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_fail
+// Description  : Take a stripe server down, as if it had failed
+//
+// Inputs       : server - its index in the list
+// Outputs      : none
+
+void hdd_stripe_fail( int server ) {
+	if ( (server < 0) || (server >= stripeServers) ) {
+		return;
+	}
+	pthread_mutex_lock(&stripeLock);
+	stripeDown(&stripeServer[server], "taken down");
+	pthread_mutex_unlock(&stripeLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_encode
+// Description  : Compute the parity units of a stripe
+//
+// Inputs       : k, m - data and parity units
+//                data - the data units
+//                parity - the parity units to fill
+//                len - bytes in a unit
+// Outputs      : none
+
+void hdd_stripe_encode( int k, int m, uint8_t **data, uint8_t **parity, uint32_t len ) {
+	uint32_t off, n;
+	int i, j;
+
+	pthread_once(&gfOnce, gfSetup);
+	for (off = 0; off < len; off += HDD_STRIPE_CODE_CHUNK) {
+		n = (len - off < HDD_STRIPE_CODE_CHUNK) ? len - off : HDD_STRIPE_CODE_CHUNK;
+		for (i = 0; i < m; i++) {
+			for (j = 0; j < k; j++) {
+				gfRegion(parity[i] + off, data[j] + off, gfCoefficient(k, i, j), n, j > 0);
+			}
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_stripe_report
+// Description  : Log the traffic of each stripe server and the units rebuilt
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_stripe_report( void ) {
+	int i;
+
+	if (stripeServers == 0) {
+		return;
+	}
+	for (i = 0; i < stripeServers; i++) {
+		logMessage(LOG_INFO_LEVEL, "HDD_STRIPE : server %d%s answered %lu requests, %.1f MB", i, stripeServer[i].down ? " (down)" : "",
+				   (unsigned long)stripeServer[i].requests, stripeServer[i].bytes / 1e6);
+	}
+	logMessage(LOG_INFO_LEVEL, "HDD_STRIPE : %d+%d units of %u bytes (%s), %lu stripes degraded, %lu units rebuilt",
+			   stripeServers - stripeParity, stripeParity, stripeUnit, hdd_stripe_kernel(),
+			   (unsigned long)stripeDegraded, (unsigned long)stripeRebuilt);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddStripeUnitTest
+// Description  : Check every kernel against the scalar one, and that every
+//                pattern of up to m lost units is rebuilt, for a few layouts
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddStripeUnitTest( void ) {
+	int layouts[][2] = { {1, 1}, {2, 1}, {3, 2}, {4, 2}, {6, 3}, {10, 4} };
+	char *kernels[] = { "scalar", "ssse3", "avx2" };
+	uint32_t len = 3000, lost, bits;
+	uint8_t *pool, *units[HDD_STRIPE_MAX_SERVERS], *held[HDD_STRIPE_MAX_SERVERS], *out[HDD_STRIPE_MAX_SERVERS];
+	uint8_t *expect, *got;
+	int have[HDD_STRIPE_MAX_SERVERS], want[HDD_STRIPE_MAX_SERVERS];
+	int l, k, m, n, i, j, h, w, c, ret = 0;
+	char *saved;
+
+	pthread_once(&gfOnce, gfSetup);
+	saved = gfKernel;
+	if ( (pool = malloc((HDD_STRIPE_MAX_SERVERS * 2 + 2) * len)) == NULL ) {
+		return( -1 );
+	}
+	for (i = 0; i < HDD_STRIPE_MAX_SERVERS; i++) {
+		units[i] = pool + i * len;
+		out[i] = pool + (HDD_STRIPE_MAX_SERVERS + i) * len;
+	}
+	expect = pool + 2 * HDD_STRIPE_MAX_SERVERS * len;
+	got = expect + len;
+
+	// Every kernel agrees with the tables, at lengths that leave tails
+	for (i = 0; i < (int)len; i++) {
+		units[0][i] = (uint8_t)random();
+		units[1][i] = (uint8_t)random();
+	}
+	for (c = 0; (c < 256) && (ret == 0); c += 7) {
+		for (i = 0; i < (int)len; i++) {
+			expect[i] = units[1][i] ^ gfMulTable[c][units[0][i]];
+		}
+		for (l = 0; l < 3; l++) {
+			if (hdd_stripe_set_kernel(kernels[l]) == -1) {
+				continue; // not on this CPU
+			}
+			memcpy(got, units[1], len);
+			gfRegion(got, units[0], (uint8_t)c, len - l, 1);
+			if (memcmp(got, expect, len - l) != 0) {
+				logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : %s kernel wrong for %d", kernels[l], c);
+				ret = -1;
+			}
+		}
+	}
+	hdd_stripe_set_kernel(saved);
+
+	// Every loss of up to m units is rebuilt
+	for (l = 0; (l < (int)(sizeof(layouts) / sizeof(layouts[0]))) && (ret == 0); l++) {
+		k = layouts[l][0];
+		m = layouts[l][1];
+		n = k + m;
+		for (i = 0; i < k; i++) {
+			for (j = 0; j < (int)len; j++) {
+				units[i][j] = (uint8_t)random();
+			}
+		}
+		hdd_stripe_encode(k, m, units, &units[k], len);
+		for (lost = 1; (lost < (1u << n)) && (ret == 0); lost++) {
+			for (bits = lost, i = 0; bits; bits &= bits - 1) {
+				i++;
+			}
+			if (i > m) {
+				continue;
+			}
+			for (j = 0, h = 0, w = 0; j < n; j++) {
+				if ( !(lost & (1u << j)) && (h < k) ) {
+					have[h] = j;
+					held[h++] = units[j];
+				} else if ( (lost & (1u << j)) && (j < k) ) {
+					want[w++] = j;
+				}
+			}
+			if (gfDecode(k, have, held, w, want, out, len) == -1) {
+				logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : %d+%d units lost %x cannot be rebuilt", k, m, lost);
+				ret = -1;
+			}
+			for (i = 0; (i < w) && (ret == 0); i++) {
+				if (memcmp(out[i], units[want[i]], len) != 0) {
+					logMessage(LOG_ERROR_LEVEL, "HDD_STRIPE : %d+%d units lost %x, unit %d rebuilt wrong", k, m, lost, want[i]);
+					ret = -1;
+				}
+			}
+		}
+	}
+	free(pool);
+
+	if (ret == 0) {
+		logMessage(LOG_INFO_LEVEL, "HDD_STRIPE : unit test succeeded (%s kernel).", hdd_stripe_kernel());
+	}
+	return( ret );
+}
@@ -0,0 +1,96 @@
+#ifndef HDD_STRIPE_INCLUDED
+#define HDD_STRIPE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_stripe.h
+//  Description    : This is the header file for striped files. A file that
+//                   grows past a threshold is split into stripe units laid
+//                   round-robin across a set of n stripe servers (separate
+//                   from the server holding the directory), and the units
+//                   of each server are transferred on its own connection in
+//                   parallel with the others. With parity m > 0 every stripe
+//                   of k = n - m data units gets m Reed-Solomon parity units
+//                   (GF(2^8), SIMD kernels where the CPU has them), so a
+//                   file stays readable with up to m servers down. The
+//                   file's directory entry points at its stripe map, a block
+//                   on the directory server listing the units' blocks.
+//
+
+//
+
+// Include files
+#include <stdint.h>
+
+// Project include files
+#include <hdd_driver.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Defines
+#define HDD_STRIPE_MAX_SERVERS 16   // servers a file is striped across
+#define HDD_STRIPE_UNIT_KB 256      // default stripe unit
+#define HDD_STRIPE_MIN_KB 1024      // default size from which a file is striped
+#define HDD_STRIPE_MAX_FILE 0x7fffffff // largest striped file, what a directory entry can carry
+
+//
+// Functional Prototypes
+
+int hdd_stripe_set_servers( char *spec );
+	// Stripe large files across the servers in spec, a comma separated list
+	// of [<ip>:]<port> (before mounting), replaces the list set before
+
+int hdd_stripe_configure( char *spec );
+	// Set the layout, spec is "default" or a comma separated list of
+	// parity=<m>, unit=<KiB>, min=<KiB> (of the next format or mount)
+
+int hdd_stripe_set_kernel( char *name );
+	// Select the GF(2^8) kernel, "auto", "scalar", "ssse3" or "avx2",
+	// returns -1 if the CPU lacks it
+
+char *hdd_stripe_kernel( void );
+	// Name of the GF(2^8) kernel in use
+
+int hdd_stripe_fits( uint64_t size );
+	// 1 if stripe servers are set and a file reaching size bytes is striped
+
+int hdd_stripe_init( void );
+	// Connect to the stripe servers (mount), a server that cannot be
+	// reached is left down, returns 0 if successful
+
+int hdd_stripe_format( void );
+	// Connect to and format every stripe server, returns 0 if successful
+
+int hdd_stripe_close( void );
+	// Save and close the stripe servers (unmount), returns 0 if successful
+
+int hdd_stripe_read( HddBlockID map, void *buf, uint64_t off, uint32_t len );
+	// Read len bytes at off of the striped file with this map, rebuilding
+	// the units of servers that are down from parity, returns 0 if successful
+
+int hdd_stripe_write( HddBlockID *map, void *buf, uint64_t off, uint32_t len );
+	// Write len bytes at off of the striped file, *map is HDD_NO_BLOCK for a
+	// new file and is updated if the map block moves, returns 0 if successful
+
+void hdd_stripe_fail( int server );
+	// Take a stripe server down as if it had failed (testing)
+
+void hdd_stripe_encode( int k, int m, uint8_t **data, uint8_t **parity, uint32_t len );
+	// Compute the m parity units of len bytes of k data units
+
+void hdd_stripe_report( void );
+	// Log the traffic of each stripe server and the units rebuilt
+
+//
+// Unit testing for the module
+
+int hddStripeUnitTest( void );
+	// Perform a test of the erasure code (needs no server)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
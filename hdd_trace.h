@@ -0,0 +1,124 @@
+#ifndef HDD_TRACE_INCLUDED
+#define HDD_TRACE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_trace.h
+//  Description    : This is the binary workload trace format, written by
+//                   hdd_wlgen and replayed by hdd_bench. Unlike the text
+//                   workloads it has no limit on the number of files or on
+//                   the length of a name or a write. It is followed by the
+//                   wire trace format, the requests a client exchanged with
+//                   its server as recorded by hdd_client_trace, which
+//                   hdd_bench replays against a server.
+//
+//  A trace is an HddTraceHeader, then "files" names (each a uint16_t length
+//  followed by the name bytes), then "ops" HddTraceOp records. Each write
+//  record is followed by its "len" bytes of data. Fields are in host order.
+//
+//  A wire trace is an HddWireHeader, then an HddWireRecord for each request
+//  in the order the responses were taken, up to the end of the file. Fields
+//  are in host order.
+//
+//  Text workloads written with the "=pos" fill pattern (large transfers)
+//  hold hdd_fill_pos() bytes, a function of the position in the file so
+//  that reads anywhere can be checked.
+//
+
+//
+
+// Include files
+#include <stdint.h>
+#include <string.h>
+
+// Project include files
+#include <hdd_driver.h>
+
+// Defines
+#define HDD_TRACE_MAGIC 0x54444448 // "HDDT"
+#define HDD_TRACE_VERSION 1
+
+// Trace operations, both positional
+typedef enum {
+	HDD_TRACE_READ  = 0, // read len bytes at off
+	HDD_TRACE_WRITE = 1, // write len bytes at off (at most the file size)
+} HDD_TRACE_OP;
+
+// The trace header
+typedef struct {
+	uint32_t magic;   // HDD_TRACE_MAGIC
+	uint32_t version; // HDD_TRACE_VERSION
+	uint32_t files;   // names that follow
+	uint32_t ops;     // operations that follow the names
+} HddTraceHeader;
+
+// An operation
+typedef struct {
+	uint8_t  op;          // HDD_TRACE_OP
+	uint8_t  reserved[3];
+	uint32_t file;        // index of the file name
+	uint32_t len;         // bytes to transfer
+	uint32_t off;         // position in the file
+} HddTraceOp;
+
+// Wire trace
+#define HDD_WIRE_MAGIC 0x57444448 // "HDDW"
+#define HDD_WIRE_VERSION 1
+#define HDD_WIRE_HASHED 0x1       // header flag, records carry a hash of their payload
+
+// The wire trace header
+typedef struct {
+	uint32_t magic;   // HDD_WIRE_MAGIC
+	uint32_t version; // HDD_WIRE_VERSION
+	uint32_t flags;   // HDD_WIRE_HASHED or 0
+	uint32_t reserved;
+} HddWireHeader;
+
+// A request and its response
+typedef struct {
+	uint64_t   start;       // us after recording started that the request was made
+	uint32_t   latency;     // us until its response was taken
+	uint32_t   hash;        // FNV-1a of the bytes written or read, 0 if not hashed
+	HddBitCmd  cmd;         // the request: op, size (bytes transferred), flags, block
+	HddBitResp resp;        // the response: op, size, flags, result, block
+	uint64_t   offset;      // first byte of the block transferred (v2)
+	uint32_t   version;     // version of a cached copy the request carried (v2), 0 for none
+	uint32_t   respVersion; // the block's version in the response (v2)
+} HddWireRecord;
+
+// The 8 bytes at a position multiple of 8 of the "=pos" fill pattern, a
+// mix of the position (splitmix64), little endian
+static inline uint64_t hdd_fill_word( uint64_t pos ) {
+	uint64_t z = (pos >> 3) + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return( z ^ (z >> 31) );
+}
+
+// Fill buf with the len bytes of the "=pos" pattern at pos, a word at a
+// time between the unaligned ends
+static inline void hdd_fill_pos( uint8_t *buf, uint64_t pos, uint64_t len ) {
+	uint64_t w;
+	int i;
+
+	while ( (len > 0) && (pos & 7) ) {
+		*buf++ = (uint8_t)(hdd_fill_word(pos) >> (8 * (pos & 7)));
+		pos++;
+		len--;
+	}
+	for ( ; len >= 8; buf += 8, pos += 8, len -= 8) {
+		w = hdd_fill_word(pos);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+		memcpy( buf, &w, 8 );
+#else
+		for (i=0; i<8; i++) {
+			buf[i] = (uint8_t)(w >> (8 * i));
+		}
+#endif
+	}
+	for (i=0; (uint64_t)i<len; i++) {
+		buf[i] = (uint8_t)(hdd_fill_word(pos + i) >> (8 * ((pos + i) & 7)));
+	}
+}
+
+#endif
@@ -0,0 +1,563 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_wlgen.c
+//  Description   : This is the synthetic workload generator for the HDD
+//                  filesystem. It writes a workload in the text format
+//                  replayed by hdd_client (and hdd_bench), or a binary trace
+//                  (hdd_trace.h) replayed by hdd_bench, and optionally the
+//                  contents every file is expected to have at the end.
+//
+
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+// Project Includes
+#include <hdd_driver.h>
+#include <hdd_trace.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define HDD_WLGEN_ARGUMENTS "hvbpf:n:s:S:m:z:o:l:M:e:x:"
+#define HDD_WLGEN_TEXT_MAX_FILES 128 // files hdd_client keeps open
+#define HDD_WLGEN_PARETO_ALPHA 1.16  // the 80/20 shape
+#define USAGE \
+	"USAGE: hdd_wlgen [-h] [-v] [-b] [-p] [-f <files>] [-n <ops>] [-s <min>:<max>] [-S uniform|pareto]\n" \
+	"                 [-m <read>:<write>:<seek>] [-z <theta>] [-o seq|rand] [-l <io>]\n" \
+	"                 [-M <max size>] [-e <dir>] [-x <seed>] <output>\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -b - write a binary trace for hdd_bench instead of a text workload\n" \
+	"    -p - write the position fill pattern instead of random text, text\n" \
+	"         workloads carry =pos in place of the data and check reads with it\n" \
+	"    -f - number of files (default 16, at most 128 for text workloads)\n" \
+	"    -n - number of operations after the files are filled (default 10000)\n" \
+	"    -s - range of the initial file sizes in bytes (default 1:4096)\n" \
+	"    -S - initial size distribution, uniform or pareto (default uniform)\n" \
+	"    -m - relative weights of reads, writes and seeks (default 60:30:10)\n" \
+	"    -z - Zipf skew of file popularity, 0 for uniform (default 0)\n" \
+	"    -o - offsets, seq continues where the file was left, rand seeks\n" \
+	"         before each operation (default rand)\n" \
+	"    -l - largest read or write in bytes (default 512)\n" \
+	"    -M - largest file size in bytes (default 1048575)\n" \
+	"    -e - directory the expected final contents are written to\n" \
+	"    -x - random seed (default 1)\n" \
+	"\n" \
+	"    <output> - the workload or trace file to write\n" \
+	"\n" \
+
+// A file of the workload as the generator sees it
+typedef struct {
+	char     name[32]; // the workload name
+	char    *data;     // contents
+	uint32_t size;     // bytes of contents
+	uint32_t pos;      // seek position
+	int      used;     // 1 once an operation touched it
+} HddWlgenFile;
+
+//
+// Global Data
+HddWlgenFile *files = NULL;
+int      nfiles = 16;
+int      nops = 10000;
+uint32_t minSize = 1, maxSize = 4096;
+int      pareto = 0;                    // 1 for pareto initial sizes
+double   mix[3] = { 60, 30, 10 };       // read, write, seek weights
+double   theta = 0;                     // Zipf skew
+double  *popularity = NULL;             // cumulative file weights
+int      sequential = 0;                // 1 for sequential offsets
+uint32_t maxIO = 512;
+uint32_t maxFile = HDD_MAX_BLOCK_SIZE;
+int      binary = 0;                    // 1 for a binary trace
+int      pattern = 0;                   // 1 to write the "=pos" fill pattern
+uint64_t rngState = 1;
+uint32_t emitted = 0;                   // operations written
+char    *iobuf = NULL;                  // write payload
+
+//
+// Functional Prototypes
+
+int generate( FILE *out );
+int write_expected( char *dir );
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rng_next
+// Description  : Get the next value of the generator's own random sequence
+//                (xorshift64*), so a seed always gives the same workload
+//
+// Inputs       : none
+// Outputs      : the random value
+
+uint64_t rng_next( void ) {
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return( rngState * 2685821657736338717ULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rng_below
+// Description  : Get a random value in [0, n)
+//
+// Inputs       : n - the bound, at least 1
+// Outputs      : the random value
+
+uint32_t rng_below( uint32_t n ) {
+	return( (uint32_t)(((rng_next() >> 32) * (uint64_t)n) >> 32) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rng_unit
+// Description  : Get a random value in [0, 1)
+//
+// Inputs       : none
+// Outputs      : the random value
+
+double rng_unit( void ) {
+	return( (double)(rng_next() >> 11) / 9007199254740992.0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pick_file
+// Description  : Pick a file by popularity, file 0 being the most popular
+//
+// Inputs       : none
+// Outputs      : the file index
+
+int pick_file( void ) {
+	double u = rng_unit() * popularity[nfiles-1];
+	int lo = 0, hi = nfiles-1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (popularity[mid] > u) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return( lo );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the workload generator
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+	// Local variables
+	char *expected = NULL, dist[16], order[16];
+	FILE *out;
+	int ch, i, ret;
+
+	// Process the command line parameters
+	initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	while ((ch = getopt(argc, argv, HDD_WLGEN_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			enableLogLevels( LOG_INFO_LEVEL );
+			break;
+
+		case 'b': // Binary trace
+			binary = 1;
+			break;
+
+		case 'p': // Fill pattern
+			pattern = 1;
+			break;
+
+		case 'f': // Number of files
+			if ( (sscanf( optarg, "%d", &nfiles ) != 1) || (nfiles < 1) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad file count [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'n': // Number of operations
+			if ( (sscanf( optarg, "%d", &nops ) != 1) || (nops < 0) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad operation count [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 's': // Initial sizes
+			if ( (sscanf( optarg, "%u:%u", &minSize, &maxSize ) != 2) || (minSize > maxSize) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad size range [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'S': // Size distribution
+			if ( (sscanf( optarg, "%15s", dist ) != 1) || (strcmp(dist, "uniform") && strcmp(dist, "pareto")) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad size distribution [%s]", optarg );
+				return( -1 );
+			}
+			pareto = (strcmp(dist, "pareto") == 0);
+			break;
+
+		case 'm': // Operation mix
+			if ( (sscanf( optarg, "%lf:%lf:%lf", &mix[0], &mix[1], &mix[2] ) != 3) ||
+				 (mix[0] < 0) || (mix[1] < 0) || (mix[2] < 0) || (mix[0] + mix[1] + mix[2] <= 0) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad operation mix [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'z': // Popularity skew
+			if ( (sscanf( optarg, "%lf", &theta ) != 1) || (theta < 0) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad Zipf skew [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'o': // Offsets
+			if ( (sscanf( optarg, "%15s", order ) != 1) || (strcmp(order, "seq") && strcmp(order, "rand")) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad offset order [%s]", optarg );
+				return( -1 );
+			}
+			sequential = (strcmp(order, "seq") == 0);
+			break;
+
+		case 'l': // Largest transfer
+			if ( (sscanf( optarg, "%u", &maxIO ) != 1) || (maxIO < 1) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad transfer size [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'M': // Largest file
+			if ( (sscanf( optarg, "%u", &maxFile ) != 1) || (maxFile < 1) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad file size limit [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'e': // Expected contents
+			expected = optarg;
+			break;
+
+		case 'x': // Seed
+			if ( (sscanf( optarg, "%lu", &rngState ) != 1) || (rngState == 0) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad seed [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// Check the limits of the output format
+	if ( optind >= argc ) {
+		fprintf( stderr, "Missing output file, use -h to see usage, aborting.\n" );
+		return( -1 );
+	}
+	if ( !binary && (nfiles > HDD_WLGEN_TEXT_MAX_FILES) ) {
+		logMessage( LOG_ERROR_LEVEL, "Text workloads hold at most %d files, use -b.", HDD_WLGEN_TEXT_MAX_FILES );
+		return( -1 );
+	}
+	if ( (maxSize > maxFile) || (maxIO > maxFile) ) {
+		logMessage( LOG_ERROR_LEVEL, "File sizes and transfers must fit the %u byte file size limit.", maxFile );
+		return( -1 );
+	}
+
+	// Set up the files and their cumulative popularity (1/rank^theta)
+	files = calloc(nfiles, sizeof(HddWlgenFile));
+	popularity = malloc(nfiles * sizeof(double));
+	iobuf = malloc(maxFile);
+	if ( (files == NULL) || (popularity == NULL) || (iobuf == NULL) ) {
+		logMessage( LOG_ERROR_LEVEL, "Out of memory." );
+		return( -1 );
+	}
+	for (i=0; i<nfiles; i++) {
+		snprintf( files[i].name, sizeof(files[i].name), "wl-%05d.dat", i );
+		popularity[i] = ((i > 0) ? popularity[i-1] : 0) + 1.0 / pow(i + 1, theta);
+	}
+
+	if ( (out = fopen(argv[optind], binary ? "wb" : "w")) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure creating [%s], error=%s", argv[optind], strerror(errno) );
+		return( -1 );
+	}
+	ret = generate(out);
+	if ( fclose(out) ) {
+		ret = -1;
+	}
+	if ( (ret == 0) && (expected != NULL) ) {
+		ret = write_expected(expected);
+	}
+	if (ret == 0) {
+		logMessage( LOG_OUTPUT_LEVEL, "HDD_WLGEN : wrote %u operations on %d files to [%s]", emitted, nfiles, argv[optind] );
+	}
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : emit
+// Description  : Write one operation. Text workloads get the command as
+//                hdd_client replays it, binary traces a positional record
+//
+// Inputs       : out - the output file
+//                f - the file index
+//                command - READ, WRITE, WRITEAT, SEEK, FORMAT, MOUNT or UNMOUNT
+//                len - the length
+//                off - the position in the file
+//                data - the write payload, NULL for other commands
+// Outputs      : 0 if successful, -1 if failure
+
+int emit( FILE *out, int f, char *command, uint32_t len, uint32_t off, char *data ) {
+	HddTraceOp rec;
+
+	if (binary) {
+		if ( (strcmp(command, "READ") != 0) && (strncmp(command, "WRITE", 5) != 0) ) {
+			return( 0 ); // the trace is positional and the replayer mounts itself
+		}
+		memset(&rec, 0x0, sizeof(rec));
+		rec.op = (data == NULL) ? HDD_TRACE_READ : HDD_TRACE_WRITE;
+		rec.file = f;
+		rec.len = len;
+		rec.off = off;
+		if ( (fwrite(&rec, sizeof(rec), 1, out) != 1) || ((data != NULL) && (fwrite(data, 1, len, out) != len)) ) {
+			return( -1 );
+		}
+	} else if ( pattern && ((strcmp(command, "READ") == 0) || (strncmp(command, "WRITE", 5) == 0)) ) {
+		if ( fprintf(out, "%s %s %u %u =pos\n", files[f].name, command, len, off) < 0 ) {
+			return( -1 ); // the data is the pattern at the file position, reads are checked
+		}
+	} else {
+		if ( fprintf(out, "%s %s %u %u :", (f < 0) ? "x" : files[f].name, command, len, off) < 0 ) {
+			return( -1 );
+		}
+		if ( ((data != NULL) && (fwrite(data, 1, len, out) != len)) || (fputc('\n', out) == EOF) ) {
+			return( -1 );
+		}
+	}
+	emitted++;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : do_write
+// Description  : Write fresh data at a position of a file, growing it as
+//                needed, and emit the operation
+//
+// Inputs       : out - the output file
+//                f - the file index
+//                len - the bytes to write
+//                off - the position, at most the file size
+// Outputs      : 0 if successful, -1 if failure
+
+int do_write( FILE *out, int f, uint32_t len, uint32_t off ) {
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+	HddWlgenFile *file = &files[f];
+	uint32_t i;
+	char *grown;
+
+	if (pattern) {
+		hdd_fill_pos( (uint8_t *)iobuf, off, len );
+	} else {
+		for (i=0; i<len; i++) {
+			iobuf[i] = alphabet[rng_below(sizeof(alphabet) - 1)]; // never '*', which text workloads turn into '\n'
+		}
+	}
+	if ( off + len > file->size ) {
+		if ( (grown = realloc(file->data, off + len)) == NULL ) {
+			return( -1 );
+		}
+		file->data = grown;
+		file->size = off + len;
+	}
+	memcpy(file->data + off, iobuf, len);
+	file->used = 1;
+
+	// Sequential writes use the seek position, random ones carry the offset
+	if ( file->pos == off ) {
+		if ( emit(out, f, "WRITE", len, off, iobuf) ) {
+			return( -1 );
+		}
+	} else if ( emit(out, f, "WRITEAT", len, off, iobuf) ) {
+		return( -1 );
+	}
+	file->pos = off + len;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : do_seek
+// Description  : Move the seek position of a file and emit the operation
+//
+// Inputs       : out - the output file
+//                f - the file index
+//                off - the position, at most the file size
+// Outputs      : 0 if successful, -1 if failure
+
+int do_seek( FILE *out, int f, uint32_t off ) {
+	files[f].pos = off;
+	files[f].used = 1;
+	return( emit(out, f, "SEEK", 0, off, NULL) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : generate
+// Description  : Write the whole workload: fill every file to its initial
+//                size, then run the operation mix
+//
+// Inputs       : out - the output file
+// Outputs      : 0 if successful, -1 if failure
+
+int generate( FILE *out ) {
+	HddTraceHeader hdr;
+	uint32_t size, len, off, chunk;
+	uint16_t nlen;
+	double u;
+	int i, f;
+
+	if (binary) {
+		hdr.magic = HDD_TRACE_MAGIC;
+		hdr.version = HDD_TRACE_VERSION;
+		hdr.files = nfiles;
+		hdr.ops = 0; // patched once the operations are counted
+		if ( fwrite(&hdr, sizeof(hdr), 1, out) != 1 ) {
+			return( -1 );
+		}
+		for (i=0; i<nfiles; i++) {
+			nlen = strlen(files[i].name);
+			if ( (fwrite(&nlen, sizeof(nlen), 1, out) != 1) || (fwrite(files[i].name, 1, nlen, out) != nlen) ) {
+				return( -1 );
+			}
+		}
+	}
+	if ( emit(out, -1, "FORMAT", 0, 0, NULL) || emit(out, -1, "MOUNT", 0, 0, NULL) ) {
+		return( -1 );
+	}
+
+	// Fill the files
+	for (f=0; f<nfiles; f++) {
+		if (pareto) {
+			size = minSize / pow(1.0 - rng_unit(), 1.0 / HDD_WLGEN_PARETO_ALPHA);
+			size = ((size > maxSize) || (size < minSize)) ? maxSize : size;
+		} else {
+			size = minSize + rng_below(maxSize - minSize + 1);
+		}
+		for (off=0; off<size; off+=chunk) {
+			chunk = (size - off < maxIO) ? size - off : maxIO;
+			if ( do_write(out, f, chunk, off) ) {
+				return( -1 );
+			}
+		}
+	}
+
+	// The operation mix
+	for (i=0; i<nops; i++) {
+		f = pick_file();
+		u = rng_unit() * (mix[0] + mix[1] + mix[2]);
+		len = 1 + rng_below(maxIO);
+
+		if ( (u < mix[0]) && (files[f].size > 0) ) {
+			// Read from the seek position, or from a random one
+			off = sequential ? files[f].pos : rng_below(files[f].size);
+			if ( off == files[f].size ) {
+				off = 0; // wrap around at the end of the file
+			}
+			if ( (off != files[f].pos) && do_seek(out, f, off) ) {
+				return( -1 );
+			}
+			len = (len > files[f].size - off) ? files[f].size - off : len;
+			if ( emit(out, f, "READ", len, off, NULL) ) {
+				return( -1 );
+			}
+			files[f].pos = off + len;
+			files[f].used = 1;
+		} else if ( u < mix[0] + mix[1] || (files[f].size == 0) ) {
+			// Write at the seek position, or at a random one without leaving a hole
+			off = sequential ? files[f].pos : rng_below(files[f].size + 1);
+			if ( off + len > maxFile ) {
+				off = 0; // keep the file within the limit
+			}
+			if ( do_write(out, f, len, off) ) {
+				return( -1 );
+			}
+		} else {
+			if ( do_seek(out, f, rng_below(files[f].size + 1)) ) {
+				return( -1 );
+			}
+		}
+	}
+	if ( emit(out, -1, "UNMOUNT", 0, 0, NULL) ) {
+		return( -1 );
+	}
+
+	// Fill in the operation count of a trace
+	if (binary) {
+		hdr.ops = emitted;
+		if ( fseek(out, 0, SEEK_SET) || (fwrite(&hdr, sizeof(hdr), 1, out) != 1) ) {
+			return( -1 );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_expected
+// Description  : Write the final contents of every file the workload
+//                touched, each under its workload name
+//
+// Inputs       : dir - the host directory to write to
+// Outputs      : 0 if successful, -1 if failure
+
+int write_expected( char *dir ) {
+	char path[PATH_MAX];
+	FILE *fhandle;
+	int f;
+
+	if ( (mkdir(dir, S_IRWXU|S_IRGRP|S_IXGRP) == -1) && (errno != EEXIST) ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure creating [%s], error=%s", dir, strerror(errno) );
+		return( -1 );
+	}
+	for (f=0; f<nfiles; f++) {
+		if ( files[f].used == 0 ) {
+			continue;
+		}
+		snprintf( path, PATH_MAX, "%s/%s", dir, files[f].name );
+		if ( ((fhandle = fopen(path, "w")) == NULL) ||
+			 (fwrite(files[f].data, 1, files[f].size, fhandle) != files[f].size) ||
+			 fclose(fhandle) ) {
+			logMessage( LOG_ERROR_LEVEL, "Failure writing [%s], error=%s", path, strerror(errno) );
+			return( -1 );
+		}
+	}
+	return( 0 );
+}
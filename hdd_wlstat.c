@@ -0,0 +1,889 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_wlstat.c
+//  Description   : This is the workload analyzer for the HDD filesystem. It
+//                  reads text workloads, binary traces (hdd_wlgen -b) or
+//                  wire traces (hdd_client -T) and reports the operation
+//                  mix, how sequential the transfers are, the reuse
+//                  distances of the pages they touch, the working set
+//                  over time and the miss ratio an LRU or ARC cache would
+//                  get at each size, to size the client cache (-c) and
+//                  read-ahead from data.
+//
+//                  Reuse distances are counted with a Fenwick tree over
+//                  the access sequence (O(log n) each), which gives the
+//                  exact LRU miss ratio curve in one pass; ARC is
+//                  simulated once per cache size.
+//
+
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+// Project Includes
+#include <hdd_driver.h>
+#include <hdd_network.h>
+#include <hdd_trace.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define HDD_WLSTAT_ARGUMENTS "hvP:w:f:"
+#define HDD_WLSTAT_PAGE 4096        // default page size
+#define HDD_WLSTAT_WINDOWS 10       // default working set windows
+#define HDD_WLSTAT_TOP_FILES 10     // default files listed
+#define HDD_WLSTAT_BUCKETS 34       // log2 distance buckets: 0, 1, 2-3, ... and cold
+#define HDD_WLSTAT_COLD (HDD_WLSTAT_BUCKETS - 1)
+#define HDD_WLSTAT_MAX_OPS 32       // operation kinds in the mix
+#define HDD_WLSTAT_NAME 128         // longest file name kept
+#define HDD_WLSTAT_NONE 0xffffffff
+#define USAGE \
+	"USAGE: hdd_wlstat [-h] [-v] [-P <page>] [-w <windows>] [-f <files>] <workload> ...\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -P - page size in bytes, the unit of reuse and of the cache (default 4096)\n" \
+	"    -w - windows the working set is reported over (default 10)\n" \
+	"    -f - files listed with their own reuse distances (default 10)\n" \
+	"\n" \
+	"    <workload> - text workloads, binary traces (hdd_wlgen -b) or wire traces\n" \
+	"                 (hdd_client -T), analyzed as one sequence in the order given\n" \
+	"\n" \
+
+// A file of the workload, a block for wire traces
+typedef struct {
+	char     name[HDD_WLSTAT_NAME]; // the workload name
+	uint32_t pos;                   // seek position (text workloads)
+	uint32_t end;                   // where its last transfer ended, HDD_WLSTAT_NONE before one
+	uint64_t run;                   // bytes of its current sequential run
+	uint64_t accesses;              // page accesses
+	uint64_t hist[HDD_WLSTAT_BUCKETS]; // its reuse distances, log2 buckets and cold
+} HddWlstatFile;
+
+// An operation kind in the mix
+typedef struct {
+	char     name[16]; // READ, WRITE, SEEK...
+	uint64_t count;    // operations
+	uint64_t bytes;    // bytes transferred
+} HddWlstatOp;
+
+//
+// Global Data
+uint32_t pageSize = HDD_WLSTAT_PAGE;
+int      windows = HDD_WLSTAT_WINDOWS;
+int      topFiles = HDD_WLSTAT_TOP_FILES;
+
+HddWlstatFile *files = NULL;          // the files seen
+uint32_t  nfiles = 0, filesSize = 0;
+uint32_t *fileIndex = NULL;           // name hash table of file + 1, 0 if empty
+uint32_t  fileIndexSize = 0;          // a power of two
+
+uint64_t *pageKey = NULL;             // open addressing table of (file, page) + 1, 0 if empty
+uint32_t *pageID = NULL;              // the dense ID of each key
+uint32_t  pageSlots = 0, npages = 0;  // table size (a power of two) and pages seen
+
+uint32_t *accPage = NULL;             // the page of each access
+uint32_t *accFile = NULL;             // and its file
+uint32_t  naccesses = 0, accSize = 0;
+
+HddWlstatOp mix[HDD_WLSTAT_MAX_OPS];  // operation mix
+int      nmix = 0;
+uint64_t transfers = 0, sequential = 0; // reads and writes, those continuing the last one on the file
+uint64_t runHist[HDD_WLSTAT_BUCKETS]; // sequential run lengths in bytes, log2 buckets
+uint64_t ops = 0;                     // operations read
+
+//
+// Functional Prototypes
+
+int load_text( FILE *fhandle, char *fname );
+int load_binary( FILE *fhandle, char *fname );
+int load_wire( FILE *fhandle, char *fname );
+int analyze( void );
+
+//
+// Functions
+
+// The log2 bucket of a value: 0, 1, 2-3, 4-7...
+int bucket( uint64_t v ) {
+	int b = 0;
+	while ( (v > 0) && (b < HDD_WLSTAT_COLD - 1) ) {
+		v >>= 1;
+		b++;
+	}
+	return( b );
+}
+
+// Smallest value of a bucket
+uint64_t bucketLow( int b ) {
+	return( (b == 0) ? 0 : (1ULL << (b - 1)) );
+}
+
+// Hash of a name (FNV-1a)
+uint32_t hashName( char *name ) {
+	uint32_t h = 2166136261u;
+	while (*name) {
+		h = (h ^ (uint8_t)*name++) * 16777619u;
+	}
+	return( h );
+}
+
+// Mix of a 64 bit key
+uint64_t hashKey( uint64_t k ) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	return( k );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_file
+// Description  : Get the index of a file by name, adding it the first time
+//
+// Inputs       : name - the file name
+// Outputs      : the index, HDD_WLSTAT_NONE if out of memory
+
+uint32_t find_file( char *name ) {
+	uint32_t slot, i, *grown;
+
+	if ( 2 * (nfiles + 1) > fileIndexSize ) {
+		uint32_t size = (fileIndexSize == 0) ? 1024 : fileIndexSize * 2;
+		if ( (grown = calloc(size, sizeof(uint32_t))) == NULL ) {
+			return( HDD_WLSTAT_NONE );
+		}
+		for (i=0; i<nfiles; i++) {
+			for (slot=hashName(files[i].name) & (size-1); grown[slot] != 0; slot=(slot+1) & (size-1));
+			grown[slot] = i + 1;
+		}
+		free( fileIndex );
+		fileIndex = grown;
+		fileIndexSize = size;
+	}
+	for (slot=hashName(name) & (fileIndexSize-1); fileIndex[slot] != 0; slot=(slot+1) & (fileIndexSize-1)) {
+		if ( strncmp(files[fileIndex[slot]-1].name, name, HDD_WLSTAT_NAME-1) == 0 ) {
+			return( fileIndex[slot] - 1 );
+		}
+	}
+
+	if (nfiles == filesSize) {
+		HddWlstatFile *more = realloc(files, (filesSize ? filesSize * 2 : 256) * sizeof(HddWlstatFile));
+		if (more == NULL) {
+			return( HDD_WLSTAT_NONE );
+		}
+		files = more;
+		filesSize = filesSize ? filesSize * 2 : 256;
+	}
+	memset( &files[nfiles], 0x0, sizeof(HddWlstatFile) );
+	strncpy( files[nfiles].name, name, HDD_WLSTAT_NAME-1 );
+	files[nfiles].end = HDD_WLSTAT_NONE;
+	fileIndex[slot] = nfiles + 1;
+	return( nfiles++ );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_page
+// Description  : Get the dense ID of a page of a file, adding it the first
+//                time
+//
+// Inputs       : file - the file index
+//                page - the page number in the file
+// Outputs      : the ID, HDD_WLSTAT_NONE if out of memory
+
+uint32_t find_page( uint32_t file, uint32_t page ) {
+	uint64_t key = (((uint64_t)file << 32) | page) + 1;
+	uint32_t slot, i, *ids;
+	uint64_t *keys;
+
+	if ( 2 * (npages + 1) > pageSlots ) {
+		uint32_t size = (pageSlots == 0) ? 4096 : pageSlots * 2;
+		keys = calloc(size, sizeof(uint64_t));
+		ids = malloc(size * sizeof(uint32_t));
+		if ( (keys == NULL) || (ids == NULL) ) {
+			free( keys );
+			free( ids );
+			return( HDD_WLSTAT_NONE );
+		}
+		for (i=0; i<pageSlots; i++) {
+			if (pageKey[i] != 0) {
+				for (slot=hashKey(pageKey[i]) & (size-1); keys[slot] != 0; slot=(slot+1) & (size-1));
+				keys[slot] = pageKey[i];
+				ids[slot] = pageID[i];
+			}
+		}
+		free( pageKey );
+		free( pageID );
+		pageKey = keys;
+		pageID = ids;
+		pageSlots = size;
+	}
+	for (slot=hashKey(key) & (pageSlots-1); pageKey[slot] != 0; slot=(slot+1) & (pageSlots-1)) {
+		if (pageKey[slot] == key) {
+			return( pageID[slot] );
+		}
+	}
+	pageKey[slot] = key;
+	pageID[slot] = npages;
+	return( npages++ );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : count_op
+// Description  : Count an operation in the mix
+//
+// Inputs       : name - the operation kind
+//                bytes - the bytes it transfers
+// Outputs      : none
+
+void count_op( char *name, uint64_t bytes ) {
+	int i;
+
+	ops++;
+	for (i=0; (i < nmix) && strcmp(mix[i].name, name); i++);
+	if (i == nmix) {
+		if (nmix == HDD_WLSTAT_MAX_OPS) {
+			i = nmix - 1; // the last kind collects the rest
+		} else {
+			strncpy( mix[nmix].name, name, sizeof(mix[nmix].name)-1 );
+			nmix++;
+		}
+	}
+	mix[i].count++;
+	mix[i].bytes += bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : transfer
+// Description  : Record a read or write: its sequentiality, and an access to
+//                every page it touches
+//
+// Inputs       : file - the file index
+//                off - the first byte
+//                len - the bytes transferred
+// Outputs      : 0 if successful, -1 if out of memory
+
+int transfer( uint32_t file, uint64_t off, uint64_t len ) {
+	HddWlstatFile *f = &files[file];
+	uint64_t pg;
+	uint32_t id;
+
+	transfers++;
+	if ( (f->end != HDD_WLSTAT_NONE) && (off == f->end) ) {
+		sequential++;
+		f->run += len;
+	} else {
+		if (f->run > 0) {
+			runHist[bucket(f->run)]++;
+		}
+		f->run = len;
+	}
+	f->end = (uint32_t)(off + len);
+
+	for (pg=off/pageSize; (len > 0) && (pg <= (off+len-1)/pageSize); pg++) {
+		if ( (id = find_page(file, (uint32_t)pg)) == HDD_WLSTAT_NONE ) {
+			return( -1 );
+		}
+		if (naccesses == accSize) {
+			uint32_t size = accSize ? accSize * 2 : 65536;
+			uint32_t *p = realloc(accPage, size * sizeof(uint32_t)), *q;
+			if (p == NULL) {
+				return( -1 );
+			}
+			accPage = p;
+			if ( (q = realloc(accFile, size * sizeof(uint32_t))) == NULL ) {
+				return( -1 );
+			}
+			accFile = q;
+			accSize = size;
+		}
+		accPage[naccesses] = id;
+		accFile[naccesses++] = file;
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the workload analyzer
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+	// Local variables
+	struct timespec t0, t1;
+	uint32_t magic;
+	FILE *fhandle;
+	int ch, i, ret;
+
+	// Process the command line parameters
+	initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	while ((ch = getopt(argc, argv, HDD_WLSTAT_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			enableLogLevels( LOG_INFO_LEVEL );
+			break;
+
+		case 'P': // Page size
+			if ( (sscanf( optarg, "%u", &pageSize ) != 1) || (pageSize < 1) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad page size [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'w': // Working set windows
+			if ( (sscanf( optarg, "%d", &windows ) != 1) || (windows < 1) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad window count [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'f': // Files listed
+			if ( (sscanf( optarg, "%d", &topFiles ) != 1) || (topFiles < 0) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad file count [%s]", optarg );
+				return( -1 );
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+	if ( optind >= argc ) {
+		fprintf( stderr, "Missing workload file, use -h to see usage, aborting.\n" );
+		return( -1 );
+	}
+
+	// Load every workload into one access sequence, the format is told
+	// apart by the first word
+	clock_gettime( CLOCK_MONOTONIC, &t0 );
+	for (i=optind; i<argc; i++) {
+		if ( (fhandle = fopen(argv[i], "rb")) == NULL ) {
+			logMessage( LOG_ERROR_LEVEL, "Failure opening [%s], error: %s", argv[i], strerror(errno) );
+			return( -1 );
+		}
+		if (fread(&magic, sizeof(magic), 1, fhandle) != 1) {
+			magic = 0;
+		}
+		rewind( fhandle );
+		if (magic == HDD_TRACE_MAGIC) {
+			ret = load_binary( fhandle, argv[i] );
+		} else if (magic == HDD_WIRE_MAGIC) {
+			ret = load_wire( fhandle, argv[i] );
+		} else {
+			ret = load_text( fhandle, argv[i] );
+		}
+		fclose( fhandle );
+		if (ret) {
+			return( -1 );
+		}
+	}
+
+	for (i=0; (uint32_t)i<nfiles; i++) {
+		if (files[i].run > 0) {
+			runHist[bucket(files[i].run)]++; // runs still open at the end
+		}
+	}
+	ret = analyze();
+	clock_gettime( CLOCK_MONOTONIC, &t1 );
+	logMessage( LOG_INFO_LEVEL, "HDD_WLSTAT : analyzed %lu operations in %.1f ms", (unsigned long)ops,
+			(t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1000000.0 );
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_text
+// Description  : Read a text workload, READ and WRITE transfer at the file's
+//                seek position, WRITEAT at its offset, SEEK moves the
+//                position
+//
+// Inputs       : fhandle - the open workload
+//                fname - its name, for messages
+// Outputs      : 0 if successful, -1 if failure
+
+int load_text( FILE *fhandle, char *fname ) {
+	char *line = NULL, name[HDD_WLSTAT_NAME], command[16];
+	size_t cap = 0;
+	int len, off, n = 0;
+	uint32_t f;
+	HddWlstatFile *fl;
+
+	while (getline(&line, &cap, fhandle) != -1) {
+		n++;
+		if ( sscanf(line, "%127s %15s %d %d", name, command, &len, &off) != 4 ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_WLSTAT : un-parsable line %d of [%s]", n, fname );
+			free( line );
+			return( -1 );
+		}
+		if ( (strcmp(command, "READ") == 0) || (strncmp(command, "WRITE", 5) == 0) || (strcmp(command, "SEEK") == 0) ||
+			 (strcmp(command, "OPEN") == 0) || (strcmp(command, "CLOSE") == 0) ) {
+			if ( (f = find_file(name)) == HDD_WLSTAT_NONE ) {
+				free( line );
+				return( -1 );
+			}
+			fl = &files[f];
+			if (strcmp(command, "SEEK") == 0) {
+				fl->pos = off;
+				count_op( command, 0 );
+				continue;
+			}
+			if ( (strcmp(command, "OPEN") == 0) || (strcmp(command, "CLOSE") == 0) ) {
+				fl->pos = 0;
+				count_op( command, 0 );
+				continue;
+			}
+			if (strcmp(command, "WRITEAT") == 0) {
+				fl->pos = off;
+			}
+			count_op( command, len );
+			if ( transfer(f, fl->pos, len) ) {
+				free( line );
+				return( -1 );
+			}
+			fl->pos += len;
+		} else {
+			count_op( command, 0 ); // MOUNT, UNMOUNT, FORMAT
+		}
+	}
+	free( line );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_binary
+// Description  : Read a binary trace (hdd_trace.h), write payloads are
+//                skipped
+//
+// Inputs       : fhandle - the open trace
+//                fname - its name, for messages
+// Outputs      : 0 if successful, -1 if failure
+
+int load_binary( FILE *fhandle, char *fname ) {
+	char name[HDD_WLSTAT_NAME];
+	HddTraceHeader hdr;
+	HddTraceOp rec;
+	uint32_t *map, i;
+	uint16_t nlen;
+
+	if ( (fread(&hdr, sizeof(hdr), 1, fhandle) != 1) || (hdr.version != HDD_TRACE_VERSION) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_WLSTAT : bad trace header in [%s]", fname );
+		return( -1 );
+	}
+	if ( (map = malloc((hdr.files + 1) * sizeof(uint32_t))) == NULL ) {
+		return( -1 );
+	}
+	for (i=0; i<hdr.files; i++) {
+		if ( (fread(&nlen, sizeof(nlen), 1, fhandle) != 1) || (nlen >= HDD_WLSTAT_NAME) ||
+			 (fread(name, 1, nlen, fhandle) != nlen) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_WLSTAT : bad file name %u in [%s]", i, fname );
+			free( map );
+			return( -1 );
+		}
+		name[nlen] = '\0';
+		if ( (map[i] = find_file(name)) == HDD_WLSTAT_NONE ) {
+			free( map );
+			return( -1 );
+		}
+	}
+	for (i=0; i<hdr.ops; i++) {
+		if ( (fread(&rec, sizeof(rec), 1, fhandle) != 1) || (rec.file >= hdr.files) ) {
+			logMessage( LOG_ERROR_LEVEL, "HDD_WLSTAT : bad operation %u in [%s]", i, fname );
+			free( map );
+			return( -1 );
+		}
+		if ( (rec.op == HDD_TRACE_WRITE) && fseek(fhandle, rec.len, SEEK_CUR) ) {
+			free( map );
+			return( -1 );
+		}
+		count_op( (rec.op == HDD_TRACE_WRITE) ? "WRITE" : "READ", rec.len );
+		if ( transfer(map[rec.file], rec.off, rec.len) ) {
+			free( map );
+			return( -1 );
+		}
+	}
+	free( map );
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_wire
+// Description  : Read a wire trace (hdd_trace.h), each block is a file and
+//                each block request a transfer of its range
+//
+// Inputs       : fhandle - the open trace
+//                fname - its name, for messages
+// Outputs      : 0 if successful, -1 if failure
+
+int load_wire( FILE *fhandle, char *fname ) {
+	char *kinds[] = { "CREATE", "READ", "OVERWRITE", "DELETE" }, name[HDD_WLSTAT_NAME];
+	HddWireHeader hdr;
+	HddWireRecord rec;
+	uint64_t block;
+	uint32_t f;
+
+	if ( (fread(&hdr, sizeof(hdr), 1, fhandle) != 1) || (hdr.version != HDD_WIRE_VERSION) ) {
+		logMessage( LOG_ERROR_LEVEL, "HDD_WLSTAT : bad wire trace header in [%s]", fname );
+		return( -1 );
+	}
+	while (fread(&rec, sizeof(rec), 1, fhandle) == 1) {
+		if ( (getFlag(rec.cmd) != HDD_NULL_FLAG) && (getFlag(rec.cmd) != HDD_META_BLOCK) ) {
+			count_op( "DEVICE", 0 );
+			continue;
+		}
+		if ( (getFlag(rec.cmd) == HDD_META_BLOCK) || (getOpCode(rec.cmd) == HDD_BLOCK_DELETE) ) {
+			count_op( (getFlag(rec.cmd) == HDD_META_BLOCK) ? "METABLOCK" : "DELETE", 0 );
+			continue;
+		}
+		block = (getOpCode(rec.cmd) == HDD_BLOCK_CREATE) ? (uint32_t)getID(rec.resp) : (uint32_t)getID(rec.cmd);
+		snprintf( name, sizeof(name), "block %lu", (unsigned long)block );
+		if ( (f = find_file(name)) == HDD_WLSTAT_NONE ) {
+			return( -1 );
+		}
+		count_op( kinds[getOpCode(rec.cmd)], (uint32_t)getBlockSize(rec.cmd) );
+		if ( transfer(f, rec.offset, (uint32_t)getBlockSize(rec.cmd)) ) {
+			return( -1 );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arc_misses
+// Description  : Simulate an ARC cache (Megiddo and Modha) of c pages over
+//                the access sequence
+//
+// Inputs       : c - the cache size in pages
+// Outputs      : the misses, UINT64_MAX if out of memory
+
+// The lists a page can be on
+#define ARC_NONE 0
+#define ARC_T1 1 // cached, seen once recently
+#define ARC_T2 2 // cached, seen at least twice
+#define ARC_B1 3 // ghost evicted from T1
+#define ARC_B2 4 // ghost evicted from T2
+
+typedef struct {
+	uint32_t head, tail, size; // head is the MRU end
+} HddWlstatList;
+
+uint32_t *arcPrev, *arcNext;
+uint8_t  *arcWhere;
+HddWlstatList arcList[5];
+
+void arc_remove( uint32_t x ) {
+	HddWlstatList *l = &arcList[arcWhere[x]];
+	if (arcPrev[x] != HDD_WLSTAT_NONE) {
+		arcNext[arcPrev[x]] = arcNext[x];
+	} else {
+		l->head = arcNext[x];
+	}
+	if (arcNext[x] != HDD_WLSTAT_NONE) {
+		arcPrev[arcNext[x]] = arcPrev[x];
+	} else {
+		l->tail = arcPrev[x];
+	}
+	l->size--;
+	arcWhere[x] = ARC_NONE;
+}
+
+void arc_push( uint32_t x, int where ) {
+	HddWlstatList *l = &arcList[where];
+	arcPrev[x] = HDD_WLSTAT_NONE;
+	arcNext[x] = l->head;
+	if (l->head != HDD_WLSTAT_NONE) {
+		arcPrev[l->head] = x;
+	} else {
+		l->tail = x;
+	}
+	l->head = x;
+	l->size++;
+	arcWhere[x] = where;
+}
+
+// Move the LRU page of T1 or T2 to its ghost list
+void arc_replace( int inB2, double p ) {
+	uint32_t t1 = arcList[ARC_T1].size, x;
+	if ( (t1 > 0) && ((inB2 && (t1 == (uint32_t)p)) || (t1 > p)) ) {
+		x = arcList[ARC_T1].tail;
+		arc_remove( x );
+		arc_push( x, ARC_B1 );
+	} else {
+		x = arcList[ARC_T2].tail;
+		arc_remove( x );
+		arc_push( x, ARC_B2 );
+	}
+}
+
+uint64_t arc_misses( uint32_t c ) {
+	uint64_t misses = 0;
+	uint32_t i, x, b1, b2;
+	double p = 0;
+	int w;
+
+	memset( arcWhere, ARC_NONE, npages );
+	for (w=0; w<5; w++) {
+		arcList[w].head = arcList[w].tail = HDD_WLSTAT_NONE;
+		arcList[w].size = 0;
+	}
+	for (i=0; i<naccesses; i++) {
+		x = accPage[i];
+		switch (arcWhere[x]) {
+		case ARC_T1:
+		case ARC_T2: // hit
+			arc_remove( x );
+			arc_push( x, ARC_T2 );
+			break;
+
+		case ARC_B1: // recently evicted once, favor recency
+			misses++;
+			b1 = arcList[ARC_B1].size;
+			b2 = arcList[ARC_B2].size;
+			p += (b1 >= b2) ? 1.0 : (double)b2 / b1;
+			p = (p > c) ? c : p;
+			arc_replace( 0, p );
+			arc_remove( x );
+			arc_push( x, ARC_T2 );
+			break;
+
+		case ARC_B2: // recently evicted twice, favor frequency
+			misses++;
+			b1 = arcList[ARC_B1].size;
+			b2 = arcList[ARC_B2].size;
+			p -= (b2 >= b1) ? 1.0 : (double)b1 / b2;
+			p = (p < 0) ? 0 : p;
+			arc_replace( 1, p );
+			arc_remove( x );
+			arc_push( x, ARC_T2 );
+			break;
+
+		default: // new
+			misses++;
+			if (arcList[ARC_T1].size + arcList[ARC_B1].size == c) {
+				if (arcList[ARC_T1].size < c) {
+					arc_remove( arcList[ARC_B1].tail );
+					arc_replace( 0, p );
+				} else {
+					arc_remove( arcList[ARC_T1].tail );
+				}
+			} else if (arcList[ARC_T1].size + arcList[ARC_T2].size + arcList[ARC_B1].size + arcList[ARC_B2].size >= c) {
+				if (arcList[ARC_T1].size + arcList[ARC_T2].size + arcList[ARC_B1].size + arcList[ARC_B2].size == 2 * c) {
+					arc_remove( arcList[ARC_B2].tail );
+				}
+				arc_replace( 0, p );
+			}
+			arc_push( x, ARC_T1 );
+			break;
+		}
+	}
+	return( misses );
+}
+
+// Order files by page accesses, most first
+int compare_files( const void *a, const void *b ) {
+	const HddWlstatFile *x = *(HddWlstatFile * const *)a, *y = *(HddWlstatFile * const *)b;
+	return( (x->accesses < y->accesses) - (x->accesses > y->accesses) );
+}
+
+// The bucket a fraction q of a histogram's accesses fall at or below
+int hist_quantile( uint64_t *hist, double q ) {
+	uint64_t total = 0, seen = 0;
+	int b;
+	for (b=0; b<HDD_WLSTAT_BUCKETS; b++) {
+		total += hist[b];
+	}
+	for (b=0; b<HDD_WLSTAT_BUCKETS; b++) {
+		seen += hist[b];
+		if ( (total > 0) && (seen >= q * total) ) {
+			return( b );
+		}
+	}
+	return( HDD_WLSTAT_COLD );
+}
+
+// A quantile bucket as text, "cold" past the largest distance
+char *bucket_text( int b, char *buf ) {
+	if (b == HDD_WLSTAT_COLD) {
+		return( "cold" );
+	}
+	sprintf( buf, "<%lu", (unsigned long)bucketLow(b + 1) );
+	return( buf );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : analyze
+// Description  : Compute and print the metrics of the access sequence
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if out of memory
+
+int analyze( void ) {
+	uint64_t hist[HDD_WLSTAT_BUCKETS], seen, cold = 0, lruMisses, arcMiss;
+	uint32_t *tree, *last, *distHist, *stamp, i, j, d, c, distinct, footprint, per;
+	HddWlstatFile **order;
+	char b1[32], b2[32], b3[32];
+	int b, w;
+
+	printf( "%lu operations, %lu transfers touching %lu pages (%u distinct) of %u bytes in %u files\n",
+			(unsigned long)ops, (unsigned long)transfers, (unsigned long)naccesses, npages, pageSize, nfiles );
+
+	// Operation mix
+	printf( "\nOperation mix\n%12s %12s %8s %14s\n", "operation", "count", "share", "bytes" );
+	for (i=0; (int)i<nmix; i++) {
+		printf( "%12s %12lu %7.2f%% %14lu\n", mix[i].name, (unsigned long)mix[i].count,
+				(ops > 0) ? 100.0 * mix[i].count / ops : 0.0, (unsigned long)mix[i].bytes );
+	}
+
+	// Sequentiality and the run lengths read-ahead would cover
+	printf( "\nSequentiality\n%.2f%% of transfers start where the last one on the file ended\n",
+			(transfers > 0) ? 100.0 * sequential / transfers : 0.0 );
+	printf( "%12s %12s %12s\n", "run bytes >=", "runs", "cumulative" );
+	for (b=0, seen=0, j=0; b<HDD_WLSTAT_COLD; b++) {
+		j += runHist[b];
+	}
+	for (b=0; b<HDD_WLSTAT_COLD; b++) {
+		if (runHist[b] > 0) {
+			seen += runHist[b];
+			printf( "%12lu %12lu %11.2f%%\n", (unsigned long)bucketLow(b), (unsigned long)runHist[b], 100.0 * seen / j );
+		}
+	}
+
+	// Reuse distances: the distinct pages accessed since the page's last
+	// access, counted as the pages whose last access falls after it
+	tree = calloc( naccesses + 1, sizeof(uint32_t) );
+	last = calloc( npages + 1, sizeof(uint32_t) );
+	distHist = calloc( npages + 1, sizeof(uint32_t) );
+	if ( (tree == NULL) || (last == NULL) || (distHist == NULL) ) {
+		return( -1 );
+	}
+	memset( hist, 0x0, sizeof(hist) );
+	for (i=0; i<naccesses; i++) {
+		uint32_t p = accPage[i], k;
+		if (last[p] == 0) {
+			cold++;
+			hist[HDD_WLSTAT_COLD]++;
+			files[accFile[i]].hist[HDD_WLSTAT_COLD]++;
+		} else {
+			for (d=0, k=i; k>0; k-=k & -k) {
+				d += tree[k];
+			}
+			for (k=last[p]; k>0; k-=k & -k) {
+				d -= tree[k];
+			}
+			for (k=last[p]; k<=naccesses; k+=k & -k) {
+				tree[k]--;
+			}
+			distHist[d]++;
+			hist[bucket(d)]++;
+			files[accFile[i]].hist[bucket(d)]++;
+		}
+		files[accFile[i]].accesses++;
+		for (k=i+1; k<=naccesses; k+=k & -k) {
+			tree[k]++;
+		}
+		last[p] = i + 1;
+	}
+
+	printf( "\nReuse distance (distinct pages between uses of a page)\n%12s %12s %12s\n", "distance >=", "accesses", "cumulative" );
+	for (b=0, seen=0; b<HDD_WLSTAT_BUCKETS; b++) {
+		if (hist[b] > 0) {
+			seen += hist[b];
+			if (b == HDD_WLSTAT_COLD) {
+				printf( "%12s %12lu %11.2f%%\n", "cold", (unsigned long)hist[b], 100.0 * seen / naccesses );
+			} else {
+				printf( "%12lu %12lu %11.2f%%\n", (unsigned long)bucketLow(b), (unsigned long)hist[b], 100.0 * seen / naccesses );
+			}
+		}
+	}
+
+	// Files with the most accesses
+	if ( (topFiles > 0) && (nfiles > 0) ) {
+		if ( (order = malloc(nfiles * sizeof(HddWlstatFile *))) == NULL ) {
+			return( -1 );
+		}
+		for (i=0; i<nfiles; i++) {
+			order[i] = &files[i];
+		}
+		qsort( order, nfiles, sizeof(HddWlstatFile *), compare_files );
+		printf( "\nReuse distance by file (the %d most accessed)\n%24s %10s %8s %8s %8s %8s\n",
+				((uint32_t)topFiles < nfiles) ? topFiles : (int)nfiles, "file", "accesses", "cold", "p50", "p90", "p99" );
+		for (i=0; (i<nfiles) && (i<(uint32_t)topFiles); i++) {
+			printf( "%24.24s %10lu %7.2f%% %8s %8s %8s\n", order[i]->name, (unsigned long)order[i]->accesses,
+					100.0 * order[i]->hist[HDD_WLSTAT_COLD] / order[i]->accesses,
+					bucket_text(hist_quantile(order[i]->hist, 0.5), b1), bucket_text(hist_quantile(order[i]->hist, 0.9), b2),
+					bucket_text(hist_quantile(order[i]->hist, 0.99), b3) );
+		}
+		free( order );
+	}
+
+	// Working set: distinct pages of each window of accesses, and all
+	// pages touched up to its end
+	stamp = calloc( npages + 1, sizeof(uint32_t) );
+	if (stamp == NULL) {
+		return( -1 );
+	}
+	per = (naccesses + windows - 1) / windows;
+	printf( "\nWorking set over %d windows of %u accesses\n%8s %12s %12s %14s\n", windows, per, "window", "pages", "KiB", "footprint KiB" );
+	for (w=0, i=0, footprint=0; (w < windows) && (i < naccesses); w++) {
+		for (distinct=0; (i < naccesses) && (i < (w + 1) * per); i++) {
+			if (stamp[accPage[i]] == 0) {
+				footprint++;
+			}
+			if (stamp[accPage[i]] != (uint32_t)w + 1) {
+				stamp[accPage[i]] = w + 1;
+				distinct++;
+			}
+		}
+		printf( "%8d %12u %12.1f %14.1f\n", w, distinct, distinct * (double)pageSize / 1024.0, footprint * (double)pageSize / 1024.0 );
+	}
+	free( stamp );
+
+	// Miss ratio curves, LRU from the reuse distances (a cache of c pages
+	// hits a distance below c), ARC simulated at each size
+	arcPrev = malloc( (npages + 1) * sizeof(uint32_t) );
+	arcNext = malloc( (npages + 1) * sizeof(uint32_t) );
+	arcWhere = malloc( npages + 1 );
+	if ( (arcPrev == NULL) || (arcNext == NULL) || (arcWhere == NULL) ) {
+		return( -1 );
+	}
+	printf( "\nMiss ratio by cache size (cold misses: %.2f%%)\n%12s %12s %10s %10s\n", (naccesses > 0) ? 100.0 * cold / naccesses : 0.0,
+			"pages", "KiB", "LRU", "ARC" );
+	lruMisses = naccesses;
+	for (c=1, d=0; (npages > 0) && (c < 2 * npages); c*=2) {
+		for ( ; (d < c) && (d < npages); d++) {
+			lruMisses -= distHist[d]; // distances below c hit
+		}
+		arcMiss = arc_misses( c );
+		printf( "%12u %12.1f %9.2f%% %9.2f%%\n", c, c * (double)pageSize / 1024.0,
+				100.0 * lruMisses / naccesses, 100.0 * arcMiss / naccesses );
+	}
+
+	free( arcPrev );
+	free( arcNext );
+	free( arcWhere );
+	free( tree );
+	free( last );
+	free( distHist );
+	return( 0 );
+}